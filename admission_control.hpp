@@ -0,0 +1,178 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef ADMISSION_CONTROL_HPP
+#define ADMISSION_CONTROL_HPP
+
+#include <algorithm>
+#include <limits>
+
+#include <boost/cstdint.hpp>
+
+// the most and least the thresholds can be scaled by.
+#define ADMISSION_MIN_SCALE (0.1)
+#define ADMISSION_MAX_SCALE (10.0)
+
+// how much the scale is cut by when over the target, and raised by when
+// under it.
+#define ADMISSION_DECREASE (0.75)
+#define ADMISSION_INCREASE (0.05)
+
+namespace rendermq
+{
+
+/* adjusts the queue length thresholds at which the handler starts to
+ * serve stale tiles, to render in the background and to turn requests
+ * away, so that they don't need re-tuning by hand whenever the render
+ * capacity changes.
+ *
+ * the configured thresholds are the starting point, and all three are
+ * scaled together so that the gaps between them stay in proportion.
+ * at the end of each interval, the shortest time a client waited on a
+ * render in that interval is compared against the target latency. as
+ * in CoDel, the shortest is used because it's only above the target if
+ * there's a standing queue which everyone has had to wait behind, not
+ * just a few slow renders. then:
+ *
+ *  - if it's above the target, the thresholds are cut by a constant
+ *    factor, so that fewer requests go to the queue.
+ *  - if it's below the target, the queue didn't grow over the interval
+ *    and requests were held back by the thresholds, then they are
+ *    raised by a constant step, to let more requests through.
+ *  - otherwise they're left as they are.
+ *
+ * the thresholds are only raised while requests are being held back,
+ * so that they don't grow without bound while the handler is quiet.
+ *
+ * a target of zero turns the adjustment off, and the thresholds stay as
+ * they were configured.
+ */
+class admission_control
+{
+   // a configured threshold as it is in effect. while the thresholds
+   // are scaled, a non-zero one isn't allowed to round down to zero.
+   size_t scaled(size_t threshold) const
+   {
+      if (!adaptive() || m_scale == 1.0 || threshold == 0) return threshold;
+      return std::max(size_t(threshold * m_scale + 0.5), size_t(1));
+   }
+
+public:
+   /* the configured stale, satisfy and max thresholds, the target
+    * latency and the interval between adjustments, in milliseconds, and
+    * the time now, from the same clock as will be passed to update().
+    */
+   admission_control(size_t stale, size_t satisfy, size_t max, 
+                     unsigned int target, unsigned int interval, boost::uint64_t now)
+      : m_stale(stale), m_satisfy(satisfy), m_max(max),
+        m_target(target), m_interval(std::max(interval, 1u)), 
+        m_scale(1.0), m_next_update(now + m_interval),
+        m_min_latency(std::numeric_limits<boost::uint64_t>::max()), m_held_back(0),
+        m_last_queue_length(0), m_latency(0), m_growth(0) {}
+
+   // whether the thresholds are being adjusted at all.
+   bool adaptive() const { return m_target > 0; }
+
+   // the thresholds currently in effect.
+   size_t threshold_stale() const { return scaled(m_stale); }
+   size_t threshold_satisfy() const { return scaled(m_satisfy); }
+   size_t threshold_max() const { return scaled(m_max); }
+
+   /* record how long, in milliseconds, a client waited for a render,
+    * including those which gave up waiting.
+    */
+   void render_latency(boost::uint64_t latency)
+   {
+      m_min_latency = std::min(m_min_latency, latency);
+   }
+
+   /* record that a request was served stale, rendered in the 
+    * background or turned away because of one of the thresholds.
+    */
+   void held_back() { ++m_held_back; }
+
+   /* adjust the thresholds if the interval is over, given the length of
+    * the queue now. returns whether they were looked at.
+    */
+   bool update(size_t queue_length, boost::uint64_t now)
+   {
+      if (now < m_next_update) return false;
+
+      const bool have_latency = (m_min_latency != std::numeric_limits<boost::uint64_t>::max());
+      const long growth = long(queue_length) - long(m_last_queue_length);
+
+      if (adaptive())
+      {
+         if (have_latency && (m_min_latency > m_target))
+         {
+            m_scale = std::max(m_scale * ADMISSION_DECREASE, ADMISSION_MIN_SCALE);
+         }
+         else if ((m_held_back > 0) && (growth <= 0))
+         {
+            m_scale = std::min(m_scale + ADMISSION_INCREASE, ADMISSION_MAX_SCALE);
+         }
+      }
+
+      m_latency = have_latency ? m_min_latency : 0;
+      m_growth = growth;
+      m_min_latency = std::numeric_limits<boost::uint64_t>::max();
+      m_held_back = 0;
+      m_last_queue_length = queue_length;
+      m_next_update = now + m_interval;
+      return true;
+   }
+
+   // how much the configured thresholds are currently scaled by.
+   double scale() const { return m_scale; }
+
+   // the shortest render latency, in milliseconds, in the last interval
+   // (zero if there weren't any renders) and how much the queue grew by
+   // over it.
+   boost::uint64_t latency() const { return m_latency; }
+   long growth() const { return m_growth; }
+
+   // the target latency and interval, in milliseconds.
+   unsigned int target() const { return m_target; }
+   unsigned int interval() const { return m_interval; }
+
+private:
+   size_t m_stale, m_satisfy, m_max;
+   unsigned int m_target, m_interval;
+   double m_scale;
+   boost::uint64_t m_next_update;
+
+   // what's been seen so far in this interval.
+   boost::uint64_t m_min_latency;
+   size_t m_held_back;
+   size_t m_last_queue_length;
+
+   // what was seen in the last interval.
+   boost::uint64_t m_latency;
+   long m_growth;
+};
+
+} // namespace rendermq
+
+#endif // ADMISSION_CONTROL_HPP
@@ -0,0 +1,316 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef BULK_SPILL_HPP
+#define BULK_SPILL_HPP
+
+#include "tile_protocol.hpp"
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <ctime> // for std::time_t
+
+#include <boost/cstdint.hpp>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace rendermq
+{
+
+/* an overflow for the broker's bulk requests, kept on local disk so
+ * that a big submission doesn't need to be held in memory, and so that
+ * it isn't lost if the broker restarts.
+ *
+ * requests are appended, in order, to segment files in a directory.
+ * the oldest segment is memory-mapped to read the requests back out, 
+ * and deleted once they've all been read. each record is a 32-bit 
+ * length followed by the time the request arrived, the address of the
+ * handler it came from and the serialised tile. a record which was only
+ * partly written when the broker stopped is ignored.
+ *
+ * the segments which are found in the directory when it's opened are
+ * read back first, so requests can be delivered twice if the broker
+ * stopped after reading some of a segment. that's harmless for bulk
+ * requests, which are only re-rendered.
+ */
+class bulk_spill
+{
+   typedef boost::uint32_t length_type;
+
+   // the file for the segment with the given number.
+   boost::filesystem::path segment_path(boost::uint64_t number) const
+   {
+      return m_directory / (boost::format("bulk-%1$016d.spill") % number).str();
+   }
+
+   // calls the function with each complete record in the data, returning
+   // the number of bytes which were read.
+   template <typename Fun>
+   static size_t for_each_record(const char *data, size_t size, Fun &fun)
+   {
+      size_t offset = 0;
+      while (offset + sizeof(length_type) <= size)
+      {
+         length_type length;
+         std::memcpy(&length, data + offset, sizeof(length));
+         if (offset + sizeof(length_type) + length > size) break;
+         fun(data + offset + sizeof(length_type), length);
+         offset += sizeof(length_type) + length;
+      }
+      return offset;
+   }
+
+   struct count_records
+   {
+      count_records() : count(0) {}
+      void operator()(const char *, size_t) { ++count; }
+      size_t count;
+   };
+
+   // starts writing a new segment after all the existing ones.
+   void open_writer()
+   {
+      m_segments.push_back(m_next_segment++);
+      m_writer.reset(new std::ofstream(segment_path(m_segments.back()).string().c_str(),
+                                       std::ios::binary | std::ios::trunc));
+      if (!*m_writer)
+      {
+         throw std::runtime_error((boost::format("Unable to create bulk spill segment %1%.") 
+                                   % segment_path(m_segments.back())).str());
+      }
+      m_writer_bytes = 0;
+   }
+
+   // finishes the segment being written, so that it can be mapped.
+   void close_writer()
+   {
+      if (m_writer)
+      {
+         m_writer->close();
+         m_writer.reset();
+      }
+   }
+
+   // maps the oldest segment for reading, deleting any which are empty.
+   // returns false if there are no segments left.
+   bool open_reader()
+   {
+      while (!m_segments.empty())
+      {
+         if (m_writer && m_segments.size() == 1) close_writer();
+
+         const boost::filesystem::path path = segment_path(m_segments.front());
+         if (boost::filesystem::file_size(path) > 0)
+         {
+            m_reader.open(path.string());
+            m_reader_offset = 0;
+            return true;
+         }
+         boost::filesystem::remove(path);
+         m_segments.pop_front();
+      }
+      return false;
+   }
+
+   // unmaps and deletes the oldest segment.
+   void close_reader()
+   {
+      m_reader.close();
+      boost::filesystem::remove(segment_path(m_segments.front()));
+      m_segments.pop_front();
+   }
+
+public:
+   /* open the spill in the given directory, creating it if necessary 
+    * and picking up any requests left in it from before. new segments
+    * are started once the current one is over segment_size bytes.
+    */
+   bulk_spill(const std::string &directory, size_t segment_size)
+      : m_directory(directory), m_segment_size(segment_size), 
+        m_next_segment(0), m_writer_bytes(0), m_reader_offset(0), m_size(0)
+   {
+      boost::filesystem::create_directories(m_directory);
+
+      std::vector<boost::uint64_t> found;
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator itr(m_directory); itr != end; ++itr)
+      {
+         const std::string name = itr->path().filename().string();
+         unsigned long long number = 0;
+         char tail = 0;
+         if (std::sscanf(name.c_str(), "bulk-%llu.spil%c", &number, &tail) == 2 && tail == 'l')
+         {
+            found.push_back(number);
+         }
+      }
+      std::sort(found.begin(), found.end());
+
+      for (std::vector<boost::uint64_t>::iterator itr = found.begin(); itr != found.end(); ++itr)
+      {
+         const boost::filesystem::path path = segment_path(*itr);
+         if (boost::filesystem::file_size(path) > 0)
+         {
+            boost::iostreams::mapped_file_source segment(path.string());
+            count_records counter;
+            for_each_record(segment.data(), segment.size(), counter);
+            m_size += counter.count;
+         }
+         m_segments.push_back(*itr);
+         m_next_segment = *itr + 1;
+      }
+   }
+
+   /* add a request to the end of the spill.
+    */
+   void push(tile_protocol const& tile, std::string const& address, std::time_t arrived)
+   {
+      std::string data;
+      if (!serialise(tile, data))
+      {
+         throw std::runtime_error("Unable to serialise bulk request for spilling.");
+      }
+
+      if (!m_writer || m_writer_bytes >= m_segment_size) 
+      {
+         close_writer();
+         open_writer();
+      }
+
+      const boost::int64_t time = arrived;
+      const length_type address_length = length_type(address.size());
+      const length_type length = length_type(sizeof(time) + sizeof(address_length) + address.size() + data.size());
+      m_writer->write(reinterpret_cast<const char *>(&length), sizeof(length));
+      m_writer->write(reinterpret_cast<const char *>(&time), sizeof(time));
+      m_writer->write(reinterpret_cast<const char *>(&address_length), sizeof(address_length));
+      m_writer->write(address.data(), address.size());
+      m_writer->write(data.data(), data.size());
+      if (!*m_writer)
+      {
+         throw std::runtime_error((boost::format("Unable to write to bulk spill segment %1%.")
+                                   % segment_path(m_segments.back())).str());
+      }
+
+      m_writer_bytes += sizeof(length) + length;
+      ++m_size;
+   }
+
+   /* take the oldest request off the spill. returns false if there
+    * aren't any left.
+    */
+   bool pop(tile_protocol &tile, std::string &address, std::time_t &arrived)
+   {
+      while (m_size > 0)
+      {
+         if (!m_reader.is_open() && !open_reader()) break;
+
+         const char *data = m_reader.data() + m_reader_offset;
+         const size_t left = m_reader.size() - m_reader_offset;
+         length_type length = 0;
+         if (left >= sizeof(length)) std::memcpy(&length, data, sizeof(length));
+
+         if (left < sizeof(length) + length)
+         {
+            // the end of the segment, or a record which wasn't finished.
+            close_reader();
+            continue;
+         }
+
+         // move past the record first, so that a corrupt one is only
+         // reported once.
+         m_reader_offset += sizeof(length) + length;
+         --m_size;
+
+         boost::int64_t time = 0;
+         length_type address_length = 0;
+         const char *record = data + sizeof(length);
+         const size_t header = sizeof(time) + sizeof(address_length);
+         if (length >= header)
+         {
+            std::memcpy(&time, record, sizeof(time));
+            std::memcpy(&address_length, record + sizeof(time), sizeof(address_length));
+         }
+         if (length < header || header + address_length > length ||
+             !unserialise(record + header + address_length, length - header - address_length, tile))
+         {
+            throw std::runtime_error((boost::format("Corrupt record in bulk spill segment %1%.")
+                                      % segment_path(m_segments.front())).str());
+         }
+         address.assign(record + header, address_length);
+         arrived = std::time_t(time);
+         return true;
+      }
+      return false;
+   }
+
+   /* throw away all the spilled requests.
+    */
+   void clear()
+   {
+      close_writer();
+      if (m_reader.is_open()) m_reader.close();
+      for (std::deque<boost::uint64_t>::iterator itr = m_segments.begin(); itr != m_segments.end(); ++itr)
+      {
+         boost::filesystem::remove(segment_path(*itr));
+      }
+      m_segments.clear();
+      m_size = 0;
+   }
+
+   // the number of requests in the spill.
+   size_t size() const { return m_size; }
+
+   bool empty() const { return m_size == 0; }
+
+private:
+   boost::filesystem::path m_directory;
+   size_t m_segment_size;
+
+   // the numbers of the segments on disk, oldest first, and the number
+   // to give the next one.
+   std::deque<boost::uint64_t> m_segments;
+   boost::uint64_t m_next_segment;
+
+   // the newest segment, while it's being appended to.
+   boost::scoped_ptr<std::ofstream> m_writer;
+   size_t m_writer_bytes;
+
+   // the oldest segment, while requests are being read from it.
+   boost::iostreams::mapped_file_source m_reader;
+   size_t m_reader_offset;
+
+   size_t m_size;
+};
+
+} // namespace rendermq
+
+#endif // BULK_SPILL_HPP
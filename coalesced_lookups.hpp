@@ -0,0 +1,144 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef COALESCED_LOOKUPS_HPP
+#define COALESCED_LOOKUPS_HPP
+
+#include "tile_protocol.hpp"
+
+#include <vector>
+#include <list>
+
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+
+namespace rendermq
+{
+
+/* keeps track of the storage lookups which are in progress, so that
+ * concurrent requests for the same tile share a single lookup.
+ *
+ * when a popular tile expires, many requests for it can arrive while
+ * the first is still waiting on storage. only the first is looked up,
+ * and the rest wait for its result, which is then copied out to each
+ * of them with their own request id and last modified header.
+ *
+ * status requests get a different answer from storage than render
+ * requests, so they're only coalesced with each other. dirty requests
+ * change storage, so they're never coalesced.
+ */
+class coalesced_lookups
+{
+   // compares the parts of the request which determine the result of
+   // the lookup.
+   struct lookup_equal
+   {
+      bool operator()(tile_protocol const& a, tile_protocol const& b) const
+      {
+         return (a.x == b.x && a.y == b.y && a.z == b.z && 
+                 a.format == b.format && a.style == b.style &&
+                 (a.status == cmdStatus) == (b.status == cmdStatus));
+      }
+   };
+
+   struct lookup_hash
+   {
+      std::size_t operator()(tile_protocol const& t) const
+      {
+         std::size_t seed = 0;
+         boost::hash_combine(seed, t.x);
+         boost::hash_combine(seed, t.y);
+         boost::hash_combine(seed, t.z);
+         boost::hash_combine(seed, int(t.format));
+         boost::hash_combine(seed, t.style);
+         boost::hash_combine(seed, t.status == cmdStatus);
+         return seed;
+      }
+   };
+
+   // the requests waiting on the lookup, other than the one which is
+   // actually being looked up.
+   typedef boost::unordered_map<tile_protocol, std::list<tile_protocol>,
+                                lookup_hash, lookup_equal> cont_type;
+
+public:
+   coalesced_lookups() : m_lookups(0), m_coalesced(0) {}
+
+   /* add a request for a tile. returns true if the request needs to be
+    * looked up in storage, or false if there's already a lookup in
+    * progress for it and it will be answered when that completes.
+    */
+   bool add(tile_protocol const& tile)
+   {
+      if (tile.status == cmdDirty) return true;
+
+      ++m_lookups;
+      std::pair<cont_type::iterator, bool> result = 
+         m_pending.insert(std::make_pair(tile, std::list<tile_protocol>()));
+      if (!result.second)
+      {
+         result.first->second.push_back(tile);
+         ++m_coalesced;
+      }
+      return result.second;
+   }
+
+   /* called with the result of a lookup. finishes the lookup and adds
+    * a copy of the result for each of the requests which were waiting
+    * on it to the replies.
+    */
+   void complete(tile_protocol const& result, std::vector<tile_protocol> &replies)
+   {
+      if (result.status == cmdDirty) return;
+
+      cont_type::iterator itr = m_pending.find(result);
+      if (itr == m_pending.end()) return;
+
+      for (std::list<tile_protocol>::const_iterator waiting = itr->second.begin();
+           waiting != itr->second.end(); ++waiting)
+      {
+         replies.push_back(result);
+         replies.back().id = waiting->id;
+         replies.back().request_last_modified = waiting->request_last_modified;
+      }
+      m_pending.erase(itr);
+   }
+
+   // the number of distinct lookups in progress.
+   size_t size() const { return m_pending.size(); }
+
+   // counters for all the lookups requested and those which were
+   // answered by sharing another's result.
+   size_t lookups() const { return m_lookups; }
+   size_t coalesced() const { return m_coalesced; }
+
+private:
+   cont_type m_pending;
+   size_t m_lookups, m_coalesced;
+};
+
+} // namespace rendermq
+
+#endif // COALESCED_LOOKUPS_HPP
@@ -157,7 +157,7 @@ runner::handle_jobs(std::list<job_t> &jobs)
    }
 }
 
-supervisor::supervisor(const std::string &config_file, std::string worker_id) {
+supervisor::supervisor(const std::string &config_file, std::string worker_id, std::string styles) {
    pt::ptree pt;
 
    try {
@@ -173,6 +173,11 @@ supervisor::supervisor(const std::string &config_file, std::string worker_id) {
       pt.put("worker.id", worker_id);
    }
 
+   // likewise the styles the worker can render
+   if (!styles.empty()) {
+      pt.put("worker.styles", styles);
+   }
+
    try {
       std::string backend_type = pt.get<std::string>("backend.type");
       pimpl.reset(create_supervisor(pt));
@@ -104,9 +104,14 @@ public:
    // separate constructor allows manual override of auto-generated worker ID, which
    // has benefits for traceability and failure recovery. NOTE: the defaulted worker
    // ID (empty string) is a *really* bad way of doing this, but the right way of 
-   // doing it (boost::optional) doesn't play nice with boost::python.
-   supervisor(const std::string &config_file, std::string worker_id = "");
+   // doing it (boost::optional) doesn't play nice with boost::python. likewise,
+   // the styles the worker can render, separated by commas, override those in
+   // the config file if they're given.
+   supervisor(const std::string &config_file, std::string worker_id = "", std::string styles = "");
     
+   // blocking call to get the next job. if the backend is configured to
+   // prefetch (worker.prefetch) then this is served from a bounded local
+   // buffer which is kept topped up while the previous job is processed.
    job_t get_job();
    void notify(const job_t &job);
     
@@ -123,6 +123,10 @@ broker::broker(const pt::ptree &config) {
   monitor = parse_zmq_host(config.get<string>("monitor"));
   in_identity = config.get_optional<string>("in_identity");
   out_identity = config.get_optional<string>("out_identity");
+  shards = config.get<size_t>("shards", 1);
+  if (shards < 1) {
+    throw std::runtime_error("Broker must have at least one shard.");
+  }
 }
 
 common::common(const pt::ptree &config) {
@@ -56,6 +56,9 @@ struct broker {
   broker(const boost::property_tree::ptree &);
   std::string in_req, in_sub, out_req, out_sub, monitor;
   boost::optional<std::string> in_identity, out_identity;
+  // number of threads, each owning part of the queue, which the
+  // broker process runs. one means the broker isn't sharded.
+  size_t shards;
 };
 
 /* Represents the parsed distributed queue config file, containing
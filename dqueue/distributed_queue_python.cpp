@@ -47,7 +47,7 @@ std::string tile_protocol_to_string(const tile_protocol &t)
 }
 
 BOOST_PYTHON_MODULE(dqueue) {
-    class_<supervisor, boost::noncopyable>("Supervisor", init<std::string, optional<std::string> >())
+    class_<supervisor, boost::noncopyable>("Supervisor", init<std::string, optional<std::string, std::string> >())
         .def("get_job", &supervisor::get_job)
         .def("notify", &supervisor::notify)
         ;
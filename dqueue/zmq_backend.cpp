@@ -35,7 +35,10 @@
 
 #include <iostream>
 #include <list>
+#include <deque>
+#include <vector>
 #include <map>
+#include <set>
 #include <iterator>
 #include <limits>
 #include <boost/tokenizer.hpp>
@@ -71,6 +74,24 @@ namespace manip = zstream::manip;
 // the broker after requesting a job.
 #define DEFAULT_BROKER_TIMEOUT (30)
 
+// if not specified in the config file, the number of jobs the worker will
+// lease from the brokers ahead of time, so that it doesn't have to wait 
+// for the broker between jobs. zero means jobs are only fetched when the
+// worker asks for them, one at a time.
+#define DEFAULT_PREFETCH (0)
+
+// if not specified in the config file, the number of seconds between the
+// worker renewing the leases on the jobs it holds. this needs to be well
+// inside the brokers' lease time, or the jobs will be given to other 
+// workers while this one is still working on them. zero turns it off.
+#define DEFAULT_LEASE_RENEW_INTERVAL (10)
+
+// if not specified in the config file, whether the worker asks the
+// brokers to send it jobs as soon as they come in when none of them have
+// any, rather than waiting for a broker to announce some to all the 
+// workers at once.
+#define DEFAULT_WAIT_FOR_JOBS (true)
+
 // number of seconds between the subscription sockets being torn down and
 // re-used. this can be set very long, as this appears to be a problem which
 // builds up over the course of several days.
@@ -179,42 +200,54 @@ struct zmq_backend_worker::task_communicator {
     * get a little bit complicated as it receives messages and
     * resends them and so forth.
     *
-    * the state transition diagram looks a bit like:
+    * there are two loosely-coupled state machines. the first tracks
+    * the worker code:
+    *
+    *     +--------+                       +--------+
+    *     |  IDLE  |---- get job request ->|  WAIT  |
+    *     +--------+     from worker code. +--------+
+    *         ^                                 |
+    *         |                           job in the buffer
+    *     job response                          |
+    *     from worker code.  +--------+         |
+    *         +--------------|  PROC  |<--------+
+    *                        +--------+
+    *
+    * the second tracks requests for jobs to the brokers, which fill up
+    * the local buffer of jobs. a request is sent to the best broker
+    * whenever the buffer has fewer jobs than the prefetch limit (plus 
+    * one, if the worker code is waiting for a job) and there isn't 
+    * already a request outstanding. if no brokers have announced any
+    * jobs, then nothing is sent until one does. if the broker replies
+    * that it has no jobs, or doesn't reply before the timeout, then
+    * it's removed from the list and the next best is tried.
     *
-    *         +--------------------------------------------------+
-    *         v                                                  |
-    *     +--------+                                             |
-    *     |  IDLE  |---- get job request  --------+              |
-    *     +--------+     from worker code.        |              |
-    *                                             v              |
-    *                                        ==================  |
-    *                                        =  any brokers   =  |
-    *                                        = available with =  |
-    *                                        =     jobs?      =  |
-    *                                        ==================  |
-    *     +--------+                            N |    Y |  ^    |
-    *     |  WAIT  | <----------------------------+      |  |    |
-    *     +--------+ ----+                               |  |    |
-    *                    broker announces job.           |  |    |
-    *                    |                               |  |    |
-    *     +--------+ <---+                               |  |    |
-    *     |  TRY   | <-------------- send job request ---+  |    |
-    *     |        |                 to best broker.        |    |
-    *     +--------+ -- timeout                             |    |
-    *          |        or no job --------------------------+    |
-    *          |        available                                |
-    *     job response                                           |
-    *     from broker                                            |
-    *          |                                                 |
-    *          v                                                 |
-    *     +--------+                                             |
-    *     |  PROC  |---- job response from ----------------------+
-    *     +--------+     worker code.
+    * when no brokers have announced any jobs, the worker can instead 
+    * wait on all the brokers it knows of, which send it jobs as soon as
+    * they come in. this means a new job goes to one waiting worker,
+    * rather than being announced to all of them so that they race for
+    * it. the brokers tell a waiting worker to ask again if nothing has
+    * come in after a while, and the worker stops waiting on the others
+    * once its buffer is full.
+    *
+    * with the default prefetch limit of zero jobs are only requested
+    * when the worker code is waiting, one at a time. larger limits
+    * keep jobs in hand while the worker is processing, so that there
+    * is no round trip to the broker between jobs.
+    *
+    * while the worker holds any jobs, either being processed or in the
+    * buffer, it periodically renews the leases on them with the brokers
+    * they came from. when it shuts down, it releases them so that the 
+    * brokers can give them to other workers straight away.
+    *
+    * a worker which can only render some styles tells each broker which
+    * ones when it first hears from it, and again with each request for
+    * jobs, so that the broker only hands it jobs of those styles.
     *
     * there's also an almost-separate event queue in that each of
-    * these states (except WAIT), when it gets a broker announcement,
-    * uses it to update the internal state of which brokers have
-    * available jobs and at which priority.
+    * these states, when it gets a broker announcement, uses it to 
+    * update the internal state of which brokers have available jobs
+    * and at which priority.
     */
    enum communicator_state {
       state_idle,              /* when the client worker code hasn't
@@ -222,19 +255,19 @@ struct zmq_backend_worker::task_communicator {
       state_waiting_for_job,   /* when the client worker code has 
                                 * asked for a job, but one hasn't been
                                 * found yet. */
-      state_trying_to_get_job, /* client code asked for a job and a 
-                                * request to a broker has been sent 
-                                * out */
       state_job_processing,    /* client code has a job and is working 
                                 * on it. */
    };
 
    task_communicator(zmq::context_t &ctx, 
-                     long p_timeout, long b_timeout,
+                     long p_timeout, long b_timeout, long r_interval, 
+                     size_t pf_limit, bool w_jobs, const std::vector<string> &stys,
                      bool &sh_req, const string &wrk_id) 
       : common(ctx), inproc_req(ctx), poll_timeout(p_timeout), 
-        broker_timeout(b_timeout), shutdown_requested(sh_req), 
-        state(state_idle), worker_id(wrk_id) {
+        broker_timeout(b_timeout), renew_interval(r_interval),
+        prefetch_limit(pf_limit), wait_for_jobs(w_jobs), styles(stys), shutdown_requested(sh_req), 
+        state(state_idle), worker_id(wrk_id),
+        next_renewal(microsec_clock::universal_time() + milliseconds(r_interval)) {
    }
 
    void operator()() {
@@ -254,26 +287,35 @@ struct zmq_backend_worker::task_communicator {
             { inproc_req.socket(), 0, ZMQ_POLLIN, 0 },
          };
 
-         zmq::poll(items, 3, poll_timeout);
+         // wake up in time to renew the leases, if that's sooner.
+         long timeout = poll_timeout;
+         if (renew_interval > 0) {
+            timeout = std::min(timeout, renew_interval * 1000);
+         }
+         zmq::poll(items, 3, timeout);
+
+         if ((renew_interval > 0) &&
+             (next_renewal < microsec_clock::universal_time())) {
+            renew_leases();
+            next_renewal = microsec_clock::universal_time() + milliseconds(renew_interval);
+         }
+
+         expire_waiting();
 
          // first check that the broker that we were trying to get a job
          // from hasn't died or otherwise timed out.
-         if ((state == state_trying_to_get_job) &&
+         if (current_broker &&
              (get_job_retry_time < microsec_clock::universal_time())) {
             
-            if (current_broker) {
-               LOG_WARNING(boost::format("Dropped job request to current broker "
-                                         "(\"%1%\"), assuming it has died.") 
-                           % current_broker.get());
+            LOG_WARNING(boost::format("Dropped job request to current broker "
+                                      "(\"%1%\"), assuming it has died.") 
+                        % current_broker.get());
                         
-               // try not to go back to the same broker again...
-               brokers_with_jobs.erase(current_broker.get());
-
-            } else {
-               LOG_ERROR("Dropped job request to unknown current broker.");
-            }
+            // try not to go back to the same broker again...
+            brokers_with_jobs.erase(current_broker.get());
+            current_broker = boost::none;
 
-            try_to_get_job();
+            try_to_get_jobs();
          }
 
          // responses from the broker
@@ -283,38 +325,55 @@ struct zmq_backend_worker::task_communicator {
 
             manip::routing_headers routing_headers(headers);
             common.broker_req >> routing_headers >> response;
+            add_known_broker(headers.front());
 
             // if we get a stray message just ignore it...
-            if ((response.compare("JOB") == 0) && common.broker_req.has_more()) {
-               // get job and send to inproc.
-               rendermq::tile_protocol tile;
-               common.broker_req >> tile;
+            if (((response.compare("JOB") == 0) || (response.compare("JOBS") == 0)) && 
+                common.broker_req.has_more()) {
+               // get all the jobs in the reply
+               list<rendermq::tile_protocol> tiles;
+               do {
+                  rendermq::tile_protocol tile;
+                  common.broker_req >> tile;
+                  tiles.push_back(tile);
+               } while (common.broker_req.has_more());
           
-               // check that we're looking for a job and looking for one 
-               // from this particular broker...
-               if ((state == state_trying_to_get_job) &&
-                   (current_broker == headers.front())) {
-                  inproc_req << tile;
-                  current_broker = headers.front();
-            
-                  LOG_INFO(boost::format("Got job (%1%) from broker (\"%2%\").")
-                           % tile % current_broker.get());
+               // check that we're looking for jobs from this particular 
+               // broker, either by asking for them or waiting on it. the
+               // jobs are leased to this worker either way, so they're
+               // kept rather than left for the lease to run out.
+               const bool waited = (waiting_brokers.erase(headers.front()) > 0);
+               if (current_broker == headers.front()) {
+                  current_broker = boost::none;
+               } else if (!waited) {
+                  LOG_DEBUG(boost::format("Unexpected job offer from broker %1%.") 
+                            % headers.front());
+               }
 
-                  // next state is processing
-                  state = state_job_processing;
+               BOOST_FOREACH(const rendermq::tile_protocol &tile, tiles) {
+                  LOG_INFO(boost::format("Got job (%1%) from broker (\"%2%\").")
+                           % tile % headers.front());
+                  prefetched.push_back(std::make_pair(headers.front(), tile));
+               }
 
-               } else {
-                  LOG_WARNING(boost::format("Unexpected job offer from broker %1%.") 
-                              % headers.front());
+               // give the worker a job if it's waiting for one, and top
+               // up the buffer if there's space or stop waiting for more
+               // if there isn't.
+               dispatch_job();
+               if (prefetched.size() >= jobs_wanted()) {
+                  stop_waiting();
                }
+               try_to_get_jobs();
             
             } else {
-               // no jobs... remove from list and try again.
+               // no jobs... remove from list and try again. this is also 
+               // how a broker tells a worker waiting on it to ask again.
                brokers_with_jobs.erase(headers.front());
-               // if worker wants job...
-               if (state == state_trying_to_get_job) {
-                  try_to_get_job();
+               waiting_brokers.erase(headers.front());
+               if (current_broker == headers.front()) {
+                  current_broker = boost::none;
                }
+               try_to_get_jobs();
             }
 
             // job availability announcements from broker
@@ -325,11 +384,11 @@ struct zmq_backend_worker::task_communicator {
 
             (*common.broker_sub) >> broker_id >> msg >> max_priority >> qsize;
             brokers_with_jobs[broker_id] = broker_status(max_priority, qsize);
+            add_known_broker(broker_id);
 
-            // if we are waiting for a job, then try and grab this one immediately
-            if (state == state_waiting_for_job) {
-               try_to_get_job();
-            }
+            // if we are waiting for a job, or have space in the buffer,
+            // then try and grab this one immediately
+            try_to_get_jobs();
 
             // worker thread replies to be routed back to broker
          } else if (items[2].revents & ZMQ_POLLIN) {
@@ -340,17 +399,18 @@ struct zmq_backend_worker::task_communicator {
                rendermq::tile_protocol tile;
                inproc_req >> tile;
                if (state == state_job_processing) {
-                  if (current_broker) {
-                     common.broker_req.to(current_broker.get()) 
+                  if (processing_broker) {
+                     common.broker_req.to(processing_broker.get()) 
                         << manip::more << "RESULT"
                         << tile;
               
-                     current_broker = boost::none;
+                     processing_broker = boost::none;
+                     processing_job = boost::none;
                      state = state_idle;
 
                   } else {
                      // the state machine implies this can never happen, as
-                     // current_broker is set anywhere we accept a job and
+                     // processing_broker is set anywhere we hand out a job and
                      // no other processing should be done, but never say 
                      // never...
                      LOG_DEBUG("worker returned a job, but there's no-one to send it to.");
@@ -362,10 +422,13 @@ struct zmq_backend_worker::task_communicator {
                   LOG_DEBUG("worker returned a job, but the state is not job_processing.");
                }
             } else {
-               // this means a request for a job. if there's a broker which has 
-               // advertised that it has jobs, go talk to it.
+               // this means a request for a job. if there's one in the buffer
+               // then it can be handed over straight away, otherwise go and
+               // talk to a broker which has advertised that it has jobs.
                if (state == state_idle) {
-                  try_to_get_job();
+                  state = state_waiting_for_job;
+                  dispatch_job();
+                  try_to_get_jobs();
 
                } else {
                   // the state machine implies this can never happen, as job 
@@ -376,6 +439,56 @@ struct zmq_backend_worker::task_communicator {
             }
          }
       }
+
+      stop_waiting();
+      release_leases();
+   }
+
+   // the jobs this worker holds from each broker, in the order that
+   // they'll be processed.
+   typedef map<string, list<rendermq::tile_protocol> > held_jobs_t;
+
+   held_jobs_t held_jobs() const {
+      held_jobs_t held;
+      if (processing_broker && processing_job) {
+         held[processing_broker.get()].push_back(processing_job.get());
+      }
+      typedef std::pair<string, rendermq::tile_protocol> prefetched_t;
+      BOOST_FOREACH(const prefetched_t &job, prefetched) {
+         held[job.first].push_back(job.second);
+      }
+      return held;
+   }
+
+   /* tell the brokers that this worker is still busy with the jobs it
+    * holds, so that they don't give them to another worker. the jobs 
+    * further back in the buffer get longer leases, as for a batch.
+    */
+   void renew_leases() {
+      held_jobs_t held = held_jobs();
+      for (held_jobs_t::iterator itr = held.begin(); itr != held.end(); ++itr) {
+         zstream::socket::osocket &out = common.broker_req.to(itr->first);
+         out << manip::more << "RENEW";
+         for (list<rendermq::tile_protocol>::iterator job = itr->second.begin(); 
+              job != itr->second.end(); ) {
+            const rendermq::tile_protocol &tile = *job;
+            if (++job != itr->second.end()) { out << manip::more; }
+            out << tile;
+         }
+      }
+   }
+
+   /* give back the jobs this worker holds when it shuts down, so that
+    * they can go to another worker without waiting for the leases to
+    * run out.
+    */
+   void release_leases() {
+      held_jobs_t held = held_jobs();
+      for (held_jobs_t::iterator itr = held.begin(); itr != held.end(); ++itr) {
+         LOG_DEBUG(boost::format("Releasing %1% jobs back to broker (\"%2%\").") 
+                   % itr->second.size() % itr->first);
+         common.broker_req.to(itr->first) << "RELEASE";
+      }
    }
 
    boost::optional<string> highest_priority_broker() const
@@ -396,48 +509,169 @@ struct zmq_backend_worker::task_communicator {
       return broker;
    }
 
+   /* if the worker code is waiting for a job and there's one in the
+    * buffer, hand it over.
+    */
+   void dispatch_job() {
+      if ((state == state_waiting_for_job) && !prefetched.empty()) {
+         inproc_req << prefetched.front().second;
+         processing_broker = prefetched.front().first;
+         processing_job = prefetched.front().second;
+         prefetched.pop_front();
+
+         // next state is processing
+         state = state_job_processing;
+      }
+   }
+
    /* examines the state of what's known about the brokers' queues to
-    * move to the appropriate state for getting a job. this might be
-    * immediately available, or it might mean waiting for a broker to
-    * announce that a new job is available.
+    * request more jobs if the buffer needs topping up. this might 
+    * send a request to a broker, or it might mean waiting for a 
+    * broker to announce that a new job is available.
     */
-   void try_to_get_job() {
+   void try_to_get_jobs() {
+      // only one request is outstanding at a time.
+      if (current_broker) { return; }
+
+      const size_t wanted = jobs_wanted();
+      if (prefetched.size() >= wanted) { return; }
+      const uint32_t num_jobs = wanted - prefetched.size();
+
       current_broker = highest_priority_broker();
 
       if (current_broker) {
-         common.broker_req.to(current_broker.get()) << "GET_JOB";
-         state = state_trying_to_get_job;
+         // the broker drops any earlier request to wait when it's asked
+         // for jobs directly.
+         waiting_brokers.erase(current_broker.get());
+
+         zstream::socket::osocket &out = common.broker_req.to(current_broker.get());
+         if (num_jobs == 1) {
+            if (!styles.empty()) { out << manip::more; }
+            out << "GET_JOB";
+         } else {
+            out << manip::more << "GET_JOBS";
+            if (!styles.empty()) { out << manip::more; }
+            out << num_jobs;
+         }
+         send_styles(out);
          // set up a time after which this worker will give up trying to 
          // get a job from the current broker, assuming it has died, and
          // try a different one instead.
          get_job_retry_time = microsec_clock::universal_time() + milliseconds(broker_timeout);
 
-      } else {
-         // otherwise switch state back to waiting so that
-         // an announce might trigger another attempt.
-         state = state_waiting_for_job;
+      } else if (wait_for_jobs) {
+         // wait on each of the brokers for jobs to come in. if one of 
+         // them doesn't answer in time it's asked again, in case it has
+         // gone away and come back.
+         const ptime expiry = microsec_clock::universal_time() + milliseconds(broker_timeout);
+         BOOST_FOREACH(const string &broker, known_brokers) {
+            if (waiting_brokers.count(broker) == 0) {
+               zstream::socket::osocket &out = common.broker_req.to(broker);
+               out << manip::more << "WAIT_JOBS";
+               if (!styles.empty()) { out << manip::more; }
+               out << num_jobs;
+               send_styles(out);
+               waiting_brokers[broker] = expiry;
+            }
+         }
       }
+      // otherwise wait, so that an announce might trigger another
+      // attempt.
+   }
+
+   // follow a message to a broker with the styles this worker can 
+   // render, if it can't render all of them. the message must already
+   // have been marked as having more parts, if there are any.
+   void send_styles(zstream::socket::osocket &out) {
+      for (size_t i = 0; i < styles.size(); ++i) {
+         if (i + 1 < styles.size()) { out << manip::more; }
+         out << styles[i];
+      }
+   }
+
+   // note a broker which this worker has heard from, telling it which
+   // styles this worker can render if it's new.
+   void add_known_broker(const string &broker) {
+      if (known_brokers.insert(broker).second && !styles.empty()) {
+         zstream::socket::osocket &out = common.broker_req.to(broker);
+         out << manip::more << "STYLES";
+         send_styles(out);
+      }
+   }
+
+   // the number of jobs to keep in the buffer. the worker code waiting
+   // for a job counts as one more slot.
+   size_t jobs_wanted() const {
+      return prefetch_limit + ((state == state_waiting_for_job) ? 1 : 0);
+   }
+
+   // tell the brokers this worker is waiting on that it doesn't want
+   // any more jobs for now.
+   void stop_waiting() {
+      typedef map<string, ptime>::value_type waiting_t;
+      BOOST_FOREACH(const waiting_t &waiting, waiting_brokers) {
+         common.broker_req.to(waiting.first) << "CANCEL_WAIT";
+      }
+      waiting_brokers.clear();
+   }
+
+   // forget about waiting on brokers which haven't answered in a whole
+   // broker timeout, and wait on them again.
+   void expire_waiting() {
+      const ptime now = microsec_clock::universal_time();
+      bool expired = false;
+      map<string, ptime>::iterator itr = waiting_brokers.begin();
+      while (itr != waiting_brokers.end()) {
+         if (itr->second < now) {
+            waiting_brokers.erase(itr++);
+            expired = true;
+         } else {
+            ++itr;
+         }
+      }
+      if (expired) { try_to_get_jobs(); }
    }
 
    zmq_backend_common common;
    zstream::socket::pair inproc_req;
 
    // poll and broker timeouts. the poll loop timeout is in microseconds, 
-   // the broker timeout in milliseconds.
-   long poll_timeout, broker_timeout;
+   // the broker timeout and lease renewal interval in milliseconds.
+   long poll_timeout, broker_timeout, renew_interval;
+
+   // the number of jobs to keep in the buffer while the worker code is
+   // busy processing.
+   size_t prefetch_limit;
+
+   // whether to wait on the brokers for jobs to come in, when none of
+   // them have announced any.
+   bool wait_for_jobs;
+
+   // the styles this worker can render, or empty if it can render any.
+   std::vector<string> styles;
 
    // whether we've been asked to shutdown this thread.
    bool &shutdown_requested;
 
-   // what stage of processing is this communicator in?
+   // what stage of processing is the worker code in?
    communicator_state state;
 
    // this worker's ID
    const string &worker_id;
 
-   // whether we're currently polling a particular worker for a job
+   // whether we're currently polling a particular broker for jobs
    boost::optional<string> current_broker;
 
+   // the broker which the job being processed by the worker code came
+   // from, so that the result can be sent back there, and the job.
+   boost::optional<string> processing_broker;
+   boost::optional<rendermq::tile_protocol> processing_job;
+
+   // jobs which have been leased from the brokers, but not yet given to
+   // the worker code, along with the broker each came from. if the worker
+   // exits with jobs in here they're released back to the brokers.
+   std::deque<std::pair<string, rendermq::tile_protocol> > prefetched;
+
    /* workers keep track of the status of the brokers to fairly
     * attempt to get the highest priority job. jobs are ordered by
     * priority on the broker and, between jobs with the same 
@@ -478,6 +712,14 @@ struct zmq_backend_worker::task_communicator {
 
    // time at which to give up on a (presumably) dead broker and retry
    ptime get_job_retry_time;
+
+   // the brokers which have been heard from, and those which this worker
+   // is waiting on for jobs along with when to give up and ask again.
+   std::set<string> known_brokers;
+   map<string, ptime> waiting_brokers;
+
+   // time at which to next renew the leases on the jobs this worker holds
+   ptime next_renewal;
 };
 
 zmq_backend_worker::zmq_backend_worker(const pt::ptree &pt) 
@@ -500,6 +742,7 @@ void
 zmq_backend_worker::setup(const pt::ptree &pt) {
    poll_timeout = long(pt.get<double>("worker.poll_timeout", DEFAULT_POLL_TIMEOUT) * 1000000);
    long broker_timeout = long(pt.get<double>("worker.broker_timeout", DEFAULT_BROKER_TIMEOUT) * 1000);
+   long renew_interval = long(pt.get<double>("worker.lease_renew_interval", DEFAULT_LEASE_RENEW_INTERVAL) * 1000);
 
    boost::optional<std::string> config_worker_id = pt.get_optional<std::string>("worker.id");
    if (config_worker_id) {
@@ -511,9 +754,21 @@ zmq_backend_worker::setup(const pt::ptree &pt) {
    // make unique so it can be used in tests...
    inproc_rep.bind("inproc://communication-" + worker_id);
 
+   size_t prefetch = pt.get<size_t>("worker.prefetch", DEFAULT_PREFETCH);
+   bool wait_for_jobs = pt.get<bool>("worker.wait_for_jobs", DEFAULT_WAIT_FOR_JOBS);
+
+   // the styles this worker can render, separated by commas, if it 
+   // can't render all of them.
+   std::vector<string> styles;
+   typedef boost::tokenizer<boost::char_separator<char> > tokenizer_t;
+   boost::char_separator<char> sep(", \t");
+   tokenizer_t tok(pt.get<string>("worker.styles", ""), sep);
+   std::copy(tok.begin(), tok.end(), std::back_inserter(styles));
+
    communicator.reset(new task_communicator(*context, poll_timeout, 
-                                            broker_timeout, shutdown_requested,
-                                            worker_id));
+                                            broker_timeout, renew_interval,
+                                            prefetch, wait_for_jobs, styles,
+                                            shutdown_requested, worker_id));
    comm_thread.reset(new boost::thread(boost::ref(*communicator)));
 
    // set the identity on the REQ socket to support identity routing. this
@@ -663,15 +918,17 @@ zmq_backend_handler::fill_pollitems(zmq::pollitem_t *items) {
 zmq_backend_handler::heartbeat::heartbeat() 
    : time(), // note: this will be an invalid time, but updated in update_heartbeat.
      queue_size(0),
+     drain_time(0),
      is_live(false) {
 }
 
 void 
-zmq_backend_handler::update_heartbeat(const string &broker_id, uint64_t qsize) {
+zmq_backend_handler::update_heartbeat(const string &broker_id, uint64_t qsize, uint64_t drain) {
    LOG_FINER(boost::format("HEARTBEAT! %1% is alive...") % broker_id);
    heartbeat &hb = heartbeats[broker_id];
    hb.time = microsec_clock::local_time();
    hb.queue_size = qsize;
+   hb.drain_time = drain;
 }
 
 bool
@@ -684,9 +941,13 @@ zmq_backend_handler::handle_pollitems(zmq::pollitem_t *items, std::list<job_t> &
       // note that the broker ID being sent over the wire will be the broker's
       // *XREP* socket ID, not the PUB one...
       std::string msg;
-      uint64_t qsize;
+      uint64_t qsize, drain = 0;
       (*common.broker_sub) >> msg >> qsize;
-      update_heartbeat(msg, qsize);
+      // older brokers don't send the expected time to drain the queue.
+      if (common.broker_sub->has_more()) {
+         (*common.broker_sub) >> drain;
+      }
+      update_heartbeat(msg, qsize, drain);
    }
 
    if (items[0].revents & ZMQ_POLLIN) {
@@ -694,6 +955,14 @@ zmq_backend_handler::handle_pollitems(zmq::pollitem_t *items, std::list<job_t> &
       common.broker_req >> manip::ignore_routing_headers
                         >> job;
 
+      // the broker sends the tile data in a separate frame, so that it
+      // doesn't have to copy it out of the metatile.
+      if (common.broker_req.has_more()) {
+         string data;
+         common.broker_req >> data;
+         job.swap_data(data);
+      }
+
       jobs.push_back(job);
 
       have_new_jobs = true;
@@ -143,6 +143,7 @@ private:
       heartbeat();
       boost::posix_time::ptime time; // when the last heartbeat was received
       uint64_t queue_size; // size of the broker's queue, as advertised.
+      uint64_t drain_time; // seconds the broker expects to take to get through it.
       bool is_live; // whether the *consistent hash* considers this live.
    };
    boost::unordered_map<std::string, heartbeat> heartbeats;
@@ -157,7 +158,7 @@ private:
    void update_live_brokers();
 
    // update the heartbeat for a broker.
-   void update_heartbeat(const std::string &broker_id, uint64_t qsize);
+   void update_heartbeat(const std::string &broker_id, uint64_t qsize, uint64_t drain);
 
    // check if we are still settling. returns true if settling has not
    // yet finished, false if the queue is ready to be used.
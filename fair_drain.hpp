@@ -0,0 +1,105 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef FAIR_DRAIN_HPP
+#define FAIR_DRAIN_HPP
+
+#include <vector>
+
+#include <boost/function.hpp>
+
+namespace rendermq
+{
+
+/* handles the messages waiting on several sources after an event loop
+ * wakes up, taking up to a fixed budget of messages from each in turn.
+ *
+ * handling everything waiting on a source before polling again saves
+ * a system call per message, and the budget stops a flood on one
+ * source (e.g: requests from mongrel) from starving the others. the
+ * source which goes first is rotated on each call, so that none of
+ * them is always served last.
+ */
+class fair_drain
+{
+public:
+   // returns whether the source has a message waiting, without blocking.
+   typedef boost::function<bool ()> ready_function_t;
+
+   // handles a single message from the source.
+   typedef boost::function<void ()> handler_function_t;
+
+   /* create a drain which takes up to budget messages from each source
+    * per call. a budget of zero is treated as one.
+    */
+   explicit fair_drain(size_t budget)
+      : m_budget(budget > 0 ? budget : 1), m_next(0) {}
+
+   void add_source(ready_function_t const& ready, handler_function_t const& handler)
+   {
+      m_sources.push_back(source(ready, handler));
+   }
+
+   /* take up to the budget of messages from each of the sources in
+    * turn. returns the number of messages handled.
+    */
+   size_t operator()()
+   {
+      const size_t num_sources = m_sources.size();
+      size_t handled = 0;
+
+      for (size_t i = 0; i < num_sources; ++i)
+      {
+         source &s = m_sources[(m_next + i) % num_sources];
+         for (size_t n = 0; n < m_budget && s.ready(); ++n)
+         {
+            s.handler();
+            ++handled;
+         }
+      }
+
+      if (num_sources > 0) { m_next = (m_next + 1) % num_sources; }
+      return handled;
+   }
+
+   size_t budget() const { return m_budget; }
+
+private:
+   struct source
+   {
+      source(ready_function_t const& r, handler_function_t const& h)
+         : ready(r), handler(h) {}
+
+      ready_function_t ready;
+      handler_function_t handler;
+   };
+
+   std::vector<source> m_sources;
+   size_t m_budget, m_next;
+};
+
+} // namespace rendermq
+
+#endif // FAIR_DRAIN_HPP
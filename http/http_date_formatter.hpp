@@ -27,6 +27,11 @@
 #define HTTP_DATE_FORMATTER_HPP
 
 #include <boost/date_time/local_time/local_time.hpp>
+#include <ctime>
+#include <cstring>
+
+// length of an RFC 1123 HTTP-date, e.g: "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_LENGTH (29)
 
 namespace rendermq
 {
@@ -58,6 +63,61 @@ public:
     time_zone_ptr zone_;
 };
 
+// writes the RFC 1123 HTTP-date for the time into buf, which must have
+// space for HTTP_DATE_LENGTH characters. this gives the same result as
+// the formatter above, but without needing a locale or time zone.
+inline void format_http_date(char *buf, std::time_t tt)
+{
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm t;
+    gmtime_r(&tt, &t);
+    const int year = t.tm_year + 1900;
+
+    std::memcpy(buf, days + 3 * t.tm_wday, 3);
+    buf[3] = ','; buf[4] = ' ';
+    buf[5] = '0' + t.tm_mday / 10; buf[6] = '0' + t.tm_mday % 10;
+    buf[7] = ' ';
+    std::memcpy(buf + 8, months + 3 * t.tm_mon, 3);
+    buf[11] = ' ';
+    buf[12] = '0' + (year / 1000) % 10; buf[13] = '0' + (year / 100) % 10;
+    buf[14] = '0' + (year / 10) % 10;   buf[15] = '0' + year % 10;
+    buf[16] = ' ';
+    buf[17] = '0' + t.tm_hour / 10; buf[18] = '0' + t.tm_hour % 10;
+    buf[19] = ':';
+    buf[20] = '0' + t.tm_min / 10;  buf[21] = '0' + t.tm_min % 10;
+    buf[22] = ':';
+    buf[23] = '0' + t.tm_sec / 10;  buf[24] = '0' + t.tm_sec % 10;
+    std::memcpy(buf + 25, " GMT", 4);
+}
+
+// keeps the HTTP-date of the last time it was asked for. the dates
+// which are worked out from the current time, such as the Date and
+// Expires headers, then only need formatting once a second.
+class http_date_cache
+{
+public:
+    http_date_cache() : time_(0), valid_(false) {}
+
+    // the formatted date, which is HTTP_DATE_LENGTH characters long
+    // and not null-terminated.
+    const char *operator() (std::time_t tt)
+    {
+        if (!valid_ || tt != time_)
+        {
+            format_http_date(buf_, tt);
+            time_ = tt;
+            valid_ = true;
+        }
+        return buf_;
+    }
+
+private:
+    std::time_t time_;
+    bool valid_;
+    char buf_[HTTP_DATE_LENGTH];
+};
+
 }
 
 
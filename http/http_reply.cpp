@@ -25,6 +25,8 @@
 
 #include "http_reply.hpp"
 #include <sstream>
+#include <cstring>
+#include <boost/lexical_cast.hpp>
 
 #define SERVER_VERSION "0.8.0"
 #define SERVER_NAME "Mapnik2"
@@ -175,6 +177,23 @@ void send_503(zmq::socket_t &socket,
    socket.send(msg);
 }
 
+void send_504(zmq::socket_t &socket,
+              const std::string &uuid,
+              const std::string &id) {
+   std::string output("The tile you requested could not be rendered in time. Please try again later.\n");
+   std::ostringstream http;
+   http << uuid << " " << id.size() << ":" << id << ", ";
+   http << "HTTP/1.1" << " " << 504 << " " << "Gateway Timeout" << "\r\n";
+   http << "Content-Type: text/plain\r\n";
+   http << "Content-Length: " << output.length()  << "\r\n";
+   http << "Server: " SERVER "\r\n\r\n";
+   http << output;
+   std::string s = http.str();
+   zmq::message_t msg(s.length());
+   std::memcpy(msg.data(),s.c_str(),s.length());
+   socket.send(msg);
+}
+
 void send_202(zmq::socket_t &socket,
               const std::string &uuid,
               const std::string &id) {
@@ -194,5 +213,143 @@ void send_202(zmq::socket_t &socket,
    socket.send(msg);
 }
 
+namespace {
+
+inline char *append(char *p, const char *s, size_t len)
+{
+   std::memcpy(p, s, len);
+   return p + len;
+}
+
+inline char *append(char *p, const std::string &s)
+{
+   return append(p, s.data(), s.size());
+}
+
+// formats a non-negative number into the end of buf, returning the
+// start of it.
+inline char *format_number(char *end, boost::uint64_t n)
+{
+   char *p = end;
+   do
+   {
+      *--p = '0' + (n % 10);
+      n /= 10;
+   } while (n > 0);
+   return p;
+}
+
+// the maximum number of digits in a 64-bit number.
+const size_t max_digits = 20;
+
+} // anonymous namespace
+
+http_reply_templates::http_reply_templates(unsigned max_age)
+{
+   const std::string age = boost::lexical_cast<std::string>(max_age);
+   m_tile_middle = "\r\nCache-Control: max-age=" + age + 
+      "\r\nEdge-Control: downstream-ttl=" + age + 
+      "\r\nLast-Modified: ";
+   m_tile_tail = "\r\nServer: " SERVER "\r\n"
+      "Access-Control-Allow-Origin: *\r\n\r\n";
+}
+
+const http_reply_templates::mime_templates &
+http_reply_templates::templates_for(const std::string &mime_type)
+{
+   std::map<std::string, mime_templates>::iterator itr = m_templates.find(mime_type);
+   if (itr == m_templates.end())
+   {
+      mime_templates t;
+      t.tile_head = "HTTP/1.1 200 OK\r\nContent-Type: " + mime_type + "\r\nContent-Length: ";
+      t.not_modified_head = "HTTP/1.1 304 Not Modified\r\nContent-Type: " + mime_type + "\r\nDate: ";
+      itr = m_templates.insert(std::make_pair(mime_type, t)).first;
+   }
+   return itr->second;
+}
+
+void http_reply_templates::tile_message(zmq::message_t &msg,
+                                        std::string const& uuid, boost::int64_t id,
+                                        std::time_t last_modified, std::time_t expire_time,
+                                        std::string const& data, const std::string &mime_type)
+{
+   static const char expires[] = "\r\nExpires: ";
+   const mime_templates &t = templates_for(mime_type);
+
+   char id_buf[max_digits], id_len_buf[max_digits], data_len_buf[max_digits];
+   char *id_end = id_buf + max_digits, *id_len_end = id_len_buf + max_digits;
+   char *data_len_end = data_len_buf + max_digits;
+   char *id_str = format_number(id_end, id);
+   char *id_len_str = format_number(id_len_end, id_end - id_str);
+   char *data_len_str = format_number(data_len_end, data.size());
+
+   const size_t size = uuid.size() + 1 + (id_len_end - id_len_str) + 1 + (id_end - id_str) + 2 +
+      t.tile_head.size() + (data_len_end - data_len_str) + m_tile_middle.size() + HTTP_DATE_LENGTH +
+      (sizeof(expires) - 1) + HTTP_DATE_LENGTH + m_tile_tail.size() + data.size();
+
+   msg.rebuild(size);
+   char *p = static_cast<char *>(msg.data());
+   p = append(p, uuid);
+   *p++ = ' ';
+   p = append(p, id_len_str, id_len_end - id_len_str);
+   *p++ = ':';
+   p = append(p, id_str, id_end - id_str);
+   p = append(p, ", ", 2);
+   p = append(p, t.tile_head);
+   p = append(p, data_len_str, data_len_end - data_len_str);
+   p = append(p, m_tile_middle);
+   p = append(p, m_last_modified(last_modified), HTTP_DATE_LENGTH);
+   p = append(p, expires, sizeof(expires) - 1);
+   p = append(p, m_expires(expire_time), HTTP_DATE_LENGTH);
+   p = append(p, m_tile_tail);
+   append(p, data);
+}
+
+void http_reply_templates::not_modified_message(zmq::message_t &msg,
+                                                std::string const& uuid, boost::int64_t id,
+                                                std::time_t date, const std::string &mime_type)
+{
+   static const char tail[] = "\r\nServer: " SERVER "\r\n\r\n";
+   const mime_templates &t = templates_for(mime_type);
+
+   char id_buf[max_digits], id_len_buf[max_digits];
+   char *id_end = id_buf + max_digits, *id_len_end = id_len_buf + max_digits;
+   char *id_str = format_number(id_end, id);
+   char *id_len_str = format_number(id_len_end, id_end - id_str);
+
+   const size_t size = uuid.size() + 1 + (id_len_end - id_len_str) + 1 + (id_end - id_str) + 2 +
+      t.not_modified_head.size() + HTTP_DATE_LENGTH + (sizeof(tail) - 1);
+
+   msg.rebuild(size);
+   char *p = static_cast<char *>(msg.data());
+   p = append(p, uuid);
+   *p++ = ' ';
+   p = append(p, id_len_str, id_len_end - id_len_str);
+   *p++ = ':';
+   p = append(p, id_str, id_end - id_str);
+   p = append(p, ", ", 2);
+   p = append(p, t.not_modified_head);
+   p = append(p, m_date(date), HTTP_DATE_LENGTH);
+   append(p, tail, sizeof(tail) - 1);
+}
+
+void http_reply_templates::send_tile(zmq::socket_t & socket, 
+                                     std::string const& uuid, boost::int64_t id,
+                                     std::time_t last_modified, std::time_t expire_time,
+                                     std::string const& data, const std::string &mime_type)
+{
+   zmq::message_t msg;
+   tile_message(msg, uuid, id, last_modified, expire_time, data, mime_type);
+   socket.send(msg);
+}
+
+void http_reply_templates::send_304(zmq::socket_t & socket, 
+                                    std::string const& uuid, boost::int64_t id,
+                                    std::time_t date, const std::string &mime_type)
+{
+   zmq::message_t msg;
+   not_modified_message(msg, uuid, id, date, mime_type);
+   socket.send(msg);
+}
 
 }
@@ -28,6 +28,8 @@
 
 #include <zmq.hpp>
 #include <string>
+#include <map>
+#include <boost/cstdint.hpp>
 
 #include "http_date_formatter.hpp"
 
@@ -65,6 +67,13 @@ void send_503(zmq::socket_t &socket,
               const std::string &uuid,
               const std::string &id);
 
+// when a tile has been waiting on the rendering queue for longer than
+// its deadline, and there's no stale copy to fall back on, return this
+// rather than leave the client waiting indefinitely.
+void send_504(zmq::socket_t &socket,
+              const std::string &uuid,
+              const std::string &id);
+
 
 // sends a tile, along with Last-Modified and cache-related headers.
 void send_tile(zmq::socket_t & socket, 
@@ -93,6 +102,70 @@ void send_202(zmq::socket_t &socket,
               const std::string &uuid,
               const std::string &id);
 
+/* sends tiles and "not modified" replies with the same headers as 
+ * send_tile and send_304, but from header templates which are made
+ * once for each mime type rather than formatted for every response.
+ * the dates are also cached, so the ones worked out from the current
+ * time are only formatted once a second.
+ *
+ * the response is written straight into the 0MQ message, so the tile
+ * data is only copied once. it can't be sent as a separate message
+ * part without copying, as mongrel2 expects the whole response in a
+ * single part.
+ */
+class http_reply_templates
+{
+public:
+   // max_age is used for the cache-related headers on all tiles.
+   explicit http_reply_templates(unsigned max_age);
+
+   // sends a tile, along with Last-Modified and cache-related headers.
+   void send_tile(zmq::socket_t & socket, 
+                  std::string const& uuid, 
+                  boost::int64_t id,
+                  std::time_t last_modified, 
+                  std::time_t expire_time,
+                  std::string const& data,
+                  const std::string &mime_type);
+
+   void send_304(zmq::socket_t & socket, 
+                 std::string const& uuid, 
+                 boost::int64_t id,
+                 std::time_t date, 
+                 const std::string &mime_type);
+
+   // build the messages which the above send.
+   void tile_message(zmq::message_t &msg,
+                     std::string const& uuid, 
+                     boost::int64_t id,
+                     std::time_t last_modified, 
+                     std::time_t expire_time,
+                     std::string const& data,
+                     const std::string &mime_type);
+
+   void not_modified_message(zmq::message_t &msg,
+                             std::string const& uuid, 
+                             boost::int64_t id,
+                             std::time_t date, 
+                             const std::string &mime_type);
+
+private:
+   // the parts of the headers which depend on the mime type.
+   struct mime_templates
+   {
+      std::string tile_head, not_modified_head;
+   };
+
+   const mime_templates &templates_for(const std::string &mime_type);
+
+   // the parts of the tile headers between the content length and the
+   // last modified date, and after the expiry date.
+   std::string m_tile_middle, m_tile_tail;
+
+   std::map<std::string, mime_templates> m_templates;
+   http_date_cache m_last_modified, m_expires, m_date;
+};
+
 }
 
 #endif // HTTP_REPLY_HPP
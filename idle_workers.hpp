@@ -0,0 +1,152 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef IDLE_WORKERS_HPP
+#define IDLE_WORKERS_HPP
+
+#include "timer_wheel.hpp"
+
+#include <list>
+#include <set>
+#include <string>
+
+#include <boost/cstdint.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+#include <boost/optional.hpp>
+
+namespace rendermq
+{
+
+/* a worker which has asked for jobs when there weren't any, and is
+ * waiting for the broker to send some as soon as they come in. the
+ * addresses are the routing headers to reply to, the first of which
+ * identifies the worker, and the timer is the one which tells the 
+ * worker to ask again if nothing has come in by then. the styles are
+ * the ones the worker can render, or empty if it can render any.
+ */
+struct waiting_worker
+{
+   waiting_worker(std::list<std::string> const& a, boost::uint32_t n, timer_wheel::timer_id t,
+                  std::set<std::string> const& s = std::set<std::string>())
+      : addresses(a), num_jobs(n), timer(t), styles(s) {}
+
+   std::string const& id() const { return addresses.front(); }
+
+   // whether the worker can render the style.
+   bool renders(std::string const& style) const { return styles.empty() || styles.count(style) > 0; }
+
+   std::list<std::string> addresses;
+   boost::uint32_t num_jobs;
+   timer_wheel::timer_id timer;
+   std::set<std::string> styles;
+};
+
+/* the workers which are waiting for jobs, so that a job coming in can
+ * be sent straight to one of them instead of announcing it to all the
+ * workers and having them race each other for it.
+ *
+ * the worker which has been waiting longest goes first. each worker
+ * waits at most once, so a worker asking again replaces its earlier
+ * request.
+ */
+class idle_workers
+{
+   typedef boost::multi_index::multi_index_container<waiting_worker,
+      boost::multi_index::indexed_by<
+// longest waiting at the front
+      boost::multi_index::sequenced<>,
+// hash index on the worker's identity
+      boost::multi_index::hashed_unique<
+         boost::multi_index::const_mem_fun<waiting_worker, std::string const&, &waiting_worker::id> >
+      > > cont_type;
+
+   typedef cont_type::nth_index<1>::type id_index_type;
+
+public:
+   typedef cont_type::const_iterator iterator;
+
+   /* add a worker to the back of the queue. if it was already waiting
+    * then the earlier request is returned, so that its timer can be
+    * cancelled.
+    */
+   boost::optional<waiting_worker> wait(waiting_worker const& worker)
+   {
+      boost::optional<waiting_worker> previous = remove(worker.id());
+      m_workers.push_back(worker);
+      return previous;
+   }
+
+   /* remove a worker, e.g: because it has asked for jobs in some other
+    * way or gone away, returning its request if it was waiting.
+    */
+   boost::optional<waiting_worker> remove(std::string const& id)
+   {
+      id_index_type & index = m_workers.get<1>();
+      id_index_type::iterator itr = index.find(id);
+      if (itr == index.end()) return boost::optional<waiting_worker>();
+
+      waiting_worker worker(*itr);
+      index.erase(itr);
+      return worker;
+   }
+
+   /* the worker which has been waiting the longest, removed from the
+    * queue, if there are any.
+    */
+   boost::optional<waiting_worker> pop()
+   {
+      if (m_workers.empty()) return boost::optional<waiting_worker>();
+
+      waiting_worker worker(m_workers.front());
+      m_workers.pop_front();
+      return worker;
+   }
+
+   // the worker which has been waiting the longest, if there are any.
+   boost::optional<waiting_worker const&> front() const
+   {
+      if (m_workers.empty()) return boost::optional<waiting_worker const&>();
+      return boost::optional<waiting_worker const&>(m_workers.front());
+   }
+
+   // the waiting workers, longest waiting first. removing one of them
+   // doesn't affect iterators to the others.
+   iterator begin() const { return m_workers.begin(); }
+   iterator end() const { return m_workers.end(); }
+
+   bool empty() const { return m_workers.empty(); }
+
+   size_t size() const { return m_workers.size(); }
+
+private:
+   cont_type m_workers;
+};
+
+} // namespace rendermq
+
+#endif // IDLE_WORKERS_HPP
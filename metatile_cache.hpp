@@ -0,0 +1,215 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef METATILE_CACHE_HPP
+#define METATILE_CACHE_HPP
+
+#include "tile_protocol.hpp"
+
+#include <string>
+#include <ctime> // for std::time_t
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace rendermq
+{
+
+// metatile data which has been received from a worker, shared between
+// the cache and everything which is sending parts of it on to handlers.
+typedef boost::shared_ptr<const std::string> shared_metatile_t;
+
+/* a metatile which was recently rendered. the tile holds the position
+ * and style (metatile-aligned) along with the status, last modified
+ * time and formats of the result which the worker sent back.
+ */
+struct cached_metatile
+{
+   cached_metatile(tile_protocol const& t, shared_metatile_t const& d, std::time_t e)
+      : tile(t), data(d), expiry(e) {}
+
+   tile_protocol tile;
+   shared_metatile_t data;
+   std::time_t expiry;
+};
+
+/* a bounded cache of recently completed metatiles, so that requests
+ * which arrive just after the metatile was rendered (e.g: the other
+ * tiles in a map view) can be answered without rendering it again.
+ *
+ * the cache is limited by the total size of the metatile data, and the
+ * least recently used entries are evicted to make space. entries also
+ * expire after a fixed time to live, so that the tiles handed out
+ * aren't too stale.
+ */
+class metatile_cache
+{
+   // compares only the parts of the tile which identify the metatile,
+   // which must already be metatile-aligned.
+   struct metatile_equal
+   {
+      bool operator()(tile_protocol const& a, tile_protocol const& b) const
+      {
+         return (a.x == b.x && a.y == b.y && a.z == b.z && a.style == b.style);
+      }
+   };
+
+   struct metatile_hash
+   {
+      std::size_t operator()(tile_protocol const& t) const
+      {
+         return hash_value(t);
+      }
+   };
+
+   typedef boost::multi_index::multi_index_container<cached_metatile,
+      boost::multi_index::indexed_by<
+// most recently used at the front
+      boost::multi_index::sequenced<>,
+// hash index on x,y,z & style
+      boost::multi_index::hashed_unique<
+         boost::multi_index::member<cached_metatile, tile_protocol, &cached_metatile::tile>,
+         metatile_hash, metatile_equal>
+      > > cont_type;
+
+   typedef cont_type::nth_index<1>::type meta_index_type;
+
+   static tile_protocol metatile_key(tile_protocol const& tile)
+   {
+      tile_protocol key(tile);
+      key.x &= ~(METATILE-1);
+      key.y &= ~(METATILE-1);
+      return key;
+   }
+
+   void erase_lru()
+   {
+      m_bytes -= m_cache.back().data->size();
+      m_cache.pop_back();
+   }
+
+public:
+   /* create a cache which holds up to max_bytes of metatile data, each
+    * for up to ttl seconds. a max_bytes of zero disables the cache.
+    */
+   metatile_cache(size_t max_bytes, int ttl)
+      : m_max_bytes(max_bytes), m_ttl(ttl), m_bytes(0),
+        m_hits(0), m_misses(0), m_evictions(0) {}
+
+   /* add a completed metatile to the cache, replacing any older copy
+    * of it. the tile gives the position, status, last modified time
+    * and formats of the metatile and data is the metatile itself.
+    */
+   void insert(tile_protocol const& tile, shared_metatile_t const& data, std::time_t now)
+   {
+      if (data->size() > m_max_bytes) return;
+
+      tile_protocol key = metatile_key(tile);
+      erase(key);
+
+      m_cache.push_front(cached_metatile(key, data, now + m_ttl));
+      m_bytes += data->size();
+
+      // throw away anything which has expired first, as it's of no
+      // use, then the least recently used until there's enough space.
+      while (!m_cache.empty() && m_cache.back().expiry <= now)
+      {
+         erase_lru();
+      }
+      while (m_bytes > m_max_bytes)
+      {
+         erase_lru();
+         ++m_evictions;
+      }
+   }
+
+   /* look up the metatile containing the given tile. this only counts
+    * as a hit if the cached copy hasn't expired and has the format
+    * being asked for.
+    */
+   boost::optional<cached_metatile const&> find(tile_protocol const& tile, std::time_t now)
+   {
+      meta_index_type & index = m_cache.get<1>();
+      meta_index_type::iterator itr = index.find(metatile_key(tile));
+
+      if (itr != index.end() && itr->expiry <= now)
+      {
+         m_bytes -= itr->data->size();
+         index.erase(itr);
+         itr = index.end();
+      }
+
+      if (itr == index.end() || (itr->tile.format & tile.format) != tile.format)
+      {
+         ++m_misses;
+         return boost::optional<cached_metatile const&>();
+      }
+
+      m_cache.relocate(m_cache.begin(), m_cache.project<0>(itr));
+      ++m_hits;
+      return boost::optional<cached_metatile const&>(*itr);
+   }
+
+   /* remove the metatile containing the given tile, e.g: because it's
+    * been marked as dirty.
+    */
+   void erase(tile_protocol const& tile)
+   {
+      meta_index_type & index = m_cache.get<1>();
+      meta_index_type::iterator itr = index.find(metatile_key(tile));
+      if (itr != index.end())
+      {
+         m_bytes -= itr->data->size();
+         index.erase(itr);
+      }
+   }
+
+   // the number of metatiles in the cache.
+   size_t size() const { return m_cache.size(); }
+
+   // the total size of the metatile data in the cache.
+   size_t bytes() const { return m_bytes; }
+
+   // counters for the lookups which were and weren't answered by the
+   // cache, and entries which had to be thrown away to make space.
+   size_t hits() const { return m_hits; }
+   size_t misses() const { return m_misses; }
+   size_t evictions() const { return m_evictions; }
+
+private:
+   cont_type m_cache;
+   size_t m_max_bytes;
+   int m_ttl;
+   size_t m_bytes;
+   size_t m_hits, m_misses, m_evictions;
+};
+
+} // namespace rendermq
+
+#endif // METATILE_CACHE_HPP
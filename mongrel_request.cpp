@@ -56,6 +56,81 @@ std::string mongrel_request::query_string() const
    }
 }
 
+namespace {
+
+// read a JSON string starting at the opening quote, which the request
+// parser has already checked, into value. the 4-hex-digit unicode
+// escapes aren't supported, as in the request grammar.
+const char *read_json_string(const char *p, std::string &value)
+{
+   value.clear();
+   for (++p; *p != '"'; ++p)
+   {
+      if (*p == '\\')
+      {
+         ++p;
+         switch (*p)
+         {
+         case 'b': value += '\b'; break;
+         case 'f': value += '\f'; break;
+         case 'n': value += '\n'; break;
+         case 'r': value += '\r'; break;
+         case 't': value += '\t'; break;
+         default: value += *p; break;
+         }
+      }
+      else
+      {
+         value += *p;
+      }
+   }
+   return p + 1;
+}
+
+// skip past the JSON string or array of strings starting at p.
+const char *skip_json_value(const char *p)
+{
+   const char open = *p, close = (open == '[') ? ']' : '"';
+   for (++p; *p != close; ++p)
+   {
+      if (*p == '\\') { ++p; }
+      else if (*p == '"' && open == '[') { p = skip_json_value(p) - 1; }
+   }
+   return p + 1;
+}
+
+const char *skip_space(const char *p)
+{
+   while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') { ++p; }
+   return p;
+}
+
+} // anonymous namespace
+
+bool mongrel_request_view::header(std::string const& name, std::string &value) const
+{
+   if (headers.empty()) { return false; }
+
+   // the parser has already checked that the headers are an object
+   // with string keys and string (or array of strings) values, and
+   // that it ends with a closing brace.
+   std::string key;
+   const char *p = skip_space(headers.begin() + 1);
+   while (*p == '"')
+   {
+      p = skip_space(read_json_string(p, key));
+      p = skip_space(p + 1); // past the colon
+      if (key == name && *p == '"')
+      {
+         read_json_string(p, value);
+         return true;
+      }
+      p = skip_space(skip_json_value(p));
+      if (*p == ',') { p = skip_space(p + 1); }
+   }
+   return false;
+}
+
 bool mongrel_request::is_disconnect() const
 {
     return false;
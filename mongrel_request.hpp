@@ -26,10 +26,15 @@
 #ifndef MONGREL_REQUEST_HPP
 #define MONGREL_REQUEST_HPP
 
+#include "tile_protocol.hpp"
+
 #include <iostream>
 #include <map>
 #include <ctime> // for std::time_t
 
+#include <boost/cstdint.hpp>
+#include <boost/range/iterator_range.hpp>
+
 namespace rendermq  {
 
 class mongrel_request 
@@ -65,6 +70,36 @@ private:
     cont_type body_;
 };
 
+/* a mongrel2 request which refers to the parts of the message it was
+ * parsed from, rather than copying them out, so the message must
+ * outlive it. when the path is for a tile, that is parsed too.
+ *
+ * the headers are left as the raw JSON object from the message, and
+ * only looked up and unescaped when they're asked for.
+ */
+struct mongrel_request_view
+{
+   typedef boost::iterator_range<const char *> range_type;
+
+   mongrel_request_view() : client_id(0), is_tile(false) {}
+
+   // look up the string value of a header, returning false if it
+   // isn't present.
+   bool header(std::string const& name, std::string &value) const;
+
+   // the mongrel2 server's identity and the client's connection id.
+   range_type uuid, id;
+   boost::int64_t client_id;
+
+   // the path, the JSON headers object (including braces) and body.
+   range_type path, headers, body;
+
+   // whether the path was a valid tile path and, if it was, the tile
+   // which it refers to.
+   bool is_tile;
+   tile_protocol tile;
+};
+
 
 }
 
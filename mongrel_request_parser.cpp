@@ -29,11 +29,193 @@
 #include <boost/foreach.hpp>
 // boost
 #include <boost/xpressive/xpressive.hpp>
+// stl
+#include <algorithm>
 #include "logging/logger.hpp"
 
 namespace rendermq
 {
 
+namespace {
+
+typedef const char * iter_t;
+
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+inline bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+inline bool is_alnum(char c) { return is_alpha(c) || is_digit(c); }
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+inline bool starts_with(iter_t p, iter_t end, const char *prefix, size_t len)
+{
+   return (size_t(end - p) >= len) && std::equal(prefix, prefix + len, p);
+}
+
+/* parse a netstring "<length>:<content>," starting at p, leaving p
+ * just after it.
+ */
+bool parse_netstring(iter_t &p, iter_t end, mongrel_request_view::range_type &content)
+{
+   size_t len = 0;
+   iter_t start = p;
+   for (; p != end && is_digit(*p); ++p)
+   {
+      if (p - start >= 9) { return false; }
+      len = 10 * len + (*p - '0');
+   }
+   if (p == start || p == end || *p != ':') { return false; }
+   ++p;
+   if (size_t(end - p) < len + 1 || p[len] != ',') { return false; }
+   content = mongrel_request_view::range_type(p, p + len);
+   p += len + 1;
+   return true;
+}
+
+/* skip a JSON string, checking that it only uses the escapes which
+ * the request grammar allows.
+ */
+bool skip_json_string(iter_t &p, iter_t end)
+{
+   if (p == end || *p != '"') { return false; }
+   for (++p; p != end; ++p)
+   {
+      if (*p == '"') { ++p; return true; }
+      if (*p == '\\')
+      {
+         if (++p == end) { return false; }
+         switch (*p)
+         {
+         case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't': break;
+         default: return false;
+         }
+      }
+   }
+   return false;
+}
+
+inline void skip_space(iter_t &p, iter_t end)
+{
+   while (p != end && is_space(*p)) { ++p; }
+}
+
+/* check the headers are a JSON object with string keys and values
+ * which are either strings or, for repeated headers, arrays of them.
+ */
+bool check_headers(iter_t p, iter_t end)
+{
+   if (p == end || *p != '{') { return false; }
+   ++p; skip_space(p, end);
+   if (p != end && *p == '}') { return ++p == end; }
+
+   while (true)
+   {
+      if (!skip_json_string(p, end)) { return false; }
+      skip_space(p, end);
+      if (p == end || *p != ':') { return false; }
+      ++p; skip_space(p, end);
+      if (p != end && *p == '[')
+      {
+         ++p; skip_space(p, end);
+         while (p != end && *p != ']')
+         {
+            if (!skip_json_string(p, end)) { return false; }
+            skip_space(p, end);
+            if (p != end && *p == ',') { ++p; skip_space(p, end); }
+         }
+         if (p == end) { return false; }
+         ++p;
+      }
+      else if (!skip_json_string(p, end))
+      {
+         return false;
+      }
+      skip_space(p, end);
+      if (p == end) { return false; }
+      if (*p == '}') { return ++p == end; }
+      if (*p != ',') { return false; }
+      ++p; skip_space(p, end);
+   }
+}
+
+bool parse_int(iter_t &p, iter_t end, int &value)
+{
+   bool negative = false;
+   if (p != end && (*p == '-' || *p == '+')) { negative = (*p == '-'); ++p; }
+   if (p == end || !is_digit(*p)) { return false; }
+
+   // accumulate as a negative number, which has the larger range.
+   const long long limit = negative ? -2147483648LL : -2147483647LL;
+   long long v = 0;
+   for (; p != end && is_digit(*p); ++p)
+   {
+      v = 10 * v - (*p - '0');
+      if (v < limit) { return false; }
+   }
+   value = int(negative ? v : -v);
+   return true;
+}
+
+/* parse a tile path in the same way as the tile_path_grammar: the
+ * first two path segments are skipped, then comes the style (which
+ * can have several parts), the z/x/y coordinates, the format and an
+ * optional command.
+ */
+bool parse_tile_path(iter_t begin, iter_t end, tile_protocol &tile)
+{
+   iter_t p = begin;
+   for (int slashes = 0; p != end; ++p)
+   {
+      if (*p == '/' && ++slashes == 3) { break; }
+   }
+   if (p == end) { return false; }
+   ++p;
+
+   // style parts, each of which starts with a letter.
+   iter_t style_begin = p, style_end = p;
+   while (p != end && is_alpha(*p))
+   {
+      for (++p; p != end && is_alnum(*p); ++p) {}
+      style_end = p;
+      if (p == end || *p != '/') { return false; }
+      ++p;
+   }
+   if (style_end == style_begin) { return false; }
+
+   int z, x, y;
+   if (!parse_int(p, end, z) || p == end || *p++ != '/' ||
+       !parse_int(p, end, x) || p == end || *p++ != '/' ||
+       !parse_int(p, end, y) || p == end || *p++ != '.')
+   {
+      return false;
+   }
+
+   protoFmt format;
+   if      (starts_with(p, end, "png", 3))  { format = fmtPNG;  p += 3; }
+   else if (starts_with(p, end, "jpeg", 4)) { format = fmtJPEG; p += 4; }
+   else if (starts_with(p, end, "jpg", 3))  { format = fmtJPEG; p += 3; }
+   else if (starts_with(p, end, "gif", 3))  { format = fmtGIF;  p += 3; }
+   else if (starts_with(p, end, "json", 4)) { format = fmtJSON; p += 4; }
+   else { return false; }
+
+   protoCmd status;
+   if      (p == end)                         { status = cmdRender; }
+   else if (starts_with(p, end, "/dirty", 6))  { status = cmdDirty; }
+   else if (starts_with(p, end, "/status", 7)) { status = cmdStatus; }
+   else { return false; }
+
+   tile.status = status;
+   tile.x = x;
+   tile.y = y;
+   tile.z = z;
+   tile.id = 0;
+   tile.style.assign(style_begin, style_end);
+   tile.format = format;
+   tile.last_modified = 0;
+   tile.request_last_modified = 0;
+   return true;
+}
+
+} // anonymous namespace
+
 struct request_parser::pimpl {
    boost::xpressive::sregex rex_;
    keys_and_values<std::string::iterator> kv_grammar_;
@@ -82,4 +264,47 @@ bool request_parser::operator() (mongrel_request & request, std::string const& i
    return false;
 }
 
+bool request_view_parser::operator() (mongrel_request_view & request, const char *begin, const char *end) const
+{
+   typedef mongrel_request_view::range_type range_type;
+   iter_t p = begin;
+
+   // "<uuid> <id> <path> <headers netstring><body netstring>"
+   for (; p != end && (is_alnum(*p) || *p == '_' || *p == '-'); ++p) {}
+   if (p == begin || p == end || *p != ' ') { return false; }
+   request.uuid = range_type(begin, p);
+
+   iter_t id_begin = ++p;
+   request.client_id = 0;
+   for (; p != end && is_digit(*p); ++p)
+   {
+      request.client_id = 10 * request.client_id + (*p - '0');
+   }
+   if (p == id_begin || p - id_begin > 18 || p == end || *p != ' ') { return false; }
+   request.id = range_type(id_begin, p);
+
+   // the path ends at the space before the headers. paths from mongrel2
+   // shouldn't contain spaces, but in case they do, the first space
+   // which is followed by valid netstrings is the end of it.
+   iter_t path_begin = ++p;
+   for (p = std::find(p, end, ' '); p != end; p = std::find(p + 1, end, ' '))
+   {
+      iter_t q = p + 1;
+      if (parse_netstring(q, end, request.headers) &&
+          parse_netstring(q, end, request.body) && q == end)
+      {
+         break;
+      }
+   }
+   if (p == end || !check_headers(request.headers.begin(), request.headers.end()))
+   {
+      LOG_ERROR("Failed to parse mongrel2 request.");
+      return false;
+   }
+   request.path = range_type(path_begin, p);
+
+   request.is_tile = parse_tile_path(path_begin, p, request.tile);
+   return true;
+}
+
 }
@@ -48,6 +48,20 @@ private:
    boost::scoped_ptr<pimpl> impl;
 };
 
+/* a hand-written parser for mongrel2 requests which makes a single
+ * pass over the message, checking the netstrings and the JSON headers
+ * and parsing the tile path, without copying anything out of it. the
+ * same tile paths are accepted as by the tile_path_parser.
+ *
+ * re-using the same view for each request means that, once the style
+ * string has grown large enough, nothing is allocated at all.
+ */
+class request_view_parser : boost::noncopyable
+{
+public:
+   bool operator() (mongrel_request_view & request, const char *begin, const char *end) const;
+};
+
 }
 
 #endif // MONGREL_REQUEST_PARSER_HPP
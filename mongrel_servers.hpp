@@ -0,0 +1,167 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef MONGREL_SERVERS_HPP
+#define MONGREL_SERVERS_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdexcept>
+
+#include <boost/cstdint.hpp>
+#include <boost/optional.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+// the client id has to fit in the tile protocol's 31 bits of positive
+// int32, so this is the most clients which can be waiting at once.
+#define MONGREL_MAX_CLIENTS (0x7fffffff)
+
+namespace rendermq
+{
+
+/* the clients of the mongrel2 servers which the handler is answering,
+ * so that each reply can go back to the connection on the server which
+ * the request came from.
+ *
+ * connection ids are only unique within a server, and mongrel2 doesn't
+ * say how big they get, so the id which goes along with the tile 
+ * (through storage and the queue, and back) is a number in a table of
+ * the waiting clients instead. it's given back with release() once the
+ * client has been answered, and re-used for later requests. ids are 
+ * re-used oldest first, so a late reply to a client which has already
+ * been answered is unlikely to find its id in use again.
+ *
+ * the ids start from one, so the ids of real clients are positive and
+ * can't be confused with background renders.
+ *
+ * there are only ever a handful of servers, so they're looked up by
+ * comparing against each in turn, which avoids copying the uuid out of
+ * the request.
+ */
+class mongrel_servers
+{
+public:
+   typedef boost::iterator_range<const char *> range_type;
+
+   mongrel_servers() : m_waiting(0) {}
+
+   /* an id for the client with the given connection id on the server
+    * with the given uuid, adding the server if it hasn't been seen
+    * before. returns nothing if there are already as many clients 
+    * waiting as there are ids.
+    */
+   boost::optional<boost::int64_t> client_id(range_type const& uuid, boost::int64_t connection)
+   {
+      size_t server = 0;
+      while (server < m_uuids.size() && !boost::equals(uuid, m_uuids[server])) { ++server; }
+
+      size_t index = 0;
+      if (!m_free.empty())
+      {
+         index = m_free.front();
+         m_free.pop_front();
+      }
+      else if (m_clients.size() < size_t(MONGREL_MAX_CLIENTS))
+      {
+         index = m_clients.size();
+         m_clients.push_back(client());
+      }
+      else
+      {
+         return boost::optional<boost::int64_t>();
+      }
+
+      if (server == m_uuids.size()) m_uuids.push_back(std::string(uuid.begin(), uuid.end()));
+      client &c = m_clients[index];
+      c.server = server;
+      c.connection = connection;
+      c.waiting = true;
+      ++m_waiting;
+      return boost::int64_t(index + 1);
+   }
+
+   // whether the id is for a client which is still waiting for a reply.
+   bool known(boost::int64_t id) const
+   {
+      return (id > 0) && (size_t(id) <= m_clients.size()) && m_clients[size_t(id - 1)].waiting;
+   }
+
+   // the uuid of the server which the client is connected to. the id
+   // must be known().
+   std::string const& uuid(boost::int64_t id) const
+   {
+      return m_uuids[lookup(id).server];
+   }
+
+   // the client's connection id on its server. the id must be known().
+   boost::int64_t connection(boost::int64_t id) const
+   {
+      return lookup(id).connection;
+   }
+
+   // the client has been answered, so its id can be used again.
+   void release(boost::int64_t id)
+   {
+      if (!known(id)) return;
+      m_clients[size_t(id - 1)].waiting = false;
+      m_free.push_back(size_t(id - 1));
+      --m_waiting;
+   }
+
+   // the number of servers which have been seen.
+   size_t size() const { return m_uuids.size(); }
+
+   // the number of clients waiting for replies.
+   size_t waiting() const { return m_waiting; }
+
+private:
+   struct client
+   {
+      client() : server(0), connection(0), waiting(false) {}
+      size_t server;
+      boost::int64_t connection;
+      bool waiting;
+   };
+
+   client const& lookup(boost::int64_t id) const
+   {
+      if (!known(id)) 
+      {
+         throw std::runtime_error("Client id doesn't belong to any waiting mongrel client.");
+      }
+      return m_clients[size_t(id - 1)];
+   }
+
+   std::vector<std::string> m_uuids;
+   std::vector<client> m_clients;
+   std::deque<size_t> m_free;
+   size_t m_waiting;
+};
+
+} // namespace rendermq
+
+#endif // MONGREL_SERVERS_HPP
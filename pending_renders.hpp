@@ -0,0 +1,229 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef PENDING_RENDERS_HPP
+#define PENDING_RENDERS_HPP
+
+#include "tile_protocol.hpp"
+#include "timer_wheel.hpp"
+
+#include <map>
+#include <string>
+#include <stdexcept>
+
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/optional.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace rendermq
+{
+
+/* how long a client can be kept waiting for a tile to be rendered
+ * before it's given up on, in milliseconds.
+ *
+ * there's a default for all tiles, which can be overridden in the
+ * [render_timeout] section of the config, in seconds, for a style
+ * (e.g: "map = 10"), a zoom level of a style (e.g: "map:18 = 5") or a
+ * zoom level of all styles (e.g: "*:18 = 5"). these are looked for in
+ * that order, starting with the style and zoom, then the zoom, then
+ * the style.
+ */
+class render_timeouts
+{
+   typedef std::map<std::pair<std::string, int>, unsigned int> cont_type;
+
+   static unsigned int to_ms(double seconds, const std::string &key)
+   {
+      if (seconds <= 0.0)
+      {
+         throw std::runtime_error((boost::format("Render timeout for `%1%' must be "
+                                                 "greater than zero.") % key).str());
+      }
+      return (unsigned int)(seconds * 1000);
+   }
+
+   unsigned int find(const std::string &style, int z) const
+   {
+      cont_type::const_iterator itr = m_timeouts.find(std::make_pair(style, z));
+      return (itr != m_timeouts.end()) ? itr->second : 0;
+   }
+
+public:
+   // every tile has the same timeout, in seconds.
+   explicit render_timeouts(double default_timeout)
+      : m_default(to_ms(default_timeout, "default")) {}
+
+   /* read the per-style and per-zoom timeouts from the config, if there
+    * are any, using the given default, in seconds, for everything else.
+    */
+   render_timeouts(const boost::property_tree::ptree &conf, double default_timeout)
+      : m_default(to_ms(default_timeout, "default"))
+   {
+      boost::optional<const boost::property_tree::ptree &> sect = conf.get_child_optional("render_timeout");
+      if (!sect) return;
+
+      for (boost::property_tree::ptree::const_iterator itr = sect->begin();
+           itr != sect->end(); ++itr)
+      {
+         const std::string &key = itr->first;
+         const std::string::size_type colon = key.find(':');
+         int z = -1;
+         if (colon != std::string::npos)
+         {
+            try
+            {
+               z = boost::lexical_cast<int>(key.substr(colon + 1));
+            }
+            catch (const boost::bad_lexical_cast &)
+            {
+               throw std::runtime_error((boost::format("In [render_timeout], the zoom level in "
+                                                       "`%1%' is not a number.") % key).str());
+            }
+         }
+         set(key.substr(0, colon), z, to_ms(itr->second.get_value<double>(), key));
+      }
+   }
+
+   /* set the timeout, in milliseconds, for a style at a zoom level. a
+    * style of "*" matches all styles and a zoom of -1 matches all zoom
+    * levels.
+    */
+   void set(const std::string &style, int z, unsigned int timeout)
+   {
+      m_timeouts[std::make_pair(style, z)] = timeout;
+   }
+
+   // the timeout, in milliseconds, for the tile.
+   unsigned int timeout(tile_protocol const& tile) const
+   {
+      if (m_timeouts.empty()) return m_default;
+
+      unsigned int t = find(tile.style, tile.z);
+      if (t == 0) { t = find("*", tile.z); }
+      if (t == 0) { t = find(tile.style, -1); }
+      return (t == 0) ? m_default : t;
+   }
+
+private:
+   cont_type m_timeouts;
+   unsigned int m_default;
+};
+
+/* a request which is waiting on the render queue. the tile is the
+ * request as it came back from storage, so it has the stale copy of
+ * the tile if there was one, the timer is the one for its deadline and
+ * sent is when, in milliseconds, it was sent to the queue.
+ */
+struct pending_render
+{
+   pending_render(tile_protocol const& t, timer_wheel::timer_id i, boost::uint64_t s) 
+      : tile(t), timer(i), sent(s) {}
+
+   tile_protocol tile;
+   timer_wheel::timer_id timer;
+   boost::uint64_t sent;
+};
+
+/* the requests which have been sent to the render queue and which a
+ * client is waiting on, so that the handler can tell whether a result
+ * coming back from the queue still has anyone to go to.
+ *
+ * requests are identified by the client and tile. the format isn't
+ * part of this, as it's the same for all of a client's requests for
+ * the tile.
+ */
+class pending_renders
+{
+   struct request_equal
+   {
+      bool operator()(tile_protocol const& a, tile_protocol const& b) const
+      {
+         return (a.id == b.id && a.x == b.x && a.y == b.y && a.z == b.z && 
+                 a.style == b.style);
+      }
+   };
+
+   struct request_hash
+   {
+      std::size_t operator()(tile_protocol const& t) const
+      {
+         std::size_t seed = 0;
+         boost::hash_combine(seed, t.id);
+         boost::hash_combine(seed, t.x);
+         boost::hash_combine(seed, t.y);
+         boost::hash_combine(seed, t.z);
+         boost::hash_combine(seed, t.style);
+         return seed;
+      }
+   };
+
+   typedef boost::unordered_map<tile_protocol, pending_render, 
+                                request_hash, request_equal> cont_type;
+
+   // only the parts of the tile which identify the request are needed
+   // as the key, not any stale data it holds.
+   static tile_protocol request_key(tile_protocol const& tile)
+   {
+      return tile_protocol(tile.status, tile.x, tile.y, tile.z, tile.id, tile.style, tile.format);
+   }
+
+public:
+   /* add a request which is waiting on a render. if the same client was
+    * already waiting for the same tile then the earlier request is 
+    * returned, so that its timer can be cancelled.
+    */
+   boost::optional<pending_render> add(pending_render const& request)
+   {
+      boost::optional<pending_render> previous = remove(request.tile);
+      m_pending.insert(std::make_pair(request_key(request.tile), request));
+      return previous;
+   }
+
+   /* remove the request for a tile, because it's been rendered or has
+    * run out of time, returning it if it was waiting.
+    */
+   boost::optional<pending_render> remove(tile_protocol const& tile)
+   {
+      cont_type::iterator itr = m_pending.find(tile);
+      if (itr == m_pending.end()) return boost::optional<pending_render>();
+
+      pending_render request(itr->second);
+      m_pending.erase(itr);
+      return request;
+   }
+
+   // the number of requests waiting.
+   size_t size() const { return m_pending.size(); }
+
+private:
+   cont_type m_pending;
+};
+
+} // namespace rendermq
+
+#endif // PENDING_RENDERS_HPP
@@ -135,3 +135,7 @@ class RendererFactory:
         else:
             return None
 
+    # the names of all the styles which this factory has renderers for.
+    def styles(self):
+        return sorted(self.renderers.keys())
+
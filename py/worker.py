@@ -148,8 +148,9 @@ if __name__ == "__main__" :
     else:
         worker_id = str(uuid.uuid4())
 
-    #so we can be on the look out for new jobs
-    queue = dqueue.Supervisor(args[1], worker_id)
+    #so we can be on the look out for new jobs. the brokers are told which
+    #styles this worker has renderers for, so that it only gets those jobs.
+    queue = dqueue.Supervisor(args[1], worker_id, ",".join(renderers.styles()))
 
     #worker run loop
     job_counter = 0
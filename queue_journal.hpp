@@ -0,0 +1,728 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef QUEUE_JOURNAL_HPP
+#define QUEUE_JOURNAL_HPP
+
+#include "task_queue.hpp"
+#include "tile_protocol.hpp"
+#include "logging/logger.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime> // for std::time_t
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/optional.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace rendermq
+{
+
+/* a write-ahead journal of the changes made to a task queue, so that
+ * the queue can be rebuilt after the broker restarts.
+ *
+ * changes are added to a buffer in memory as they're made, and a 
+ * background thread writes the buffer out and syncs it to disk once
+ * every commit interval. the broker never waits for the disk, but the
+ * changes made in the last commit interval before a crash are lost.
+ *
+ * as the journal grows, a snapshot of the queue is written: the 
+ * shortest list of changes which rebuilds the queue as it is at that
+ * point. a new journal is started after it. each snapshot and the 
+ * journal after it are a generation, and only the latest generation
+ * is kept.
+ *
+ * once the journal is opened, snapshots are taken by the commit thread
+ * rather than from the live queue. it starts the next journal, then
+ * replays the previous snapshot and journal into a queue of its own and
+ * writes that out, so the broker carries on while it does. until the
+ * new snapshot is in place, the queue is recovered from the previous
+ * snapshot and both journals.
+ *
+ * each record is a 32-bit length followed by the type of the change
+ * and its parameters. a record which was only partly written when the
+ * broker stopped is ignored.
+ */
+class queue_journal : public queue_listener, public boost::noncopyable
+{
+   typedef boost::uint32_t length_type;
+
+   enum record_type
+   {
+      record_push = 1,
+      record_processed = 2,
+      record_erase = 3,
+      record_clear = 4,
+      record_requeue = 5
+   };
+
+   template <typename T>
+   static void put(std::string &buf, T value)
+   {
+      buf.append(reinterpret_cast<const char *>(&value), sizeof(value));
+   }
+
+   static void put_string(std::string &buf, std::string const& s)
+   {
+      put(buf, boost::uint16_t(s.size()));
+      buf.append(s);
+   }
+
+   // the parts of the tile which say which metatile it's in, which is
+   // all that's needed to hand out or erase a task.
+   static void put_position(std::string &buf, tile_protocol const& tile)
+   {
+      put(buf, boost::int32_t(tile.x));
+      put(buf, boost::int32_t(tile.y));
+      put(buf, boost::uint8_t(tile.z));
+      put_string(buf, tile.style);
+   }
+
+   // the parts of the tile which a request has, i.e: not the data.
+   static void put_tile(std::string &buf, tile_protocol const& tile)
+   {
+      put(buf, boost::uint8_t(tile.status));
+      put(buf, boost::uint8_t(tile.format));
+      put(buf, boost::int64_t(tile.id));
+      put(buf, boost::int64_t(tile.last_modified));
+      put(buf, boost::int64_t(tile.request_last_modified));
+      put_position(buf, tile);
+   }
+
+   // starts a record of the given type at the end of the buffer,
+   // returning where it starts so that the length can be filled in.
+   static size_t begin_record(std::string &buf, record_type type)
+   {
+      const size_t start = buf.size();
+      put(buf, length_type(0));
+      put(buf, boost::uint8_t(type));
+      return start;
+   }
+
+   static void end_record(std::string &buf, size_t start)
+   {
+      const length_type length = length_type(buf.size() - start - sizeof(length_type));
+      std::memcpy(&buf[start], &length, sizeof(length));
+   }
+
+   static void append_push(std::string &buf, tile_protocol const& tile, std::string const& address,
+                           int priority, std::time_t now)
+   {
+      const size_t start = begin_record(buf, record_push);
+      put(buf, boost::int32_t(priority));
+      put(buf, boost::int64_t(now));
+      put_string(buf, address);
+      put_tile(buf, tile);
+      end_record(buf, start);
+   }
+
+   static void append_processed(std::string &buf, tile_protocol const& tile, std::string const& worker,
+                                std::time_t lease_expiry)
+   {
+      const size_t start = begin_record(buf, record_processed);
+      put(buf, boost::int64_t(lease_expiry));
+      put_string(buf, worker);
+      put_position(buf, tile);
+      end_record(buf, start);
+   }
+
+   // reads the parameters back out of a record.
+   struct record_reader
+   {
+      record_reader(const char *d, size_t s) : data(d), size(s), offset(0), ok(true) {}
+
+      void reset(const char *d, size_t s)
+      {
+         data = d;
+         size = s;
+         offset = 0;
+      }
+
+      template <typename T>
+      T get()
+      {
+         T value = T();
+         if (offset + sizeof(value) > size) { ok = false; return value; }
+         std::memcpy(&value, data + offset, sizeof(value));
+         offset += sizeof(value);
+         return value;
+      }
+
+      // strings are read into existing ones, to save allocating new
+      // ones for every record.
+      void get_string(std::string &s)
+      {
+         const size_t length = get<boost::uint16_t>();
+         if (offset + length > size) { ok = false; return; }
+         s.assign(data + offset, length);
+         offset += length;
+      }
+
+      void get_position(tile_protocol &tile)
+      {
+         tile.x = get<boost::int32_t>();
+         tile.y = get<boost::int32_t>();
+         tile.z = get<boost::uint8_t>();
+         get_string(tile.style);
+      }
+
+      void get_tile(tile_protocol &tile)
+      {
+         tile.status = static_cast<protoCmd>(get<boost::uint8_t>());
+         tile.format = static_cast<protoFmt>(get<boost::uint8_t>());
+         tile.id = get<boost::int64_t>();
+         tile.last_modified = std::time_t(get<boost::int64_t>());
+         tile.request_last_modified = std::time_t(get<boost::int64_t>());
+         get_position(tile);
+      }
+
+      const char *data;
+      size_t size, offset;
+      bool ok;
+   };
+
+   // makes the change in one record to the queue. the tile and name
+   // are only passed in so that they can be re-used between records.
+   static void apply(record_reader &in, tile_protocol &tile, std::string &name, task_queue &queue)
+   {
+      const boost::uint8_t type = in.get<boost::uint8_t>();
+
+      if (type == record_push)
+      {
+         const int priority = in.get<boost::int32_t>();
+         const std::time_t now = std::time_t(in.get<boost::int64_t>());
+         in.get_string(name);
+         in.get_tile(tile);
+         if (in.ok) queue.push(tile, name, priority, now);
+      }
+      else if (type == record_processed)
+      {
+         const std::time_t lease_expiry = std::time_t(in.get<boost::int64_t>());
+         in.get_string(name);
+         in.get_position(tile);
+         if (in.ok) queue.set_processed(tile, name, lease_expiry);
+      }
+      else if (type == record_requeue)
+      {
+         in.get_position(tile);
+         if (in.ok) queue.requeue(tile);
+      }
+      else if (type == record_erase)
+      {
+         in.get_position(tile);
+         if (in.ok) queue.erase(tile);
+      }
+      else if (type == record_clear)
+      {
+         queue.clear();
+      }
+      else
+      {
+         in.ok = false;
+      }
+
+      if (!in.ok)
+      {
+         throw std::runtime_error("Corrupt record in task queue journal.");
+      }
+   }
+
+   // makes the changes in a snapshot or journal file to the queue,
+   // returning the number of changes.
+   static size_t replay(boost::filesystem::path const& path, task_queue &queue)
+   {
+      if (!boost::filesystem::exists(path) || boost::filesystem::file_size(path) == 0) return 0;
+
+      boost::iostreams::mapped_file_source file(path.string());
+      record_reader in(file.data(), 0);
+      tile_protocol tile;
+      std::string name;
+      size_t offset = 0, count = 0;
+      while (offset + sizeof(length_type) <= file.size())
+      {
+         length_type length;
+         std::memcpy(&length, file.data() + offset, sizeof(length));
+         if (offset + sizeof(length_type) + length > file.size()) break;
+         in.reset(file.data() + offset + sizeof(length_type), length);
+         apply(in, tile, name, queue);
+         offset += sizeof(length_type) + length;
+         ++count;
+      }
+      return count;
+   }
+
+   // writes out a snapshot of the queue, as the changes to push each
+   // subscriber of each task and then hand it out if it's processed.
+   struct snapshot_writer
+   {
+      snapshot_writer(task_queue const& q, int f) : queue(q), fd(f) {}
+
+      void operator()(task const& t)
+      {
+         std::pair<task::iterator, task::iterator> subs = t.subscribers();
+         for (task::iterator itr = subs.first; itr != subs.second; ++itr)
+         {
+            append_push(buf, queue.subscriber_tile(t, *itr), queue.address(*itr), t.priority(), t.timestamp());
+         }
+         if (t.processed())
+         {
+            append_processed(buf, queue.tile(t), queue.worker(t), t.lease_expiry());
+         }
+         if (buf.size() > (1 << 20)) flush();
+      }
+
+      void flush()
+      {
+         write_all(fd, buf);
+         buf.clear();
+      }
+
+      task_queue const& queue;
+      int fd;
+      std::string buf;
+   };
+
+   static void write_all(int fd, std::string const& buf)
+   {
+      size_t written = 0;
+      while (written < buf.size())
+      {
+         const ssize_t n = ::write(fd, buf.data() + written, buf.size() - written);
+         if (n < 0)
+         {
+            if (errno == EINTR) continue;
+            throw std::runtime_error((boost::format("Unable to write to task queue journal: %1%") 
+                                      % std::strerror(errno)).str());
+         }
+         written += size_t(n);
+      }
+   }
+
+   static int open_file(boost::filesystem::path const& path)
+   {
+      const int fd = ::open(path.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+      {
+         throw std::runtime_error((boost::format("Unable to create `%1%': %2%") 
+                                   % path.string() % std::strerror(errno)).str());
+      }
+      return fd;
+   }
+
+   // makes sure that files created or renamed in the directory stay 
+   // that way after a crash.
+   void sync_directory() const
+   {
+      const int fd = ::open(m_directory.string().c_str(), O_RDONLY);
+      if (fd >= 0)
+      {
+         ::fsync(fd);
+         ::close(fd);
+      }
+   }
+
+   boost::filesystem::path snapshot_path(boost::uint64_t generation) const
+   {
+      return m_directory / (boost::format("snapshot-%1$016d") % generation).str();
+   }
+
+   boost::filesystem::path journal_path(boost::uint64_t generation) const
+   {
+      return m_directory / (boost::format("journal-%1$016d") % generation).str();
+   }
+
+   // parses the generation out of the name of a snapshot or journal
+   // file with the given prefix.
+   static bool parse_generation(std::string const& name, const char *prefix, boost::uint64_t &generation)
+   {
+      const std::string format = std::string(prefix) + "%llu%c";
+      unsigned long long g = 0;
+      char tail = 0;
+      if (std::sscanf(name.c_str(), format.c_str(), &g, &tail) != 1) return false;
+      generation = g;
+      return true;
+   }
+
+   // makes the changes in the latest snapshot up to the given generation
+   // and in all the journals after it, up to and including that 
+   // generation's, to the queue. returns the number of changes.
+   size_t replay_generations(boost::uint64_t last, task_queue &queue) const
+   {
+      boost::optional<boost::uint64_t> snapshot;
+      std::vector<boost::uint64_t> journals;
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator itr(m_directory); itr != end; ++itr)
+      {
+         const std::string name = itr->path().filename().string();
+         boost::uint64_t generation = 0;
+         if (parse_generation(name, "snapshot-", generation))
+         {
+            if ((generation <= last) && (!snapshot || (generation > *snapshot))) snapshot = generation;
+         }
+         else if (parse_generation(name, "journal-", generation))
+         {
+            if (generation <= last) journals.push_back(generation);
+         }
+      }
+      std::sort(journals.begin(), journals.end());
+
+      size_t count = 0;
+      if (snapshot) count += replay(snapshot_path(*snapshot), queue);
+      for (std::vector<boost::uint64_t>::const_iterator itr = journals.begin(); itr != journals.end(); ++itr)
+      {
+         if (!snapshot || (*itr >= *snapshot)) count += replay(journal_path(*itr), queue);
+      }
+      return count;
+   }
+
+   // writes the queue out as the snapshot of the given generation. it's
+   // written under another name and renamed once it's all on disk.
+   void write_snapshot(task_queue const& queue, boost::uint64_t generation) const
+   {
+      const boost::filesystem::path tmp = m_directory / (snapshot_path(generation).filename().string() + ".tmp");
+      const int snapshot_fd = open_file(tmp);
+      try
+      {
+         snapshot_writer writer(queue, snapshot_fd);
+         queue.for_each(writer);
+         writer.flush();
+         ::fdatasync(snapshot_fd);
+      }
+      catch (...)
+      {
+         ::close(snapshot_fd);
+         throw;
+      }
+      ::close(snapshot_fd);
+      boost::filesystem::rename(tmp, snapshot_path(generation));
+   }
+
+   // removes the snapshots and journals from before the given generation.
+   void remove_generations_before(boost::uint64_t next) const
+   {
+      std::vector<boost::filesystem::path> old;
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator itr(m_directory); itr != end; ++itr)
+      {
+         const std::string name = itr->path().filename().string();
+         boost::uint64_t generation = 0;
+         if ((parse_generation(name, "snapshot-", generation) || parse_generation(name, "journal-", generation)) &&
+             (generation < next))
+         {
+            old.push_back(itr->path());
+         }
+      }
+      for (std::vector<boost::filesystem::path>::const_iterator itr = old.begin(); itr != old.end(); ++itr)
+      {
+         boost::filesystem::remove(*itr);
+      }
+   }
+
+   /* replaces the current generation with a snapshot of the queue as it
+    * is at the end of its journal. the next journal is started first, so
+    * that changes carry on being committed to it, and the snapshot is 
+    * written from a queue rebuilt from the files rather than the live 
+    * one.
+    */
+   void compact()
+   {
+      boost::mutex::scoped_lock compact_lock(m_compact_mutex);
+      boost::uint64_t previous = 0, next = 0;
+      {
+         boost::mutex::scoped_lock lock(m_file_mutex);
+         if (m_fd < 0) return;
+         commit();
+
+         previous = m_generation;
+         next = previous + 1;
+         const int journal_fd = open_file(journal_path(next));
+         sync_directory();
+         ::close(m_fd);
+         m_fd = journal_fd;
+         m_generation = next;
+
+         boost::mutex::scoped_lock buffer_lock(m_buffer_mutex);
+         m_journal_bytes = m_buffer.size();
+      }
+
+      const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+      task_queue queue;
+      replay_generations(previous, queue);
+      write_snapshot(queue, next);
+      sync_directory();
+      remove_generations_before(next);
+      LOG_INFO(boost::format("Compacted task queue journal to a snapshot of %1% tasks in %2% s.") 
+               % queue.size() % ((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds() / 1000.0));
+   }
+
+   // writes out and syncs the changes made since the last commit. the
+   // file mutex must be held.
+   void commit()
+   {
+      {
+         // anything left from a commit which failed goes first.
+         boost::mutex::scoped_lock lock(m_buffer_mutex);
+         if (m_committing.empty())
+         {
+            m_committing.swap(m_buffer);
+         }
+         else
+         {
+            m_committing.append(m_buffer);
+            m_buffer.clear();
+         }
+      }
+      if (m_committing.empty() || m_fd < 0) return;
+
+      write_all(m_fd, m_committing);
+      ::fdatasync(m_fd);
+      m_committing.clear();
+   }
+
+   void run()
+   {
+      while (true)
+      {
+         {
+            boost::mutex::scoped_lock lock(m_buffer_mutex);
+            if (!m_stop) m_wakeup.timed_wait(lock, m_commit_interval);
+            if (m_stop) break;
+         }
+
+         try
+         {
+            boost::mutex::scoped_lock lock(m_file_mutex);
+            commit();
+         }
+         catch (const std::exception &e)
+         {
+            LOG_ERROR(boost::format("Error committing task queue journal: %1%") % e.what());
+         }
+
+         if ((m_snapshot_size > 0) && (journal_bytes() >= m_snapshot_size))
+         {
+            try
+            {
+               compact();
+            }
+            catch (const std::exception &e)
+            {
+               LOG_ERROR(boost::format("Error compacting task queue journal: %1%") % e.what());
+            }
+         }
+      }
+   }
+
+public:
+   /* open the journal in the given directory, creating it if necessary.
+    * changes are committed to disk every commit_interval milliseconds,
+    * and once the journal has grown to snapshot_size bytes it's compacted
+    * in the background. a snapshot_size of zero never compacts it.
+    *
+    * any queue left in the directory from before should be rebuilt 
+    * with recover(), and then a snapshot() taken before the journal
+    * is used as the queue's listener.
+    */
+   queue_journal(std::string const& directory, int commit_interval, size_t snapshot_size = 0)
+      : m_directory(directory), m_commit_interval(boost::posix_time::milliseconds(commit_interval)),
+        m_snapshot_size(snapshot_size), m_generation(0), m_fd(-1), m_journal_bytes(0), m_stop(false)
+   {
+      boost::filesystem::create_directories(m_directory);
+
+      // the latest generation is the one to recover from. snapshots are
+      // written under another name and then renamed, so anything else is
+      // left over from a snapshot which didn't finish.
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator itr(m_directory); itr != end; ++itr)
+      {
+         const std::string name = itr->path().filename().string();
+         boost::uint64_t generation = 0;
+         if (parse_generation(name, "snapshot-", generation) || parse_generation(name, "journal-", generation))
+         {
+            m_generation = std::max(m_generation, generation);
+         }
+         else if (name.compare(0, 9, "snapshot-") == 0)
+         {
+            boost::filesystem::remove(itr->path());
+         }
+      }
+
+      m_thread.reset(new boost::thread(boost::bind(&queue_journal::run, this)));
+   }
+
+   ~queue_journal()
+   {
+      {
+         boost::mutex::scoped_lock lock(m_buffer_mutex);
+         m_stop = true;
+      }
+      m_wakeup.notify_all();
+      m_thread->join();
+
+      try
+      {
+         boost::mutex::scoped_lock lock(m_file_mutex);
+         commit();
+      }
+      catch (const std::exception &e)
+      {
+         LOG_ERROR(boost::format("Error committing task queue journal: %1%") % e.what());
+      }
+      if (m_fd >= 0) ::close(m_fd);
+   }
+
+   /* rebuild the queue from the latest snapshot and the journals after
+    * it, returning the number of changes made to it. the journal mustn't
+    * be the queue's listener yet.
+    */
+   size_t recover(task_queue &queue) const
+   {
+      return replay_generations(m_generation, queue);
+   }
+
+   /* write a snapshot of the queue and start a new journal after it,
+    * removing the previous generations. this blocks until the snapshot
+    * is on disk, so is only meant for when the journal is opened. after
+    * that the journal is compacted in the background.
+    */
+   void snapshot(task_queue const& queue)
+   {
+      boost::mutex::scoped_lock compact_lock(m_compact_mutex);
+      boost::mutex::scoped_lock lock(m_file_mutex);
+
+      // anything already in the journal is superseded by the snapshot,
+      // but commit it anyway in case the snapshot doesn't finish.
+      commit();
+
+      const boost::uint64_t next = m_generation + 1;
+      write_snapshot(queue, next);
+
+      const int journal_fd = open_file(journal_path(next));
+      sync_directory();
+
+      if (m_fd >= 0) ::close(m_fd);
+      m_fd = journal_fd;
+      remove_generations_before(next);
+      m_generation = next;
+
+      boost::mutex::scoped_lock buffer_lock(m_buffer_mutex);
+      m_journal_bytes = m_buffer.size();
+   }
+
+   /* the size of the changes written to the journal since the last 
+    * snapshot.
+    */
+   size_t journal_bytes() const
+   {
+      boost::mutex::scoped_lock lock(m_buffer_mutex);
+      return m_journal_bytes;
+   }
+
+   void pushed(tile_protocol const& tile, std::string const& address, int priority, std::time_t now)
+   {
+      boost::mutex::scoped_lock lock(m_buffer_mutex);
+      const size_t before = m_buffer.size();
+      append_push(m_buffer, tile, address, priority, now);
+      m_journal_bytes += m_buffer.size() - before;
+   }
+
+   void processed(tile_protocol const& tile, std::string const& worker, std::time_t lease_expiry)
+   {
+      boost::mutex::scoped_lock lock(m_buffer_mutex);
+      const size_t before = m_buffer.size();
+      append_processed(m_buffer, tile, worker, lease_expiry);
+      m_journal_bytes += m_buffer.size() - before;
+   }
+
+   void requeued(tile_protocol const& tile)
+   {
+      boost::mutex::scoped_lock lock(m_buffer_mutex);
+      const size_t start = begin_record(m_buffer, record_requeue);
+      put_position(m_buffer, tile);
+      end_record(m_buffer, start);
+      m_journal_bytes += m_buffer.size() - start;
+   }
+
+   void erased(tile_protocol const& tile)
+   {
+      boost::mutex::scoped_lock lock(m_buffer_mutex);
+      const size_t start = begin_record(m_buffer, record_erase);
+      put_position(m_buffer, tile);
+      end_record(m_buffer, start);
+      m_journal_bytes += m_buffer.size() - start;
+   }
+
+   void cleared()
+   {
+      boost::mutex::scoped_lock lock(m_buffer_mutex);
+      const size_t start = begin_record(m_buffer, record_clear);
+      end_record(m_buffer, start);
+      m_journal_bytes += m_buffer.size() - start;
+   }
+
+private:
+   boost::filesystem::path m_directory;
+   boost::posix_time::time_duration m_commit_interval;
+
+   // the size in bytes the journal grows to before it's compacted.
+   size_t m_snapshot_size;
+
+   // the current generation and the file its journal is written to.
+   boost::uint64_t m_generation;
+   int m_fd;
+
+   // changes waiting for the next commit, and those being committed.
+   std::string m_buffer, m_committing;
+   size_t m_journal_bytes;
+
+   // the buffer mutex guards the buffer and the flag to stop the commit
+   // thread. the file mutex guards the journal file and generation, and
+   // the compact mutex stops two snapshots being written at once.
+   mutable boost::mutex m_buffer_mutex;
+   boost::mutex m_file_mutex, m_compact_mutex;
+   boost::condition_variable m_wakeup;
+   bool m_stop;
+   boost::scoped_ptr<boost::thread> m_thread;
+};
+
+} // namespace rendermq
+
+#endif // QUEUE_JOURNAL_HPP
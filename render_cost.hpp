@@ -0,0 +1,153 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDER_COST_HPP
+#define RENDER_COST_HPP
+
+#include <map>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio> // for std::rename
+
+namespace rendermq
+{
+
+/* estimates of how long a metatile takes to render, in milliseconds,
+ * for each style and zoom, learned from the render times of completed
+ * jobs.
+ *
+ * each estimate is an exponentially weighted moving average, so that
+ * it follows changes in the data or the workers. a style and zoom which
+ * hasn't been seen yet is estimated at the average of all the others,
+ * or the default cost if nothing has been seen at all.
+ *
+ * the estimates can be saved to a file and loaded again, so that they
+ * don't have to be learned all over again when the broker restarts.
+ */
+class render_cost_model
+{
+   struct estimate
+   {
+      estimate() : cost(0.0), samples(0) {}
+
+      double cost;
+      size_t samples;
+   };
+
+   typedef std::map<std::pair<std::string, int>, estimate> cont_type;
+
+public:
+   /* a model with the given cost for renders nothing is known about,
+    * where each new render time has the given weight (between 0 and 1)
+    * in the moving average.
+    */
+   render_cost_model(double default_cost, double smoothing)
+      : m_default_cost(default_cost), m_smoothing(smoothing), m_total(0.0) {}
+
+   // record a render of the given style and zoom taking the given time.
+   void record(std::string const& style, int z, double time)
+   {
+      estimate &e = m_estimates[std::make_pair(style, z)];
+      const double old_cost = e.cost;
+      e.cost = (e.samples == 0) ? time : (e.cost + m_smoothing * (time - e.cost));
+      ++e.samples;
+      m_total += e.cost - old_cost;
+   }
+
+   // the expected time to render a metatile of the given style and zoom.
+   double cost(std::string const& style, int z) const
+   {
+      cont_type::const_iterator itr = m_estimates.find(std::make_pair(style, z));
+      if (itr != m_estimates.end()) return itr->second.cost;
+      return default_cost();
+   }
+
+   // the expected time to render a metatile nothing is known about.
+   double default_cost() const
+   {
+      return m_estimates.empty() ? m_default_cost : (m_total / m_estimates.size());
+   }
+
+   // the number of styles and zooms which have estimates.
+   size_t size() const { return m_estimates.size(); }
+
+   /* write the estimates to a file, one "style zoom cost samples" per
+    * line. the file is replaced in one go, so a crash part way through
+    * leaves the old one in place.
+    */
+   void save(std::string const& file) const
+   {
+      const std::string tmp = file + ".tmp";
+      {
+         std::ofstream out(tmp.c_str());
+         for (cont_type::const_iterator itr = m_estimates.begin(); itr != m_estimates.end(); ++itr)
+         {
+            out << itr->first.first << " " << itr->first.second << " " 
+                << itr->second.cost << " " << itr->second.samples << "\n";
+         }
+         out.close();
+         if (!out)
+         {
+            throw std::runtime_error("Unable to write render costs to `" + tmp + "'.");
+         }
+      }
+      if (std::rename(tmp.c_str(), file.c_str()) != 0)
+      {
+         throw std::runtime_error("Unable to replace render costs file `" + file + "'.");
+      }
+   }
+
+   /* read estimates written by save(), replacing any already known for
+    * the same style and zoom. returns false if there's no such file.
+    */
+   bool load(std::string const& file)
+   {
+      std::ifstream in(file.c_str());
+      if (!in) return false;
+
+      std::string style;
+      int z;
+      estimate e;
+      while (in >> style >> z >> e.cost >> e.samples)
+      {
+         estimate &existing = m_estimates[std::make_pair(style, z)];
+         m_total += e.cost - existing.cost;
+         existing = e;
+      }
+      return true;
+   }
+
+private:
+   cont_type m_estimates;
+   double m_default_cost, m_smoothing;
+
+   // the sum of all the estimates, for the average.
+   double m_total;
+};
+
+} // namespace rendermq
+
+#endif // RENDER_COST_HPP
@@ -0,0 +1,116 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDER_TIMES_HPP
+#define RENDER_TIMES_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/cstdint.hpp>
+#include <boost/optional.hpp>
+
+namespace rendermq
+{
+
+/* how long metatiles have taken to render, by style and zoom, so that
+ * renders which are taking much longer than usual can be spotted.
+ *
+ * only the most recent render times for each style and zoom are kept, 
+ * so that the statistics follow changes in the data or the load on the
+ * workers. until there are enough of them to go on, nothing is known
+ * about how long a render should take.
+ */
+class render_times
+{
+   // the recent times for one style and zoom, as a ring buffer.
+   struct samples
+   {
+      samples() : next(0) {}
+
+      std::vector<boost::uint64_t> times;
+      size_t next;
+   };
+
+   typedef std::map<std::pair<std::string, int>, samples> cont_type;
+
+public:
+   /* keep up to max_samples times for each style and zoom, and only
+    * give percentiles when there are at least min_samples.
+    */
+   render_times(size_t max_samples, size_t min_samples)
+      : m_max_samples(std::max(max_samples, size_t(1))), 
+        m_min_samples(std::max(min_samples, size_t(1))) {}
+
+   // record a render of the given style and zoom taking the given time.
+   void record(std::string const& style, int z, boost::uint64_t time)
+   {
+      samples &s = m_samples[std::make_pair(style, z)];
+      if (s.times.size() < m_max_samples)
+      {
+         s.times.push_back(time);
+      }
+      else
+      {
+         s.times[s.next] = time;
+         s.next = (s.next + 1) % m_max_samples;
+      }
+   }
+
+   /* the time which the given fraction of recent renders of the style
+    * and zoom were done within, if there are enough to go on.
+    */
+   boost::optional<boost::uint64_t> percentile(std::string const& style, int z, double p) const
+   {
+      cont_type::const_iterator itr = m_samples.find(std::make_pair(style, z));
+      if (itr == m_samples.end() || itr->second.times.size() < m_min_samples)
+      {
+         return boost::optional<boost::uint64_t>();
+      }
+
+      std::vector<boost::uint64_t> times(itr->second.times);
+      const double clamped = std::min(std::max(p, 0.0), 1.0);
+      std::vector<boost::uint64_t>::iterator nth = times.begin() + size_t(clamped * (times.size() - 1) + 0.5);
+      std::nth_element(times.begin(), nth, times.end());
+      return *nth;
+   }
+
+   // the number of recent times kept for the style and zoom.
+   size_t count(std::string const& style, int z) const
+   {
+      cont_type::const_iterator itr = m_samples.find(std::make_pair(style, z));
+      return (itr == m_samples.end()) ? 0 : itr->second.times.size();
+   }
+
+private:
+   cont_type m_samples;
+   size_t m_max_samples, m_min_samples;
+};
+
+} // namespace rendermq
+
+#endif // RENDER_TIMES_HPP
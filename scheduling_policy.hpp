@@ -0,0 +1,100 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef SCHEDULING_POLICY_HPP
+#define SCHEDULING_POLICY_HPP
+
+#include <map>
+#include <ctime> // for std::time_t
+
+namespace rendermq
+{
+
+/* decides which of the tasks waiting in the queue is handed out next.
+ *
+ * the queue keeps the waiting tasks at each priority in the order they
+ * were queued, so a policy only has to choose between the oldest task
+ * at each priority. it does this by scoring them, and the task with the
+ * highest score goes first. if there's a tie, the task with the higher
+ * priority wins.
+ *
+ * without a policy, the queue hands out tasks strictly in priority 
+ * order, which means that low priority tasks can wait forever when the
+ * queue is busy.
+ */
+class scheduling_policy
+{
+public:
+   virtual ~scheduling_policy() {}
+
+   // the score for a task with the given priority, which was queued at
+   // the given time.
+   virtual double score(int priority, std::time_t queued, std::time_t now) const = 0;
+};
+
+/* priority aging: a task's priority goes up by rate for every second it
+ * waits, so that a low priority task will eventually go ahead of newer
+ * high priority ones.
+ */
+class aging_policy : public scheduling_policy
+{
+public:
+   explicit aging_policy(double rate) : m_rate(rate) {}
+
+   double score(int priority, std::time_t queued, std::time_t now) const
+   {
+      return priority + m_rate * double(now - queued);
+   }
+
+private:
+   double m_rate;
+};
+
+/* earliest deadline first: each priority has a deadline, the number of
+ * seconds a task at that priority should be done within, and the task
+ * whose deadline is soonest goes first. priorities without a deadline
+ * of their own use the default.
+ */
+class deadline_policy : public scheduling_policy
+{
+public:
+   deadline_policy(std::map<int, int> const& deadlines, int default_deadline)
+      : m_deadlines(deadlines), m_default_deadline(default_deadline) {}
+
+   double score(int priority, std::time_t queued, std::time_t) const
+   {
+      std::map<int, int>::const_iterator itr = m_deadlines.find(priority);
+      const int deadline = (itr == m_deadlines.end()) ? m_default_deadline : itr->second;
+      return -double(queued + deadline);
+   }
+
+private:
+   std::map<int, int> m_deadlines;
+   int m_default_deadline;
+};
+
+} // namespace rendermq
+
+#endif // SCHEDULING_POLICY_HPP
@@ -45,6 +45,10 @@
 // above.
 #define CHECK_THREAD_DEATH_INTERVAL (5*STORAGE_WORKER_POLL_TIMEOUT)
 
+// how often to log the number of lookups which were coalesced, in
+// seconds.
+#define COALESCED_REPORT_INTERVAL (60)
+
 namespace pt = boost::property_tree;
 namespace bt = boost::posix_time;
 using boost::shared_ptr;
@@ -54,6 +58,7 @@ using std::make_pair;
 using std::map;
 using std::list;
 using std::string;
+using std::vector;
 
 namespace rendermq {
 
@@ -201,8 +206,13 @@ storage_worker::thread_func(const pt::ptree &conf,
          }
          catch (const std::exception &e)
          {
-            // set tile to "not done" status
-            tile.status = cmdNotDone;
+            // set tile to "not done" status. status requests keep their
+            // status, as for a missing tile, so that the result can still
+            // be matched to any requests which are waiting on it.
+            if (tile.status != cmdStatus)
+            {
+               tile.status = cmdNotDone;
+            }
             LOG_ERROR(boost::format("Exception during storage activity: %1%, sending "
                                     "'not done' response.") 
                       % e.what());
@@ -282,10 +292,18 @@ storage_worker::operator()() {
       // temporary tile object
       tile_protocol tile;
 
+      // results for the requests which were waiting on another's lookup
+      vector<tile_protocol> replies;
+
       // time to next check for thread death
       bt::ptime next_check_time = bt::microsec_clock::local_time() + 
          bt::microseconds(CHECK_THREAD_DEATH_INTERVAL);
 
+      // time to next log the coalesced lookup counts
+      bt::ptime next_report_time = bt::microsec_clock::local_time() +
+         bt::seconds(COALESCED_REPORT_INTERVAL);
+      size_t last_reported_lookups = 0;
+
       while (true) {
          zmq::pollitem_t items [] = {
             { requests_in.socket(), 0, ZMQ_POLLIN, 0 },
@@ -307,14 +325,19 @@ storage_worker::operator()() {
          {
             requests_in >> tile;
         
-            if (cur_concurrency < max_concurrency) 
+            // if the tile is already being looked up then the request
+            // just waits for that result.
+            if (m_lookups.add(tile))
             {
-               threads_out << tile;
-               ++cur_concurrency;
-            } 
-            else 
-            {
-               queued_requests.push_back(make_shared<tile_protocol>(tile));
+               if (cur_concurrency < max_concurrency) 
+               {
+                  threads_out << tile;
+                  ++cur_concurrency;
+               } 
+               else 
+               {
+                  queued_requests.push_back(make_shared<tile_protocol>(tile));
+               }
             }
          }
 
@@ -323,6 +346,13 @@ storage_worker::operator()() {
             threads_in >> tile;
             results_out << tile;
 
+            replies.clear();
+            m_lookups.complete(tile, replies);
+            BOOST_FOREACH(const tile_protocol &reply, replies)
+            {
+               results_out << reply;
+            }
+
             if (!queued_requests.empty()) 
             {
                shared_ptr<tile_protocol> tile = queued_requests.front();
@@ -372,6 +402,18 @@ storage_worker::operator()() {
             // set up next interval
             next_check_time += bt::microseconds(CHECK_THREAD_DEATH_INTERVAL);
          }
+
+         if (bt::microsec_clock::local_time() > next_report_time)
+         {
+            if (m_lookups.lookups() != last_reported_lookups)
+            {
+               LOG_INFO(boost::format("Storage lookups: %1% requested, %2% coalesced "
+                                      "with one already in progress.") 
+                        % m_lookups.lookups() % m_lookups.coalesced());
+               last_reported_lookups = m_lookups.lookups();
+            }
+            next_report_time += bt::seconds(COALESCED_REPORT_INTERVAL);
+         }
       }
    } catch (...) {
    }
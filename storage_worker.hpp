@@ -28,6 +28,7 @@
 
 #include "zstream.hpp"
 #include "tile_protocol.hpp"
+#include "coalesced_lookups.hpp"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/shared_ptr.hpp>
@@ -115,6 +116,10 @@ private:
    // queue of requests which didn't get processed because of the limit 
    // on i/o threads.
    std::list<boost::shared_ptr<tile_protocol> > queued_requests;
+
+   // lookups which are queued or in progress, which later requests for
+   // the same tile wait on rather than looking it up again.
+   coalesced_lookups m_lookups;
 };
 
 } // namespace rendermq
@@ -27,11 +27,19 @@
 #define TASK_QUEUE_HPP
 
 #include "tile_protocol.hpp"
+#include "scheduling_policy.hpp"
+#include "render_cost.hpp"
 #include "logging/logger.hpp"
 // stl
 #include <iostream>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <stdexcept>
 #include <ctime> // for std::time_t
+#include <cstdlib> // for std::abs
+#include <stdint.h> // for uint64_t
 // boost
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
@@ -40,27 +48,171 @@
 #include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/composite_key.hpp>
 #include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
 
 namespace rendermq 
 {
         
 using namespace boost::multi_index;
-struct task : tile_protocol
+
+// spreads the bits of v out so that there's a zero between each one.
+inline uint64_t interleave_zeros(uint32_t v)
+{
+   uint64_t x = v;
+   x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+   x = (x | (x << 8))  & 0x00ff00ff00ff00ffULL;
+   x = (x | (x << 4))  & 0x0f0f0f0f0f0f0f0fULL;
+   x = (x | (x << 2))  & 0x3333333333333333ULL;
+   x = (x | (x << 1))  & 0x5555555555555555ULL;
+   return x;
+}
+
+// the reverse of interleave_zeros, taking every other bit of x.
+inline uint32_t remove_zeros(uint64_t x)
+{
+   x &= 0x5555555555555555ULL;
+   x = (x | (x >> 1))  & 0x3333333333333333ULL;
+   x = (x | (x >> 2))  & 0x0f0f0f0f0f0f0f0fULL;
+   x = (x | (x >> 4))  & 0x00ff00ff00ff00ffULL;
+   x = (x | (x >> 8))  & 0x0000ffff0000ffffULL;
+   x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+   return uint32_t(x);
+}
+
+/* the position of a metatile along the Z-order (morton) curve, which
+ * interleaves the bits of the metatile's column and row. metatiles
+ * which are close together in this order are close together on the
+ * map, although the reverse isn't always true.
+ */
+inline uint64_t zorder_key(int x, int y)
+{
+   return interleave_zeros(uint32_t(x / METATILE)) | (interleave_zeros(uint32_t(y / METATILE)) << 1);
+}
+
+/* the zoom and position of a metatile packed into 64 bits, with the
+ * zoom in the top 6 bits and the position along the Z-order curve in
+ * the rest. sorting on this sorts by zoom, then along the curve.
+ */
+inline uint64_t metatile_key(int x, int y, int z)
+{
+   return (uint64_t(z) << 58) | (zorder_key(x, y) & 0x03ffffffffffffffULL);
+}
+
+/* a table of strings, each of which is given a small number so that
+ * tasks can refer to it without keeping their own copy. entries are
+ * never removed, so this is only for things of which there are few,
+ * such as styles and the addresses of handlers and workers.
+ */
+class string_table
+{
+public:
+   // the string's number, adding it to the table if it's new.
+   uint32_t intern(std::string const& s)
+   {
+      boost::unordered_map<std::string, uint32_t>::const_iterator itr = m_ids.find(s);
+      if (itr != m_ids.end()) return itr->second;
+      const uint32_t id = uint32_t(m_names.size());
+      m_names.push_back(s);
+      m_ids.insert(std::make_pair(s, id));
+      return id;
+   }
+
+   // the string's number, if it's in the table.
+   boost::optional<uint32_t> find(std::string const& s) const
+   {
+      boost::unordered_map<std::string, uint32_t>::const_iterator itr = m_ids.find(s);
+      if (itr == m_ids.end()) return boost::optional<uint32_t>();
+      return itr->second;
+   }
+
+   std::string const& name(uint32_t id) const
+   {
+      return m_names[id];
+   }
+
+   size_t size() const
+   {
+      return m_names.size();
+   }
+
+private:
+   std::vector<std::string> m_names;
+   boost::unordered_map<std::string, uint32_t> m_ids;
+};
+
+/* someone waiting for a tile in a task's metatile. this is the client
+ * id, status, format and last modified time of their request, the
+ * handler it came from (by number, in the queue's table of handler
+ * addresses) and which tile of the metatile it's for.
+ */
+struct subscriber
+{
+   int64_t id;
+   // 32 bits is enough for a time until 2106.
+   uint32_t request_last_modified;
+   uint32_t handler;
+   uint8_t status;
+   uint8_t format;
+   // column + METATILE * row within the metatile.
+   uint8_t offset;
+};
+
+/* a metatile waiting to be, or being, rendered.
+ *
+ * a broker can have millions of these queued, so they're kept small.
+ * the position is packed into a single key, the style is a number in
+ * the queue's table of styles, and each subscriber keeps only what's
+ * needed to send the tile back. the queue turns tasks and subscribers
+ * back into tile_protocols.
+ */
+struct task
 {
-   typedef std::vector<std::pair<tile_protocol,std::string> > cont_type;
+   typedef std::vector<subscriber> cont_type;
    typedef cont_type::const_iterator iterator;
     
-   explicit task(tile_protocol const& t, int priority=0)
-      : tile_protocol(t),
-        priority_(priority),
+   task(uint64_t key, uint16_t style, int priority=0)
+      : key_(key),
         timestamp_(std::time(0)),
-        processed_(false) {}
-    
-   task(int x,int y, int z, const std::string &style, protoCmd status, protoFmt fmt, std::time_t last_mod_, std::time_t req_last_mod_, int priority=0)
-      : tile_protocol(status,x,y,z,0,style,fmt,last_mod_,req_last_mod_),
+        lease_expiry_(0),
         priority_(priority),
-        timestamp_(std::time(0)),
+        worker_(0),
+        style_(style),
+        format_(fmtNone),
         processed_(false) {}
+
+   // the position is in the bottom 58 bits of the key, under the zoom.
+   int x() const
+   {
+      return int(remove_zeros(key_ & 0x03ffffffffffffffULL)) * METATILE;
+   }
+
+   int y() const
+   {
+      return int(remove_zeros((key_ & 0x03ffffffffffffffULL) >> 1)) * METATILE;
+   }
+
+   int z() const
+   {
+      return int(key_ >> 58);
+   }
+
+   uint64_t key() const
+   {
+      return key_;
+   }
+
+   uint16_t style_id() const
+   {
+      return style_;
+   }
+
+   protoFmt format() const
+   {
+      return static_cast<protoFmt>(format_);
+   }
     
    void set_priority(int priority)
    {
@@ -72,12 +224,11 @@ struct task : tile_protocol
       return priority_;
    }
    
-   void add_subscriber(tile_protocol const& tile, std::string const& addr)
+   void add_subscriber(subscriber const& sub)
    {
-      if (&tile == this) {
-         LOG_WARNING("Adding self to own subscribers vector - this shouldn't happen");
-      }
-      subscribers_.push_back(std::make_pair(tile,addr));
+      subscribers_.push_back(sub);
+      // the worker renders all the formats anyone asked for.
+      format_ |= sub.format;
    }
    
    std::pair<iterator,iterator> subscribers() const
@@ -104,53 +255,207 @@ struct task : tile_protocol
    {
       return timestamp_;
    }
+
+   void set_lease(uint32_t worker, std::time_t const& expiry)
+   {
+      worker_ = worker;
+      lease_expiry_ = expiry;
+   }
+
+   // the worker holding the lease, by number in the queue's table of
+   // worker addresses.
+   uint32_t worker_id() const
+   {
+      return worker_;
+   }
+
+   std::time_t lease_expiry() const
+   {
+      return lease_expiry_;
+   }
+
+   // whether nobody is waiting for the result.
+   bool bulk() const
+   {
+      for (iterator itr = subscribers_.begin(); itr != subscribers_.end(); ++itr)
+      {
+         if (itr->status != cmdRenderBulk) return false;
+      }
+      return true;
+   }
     
-   int priority_;
+   uint64_t key_;
+   // when the task was queued or, while it's being processed, when
+   // it was handed out.
    std::time_t timestamp_;
+   // while the task is being processed, the time its lease runs out 
+   // and (below) the worker which holds that lease.
+   std::time_t lease_expiry_;
    cont_type subscribers_;
+   int priority_;
+   uint32_t worker_;
+   uint16_t style_;
+   uint8_t format_;
    bool processed_; 
 };
 
 inline bool operator==(task const& t0, task const& t1)
 {
-   return (t0.x == t1.x &&
-           t0.y == t1.y && 
-           t0.z == t1.z &&
-           t0.style == t1.style);
+   return (t0.key_ == t1.key_ &&
+           t0.style_ == t1.style_);
 }
     
 inline std::size_t hash_value( task const& t)
 {
-   return hash_value(static_cast<const tile_protocol &>(t));
+   std::size_t seed = 0;
+   boost::hash_combine(seed, t.key_);
+   boost::hash_combine(seed, t.style_);
+   return seed;
 }
 
 struct priority {};
 struct metatile {};
 struct timestamp {};
+struct lease_expiry {};
+struct lease_holder {};
+struct locality {};
+struct fair_share {};
+
+// the styles a worker is able to render. an empty set means it can
+// render any of them.
+typedef std::set<std::string> style_set;
+
+/* counts of the tasks for a style, so that a style which is hogging
+ * the workers can be spotted.
+ */
+struct style_counts
+{
+   style_counts() : queued(0), in_flight(0), completed(0) {}
+
+   // tasks waiting to be handed out, being processed by a worker and
+   // which have been finished.
+   size_t queued, in_flight, completed;
+};
+
+/* something which is told about the changes made to a task queue,
+ * e.g: to keep a journal of them, so that the queue can be rebuilt by
+ * making the same changes again.
+ */
+class queue_listener
+{
+public:
+   virtual ~queue_listener() {}
+
+   virtual void pushed(tile_protocol const& tile, std::string const& address, 
+                       int priority, std::time_t now) = 0;
+   virtual void processed(tile_protocol const& tile, std::string const& worker, 
+                          std::time_t lease_expiry) = 0;
+   virtual void requeued(tile_protocol const& tile) = 0;
+   virtual void erased(tile_protocol const& tile) = 0;
+   virtual void cleared() = 0;
+};
 
 /* a priority queue of tasks, sorted by priority (highest priority at the 
- * *front* of the queue) and unique by position and style parameters. finally
- * it's sorted on timestamp.
+ * *front* of the queue) and unique by position and style parameters.
+ *
+ * tasks which have been handed out to a worker (processed) are kept
+ * in a separate container from those which are still waiting, so that
+ * finding the front of the queue and counting the waiting tasks don't
+ * have to skip over all the in-flight ones. this matters when the 
+ * queue is very long, as the broker asks for both on almost every
+ * message it handles.
+ *
+ * each task which has been handed out is leased to a worker until a
+ * given time. the worker can renew the lease while it's still working
+ * on the task, and the leases of a worker which is known to be dead
+ * can be released straight away.
+ *
+ * by default, tasks are handed out in priority order and, within the
+ * same priority, in the order they were queued. a scheduling policy
+ * can be set to mix up the priorities, e.g: so that low priority tasks
+ * don't wait forever.
+ *
+ * a worker renders a metatile much faster when it has just rendered
+ * one nearby, as the data it needs is already in its caches. so when
+ * the queue is asked for a task to give to a worker which has been
+ * given one before, it can prefer a task of the same priority which
+ * is near to the worker's last one.
+ *
+ * when styles are given weights, the tasks of each priority are shared
+ * out between the styles in proportion to their weights, so that one
+ * style with a huge backlog doesn't starve the others. within a style,
+ * tasks are still handed out oldest first.
+ *
+ * not every worker can render every style, so the queue can also be
+ * asked for the task to give to a worker which can only render some
+ * of them, which is found by looking at just those styles' tasks.
+ *
+ * the queue keeps the tables of style names and addresses which its
+ * tasks refer to by number, and tile() and subscriber_tile() turn the
+ * tasks back into tile_protocols to send to workers and handlers.
  */
 class task_queue 
 {
+   // tasks waiting to be handed out to a worker.
    typedef multi_index_container<task,
                                  indexed_by<
-// sort on priority
+// sort on priority, then the time the task was queued
                                  ordered_non_unique<tag<priority>,
-                                                    member<task,int, &task::priority_>,
-                                                    std::greater<int> > ,
+                                                    composite_key<task,
+                                                                  member<task,int, &task::priority_>,
+                                                                  member<task,std::time_t, &task::timestamp_> >,
+                                                    composite_key_compare<std::greater<int>,
+                                                                          std::less<std::time_t> > > ,
 // hash index on x,y,z & style
                                  hashed_unique<tag<metatile>,
                                                identity<task> >,
-// index to order by timestamp 
-                                 ordered_non_unique<tag<timestamp>,
-                                                    member<task,std::time_t, &task::timestamp_>,
-                                                    std::less<int> >
-                                 > > cont_type;
-    
-   typedef cont_type::index<rendermq::priority>::type priority_index_type;
-   typedef priority_index_type::iterator priority_index_iterator;
+// sort on priority, then style, then zoom and position along the
+// Z-order curve (which is the metatile key)
+                                 ordered_non_unique<tag<locality>,
+                                                    composite_key<task,
+                                                                  member<task,int, &task::priority_>,
+                                                                  member<task,uint16_t, &task::style_>,
+                                                                  member<task,uint64_t, &task::key_> >,
+                                                    composite_key_compare<std::greater<int>,
+                                                                          std::less<uint16_t>,
+                                                                          std::less<uint64_t> > >,
+// sort on priority, then style, then the time the task was queued
+                                 ordered_non_unique<tag<fair_share>,
+                                                    composite_key<task,
+                                                                  member<task,int, &task::priority_>,
+                                                                  member<task,uint16_t, &task::style_>,
+                                                                  member<task,std::time_t, &task::timestamp_> >,
+                                                    composite_key_compare<std::greater<int>,
+                                                                          std::less<uint16_t>,
+                                                                          std::less<std::time_t> > >
+                                 > > unprocessed_type;
+
+   // tasks which are being processed by a worker. these don't need
+   // to be in priority order, but are sorted on lease expiry so that
+   // the expired tasks can be found without looking at all the others,
+   // and indexed on the worker holding the lease so that they can be
+   // released if it dies.
+   typedef multi_index_container<task,
+                                 indexed_by<
+// hash index on x,y,z & style
+                                 hashed_unique<tag<metatile>,
+                                               identity<task> >,
+// index to order by lease expiry
+                                 ordered_non_unique<tag<lease_expiry>,
+                                                    member<task,std::time_t, &task::lease_expiry_>,
+                                                    std::less<std::time_t> >,
+// hash index on the worker holding the lease
+                                 hashed_non_unique<tag<lease_holder>,
+                                                   member<task,uint32_t, &task::worker_> >
+                                 > > processed_type;
+
+   typedef unprocessed_type::index<rendermq::priority>::type priority_index_type;
+   typedef unprocessed_type::index<rendermq::metatile>::type unprocessed_meta_index_type;
+   typedef unprocessed_type::index<rendermq::locality>::type locality_index_type;
+   typedef unprocessed_type::index<rendermq::fair_share>::type fair_index_type;
+   typedef processed_type::index<rendermq::metatile>::type processed_meta_index_type;
+   typedef processed_type::index<rendermq::lease_expiry>::type lease_index_type;
+   typedef processed_type::index<rendermq::lease_holder>::type holder_index_type;
 
    /* boost multi-index needs all modifications to the entries in the
     * data structure to happen through these functor objects, so that
@@ -158,20 +463,6 @@ class task_queue
     * the index after the modification happens.
     */
 
-   // sets the priority of a task
-   struct priority_modifier
-   {
-      priority_modifier(int priority)
-         : priority_(priority) {}
-        
-      void operator() (task & t)
-      {           
-         t.set_priority(priority_);
-      }
-        
-      int priority_;
-   };
-    
    // called when a new task is to be added. this functor may need to
    // adjust the priority of a task and the formats requested, as when
    // tasks are added they may have higher priority than the one
@@ -180,94 +471,407 @@ class task_queue
    // quickly, even if they're merged with existing low priority tasks.
    struct add_subscriber
    {
-      add_subscriber(tile_protocol const& tile, std::string const& addr,int priority)
-         : tile_(tile),
-           addr_(addr),
+      add_subscriber(subscriber const& sub, int priority)
+         : sub_(sub),
            priority_(priority) {}
         
       void operator() (task & t)
       {
          if (priority_ > t.priority())
             t.set_priority(priority_);
-         t.add_subscriber(tile_,addr_);
-         // union all the requested formats for the same metatile
-         t.format = static_cast<protoFmt>(t.format | tile_.format);
+         t.add_subscriber(sub_);
       }
       
-      tile_protocol const& tile_;
-      std::string const& addr_;
+      subscriber const& sub_;
       int priority_;
    };
 
-   // marks the task as being processed.
-   struct processed_fun
+   // swaps the subscribers of the task with an external list. this is
+   // used to move tasks between the containers without copying what
+   // can be quite a long list of subscribers.
+   struct swap_subscribers
    {
+      explicit swap_subscribers(task::cont_type &subs)
+         : subs_(subs) {}
+
       void operator() (task & t)
-      {            
-         t.set_processed(true);
+      {
+         t.subscribers_.swap(subs_);
       }
+
+      task::cont_type &subs_;
    };
-   
-   // unmarks the task as being processed and resets the timestamp so
-   // that it doesn't immediately get resubmitted again.
-   struct unprocessed_fun
+
+   // changes the expiry of a task's lease.
+   struct set_lease_expiry
    {
+      explicit set_lease_expiry(std::time_t expiry)
+         : expiry_(expiry) {}
+
       void operator() (task & t)
-      {            
-         std::time_t current_time(std::time(0));
-         t.set_processed(false);
-         t.set_timestamp(current_time);
+      {
+         t.lease_expiry_ = expiry_;
+      }
+
+      std::time_t expiry_;
+   };
+
+   // moves the task at itr from one of the containers to the
+   // other, giving it the new processed state and lease. the task keeps
+   // the time it was queued, so that one which goes back to the queue
+   // isn't made younger (or given a later deadline) by having been
+   // handed out.
+   template <typename FromIndex, typename ToContainer>
+   static void transfer(FromIndex &from, typename FromIndex::iterator itr,
+                        ToContainer &to, bool processed,
+                        uint32_t worker = 0, std::time_t lease_expiry = 0)
+   {
+      task t(itr->key(), itr->style_id(), itr->priority());
+      t.format_ = itr->format_;
+      t.set_processed(processed);
+      t.set_timestamp(itr->timestamp());
+      t.set_lease(worker, lease_expiry);
+
+      task::cont_type subs;
+      swap_subscribers take(subs);
+      from.modify(itr, take);
+      from.erase(itr);
+
+      std::pair<typename ToContainer::iterator, bool> result = to.insert(t);
+      swap_subscribers give(subs);
+      to.modify(result.first, give);
+   }
+
+   // moves a task which is being processed back to the queue, so that
+   // it can be handed out again.
+   template <typename Index>
+   void requeue(Index &index, typename Index::iterator itr)
+   {
+      count_up(itr->priority());
+      count_zoom(*itr, 1);
+      style_counts &counts = m_style_counts[itr->style_id()];
+      --counts.in_flight;
+      ++counts.queued;
+      if (m_listener) m_listener->requeued(tile(*itr));
+      transfer(index, itr, m_unprocessed, false);
+   }
+
+   // the key to look up the task for the metatile containing the given
+   // tile, if there can be one.
+   boost::optional<task> find_key(tile_protocol const& tile) const
+   {
+      boost::optional<uint32_t> style = m_styles.find(tile.style);
+      if (!style) return boost::optional<task>();
+      return task(metatile_key(tile.x, tile.y, tile.z), uint16_t(*style));
+   }
+
+   // keep the per-priority counts of unprocessed tasks up to date.
+   void count_up(int priority)
+   {
+      ++m_priority_counts[priority];
+   }
+
+   void count_down(int priority)
+   {
+      std::map<int, size_t>::iterator itr = m_priority_counts.find(priority);
+      if (itr != m_priority_counts.end() && --(itr->second) == 0)
+      {
+         m_priority_counts.erase(itr);
+      }
+   }
+
+   // keep the counts of unprocessed tasks by style and zoom up to date.
+   void count_zoom(task const& t, int delta)
+   {
+      const std::pair<uint16_t, int> key(t.style_id(), t.z());
+      size_t &count = m_zoom_counts[key];
+      count += delta;
+      if (count == 0) m_zoom_counts.erase(key);
+   }
+
+   // the expected time to render the task, if there's a cost model.
+   double cost(task const& t) const
+   {
+      return m_cost_model->cost(m_styles.name(t.style_id()), t.z());
+   }
+
+   /* the task expected to be quickest to render of those tied with the
+    * task at first: the tasks following it in the index at the same
+    * priority, queued in the same second and, if same_style, of the
+    * same style. only the first few tied tasks are looked at, so that
+    * a big burst of tasks doesn't make this slow.
+    */
+   template <typename Index>
+   task const& cheapest_tied(Index const& index, typename Index::const_iterator first, bool same_style) const
+   {
+      if (!m_cost_model || m_cheapest_window == 0 || first->priority() < m_cheapest_min_priority)
+         return *first;
+
+      typename Index::const_iterator best = first, itr = first;
+      double best_cost = cost(*first);
+      for (size_t n = 1; n < m_cheapest_window && ++itr != index.end(); ++n)
+      {
+         if (itr->priority() != first->priority() || itr->timestamp() != first->timestamp() ||
+             (same_style && itr->style_id() != first->style_id()))
+            break;
+         const double c = cost(*itr);
+         if (c < best_cost)
+         {
+            best = itr;
+            best_cost = c;
+         }
+      }
+      return *best;
+   }
+
+   // whether the task is within the locality radius of the tile, in 
+   // metatiles, and how far it is if so.
+   bool is_near(task const& t, uint16_t style, tile_protocol const& tile, int &distance) const
+   {
+      if (t.style_id() != style || t.z() != tile.z) return false;
+      const int dx = std::abs(t.x() / METATILE - tile.x / METATILE);
+      const int dy = std::abs(t.y() / METATILE - tile.y / METATILE);
+      distance = std::max(dx, dy);
+      return distance <= m_locality_radius;
+   }
+
+   /* the task nearest to the last tile a worker was given, of those
+    * at the same priority and of the same style as t, if there are any
+    * within the locality radius. otherwise t.
+    */
+   boost::optional<task const&> nearby(boost::optional<task const&> t, tile_protocol const& last) const
+   {
+      if (!t || m_locality_radius <= 0) return t;
+      boost::optional<uint32_t> style = m_styles.find(last.style);
+      if (!style) return t;
+      // a nearby task of another style would take that style's turn.
+      if (!m_style_weights.empty() && t->style_id() != *style) return t;
+
+      locality_index_type const& index = m_unprocessed.get<rendermq::locality>();
+      locality_index_type::const_iterator itr = index.lower_bound(
+         boost::make_tuple(t->priority(), uint16_t(*style), metatile_key(last.x, last.y, last.z)));
+
+      // the nearest tasks along the curve are either side of where the
+      // last tile would be.
+      locality_index_type::const_iterator best = index.end();
+      int distance = 0, best_distance = 0;
+      if (itr != index.end() && itr->priority() == t->priority() && 
+          is_near(*itr, uint16_t(*style), last, distance))
+      {
+         best = itr;
+         best_distance = distance;
+      }
+      if (itr != index.begin())
+      {
+         --itr;
+         if (itr->priority() == t->priority() && is_near(*itr, uint16_t(*style), last, distance) &&
+             (best == index.end() || distance < best_distance))
+         {
+            best = itr;
+         }
       }
+      return (best == index.end()) ? t : boost::optional<task const&>(*best);
+   }
+
+   // the style's share of the workers relative to the other styles.
+   double style_weight(uint16_t style) const
+   {
+      std::map<std::string, double>::const_iterator itr = m_style_weights.find(m_styles.name(style));
+      return (itr == m_style_weights.end()) ? 1.0 : itr->second;
+   }
+
+   /* the shares are handed out by keeping a virtual clock for each 
+    * priority, which ticks on by 1/weight for the style each time one
+    * of its tasks is handed out. the style which would start its next
+    * task earliest goes next. a style which hasn't had tasks for a 
+    * while starts from the current time, rather than being able to 
+    * catch up on the shares it didn't use.
+    */
+   struct fair_clock
+   {
+      fair_clock() : now(0.0) {}
+
+      double now;
+      std::map<uint16_t, double> finish;
    };
+
+   double fair_start(int priority, uint16_t style) const
+   {
+      std::map<int, fair_clock>::const_iterator clock = m_fair_clocks.find(priority);
+      if (clock == m_fair_clocks.end()) return 0.0;
+      std::map<uint16_t, double>::const_iterator itr = clock->second.finish.find(style);
+      if (itr == clock->second.finish.end()) return clock->second.now;
+      return std::max(clock->second.now, itr->second);
+   }
+
+   void fair_hand_out(int priority, uint16_t style)
+   {
+      if (m_style_weights.empty()) return;
+      const double start = fair_start(priority, style);
+      fair_clock &clock = m_fair_clocks[priority];
+      clock.now = start;
+      clock.finish[style] = start + 1.0 / style_weight(style);
+   }
+
+   // the oldest task at the given priority of the style whose turn it
+   // is next, which there must be at least one task at.
+   task const& fair_front(int priority) const
+   {
+      fair_index_type const& index = m_unprocessed.get<rendermq::fair_share>();
+      fair_index_type::const_iterator best = index.end();
+      double best_start = 0.0;
+      // the first task of each style is the oldest one.
+      for (fair_index_type::const_iterator itr = index.lower_bound(boost::make_tuple(priority));
+           itr != index.end() && itr->priority() == priority;
+           itr = index.upper_bound(boost::make_tuple(priority, itr->style_id())))
+      {
+         const double start = fair_start(priority, itr->style_id());
+         if (best == index.end() || start < best_start)
+         {
+            best = itr;
+            best_start = start;
+         }
+      }
+      return cheapest_tied(index, best, true);
+   }
     
 public:
-   /* sets the task identified by the tile parameter as being processed.
+   task_queue()
+      : m_locality_radius(0), m_cheapest_min_priority(0), m_cheapest_window(0) {}
+
+   /* sets the task identified by the tile parameter as being processed,
+    * leased to the given worker until the lease expiry time.
     * 
     * this means that the task will not appear as available via the 
-    * front() function unless it is resubmitted via the 
-    * resubmit_older_than() function, which means it won't get send out
-    * to other workers.
+    * front() function unless its lease runs out or is released, which
+    * means it won't get send out to other workers.
+    *
+    * a worker which leases several tasks at once will work through
+    * them in turn, so the later ones can be given leases which expire
+    * later.
     */
-   void set_processed(tile_protocol const& tile)
+   void set_processed(tile_protocol const& tile, std::string const& worker, std::time_t lease_expiry)
    {
-      typedef cont_type::index<rendermq::metatile>::type meta_index_type;
-      meta_index_type & index = queue.get<rendermq::metatile>();
-      meta_index_type::iterator itr = index.find(task(tile,0));
+      boost::optional<task> key = find_key(tile);
+      if (!key) return;
+      unprocessed_meta_index_type & index = m_unprocessed.get<rendermq::metatile>();
+      unprocessed_meta_index_type::iterator itr = index.find(*key);
       if (itr!=index.end())
       {            
-         processed_fun op;
-         index.modify(itr,op);
+         count_down(itr->priority());
+         count_zoom(*itr, -1);
+         style_counts &counts = m_style_counts[itr->style_id()];
+         --counts.queued;
+         ++counts.in_flight;
+         fair_hand_out(itr->priority(), itr->style_id());
+         transfer(index, itr, m_processed, true, m_workers.intern(worker), lease_expiry);
+         if (m_listener) m_listener->processed(tile, worker, lease_expiry);
+      }
+   }
+
+   /* extends the lease on a task, for a worker which is taking longer
+    * than expected to process it.
+    *
+    * returns false if the worker doesn't hold the lease on the task, 
+    * e.g: because it has already expired and the task was resubmitted.
+    */
+   bool renew(tile_protocol const& tile, std::string const& worker, std::time_t lease_expiry)
+   {
+      boost::optional<task> key = find_key(tile);
+      boost::optional<uint32_t> worker_id = m_workers.find(worker);
+      if (!key || !worker_id) return false;
+      processed_meta_index_type & index = m_processed.get<rendermq::metatile>();
+      processed_meta_index_type::iterator itr = index.find(*key);
+      if (itr == index.end() || itr->worker_id() != *worker_id)
+      {
+         return false;
       }
+      set_lease_expiry op(lease_expiry);
+      index.modify(itr, op);
+      return true;
    }
    
-   /* resets all tasks in the queue which have been marked as being
-    * processed for at least a timeout number of seconds.
+   /* resets all tasks in the queue whose leases have expired by the
+    * given time, so that they're available to be processed by other 
+    * workers. this is used to detect jobs which are running longer than
+    * expected, probably due to worker failure.
     *
-    * this is used to detect jobs which are running longer than expected,
-    * possibly due to worker failure, and make them available to be 
-    * processed by other workers.
+    * only the expired leases are looked at, so this is cheap to call
+    * often. bulk requests aren't resubmitted, as nothing is waiting
+    * for them, and are just dropped.
     *
-    * jobs are resubmitted only when they have been in the queue for at
-    * least timeout seconds, are marked as being processed and are not
-    * bulk requests.
-    */
-   void resubmit_older_than (int timeout)
-   {
-      typedef cont_type::index<rendermq::timestamp>::type index_type;
-      index_type & index = queue.get<rendermq::timestamp>();
-      index_type::iterator itr = index.begin();
-      index_type::iterator end = index.end();
-      std::time_t now = std::time(0);
-      for (; itr!=end; ++itr) 
+    * returns the number of tasks which were resubmitted.
+    */
+   size_t resubmit_expired(std::time_t now)
+   {
+      lease_index_type & index = m_processed.get<rendermq::lease_expiry>();
+      size_t count = 0;
+      // the index is in expiry order, so everything after the first
+      // lease which hasn't expired hasn't expired either.
+      while (!index.empty() && index.begin()->lease_expiry() <= now)
       {
-         if (itr->status != cmdRenderBulk && now - itr->timestamp() >= timeout &&
-             itr->processed())
+         lease_index_type::iterator itr = index.begin();
+         if (itr->bulk())
+         {
+            --m_style_counts[itr->style_id()].in_flight;
+            if (m_listener) m_listener->erased(tile(*itr));
+            index.erase(itr);
+         }
+         else
          {
-            LOG_INFO(boost::format("Resubmitting task: %1%") % static_cast<tile_protocol>(*itr));
-            unprocessed_fun op;
-            index.modify(itr,op);
+            LOG_INFO(boost::format("Resubmitting task: %1%") % tile(*itr));
+            requeue(index, itr);
+            ++count;
          }
       }
+      return count;
+   }
+
+   /* returns when the next lease runs out, if there are any tasks
+    * being processed.
+    */
+   boost::optional<std::time_t> next_lease_expiry() const
+   {
+      lease_index_type const& index = m_processed.get<rendermq::lease_expiry>();
+      if (index.empty()) return boost::optional<std::time_t>();
+      return index.begin()->lease_expiry();
+   }
+
+   /* makes all the tasks leased to a worker available again, e.g: 
+    * because the worker has died or is shutting down.
+    *
+    * returns the number of tasks which were released.
+    */
+   size_t release(std::string const& worker)
+   {
+      boost::optional<uint32_t> worker_id = m_workers.find(worker);
+      if (!worker_id) return 0;
+      holder_index_type & index = m_processed.get<rendermq::lease_holder>();
+      holder_index_type::iterator itr;
+      size_t count = 0;
+      while ((itr = index.find(*worker_id)) != index.end())
+      {
+         LOG_INFO(boost::format("Releasing task: %1%") % tile(*itr));
+         requeue(index, itr);
+         ++count;
+      }
+      return count;
+   }
+
+   /* makes a task which has been handed out available again, as if its
+    * lease had run out, e.g: when replaying a journal.
+    *
+    * returns false if the task isn't being processed.
+    */
+   bool requeue(tile_protocol const& tile)
+   {
+      boost::optional<task> key = find_key(tile);
+      if (!key) return false;
+      processed_meta_index_type & index = m_processed.get<rendermq::metatile>();
+      processed_meta_index_type::iterator itr = index.find(*key);
+      if (itr == index.end()) return false;
+      requeue(index, itr);
+      return true;
    }
 
    /* add a new task to the queue with the given priority, possibly
@@ -278,45 +882,82 @@ public:
     * route the finished job back to the endpoint which originated
     * it.
     *
+    * a new task is recorded as being queued at the given time, which
+    * the scheduling policy may use to decide when it's handed out.
+    *
     * returns true when the task was newly-added, false if the task
     * was merged with another already in the queue.
     */
-   bool push(tile_protocol const& tile, std::string const& address, int priority)
+   bool push(tile_protocol const& tile, std::string const& address, int priority, std::time_t now)
    {
-      tile_protocol meta(tile);
-      meta.x &= ~(METATILE-1);
-      meta.y &= ~(METATILE-1);
-      // because jobs can come in at any time, including while the job
-      // is out being rendered by a worker, it's necessary to play it
-      // safe and always tell the worker to render. otherwise the
-      // worker might think that no data is required back (bulk) and
-      // then this broker wouldn't have anything to send to the
-      // handler.
-      meta.status = cmdRender;
+      const uint32_t style = m_styles.intern(tile.style);
+      if (style > 0xffff)
+      {
+         throw std::runtime_error("Too many styles for the task queue.");
+      }
+      if (style >= m_style_counts.size())
+      {
+         m_style_counts.resize(style + 1);
+      }
+      if (m_listener) m_listener->pushed(tile, address, priority, now);
+
+      subscriber sub;
+      sub.id = tile.id;
+      sub.request_last_modified = uint32_t(tile.request_last_modified);
+      sub.handler = m_handlers.intern(address);
+      sub.status = uint8_t(tile.status);
+      sub.format = uint8_t(tile.format);
+      sub.offset = uint8_t((tile.x & (METATILE-1)) + METATILE * (tile.y & (METATILE-1)));
+
+      add_subscriber op(sub,priority);
+      task key(metatile_key(tile.x, tile.y, tile.z), uint16_t(style), priority);
+      key.set_timestamp(now);
+
+      // if the metatile is already being processed then the subscriber
+      // just gets added to the in-flight task.
+      processed_meta_index_type & proc_index = m_processed.get<rendermq::metatile>();
+      processed_meta_index_type::iterator proc_itr = proc_index.find(key);
+      if (proc_itr != proc_index.end())
+      {
+         proc_index.modify(proc_itr, op);
+         return false;
+      }
       
-      std::pair<cont_type::iterator,bool> result = queue.insert(rendermq::task(meta,priority)); 
-      if (result.first != queue.end())
+      std::pair<unprocessed_type::iterator,bool> result = m_unprocessed.insert(key); 
+      int old_priority = result.first->priority();
+      m_unprocessed.modify(result.first,op);   
+      if (result.second)
+      {
+         count_up(result.first->priority());
+         count_zoom(*result.first, 1);
+         ++m_style_counts[style].queued;
+      }
+      else if (old_priority != result.first->priority())
       {
-         add_subscriber sub(tile,address,priority);
-         queue.modify(result.first,sub);   
+         count_down(old_priority);
+         count_up(result.first->priority());
       }
       return result.second;
    }
+
+   bool push(tile_protocol const& tile, std::string const& address, int priority)
+   {
+      return push(tile, address, priority, std::time(0));
+   }
    
-   /* remove the highest priority item from the queue.
+   /* remove the unprocessed item at the front of the queue.
     *
-    * note that this doesn't pay any attention to whether the item is
-    * being processed or not, and should be used with care. a better
-    * approach may be to use erase() with the tile/task which you want
-    * to remove.
+    * this should be used with care, as it doesn't tell anyone that
+    * the task was removed. a better approach may be to use erase() 
+    * with the tile/task which you want to remove.
     */
    void pop() 
    {
-      typedef cont_type::index<rendermq::priority>::type priority_index_type;
-      priority_index_type & index = queue.get<rendermq::priority>();
-      priority_index_type::iterator itr = index.begin();
-      priority_index_type::iterator end = index.end();
-      if (itr!=end) index.erase(itr);
+      boost::optional<task const&> t = front();
+      if (t) 
+      {
+         erase(tile(*t));
+      }
    }
    
    /* remove a specific task from the queue.
@@ -329,12 +970,30 @@ public:
     */
    bool erase(tile_protocol const& tile)
    {
-      typedef cont_type::index<rendermq::metatile>::type meta_index_type;
-      meta_index_type & index = queue.get<rendermq::metatile>();
-      meta_index_type::iterator itr = index.find(task(tile,0));
+      boost::optional<task> key = find_key(tile);
+      if (!key) return false;
+
+      processed_meta_index_type & proc_index = m_processed.get<rendermq::metatile>();
+      processed_meta_index_type::iterator proc_itr = proc_index.find(*key);
+      if (proc_itr != proc_index.end())
+      {
+         style_counts &counts = m_style_counts[proc_itr->style_id()];
+         --counts.in_flight;
+         ++counts.completed;
+         proc_index.erase(proc_itr);
+         if (m_listener) m_listener->erased(tile);
+         return true;
+      }
+
+      unprocessed_meta_index_type & index = m_unprocessed.get<rendermq::metatile>();
+      unprocessed_meta_index_type::iterator itr = index.find(*key);
       if (itr!=index.end())
       {
-         index.erase(*itr);
+         count_down(itr->priority());
+         count_zoom(*itr, -1);
+         --m_style_counts[itr->style_id()].queued;
+         index.erase(itr);
+         if (m_listener) m_listener->erased(tile);
          return true;
       }
       return false;
@@ -343,49 +1002,296 @@ public:
    /* returns the task corresponding to a given tile, or an empty
     * optional if it could not be found.
     *
-    * note that the tile parameter must be metatile-aligned, or it
-    * won't match any tasks.
+    * any tile within the metatile will find the task.
     */
    boost::optional<task const&> get(tile_protocol const& tile) const
    {
-      typedef cont_type::index<rendermq::metatile>::type meta_index_type;
-      meta_index_type const& index = queue.get<rendermq::metatile>();
-      meta_index_type::iterator itr = index.find(task(tile,0));
-      boost::optional<task const&> result;
-      if (itr!=index.end()) return  boost::optional<task const&>(*itr);
-      return result;
+      boost::optional<task> key = find_key(tile);
+      if (!key) return boost::optional<task const&>();
+
+      processed_meta_index_type const& proc_index = m_processed.get<rendermq::metatile>();
+      processed_meta_index_type::const_iterator proc_itr = proc_index.find(*key);
+      if (proc_itr != proc_index.end()) return boost::optional<task const&>(*proc_itr);
+
+      unprocessed_meta_index_type const& index = m_unprocessed.get<rendermq::metatile>();
+      unprocessed_meta_index_type::const_iterator itr = index.find(*key);
+      if (itr!=index.end()) return boost::optional<task const&>(*itr);
+
+      return boost::optional<task const&>();
    }
-   
-   /* returns an iterator range through all the tasks in the queue.
+
+   /* returns the job to send to a worker for the task: the metatile in
+    * all the formats which were asked for, with the client id and last
+    * modified time of the first request for it.
+    */
+   tile_protocol tile(task const& t) const
+   {
+      // because jobs can come in at any time, including while the job
+      // is out being rendered by a worker, it's necessary to play it
+      // safe and always tell the worker to render. otherwise the
+      // worker might think that no data is required back (bulk) and
+      // then this broker wouldn't have anything to send to the
+      // handler.
+      tile_protocol job(cmdRender, t.x(), t.y(), t.z(), 0, m_styles.name(t.style_id()), t.format());
+      if (!t.subscribers_.empty())
+      {
+         job.id = t.subscribers_.front().id;
+         job.request_last_modified = t.subscribers_.front().request_last_modified;
+      }
+      return job;
+   }
+
+   /* returns the tile which a subscriber to the task asked for.
+    */
+   tile_protocol subscriber_tile(task const& t, subscriber const& sub) const
+   {
+      return tile_protocol(static_cast<protoCmd>(sub.status), 
+                           t.x() + sub.offset % METATILE, t.y() + sub.offset / METATILE, t.z(), 
+                           sub.id, m_styles.name(t.style_id()), static_cast<protoFmt>(sub.format),
+                           0, sub.request_last_modified);
+   }
+
+   /* returns the address of the handler which a subscriber's request
+    * came from.
     */
-   std::pair<priority_index_iterator,priority_index_iterator> tasks() const
-   {        
-      priority_index_type const& index = queue.get<rendermq::priority>();
-      priority_index_iterator itr = index.begin();
-      priority_index_iterator end = index.end();
-      return std::make_pair<priority_index_iterator,priority_index_iterator>(itr,end);
+   std::string const& address(subscriber const& sub) const
+   {
+      return m_handlers.name(sub.handler);
+   }
+
+   /* returns the worker which a processed task is leased to.
+    */
+   std::string const& worker(task const& t) const
+   {
+      return m_workers.name(t.worker_id());
+   }
+
+   /* calls the function with each task in the queue, the unprocessed
+    * tasks in priority order and then the processed ones.
+    */
+   template <typename Fun>
+   void for_each(Fun &fun) const
+   {
+      for (unprocessed_type::const_iterator itr = m_unprocessed.begin(); itr != m_unprocessed.end(); ++itr)
+      {
+         fun(*itr);
+      }
+      for (processed_type::const_iterator itr = m_processed.begin(); itr != m_processed.end(); ++itr)
+      {
+         fun(*itr);
+      }
    }
    
-   /* returns the highest priority unprocessed task, if there is
-    * one. otherwise returns an empty optional.
+   /* returns the unprocessed task which should be handed out next,
+    * if there is one. otherwise returns an empty optional.
+    *
+    * this is the highest priority task unless a scheduling policy has
+    * been set, in which case it's the oldest task at whichever priority
+    * the policy scores highest at the given time. if styles have been
+    * given weights, it's the oldest task at that priority of the style
+    * whose turn it is. with a cost model, the task expected to render
+    * quickest of those queued in the same second is chosen instead.
     *
     * FIXME: method name is misleading, should be front_unprocessed()?
     */
+   boost::optional<task const&> front(std::time_t now) const
+   {
+      priority_index_type const& index = m_unprocessed.get<rendermq::priority>();
+      if (index.empty()) return boost::optional<task const&>();
+      if (!m_policy) 
+      {
+         if (m_style_weights.empty()) return boost::optional<task const&>(cheapest_tied(index, index.begin(), false));
+         return boost::optional<task const&>(fair_front(index.begin()->priority()));
+      }
+
+      priority_index_type::const_iterator best = index.end();
+      double best_score = 0.0;
+      // the oldest task at each priority, highest priority first.
+      for (std::map<int, size_t>::const_reverse_iterator p = m_priority_counts.rbegin();
+           p != m_priority_counts.rend(); ++p)
+      {
+         priority_index_type::const_iterator itr = index.lower_bound(boost::make_tuple(p->first));
+         const double score = m_policy->score(itr->priority(), itr->timestamp(), now);
+         if (best == index.end() || score > best_score)
+         {
+            best = itr;
+            best_score = score;
+         }
+      }
+      if (!m_style_weights.empty()) return boost::optional<task const&>(fair_front(best->priority()));
+      return boost::optional<task const&>(cheapest_tied(index, best, false));
+   }
+
    boost::optional<task const&> front() const
    {
-      typedef cont_type::index<rendermq::priority>::type priority_index_type;
-      priority_index_type const& index = queue.get<rendermq::priority>();
-      priority_index_type::iterator itr = index.begin();
-      priority_index_type::iterator end = index.end();
-      boost::optional<task const&> result;
-      for (;itr!=end;++itr) 
+      return front(m_policy ? std::time(0) : 0);
+   }
+
+   /* returns the unprocessed task which should be handed out next to
+    * a worker whose last task was the given tile.
+    *
+    * this is a task of the same priority as front(now) would return, 
+    * but the one nearest to the tile if there are any within the
+    * locality radius. nearness is judged by the Z-order curve, so this
+    * isn't always the very nearest task, but it's cheap to find.
+    */
+   boost::optional<task const&> front(std::time_t now, tile_protocol const& last) const
+   {
+      return nearby(front(now), last);
+   }
+
+   /* returns the unprocessed task which should be handed out next to
+    * a worker which can only render the given styles, if there is one.
+    *
+    * the tasks of each style at each priority are kept in order in the
+    * fair share index, so these act as a sub-queue per style, and this
+    * is the task which front(now) would return if those were the only
+    * styles queued. when the tasks queued in the same second are ordered
+    * by cost, only those of the same style are compared.
+    */
+   boost::optional<task const&> front(std::time_t now, style_set const& styles) const
+   {
+      if (styles.empty()) return front(now);
+
+      std::vector<uint16_t> ids;
+      for (style_set::const_iterator itr = styles.begin(); itr != styles.end(); ++itr)
+      {
+         boost::optional<uint32_t> id = m_styles.find(*itr);
+         if (id && m_style_counts[*id].queued > 0) ids.push_back(uint16_t(*id));
+      }
+      if (ids.empty()) return boost::optional<task const&>();
+
+      fair_index_type const& index = m_unprocessed.get<rendermq::fair_share>();
+      fair_index_type::const_iterator best = index.end();
+      double best_score = 0.0;
+      for (std::map<int, size_t>::const_reverse_iterator p = m_priority_counts.rbegin();
+           p != m_priority_counts.rend(); ++p)
       {
-         if (!itr->processed())
-            return boost::optional<task const&>(*itr);
+         // the oldest task at this priority of any of the styles or, if
+         // the styles have weights, that of the style whose turn it is.
+         fair_index_type::const_iterator first = index.end();
+         double first_start = 0.0;
+         for (std::vector<uint16_t>::const_iterator s = ids.begin(); s != ids.end(); ++s)
+         {
+            fair_index_type::const_iterator itr = index.lower_bound(boost::make_tuple(p->first, *s));
+            if (itr == index.end() || itr->priority() != p->first || itr->style_id() != *s) continue;
+            const double start = m_style_weights.empty() ? double(itr->timestamp()) : fair_start(p->first, *s);
+            if (first == index.end() || start < first_start)
+            {
+               first = itr;
+               first_start = start;
+            }
+         }
+         if (first == index.end()) continue;
+         if (!m_policy)
+         {
+            best = first;
+            break;
+         }
+
+         const double score = m_policy->score(first->priority(), first->timestamp(), now);
+         if (best == index.end() || score > best_score)
+         {
+            best = first;
+            best_score = score;
+         }
       }
-      return result;
+      if (best == index.end()) return boost::optional<task const&>();
+      return boost::optional<task const&>(cheapest_tied(index, best, true));
+   }
+
+   /* as front(now, last), for a worker which can only render the given
+    * styles.
+    */
+   boost::optional<task const&> front(std::time_t now, tile_protocol const& last, style_set const& styles) const
+   {
+      // the worker may no longer be able to render its last style.
+      if (!styles.empty() && styles.count(last.style) == 0) return front(now, styles);
+      return nearby(front(now, styles), last);
+   }
+
+   /* sets the policy which decides the order tasks are handed out in,
+    * or strict priority order if it's null.
+    */
+   void set_scheduling_policy(boost::shared_ptr<const scheduling_policy> const& policy)
+   {
+      m_policy = policy;
+   }
+
+   /* sets something to be told about each task pushed, handed out or
+    * erased and when the queue is cleared, or nothing if it's null.
+    */
+   void set_listener(boost::shared_ptr<queue_listener> const& listener)
+   {
+      m_listener = listener;
+   }
+
+   /* sets how far away, in metatiles, a task can be from a worker's 
+    * last one and still be preferred over the task at the front of
+    * the queue. zero turns this off.
+    */
+   void set_locality_radius(int radius)
+   {
+      m_locality_radius = radius;
+   }
+
+   /* sets the weight of each style's share of the tasks at each 
+    * priority. styles which aren't given a weight have a weight of 1,
+    * and if no weights are given then the tasks are handed out without
+    * regard to their style.
+    */
+   void set_style_weights(std::map<std::string, double> const& weights)
+   {
+      m_style_weights = weights;
+      m_fair_clocks.clear();
    }
    
+   /* sets the model of how long each style and zoom takes to render,
+    * or nothing if it's null.
+    */
+   void set_cost_model(boost::shared_ptr<const render_cost_model> const& model)
+   {
+      m_cost_model = model;
+   }
+
+   /* sets how tasks at or above the given priority, which were queued
+    * in the same second, are ordered: the one expected to be quickest
+    * to render of the first window of them goes first, which cuts the 
+    * average wait. zero turns this off, as does not having a cost model.
+    */
+   void set_cheapest_first(int min_priority, size_t window)
+   {
+      m_cheapest_min_priority = min_priority;
+      m_cheapest_window = window;
+   }
+
+   /* returns the expected time to render all the available tasks in the
+    * queue, according to the cost model, or zero if there isn't one.
+    */
+   double expected_cost() const
+   {
+      double total = 0.0;
+      if (!m_cost_model) return total;
+      typedef std::map<std::pair<uint16_t, int>, size_t>::const_iterator iterator;
+      for (iterator itr = m_zoom_counts.begin(); itr != m_zoom_counts.end(); ++itr)
+      {
+         total += itr->second * m_cost_model->cost(m_styles.name(itr->first.first), itr->first.second);
+      }
+      return total;
+   }
+
+   /* returns true if there's a task, processed or not, for the 
+    * metatile containing the given tile. a request for it would be
+    * merged with that task rather than adding a new one.
+    */
+   bool contains(tile_protocol const& tile) const
+   {
+      boost::optional<task> key = find_key(tile);
+      if (!key) return false;
+      return (m_unprocessed.get<rendermq::metatile>().count(*key) > 0 ||
+              m_processed.get<rendermq::metatile>().count(*key) > 0);
+   }
+
    /* returns the number of tasks in the queue, total.
     *
     * see count_unprocessed() if you want the number of available,
@@ -393,33 +1299,102 @@ public:
     */
    size_t size() const
    {
-      return queue.size();
+      return m_unprocessed.size() + m_processed.size();
    }
    
    /* returns the number of available tasks in the queue.
     */
    size_t count_unprocessed() const
    {
-      size_t count=0;
-      typedef cont_type::index<rendermq::priority>::type priority_index_type;
-      priority_index_type const& index = queue.get<rendermq::priority>();
-      priority_index_type::iterator itr = index.begin();
-      priority_index_type::iterator end = index.end();
-      for (; itr!=end;++itr)
+      return m_unprocessed.size();
+   }
+
+   /* returns the number of available tasks in the queue at the given
+    * priority.
+    */
+   size_t count_unprocessed(int priority) const
+   {
+      std::map<int, size_t>::const_iterator itr = m_priority_counts.find(priority);
+      return (itr == m_priority_counts.end()) ? 0 : itr->second;
+   }
+
+   /* returns the number of available tasks at each priority which 
+    * has any available tasks, keyed on the priority.
+    */
+   const std::map<int, size_t> &unprocessed_priority_counts() const
+   {
+      return m_priority_counts;
+   }
+
+   /* returns the counts of queued, in-flight and completed tasks for
+    * each style which has had any tasks, keyed on the style.
+    */
+   std::map<std::string, style_counts> counts_by_style() const
+   {
+      std::map<std::string, style_counts> counts;
+      for (size_t i = 0; i < m_style_counts.size(); ++i)
       {
-         if (!itr->processed()) ++count;
+         counts[m_styles.name(uint32_t(i))] = m_style_counts[i];
       }
-      return count;
+      return counts;
    }
    
    /* removes all tasks from the queue.
     */
-   void clear() { queue.clear();}
+   void clear() 
+   {
+      if (m_listener) m_listener->cleared();
+      m_unprocessed.clear();
+      m_processed.clear();
+      m_priority_counts.clear();
+      m_zoom_counts.clear();
+      m_fair_clocks.clear();
+      // the completed counts are kept, as they're a running total.
+      for (std::vector<style_counts>::iterator itr = m_style_counts.begin();
+           itr != m_style_counts.end(); ++itr)
+      {
+         itr->queued = 0;
+         itr->in_flight = 0;
+      }
+   }
 
 private:
+   // the queue itself, split into the tasks which are waiting and the
+   // tasks which are being worked on.
+   unprocessed_type m_unprocessed;
+   processed_type m_processed;
+
+   // the names of the styles, handlers and workers which the tasks
+   // refer to by number.
+   string_table m_styles, m_handlers, m_workers;
+
+   // the number of unprocessed tasks at each priority, and for each
+   // style (by number) and zoom.
+   std::map<int, size_t> m_priority_counts;
+   std::map<std::pair<uint16_t, int>, size_t> m_zoom_counts;
+
+   // the order to hand out tasks in, or null for priority order.
+   boost::shared_ptr<const scheduling_policy> m_policy;
+
+   // told about changes to the queue, if set.
+   boost::shared_ptr<queue_listener> m_listener;
+
+   // how far from a worker's last task to look for its next one.
+   int m_locality_radius;
+
+   // how long tasks are expected to take, if known, and the priorities
+   // and number of tied tasks to hand out the cheapest of first.
+   boost::shared_ptr<const render_cost_model> m_cost_model;
+   int m_cheapest_min_priority;
+   size_t m_cheapest_window;
+
+   // the weight of each style's share of the tasks, and where each
+   // priority's clock has got to in handing out those shares.
+   std::map<std::string, double> m_style_weights;
+   std::map<int, fair_clock> m_fair_clocks;
 
-   // the queue itself.
-   cont_type queue;
+   // the number of tasks for each style, by style number.
+   std::vector<style_counts> m_style_counts;
 };
 
 } // namespace rendermq
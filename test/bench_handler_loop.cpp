@@ -0,0 +1,230 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* simulation of the tile handler's event loop under a storm of
+ * requests from mongrel, to see how the way it takes messages from its
+ * sockets affects throughput and how long results wait.
+ *
+ * the simulation runs in virtual time. each request from mongrel is
+ * sent to storage, whose result comes back a couple of milliseconds
+ * later. most results can be sent straight back to the client, but
+ * some have to be rendered, and those come back from the queue later
+ * still. every poll and every message handled costs some time.
+ *
+ * the original loop handled one message per poll, always preferring
+ * mongrel to storage to the queue. this is compared against the fair
+ * drain with a range of budgets.
+ *
+ * usage: bench_handler_loop [requests per second] [seconds]
+ */
+
+#include "fair_drain.hpp"
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/bind.hpp>
+
+using rendermq::fair_drain;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+// the sources, in the order the original loop checked them.
+enum { mongrel = 0, storage = 1, queue = 2, num_sources = 3 };
+const char *source_names[num_sources] = { "mongrel", "storage", "queue" };
+
+// costs, in microseconds, of polling and of handling each type of
+// message, and the time storage and rendering take.
+const double poll_cost = 5.0;
+const double handle_cost[num_sources] = { 10.0, 15.0, 10.0 };
+const double storage_latency = 2000.0;
+const double render_latency = 100000.0;
+
+// one in this many storage results need rendering.
+const int render_every = 10;
+
+// the value at the given fraction of the way through a sorted list.
+double percentile(const vector<double> &sorted, double p)
+{
+   if (sorted.empty()) { return 0.0; }
+   return sorted[size_t(p * (sorted.size() - 1) + 0.5)];
+}
+
+/* the handler's sockets and the messages which will arrive on them.
+ */
+class simulation
+{
+public:
+   simulation(double requests_per_second, double seconds)
+      : now(0.0), polls(0), responses(0), storage_results(0)
+   {
+      const double interval = 1.0e6 / requests_per_second;
+      for (double t = 0.0; t < seconds * 1.0e6; t += interval)
+      {
+         arrivals.insert(std::make_pair(t, int(mongrel)));
+      }
+   }
+
+   // whether a message has arrived on the source.
+   bool ready(int source)
+   {
+      deliver();
+      return !waiting[source].empty();
+   }
+
+   void handle(int source)
+   {
+      const double arrived = waiting[source].front();
+      waiting[source].pop_front();
+      waits[source].push_back(now - arrived);
+      now += handle_cost[source];
+
+      if (source == mongrel)
+      {
+         arrivals.insert(std::make_pair(now + storage_latency, int(storage)));
+      }
+      else if (source == storage && (++storage_results % render_every) == 0)
+      {
+         arrivals.insert(std::make_pair(now + render_latency, int(queue)));
+      }
+      else
+      {
+         ++responses;
+      }
+   }
+
+   // blocks until something arrives, returning false when nothing ever
+   // will.
+   bool poll()
+   {
+      deliver();
+      bool any = false;
+      for (int s = 0; s < num_sources; ++s) { any = any || !waiting[s].empty(); }
+      if (!any)
+      {
+         if (arrivals.empty()) { return false; }
+         now = std::max(now, arrivals.begin()->first);
+      }
+      now += poll_cost;
+      ++polls;
+      return true;
+   }
+
+   void report(const string &name)
+   {
+      cout << boost::format("%1$-18s %2$9.0f responses/s  %3$9d polls") 
+         % name % (responses / (now / 1.0e6)) % polls << endl;
+      for (int s = 0; s < num_sources; ++s)
+      {
+         std::sort(waits[s].begin(), waits[s].end());
+         cout << boost::format("  %1$-8s %2$8d handled  wait p50 %3$10.0f us  p99 %4$10.0f us")
+            % source_names[s] % waits[s].size() % percentile(waits[s], 0.5) 
+            % percentile(waits[s], 0.99) << endl;
+      }
+      cout << endl;
+   }
+
+private:
+   // move everything which has arrived by now onto its socket.
+   void deliver()
+   {
+      while (!arrivals.empty() && arrivals.begin()->first <= now)
+      {
+         waiting[arrivals.begin()->second].push_back(arrivals.begin()->first);
+         arrivals.erase(arrivals.begin());
+      }
+   }
+
+   double now;
+   std::multimap<double, int> arrivals;
+   std::deque<double> waiting[num_sources];
+   vector<double> waits[num_sources];
+   size_t polls, responses, storage_results;
+};
+
+void run_original(double requests_per_second, double seconds)
+{
+   simulation sim(requests_per_second, seconds);
+   while (sim.poll())
+   {
+      for (int s = 0; s < num_sources; ++s)
+      {
+         if (sim.ready(s)) { sim.handle(s); break; }
+      }
+   }
+   sim.report("one per poll");
+}
+
+void run_drain(double requests_per_second, double seconds, size_t budget)
+{
+   simulation sim(requests_per_second, seconds);
+   fair_drain drain(budget);
+   for (int s = 0; s < num_sources; ++s)
+   {
+      drain.add_source(boost::bind(&simulation::ready, &sim, s),
+                       boost::bind(&simulation::handle, &sim, s));
+   }
+   while (sim.poll())
+   {
+      drain();
+   }
+   sim.report((boost::format("drain (budget %1%)") % budget).str());
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   double requests_per_second = 40000, seconds = 2;
+
+   try
+   {
+      if (argc > 1) { requests_per_second = boost::lexical_cast<double>(argv[1]); }
+      if (argc > 2) { seconds = boost::lexical_cast<double>(argv[2]); }
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      std::cerr << "usage: " << argv[0] << " [requests per second] [seconds]" << endl;
+      return 1;
+   }
+
+   cout << boost::format("== Handler loop simulation: %1% requests/s for %2% s ==")
+      % requests_per_second % seconds << endl << endl;
+
+   run_original(requests_per_second, seconds);
+   run_drain(requests_per_second, seconds, 1);
+   run_drain(requests_per_second, seconds, 8);
+   run_drain(requests_per_second, seconds, 32);
+   run_drain(requests_per_second, seconds, 128);
+
+   return 0;
+}
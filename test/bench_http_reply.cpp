@@ -0,0 +1,138 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* micro-benchmark for the handler's reply path.
+ *
+ * tiles and "not modified" replies are sent on a PUB socket with no
+ * subscribers, so that the cost is formatting the response and handing
+ * it to 0MQ. the original functions, which format all the headers with
+ * a stream for each response, are compared with the header templates.
+ * the current time advances by a second every thousand responses, as
+ * it would for a busy handler.
+ *
+ * usage: bench_http_reply [responses] [tile size]
+ */
+
+#include "http/http_reply.hpp"
+#include <iostream>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using rendermq::http_date_formatter;
+using rendermq::http_reply_templates;
+using std::cout;
+using std::endl;
+using std::string;
+namespace bt = boost::posix_time;
+
+namespace {
+
+const unsigned max_age = 3600;
+const std::time_t start_time = 1307108537;
+const string uuid = "54c6755b-9628-40a4-9a2d-cc82a816345e";
+const string mime_type = "image/png";
+
+void report(const string &name, size_t responses, const bt::time_duration &elapsed)
+{
+   const double secs = elapsed.total_microseconds() / 1.0e6;
+   cout << boost::format("%1$-20s %2$10d responses  %3$8.3f s  %4$12.0f responses/s")
+      % name % responses % secs % (responses / secs) << endl;
+}
+
+void run_original(zmq::socket_t &socket, size_t responses, const string &data)
+{
+   http_date_formatter formatter;
+
+   bt::ptime start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < responses; ++i)
+   {
+      const std::time_t now = start_time + i / 1000;
+      const string id = (boost::format("%d") % i).str();
+      rendermq::send_tile(socket, formatter, uuid, id, max_age, start_time - (i % 100000), 
+                          now + max_age, data, mime_type);
+   }
+   report("original tile", responses, bt::microsec_clock::universal_time() - start);
+
+   start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < responses; ++i)
+   {
+      const std::time_t now = start_time + i / 1000;
+      const string id = (boost::format("%d") % i).str();
+      rendermq::send_304(socket, uuid, id, now, formatter, mime_type);
+   }
+   report("original 304", responses, bt::microsec_clock::universal_time() - start);
+}
+
+void run_templates(zmq::socket_t &socket, size_t responses, const string &data)
+{
+   http_reply_templates templates(max_age);
+
+   bt::ptime start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < responses; ++i)
+   {
+      const std::time_t now = start_time + i / 1000;
+      templates.send_tile(socket, uuid, i, start_time - (i % 100000), now + max_age, data, mime_type);
+   }
+   report("templates tile", responses, bt::microsec_clock::universal_time() - start);
+
+   start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < responses; ++i)
+   {
+      const std::time_t now = start_time + i / 1000;
+      templates.send_304(socket, uuid, i, now, mime_type);
+   }
+   report("templates 304", responses, bt::microsec_clock::universal_time() - start);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   size_t responses = 1000000, tile_size = 20000;
+
+   try
+   {
+      if (argc > 1) { responses = boost::lexical_cast<size_t>(argv[1]); }
+      if (argc > 2) { tile_size = boost::lexical_cast<size_t>(argv[2]); }
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      std::cerr << "usage: " << argv[0] << " [responses] [tile size]" << endl;
+      return 1;
+   }
+
+   zmq::context_t context(1);
+   zmq::socket_t socket(context, ZMQ_PUB);
+   socket.bind("inproc://bench_http_reply");
+   const string data(tile_size, 'x');
+
+   cout << boost::format("== HTTP reply benchmark: %1% byte tiles ==") % tile_size << endl << endl;
+
+   run_original(socket, responses, data);
+   run_templates(socket, responses, data);
+
+   return 0;
+}
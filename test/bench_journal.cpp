@@ -0,0 +1,231 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* benchmark for the broker's task queue journal.
+ *
+ * this drives the queue the way the broker does, as in bench_task_queue,
+ * with and without a journal of the changes being kept, to show what the
+ * journal costs. then a queue of the given number of tasks is written 
+ * to a journal and a snapshot, and the time to rebuild the queue from
+ * each is measured, as the broker would on restart.
+ *
+ * the journal is kept in a temporary directory under the one given, 
+ * which should be on the disk the broker would use.
+ *
+ * usage: bench_journal [operations] [tasks] [directory]
+ */
+
+#include "queue_journal.hpp"
+#include <iostream>
+#include <deque>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using rendermq::task_queue;
+using rendermq::queue_journal;
+using rendermq::tile_protocol;
+using rendermq::task;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using boost::optional;
+using boost::shared_ptr;
+using std::cout;
+using std::endl;
+using std::string;
+namespace bt = boost::posix_time;
+namespace fs = boost::filesystem;
+
+namespace {
+
+/* a cheap, deterministic stream of requests spread over a large area
+ * at the broker's usual priorities.
+ */
+struct request_generator
+{
+   request_generator() : state(12345) {}
+
+   tile_protocol next(int &priority)
+   {
+      static const int priorities[] = { 0, 50, 100, 150 };
+      state = state * 1103515245u + 12345u;
+      priority = priorities[(state >> 16) & 3];
+      const int x = (state >> 4) & 0xfff8, y = (state >> 20) & 0xfff8;
+      return tile_protocol(cmdRender, x, y, 18, 0, "map", fmtPNG);
+   }
+
+   unsigned int state;
+};
+
+double seconds_since(const bt::ptime &start)
+{
+   return (bt::microsec_clock::universal_time() - start).total_microseconds() / 1.0e6;
+}
+
+// push, hand out and complete jobs with a backlog of 1000 and 100 in 
+// flight, as bench_task_queue does.
+void run(const string &name, task_queue &q, size_t operations)
+{
+   request_generator gen;
+   std::deque<tile_protocol> processing;
+   const string addr = "handler", worker = "worker";
+   int priority = 0;
+
+   for (size_t i = 0; i < 1000; ++i)
+   {
+      q.push(gen.next(priority), addr, priority);
+   }
+
+   bt::ptime start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < operations; ++i)
+   {
+      q.push(gen.next(priority), addr, priority);
+
+      optional<task const &> job = q.front();
+      if (job)
+      {
+         tile_protocol meta = q.tile(*job);
+         q.set_processed(meta, worker, 0);
+         processing.push_back(meta);
+      }
+
+      if (processing.size() > 100)
+      {
+         q.erase(processing.front());
+         processing.pop_front();
+      }
+   }
+   const double secs = seconds_since(start);
+
+   cout << boost::format("%1$-20s %2$10d ops  %3$8.3f s  %4$10.0f ops/s")
+      % name % operations % secs % (operations / secs) << endl;
+}
+
+// fill a queue with the given number of tasks, a tenth of them handed
+// out to workers.
+void fill(task_queue &q, size_t tasks)
+{
+   for (size_t i = 0; i < tasks; ++i)
+   {
+      const tile_protocol t(cmdRender, int(i % 8192) * METATILE, int(i / 8192) * METATILE, 18, 0, "map", fmtPNG);
+      q.push(t, "handler", (i % 4) * 50, 1000000);
+      if (i % 10 == 0) { q.set_processed(t, "worker", 2000000000); }
+   }
+}
+
+void recover(const string &name, const fs::path &dir, size_t tasks)
+{
+   bt::ptime start = bt::microsec_clock::universal_time();
+   task_queue q;
+   queue_journal journal(dir.string(), 100);
+   const size_t changes = journal.recover(q);
+   const double secs = seconds_since(start);
+
+   if (q.size() != tasks) { throw std::runtime_error("Wrong number of tasks recovered."); }
+   cout << boost::format("%1$-20s %2$10d tasks  %3$10d changes  %4$8.3f s  %5$10.0f tasks/s")
+      % name % q.size() % changes % secs % (q.size() / secs) << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   size_t operations = 2000000, tasks = 1000000;
+   fs::path base("/tmp");
+
+   try
+   {
+      if (argc > 1) { operations = boost::lexical_cast<size_t>(argv[1]); }
+      if (argc > 2) { tasks = boost::lexical_cast<size_t>(argv[2]); }
+      if (argc > 3) { base = argv[3]; }
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      std::cerr << "usage: " << argv[0] << " [operations] [tasks] [directory]" << endl;
+      return 1;
+   }
+
+   const fs::path dir = base / fs::unique_path("bench-journal-%%%%-%%%%");
+   cout << "== Task queue journal benchmark ==" << endl << endl;
+
+   try
+   {
+      {
+         task_queue q;
+         run("no journal", q, operations);
+      }
+      {
+         task_queue q;
+         shared_ptr<queue_journal> journal(new queue_journal(dir.string(), 100));
+         journal->snapshot(q);
+         q.set_listener(journal);
+         run("journal", q, operations);
+         cout << boost::format("%1$-20s %2$10.1f MB journalled") % "" % (journal->journal_bytes() / 1048576.0) << endl;
+      }
+      fs::remove_all(dir);
+      cout << endl;
+
+      // the time to build the queue directly, to compare with rebuilding
+      // the same tasks from a journal of their changes and then from a
+      // snapshot of them.
+      {
+         bt::ptime start = bt::microsec_clock::universal_time();
+         task_queue q;
+         fill(q, tasks);
+         const double secs = seconds_since(start);
+         cout << boost::format("%1$-20s %2$10d tasks  %3$8.3f s  %4$10.0f tasks/s")
+            % "build directly" % q.size() % secs % (q.size() / secs) << endl;
+      }
+      {
+         task_queue q;
+         shared_ptr<queue_journal> journal(new queue_journal(dir.string(), 100));
+         journal->snapshot(q);
+         q.set_listener(journal);
+         fill(q, tasks);
+      }
+      recover("from journal", dir, tasks);
+      {
+         task_queue q;
+         queue_journal journal(dir.string(), 100);
+         journal.recover(q);
+         bt::ptime start = bt::microsec_clock::universal_time();
+         journal.snapshot(q);
+         cout << boost::format("%1$-20s %2$10d tasks  %3$8.3f s") % "write snapshot" % q.size() % seconds_since(start) << endl;
+      }
+      recover("from snapshot", dir, tasks);
+   }
+   catch (const std::exception &e)
+   {
+      fs::remove_all(dir);
+      std::cerr << e.what() << endl;
+      return 1;
+   }
+
+   fs::remove_all(dir);
+   return 0;
+}
@@ -0,0 +1,202 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* simulation of seeding with a pool of fake workers, to see how much
+ * handing each worker jobs near its last one speeds things up.
+ *
+ * a square of metatiles at zoom 15 is queued as bulk jobs, either in
+ * row order or shuffled (as when several seeders are running), and
+ * the workers take jobs from the queue until it's empty. the time a
+ * fake worker takes to render a metatile depends on how far it is 
+ * from the last metatile that worker rendered, as real workers are
+ * much faster when their database and file system caches are warm:
+ *
+ *   next to the last metatile:    0.25 s
+ *   within 4 metatiles:           0.5 s
+ *   anywhere else:                1 s
+ *
+ * this is run with locality turned off and with several radii, and
+ * the simulated seeding throughput and the real time spent choosing
+ * jobs from the queue are reported for each.
+ *
+ * usage: bench_locality [metatiles per side] [workers]
+ */
+
+#include "task_queue.hpp"
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <cstdlib>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using rendermq::task_queue;
+using rendermq::tile_protocol;
+using rendermq::task;
+using rendermq::cmdRenderBulk;
+using rendermq::fmtPNG;
+using boost::optional;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bt = boost::posix_time;
+
+namespace {
+
+const int zoom = 15;
+
+// the simulated time for a worker to render a metatile, given where
+// its last one was.
+double render_cost(const tile_protocol &last, const tile_protocol &next)
+{
+   const int distance = std::max(std::abs(last.x - next.x), std::abs(last.y - next.y)) / METATILE;
+   if (distance <= 1) { return 0.25; }
+   if (distance <= 4) { return 0.5; }
+   return 1.0;
+}
+
+vector<tile_protocol> make_jobs(int side, bool shuffle)
+{
+   vector<tile_protocol> jobs;
+   for (int y = 0; y < side; ++y)
+   {
+      for (int x = 0; x < side; ++x)
+      {
+         jobs.push_back(tile_protocol(cmdRenderBulk, x * METATILE, y * METATILE, zoom, 0, "map", fmtPNG));
+      }
+   }
+
+   if (shuffle)
+   {
+      // a deterministic shuffle, so that every run is the same.
+      unsigned int state = 12345;
+      for (size_t i = jobs.size(); i > 1; --i)
+      {
+         state = state * 1103515245u + 12345u;
+         std::swap(jobs[i - 1], jobs[(state >> 8) % i]);
+      }
+   }
+   return jobs;
+}
+
+// a worker which will be free at the given simulated time.
+struct worker_event
+{
+   worker_event(double t, size_t w) : time(t), worker(w) {}
+   bool operator<(const worker_event &other) const { return time > other.time; }
+   double time;
+   size_t worker;
+};
+
+void run(const string &name, const vector<tile_protocol> &jobs, size_t num_workers, int radius)
+{
+   task_queue q;
+   q.set_locality_radius(radius);
+   const string addr = "seeder";
+   for (size_t i = 0; i < jobs.size(); ++i)
+   {
+      q.push(jobs[i], addr, 0, 0);
+   }
+
+   vector<optional<tile_protocol> > last(num_workers);
+   std::priority_queue<worker_event> free_workers;
+   for (size_t w = 0; w < num_workers; ++w)
+   {
+      free_workers.push(worker_event(0.0, w));
+   }
+
+   size_t warm = 0, rendered = 0;
+   double finish = 0.0;
+   bt::time_duration choosing;
+
+   while (!free_workers.empty())
+   {
+      const worker_event e = free_workers.top();
+      free_workers.pop();
+      const std::time_t now = std::time_t(e.time);
+      if (last[e.worker]) { q.erase(*last[e.worker]); }
+
+      bt::ptime start = bt::microsec_clock::universal_time();
+      optional<task const &> job = last[e.worker] ? q.front(now, *last[e.worker]) : q.front(now);
+      choosing += bt::microsec_clock::universal_time() - start;
+      if (!job)
+      {
+         finish = std::max(finish, e.time);
+         continue;
+      }
+
+      tile_protocol meta = q.tile(*job);
+      q.set_processed(meta, boost::lexical_cast<string>(e.worker), now + 60);
+      const double cost = last[e.worker] ? render_cost(*last[e.worker], meta) : 1.0;
+      if (cost < 1.0) { ++warm; }
+      ++rendered;
+      last[e.worker] = meta;
+      free_workers.push(worker_event(e.time + cost, e.worker));
+   }
+
+   cout << boost::format("%1$-28s %2$8d metatiles  %3$9.1f s  %4$8.2f metatiles/s  %5$5.1f%% warm  %6$6.2f us/job")
+      % name % rendered % finish % (rendered / finish) % (100.0 * warm / rendered)
+      % (choosing.total_microseconds() / double(rendered)) << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   int side = 128;
+   size_t num_workers = 16;
+
+   try
+   {
+      if (argc > 1) { side = boost::lexical_cast<int>(argv[1]); }
+      if (argc > 2) { num_workers = boost::lexical_cast<size_t>(argv[2]); }
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      std::cerr << "usage: " << argv[0] << " [metatiles per side] [workers]" << endl;
+      return 1;
+   }
+
+   cout << boost::format("== Seeding locality benchmark: %1%x%1% metatiles, %2% workers ==")
+      % side % num_workers << endl << endl;
+
+   const int radii[] = { 0, 1, 4, 16 };
+   for (int order = 0; order < 2; ++order)
+   {
+      const bool shuffle = (order == 1);
+      const vector<tile_protocol> jobs = make_jobs(side, shuffle);
+      for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+      {
+         const string name = (boost::format("%1%, radius %2%") % (shuffle ? "shuffled" : "row order") % radii[i]).str();
+         run(name, jobs, num_workers, radii[i]);
+      }
+      cout << endl;
+   }
+
+   return 0;
+}
@@ -0,0 +1,218 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* micro-benchmark for parsing mongrel2 requests in the handler.
+ *
+ * each request is parsed the way the handler originally did it: the
+ * message is copied into a string, parsed with the regex and headers
+ * grammar, and then the path is parsed again by the tile path parser.
+ * this is compared against the view parser, which does all of that
+ * in one pass over the message buffer. the number of allocations per
+ * request is counted for both.
+ *
+ * the corpus can be read from a file, with one request per line. a
+ * line can be a whole mongrel2 message or just a path, in which case
+ * it's wrapped in the headers a browser would typically send.
+ * otherwise a small built-in corpus is used.
+ *
+ * usage: bench_request_parser [iterations] [corpus]
+ */
+
+#include "mongrel_request_parser.hpp"
+#include "tile_path_parser.hpp"
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using rendermq::request_parser;
+using rendermq::request_view_parser;
+using rendermq::tile_path_parser;
+using rendermq::mongrel_request;
+using rendermq::mongrel_request_view;
+using rendermq::tile_protocol;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bt = boost::posix_time;
+
+// count every allocation made, so that the parsers can be compared.
+namespace {
+size_t allocations = 0;
+}
+
+void *operator new(size_t size) throw (std::bad_alloc)
+{
+   ++allocations;
+   void *p = std::malloc(size > 0 ? size : 1);
+   if (p == NULL) { throw std::bad_alloc(); }
+   return p;
+}
+
+void operator delete(void *p) throw ()
+{
+   std::free(p);
+}
+
+namespace {
+
+/* wrap a path in the headers which a browser would typically send.
+ */
+string browser_request(const string &path, int id)
+{
+   const string headers = (boost::format(
+      "{\"PATH\":\"%1%\",\"x-forwarded-for\":\"10.12.1.7\",\"accept-language\":\"en-US,en;q=0.8\","
+      "\"accept-encoding\":\"gzip,deflate,sdch\",\"connection\":\"keep-alive\",\"accept\":\"image/png,"
+      "image/*;q=0.8,*/*;q=0.5\",\"user-agent\":\"Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/535.19 "
+      "(KHTML, like Gecko) Chrome/18.0.1025.168 Safari/535.19\",\"host\":\"otile1.mqcdn.com\",\"referer\":"
+      "\"http://www.mapquest.com/\",\"if-modified-since\":\"Fri, 03 Jun 2011 13:42:17 GMT\","
+      "\"METHOD\":\"GET\",\"VERSION\":\"HTTP/1.1\",\"URI\":\"%1%\",\"PATTERN\":\"/tiles\"}") % path).str();
+   return (boost::format("54c6755b-9628-40a4-9a2d-cc82a816345e %1% %2% %3%:%4%,0:,")
+           % id % path % headers.size() % headers).str();
+}
+
+vector<string> read_corpus(const string &file)
+{
+   vector<string> corpus;
+   std::ifstream in(file.c_str());
+   if (!in) { throw std::runtime_error("Unable to open corpus `" + file + "'."); }
+
+   string line;
+   while (std::getline(in, line))
+   {
+      if (line.empty()) { continue; }
+      corpus.push_back(line[0] == '/' ? browser_request(line, int(corpus.size())) : line);
+   }
+   return corpus;
+}
+
+vector<string> make_up_corpus()
+{
+   const char *paths[] = {
+      "/tiles/1.0.0/map/13/2353/3085.png",
+      "/tiles/1.0.0/vx/map/15/9412/12340.jpg",
+      "/tiles/1.0.0/vy/hyb/11/588/771.png",
+      "/tiles/1.0.0/sat/8/73/96.jpg",
+      "/tiles/1.0.0/osm/17/37651/49361.png",
+      "/tiles/1.0.0/map/5/9/12.json",
+      "/tiles/1.0.0/map/13/2353/3085.png/status",
+      "/tiles/1.0.0/map/13/2353/3085.png/dirty",
+      "/favicon.ico",
+   };
+   vector<string> corpus;
+   for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+   {
+      corpus.push_back(browser_request(paths[i], 1000 + int(i)));
+   }
+   return corpus;
+}
+
+void report(const string &name, size_t parsed, size_t iterations, size_t requests, 
+            const bt::time_duration &elapsed, size_t allocs)
+{
+   const double n = double(iterations) * requests;
+   cout << boost::format("%1$-8s %2$10.0f requests  %3$8.0f ns/request  %4$6.1f allocations/request  (%5% parsed)")
+      % name % n % (elapsed.total_nanoseconds() / n) % (allocs / n) % parsed << endl;
+}
+
+void run_original(const vector<string> &corpus, size_t iterations)
+{
+   request_parser parser;
+   tile_path_parser path_parser;
+   size_t parsed = 0;
+
+   const size_t allocs_before = allocations;
+   bt::ptime start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < iterations; ++i)
+   {
+      for (vector<string>::const_iterator itr = corpus.begin(); itr != corpus.end(); ++itr)
+      {
+         // the handler copied the message out of the 0MQ message first.
+         string txt(itr->data(), itr->size());
+         mongrel_request request;
+         if (parser(request, txt))
+         {
+            tile_protocol tile;
+            if (path_parser(tile, request.path())) { ++parsed; }
+         }
+      }
+   }
+   bt::time_duration elapsed = bt::microsec_clock::universal_time() - start;
+   report("original", parsed, iterations, corpus.size(), elapsed, allocations - allocs_before);
+}
+
+void run_view(const vector<string> &corpus, size_t iterations)
+{
+   request_view_parser parser;
+   mongrel_request_view request;
+   size_t parsed = 0;
+
+   const size_t allocs_before = allocations;
+   bt::ptime start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < iterations; ++i)
+   {
+      for (vector<string>::const_iterator itr = corpus.begin(); itr != corpus.end(); ++itr)
+      {
+         const char *txt = itr->data();
+         if (parser(request, txt, txt + itr->size()) && request.is_tile) { ++parsed; }
+      }
+   }
+   bt::time_duration elapsed = bt::microsec_clock::universal_time() - start;
+   report("view", parsed, iterations, corpus.size(), elapsed, allocations - allocs_before);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   size_t iterations = 100000;
+   vector<string> corpus;
+
+   try
+   {
+      if (argc > 1) { iterations = boost::lexical_cast<size_t>(argv[1]); }
+      corpus = (argc > 2) ? read_corpus(argv[2]) : make_up_corpus();
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << e.what() << endl;
+      std::cerr << "usage: " << argv[0] << " [iterations] [corpus]" << endl;
+      return 1;
+   }
+
+   cout << boost::format("== Request parser benchmark: %1% requests, %2% iterations ==")
+      % corpus.size() % iterations << endl << endl;
+
+   run_original(corpus, iterations);
+   run_view(corpus, iterations);
+
+   return 0;
+}
@@ -0,0 +1,246 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* simulation of the broker's queue under each of the scheduling
+ * policies, to see how long each type of request waits for a worker.
+ *
+ * the simulation runs in whole seconds. each second the requests which
+ * arrived are pushed onto the queue, then the workers take as many
+ * jobs as they can render in a second from the front. the wait is the
+ * time from a request being queued until a worker takes it.
+ *
+ * the request mix can be replayed from a file with one request per
+ * line, giving the second it arrived and its type (bulk, dirty, render
+ * or prio), in order of arrival. otherwise an hour of made-up traffic
+ * is used, where the interactive load comes in waves which, at their
+ * peak, are more than the workers can keep up with.
+ *
+ * usage: bench_scheduling [jobs per second] [request log]
+ */
+
+#include "task_queue.hpp"
+#include "scheduling_policy.hpp"
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+
+using rendermq::task_queue;
+using rendermq::tile_protocol;
+using rendermq::task;
+using rendermq::scheduling_policy;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using boost::optional;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+// the request types and the priorities the broker gives them.
+const int num_classes = 4;
+const char *class_names[num_classes] = { "bulk", "dirty", "render", "prio" };
+const int class_priorities[num_classes] = { 0, 50, 100, 150 };
+
+struct request
+{
+   request(int t, int c) : time(t), cls(c) {}
+   int time, cls;
+};
+
+int class_of_priority(int priority)
+{
+   for (int c = 0; c < num_classes; ++c)
+   {
+      if (class_priorities[c] == priority) { return c; }
+   }
+   return 0;
+}
+
+/* read a request log, one "<second> <type>" per line.
+ */
+vector<request> read_log(const string &file)
+{
+   vector<request> requests;
+   std::ifstream in(file.c_str());
+   if (!in) { throw std::runtime_error("Unable to open request log `" + file + "'."); }
+
+   int time;
+   string type;
+   while (in >> time >> type)
+   {
+      int cls = -1;
+      for (int c = 0; c < num_classes; ++c)
+      {
+         if (type == class_names[c]) { cls = c; }
+      }
+      if (cls < 0) { throw std::runtime_error("Unknown request type `" + type + "' in log."); }
+      requests.push_back(request(time, cls));
+   }
+   return requests;
+}
+
+/* an hour of traffic: a steady trickle of prio, dirty and bulk requests
+ * and render requests in ten minute waves. the average load is a
+ * little under 100 requests per second.
+ */
+vector<request> make_up_log()
+{
+   const double pi = 3.14159265358979;
+   vector<request> requests;
+   unsigned int state = 12345;
+   double carry[num_classes] = { 0.0, 0.0, 0.0, 0.0 };
+
+   for (int t = 0; t < 3600; ++t)
+   {
+      const double rates[num_classes] = { 10.0, 8.0, 70.0 + 40.0 * std::sin(2.0 * pi * t / 600.0), 5.0 };
+      for (int c = 0; c < num_classes; ++c)
+      {
+         // jitter the arrivals a little, keeping the average rate.
+         state = state * 1103515245u + 12345u;
+         carry[c] += rates[c] * (0.5 + ((state >> 16) & 0x7fff) / 32768.0);
+         for (; carry[c] >= 1.0; carry[c] -= 1.0)
+         {
+            requests.push_back(request(t, c));
+         }
+      }
+   }
+   return requests;
+}
+
+// the value at the given fraction of the way through a sorted list.
+int percentile(const vector<int> &sorted, double p)
+{
+   if (sorted.empty()) { return 0; }
+   return sorted[size_t(p * (sorted.size() - 1) + 0.5)];
+}
+
+void simulate(const string &name, boost::shared_ptr<const scheduling_policy> policy,
+              const vector<request> &requests, size_t jobs_per_second)
+{
+   task_queue q;
+   q.set_scheduling_policy(policy);
+   vector<int> waits[num_classes];
+   const string addr = "handler", worker = "worker";
+   size_t next = 0;
+   int t = 0;
+
+   // keep going until all the requests have arrived and, for as long
+   // again, until they've all been handed out.
+   const int end = requests.empty() ? 0 : requests.back().time + 1;
+   for (; (t < end) || (q.count_unprocessed() > 0 && t < 2 * end); ++t)
+   {
+      for (; next < requests.size() && requests[next].time <= t; ++next)
+      {
+         // each request is for a different metatile, so none are merged.
+         const int x = int(next % 4096) * METATILE, y = int(next / 4096) * METATILE;
+         q.push(tile_protocol(cmdRender, x, y, 18, 0, "map", fmtPNG), addr,
+                class_priorities[requests[next].cls], t);
+      }
+
+      for (size_t j = 0; j < jobs_per_second; ++j)
+      {
+         optional<task const &> job = q.front(t);
+         if (!job) { break; }
+         waits[class_of_priority(job->priority())].push_back(int(t - job->timestamp()));
+         tile_protocol meta = q.tile(*job);
+         q.set_processed(meta, worker, t + 60);
+         q.erase(meta);
+      }
+   }
+
+   // anything left in the queue never got handed out.
+   size_t unserved[num_classes] = { 0, 0, 0, 0 };
+   for (optional<task const &> job = q.front(t); job; job = q.front(t))
+   {
+      ++unserved[class_of_priority(job->priority())];
+      q.pop();
+   }
+
+   cout << name << endl;
+   for (int c = num_classes - 1; c >= 0; --c)
+   {
+      std::sort(waits[c].begin(), waits[c].end());
+      cout << boost::format("  %1$-7s %2$8d served  p50 %3$6d s  p90 %4$6d s  p99 %5$6d s  max %6$6d s  %7$8d unserved")
+         % class_names[c] % waits[c].size() % percentile(waits[c], 0.5) % percentile(waits[c], 0.9)
+         % percentile(waits[c], 0.99) % (waits[c].empty() ? 0 : waits[c].back()) % unserved[c] << endl;
+   }
+   cout << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   size_t jobs_per_second = 95;
+   vector<request> requests;
+
+   try
+   {
+      if (argc > 1) { jobs_per_second = boost::lexical_cast<size_t>(argv[1]); }
+      requests = (argc > 2) ? read_log(argv[2]) : make_up_log();
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << e.what() << endl;
+      std::cerr << "usage: " << argv[0] << " [jobs per second] [request log]" << endl;
+      return 1;
+   }
+
+   cout << boost::format("== Scheduling simulation: %1% requests, %2% jobs/s ==")
+      % requests.size() % jobs_per_second << endl << endl;
+
+   // the broker's default deadlines, and some which are short enough
+   // to make a difference within an hour.
+   std::map<int, int> deadlines, tight_deadlines;
+   deadlines[0] = 86400;
+   deadlines[50] = 3600;
+   deadlines[100] = 60;
+   deadlines[150] = 10;
+   tight_deadlines[0] = 600;
+   tight_deadlines[50] = 300;
+   tight_deadlines[100] = 60;
+   tight_deadlines[150] = 10;
+
+   simulate("priority", boost::shared_ptr<const scheduling_policy>(), requests, jobs_per_second);
+   simulate("aging (0.1/s)", boost::shared_ptr<const scheduling_policy>(new rendermq::aging_policy(0.1)),
+            requests, jobs_per_second);
+   simulate("aging (1/s)", boost::shared_ptr<const scheduling_policy>(new rendermq::aging_policy(1.0)),
+            requests, jobs_per_second);
+   simulate("deadline", boost::shared_ptr<const scheduling_policy>(new rendermq::deadline_policy(deadlines, 60)),
+            requests, jobs_per_second);
+   simulate("deadline (tight)", boost::shared_ptr<const scheduling_policy>(new rendermq::deadline_policy(tight_deadlines, 60)),
+            requests, jobs_per_second);
+
+   return 0;
+}
@@ -0,0 +1,222 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* measures how much memory the broker's queue needs per task, for the
+ * compact task representation and for the one it replaced, which held
+ * a whole tile_protocol for the task and each of its subscribers.
+ *
+ * each queue is filled with tasks for distinct metatiles, each with a
+ * single subscriber, and the bytes allocated on the heap while filling
+ * it are counted. this doesn't include the allocator's own overhead of
+ * a few bytes per allocation, which is about the same for both.
+ *
+ * the legacy representation needs several GB at 10 million tasks, so
+ * on smaller machines pass smaller sizes.
+ *
+ * usage: bench_task_memory [tasks...]
+ */
+
+#include "task_queue.hpp"
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <new>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+using rendermq::task_queue;
+using rendermq::tile_protocol;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bmi = boost::multi_index;
+
+namespace {
+
+// the number of bytes currently allocated through operator new.
+size_t allocated_bytes = 0;
+
+// the size of each allocation is kept in front of it, so that it can
+// be taken off the count when it's freed.
+const size_t header_size = 16;
+
+} // anonymous namespace
+
+void *operator new(size_t size) throw (std::bad_alloc)
+{
+   char *p = static_cast<char *>(std::malloc(size + header_size));
+   if (p == 0) { throw std::bad_alloc(); }
+   *reinterpret_cast<size_t *>(p) = size;
+   allocated_bytes += size;
+   return p + header_size;
+}
+
+void operator delete(void *ptr) throw ()
+{
+   if (ptr == 0) { return; }
+   char *p = static_cast<char *>(ptr) - header_size;
+   allocated_bytes -= *reinterpret_cast<size_t *>(p);
+   std::free(p);
+}
+
+void *operator new[](size_t size) throw (std::bad_alloc) { return operator new(size); }
+void operator delete[](void *ptr) throw () { operator delete(ptr); }
+
+namespace {
+
+/* the task as it was before it was made compact.
+ */
+struct legacy_task : tile_protocol
+{
+   legacy_task(tile_protocol const& t, int priority, std::time_t now)
+      : tile_protocol(t), priority_(priority), timestamp_(now), processed_(false) {}
+
+   int priority_;
+   std::time_t timestamp_;
+   std::vector<std::pair<tile_protocol,std::string> > subscribers_;
+   bool processed_;
+};
+
+inline bool operator==(legacy_task const& t0, legacy_task const& t1)
+{
+   return (t0.x == t1.x && t0.y == t1.y && t0.z == t1.z && t0.style == t1.style);
+}
+
+inline std::size_t hash_value(legacy_task const& t)
+{
+   return hash_value(static_cast<const tile_protocol &>(t));
+}
+
+/* the legacy tasks in a container with the same priority, metatile and
+ * timestamp indexes the queue used to have. the compact queue has more
+ * indexes than this, so the comparison flatters the legacy one.
+ */
+class legacy_task_queue
+{
+   typedef bmi::multi_index_container<legacy_task,
+      bmi::indexed_by<
+         bmi::ordered_non_unique<bmi::tag<rendermq::priority>,
+                                 bmi::member<legacy_task,int, &legacy_task::priority_>,
+                                 std::greater<int> >,
+         bmi::hashed_unique<bmi::tag<rendermq::metatile>,
+                            bmi::identity<legacy_task> >,
+         bmi::ordered_non_unique<bmi::tag<rendermq::timestamp>,
+                                 bmi::member<legacy_task,std::time_t, &legacy_task::timestamp_>,
+                                 std::less<std::time_t> >
+         > > cont_type;
+
+   struct add_subscriber
+   {
+      add_subscriber(tile_protocol const& tile, std::string const& addr)
+         : tile_(tile), addr_(addr) {}
+      void operator() (legacy_task & t)
+      {
+         t.subscribers_.push_back(std::make_pair(tile_, addr_));
+      }
+      tile_protocol const& tile_;
+      std::string const& addr_;
+   };
+
+public:
+   bool push(tile_protocol const& tile, std::string const& address, int priority, std::time_t now)
+   {
+      tile_protocol meta(tile);
+      meta.x &= ~(METATILE-1);
+      meta.y &= ~(METATILE-1);
+      meta.status = cmdRender;
+      std::pair<cont_type::iterator,bool> result = queue.insert(legacy_task(meta,priority,now));
+      add_subscriber sub(tile,address);
+      queue.modify(result.first,sub);
+      return result.second;
+   }
+
+   size_t size() const { return queue.size(); }
+
+private:
+   cont_type queue;
+};
+
+template <typename Queue>
+void measure(const string &name, size_t tasks)
+{
+   const size_t before = allocated_bytes;
+   const std::time_t now = 1000000;
+   const char *handlers[] = { "handler-0", "handler-1", "handler-2", "handler-3" };
+   static const int priorities[] = { 0, 50, 100, 150 };
+
+   {
+      Queue q;
+      for (size_t i = 0; i < tasks; ++i)
+      {
+         // each task is for a different metatile, so none are merged.
+         const int x = int(i % 8192) * METATILE, y = int(i / 8192) * METATILE;
+         q.push(tile_protocol(cmdRender, x, y, 18, 0, "map", fmtPNG),
+                handlers[i & 3], priorities[(i >> 2) & 3], now + std::time_t(i / 1000));
+      }
+
+      const double bytes = double(allocated_bytes - before);
+      cout << boost::format("%1$-8s %2$10d tasks  %3$10.1f MB  %4$7.1f bytes/task")
+         % name % tasks % (bytes / 1048576.0) % (bytes / tasks) << endl;
+   }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   vector<size_t> sizes;
+
+   try
+   {
+      for (int i = 1; i < argc; ++i)
+      {
+         sizes.push_back(boost::lexical_cast<size_t>(argv[i]));
+      }
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      std::cerr << "usage: " << argv[0] << " [tasks...]" << endl;
+      return 1;
+   }
+   if (sizes.empty())
+   {
+      sizes.push_back(1000000);
+      sizes.push_back(5000000);
+      sizes.push_back(10000000);
+   }
+
+   cout << "== Task memory benchmark ==" << endl << endl;
+
+   for (vector<size_t>::iterator itr = sizes.begin(); itr != sizes.end(); ++itr)
+   {
+      measure<task_queue>("compact", *itr);
+      measure<legacy_task_queue>("legacy", *itr);
+   }
+
+   return 0;
+}
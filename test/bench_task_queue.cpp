@@ -0,0 +1,300 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* micro-benchmark for the broker's task queue.
+ *
+ * this drives the queue the way the broker does: requests are pushed
+ * in, the front task is handed out (set_processed) and the count of
+ * unprocessed tasks is checked for every message. a fixed number of
+ * tasks are kept "in flight" to the workers, and the oldest of those
+ * is erased as its result comes back.
+ *
+ * the same workload is run against a copy of the original queue, which
+ * kept all the tasks in one multi_index container and had to scan past
+ * the processed tasks to find the front or count the unprocessed ones.
+ *
+ * usage: bench_task_queue [operations] [backlog] [in-flight]
+ */
+
+#include "task_queue.hpp"
+#include <iostream>
+#include <deque>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using rendermq::task_queue;
+using rendermq::tile_protocol;
+using rendermq::task;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using boost::optional;
+using std::cout;
+using std::endl;
+using std::string;
+namespace bt = boost::posix_time;
+namespace bmi = boost::multi_index;
+
+namespace {
+
+/* the task as it was before it was made compact, holding a whole
+ * tile_protocol for itself and each of its subscribers.
+ */
+struct legacy_task : tile_protocol
+{
+   typedef std::vector<std::pair<tile_protocol,std::string> > cont_type;
+
+   legacy_task(tile_protocol const& t, int priority)
+      : tile_protocol(t), priority_(priority), timestamp_(std::time(0)), processed_(false) {}
+
+   void add_subscriber(tile_protocol const& tile, std::string const& addr)
+   {
+      subscribers_.push_back(std::make_pair(tile,addr));
+   }
+
+   int priority_;
+   std::time_t timestamp_;
+   cont_type subscribers_;
+   bool processed_;
+};
+
+inline bool operator==(legacy_task const& t0, legacy_task const& t1)
+{
+   return (t0.x == t1.x && t0.y == t1.y && t0.z == t1.z && t0.style == t1.style);
+}
+
+inline std::size_t hash_value(legacy_task const& t)
+{
+   return hash_value(static_cast<const tile_protocol &>(t));
+}
+
+/* the task queue as it was before processed and unprocessed tasks
+ * were split, for comparison. only the operations which the broker
+ * uses on the hot path are present.
+ */
+class legacy_task_queue
+{
+   typedef bmi::multi_index_container<legacy_task,
+      bmi::indexed_by<
+         bmi::ordered_non_unique<bmi::tag<rendermq::priority>,
+                                 bmi::member<legacy_task,int, &legacy_task::priority_>,
+                                 std::greater<int> >,
+         bmi::hashed_unique<bmi::tag<rendermq::metatile>,
+                            bmi::identity<legacy_task> >,
+         bmi::ordered_non_unique<bmi::tag<rendermq::timestamp>,
+                                 bmi::member<legacy_task,std::time_t, &legacy_task::timestamp_>,
+                                 std::less<std::time_t> >
+         > > cont_type;
+   typedef cont_type::index<rendermq::priority>::type priority_index_type;
+   typedef cont_type::index<rendermq::metatile>::type meta_index_type;
+
+   struct add_subscriber
+   {
+      add_subscriber(tile_protocol const& tile, std::string const& addr,int priority)
+         : tile_(tile), addr_(addr), priority_(priority) {}
+      void operator() (legacy_task & t)
+      {
+         if (priority_ > t.priority_)
+            t.priority_ = priority_;
+         t.add_subscriber(tile_,addr_);
+         t.format = static_cast<rendermq::protoFmt>(t.format | tile_.format);
+      }
+      tile_protocol const& tile_;
+      std::string const& addr_;
+      int priority_;
+   };
+
+   struct processed_fun
+   {
+      void operator() (legacy_task & t) { t.processed_ = true; }
+   };
+
+public:
+   void set_processed(tile_protocol const& tile, std::string const&, std::time_t)
+   {
+      meta_index_type & index = queue.get<rendermq::metatile>();
+      meta_index_type::iterator itr = index.find(legacy_task(tile,0));
+      if (itr!=index.end())
+      {
+         processed_fun op;
+         index.modify(itr,op);
+      }
+   }
+
+   bool push(tile_protocol const& tile, std::string const& address, int priority)
+   {
+      tile_protocol meta(tile);
+      meta.x &= ~(METATILE-1);
+      meta.y &= ~(METATILE-1);
+      meta.status = cmdRender;
+      std::pair<cont_type::iterator,bool> result = queue.insert(legacy_task(meta,priority));
+      add_subscriber sub(tile,address,priority);
+      queue.modify(result.first,sub);
+      return result.second;
+   }
+
+   bool erase(tile_protocol const& tile)
+   {
+      meta_index_type & index = queue.get<rendermq::metatile>();
+      meta_index_type::iterator itr = index.find(legacy_task(tile,0));
+      if (itr!=index.end())
+      {
+         index.erase(itr);
+         return true;
+      }
+      return false;
+   }
+
+   boost::optional<legacy_task const&> front() const
+   {
+      priority_index_type const& index = queue.get<rendermq::priority>();
+      for (priority_index_type::iterator itr = index.begin(); itr != index.end(); ++itr)
+      {
+         if (!itr->processed_)
+            return boost::optional<legacy_task const&>(*itr);
+      }
+      return boost::optional<legacy_task const&>();
+   }
+
+   size_t count_unprocessed() const
+   {
+      size_t count=0;
+      priority_index_type const& index = queue.get<rendermq::priority>();
+      for (priority_index_type::iterator itr = index.begin(); itr != index.end(); ++itr)
+      {
+         if (!itr->processed_) ++count;
+      }
+      return count;
+   }
+
+private:
+   cont_type queue;
+};
+
+// the job at the front of either queue, if there is one.
+bool front_job(task_queue &q, tile_protocol &job)
+{
+   optional<task const &> t = q.front();
+   if (t) { job = q.tile(*t); }
+   return bool(t);
+}
+
+bool front_job(legacy_task_queue &q, tile_protocol &job)
+{
+   optional<legacy_task const &> t = q.front();
+   if (t) { job = *t; }
+   return bool(t);
+}
+
+/* a cheap, deterministic stream of requests spread over a large area
+ * at the broker's usual priorities.
+ */
+struct request_generator
+{
+   request_generator() : state(12345) {}
+
+   tile_protocol next(int &priority)
+   {
+      static const int priorities[] = { 0, 50, 100, 150 };
+      state = state * 1103515245u + 12345u;
+      priority = priorities[(state >> 16) & 3];
+      const int x = (state >> 4) & 0xfff8, y = (state >> 20) & 0xfff8;
+      return tile_protocol(cmdRender, x, y, 18, 0, "map", fmtPNG);
+   }
+
+   unsigned int state;
+};
+
+template <typename Queue>
+void run(const string &name, size_t operations, size_t backlog, size_t in_flight)
+{
+   Queue q;
+   request_generator gen;
+   std::deque<tile_protocol> processing;
+   const string addr = "handler";
+   size_t unprocessed_total = 0;
+   int priority = 0;
+
+   for (size_t i = 0; i < backlog; ++i)
+   {
+      tile_protocol t = gen.next(priority);
+      q.push(t, addr, priority);
+   }
+
+   bt::ptime start = bt::microsec_clock::universal_time();
+   for (size_t i = 0; i < operations; ++i)
+   {
+      tile_protocol t = gen.next(priority);
+      q.push(t, addr, priority);
+
+      tile_protocol meta;
+      if (front_job(q, meta))
+      {
+         q.set_processed(meta, addr, 0);
+         processing.push_back(meta);
+      }
+
+      if (processing.size() > in_flight)
+      {
+         q.erase(processing.front());
+         processing.pop_front();
+      }
+
+      // the broker checks this on every heartbeat and announcement.
+      unprocessed_total += q.count_unprocessed();
+   }
+   bt::time_duration elapsed = bt::microsec_clock::universal_time() - start;
+
+   const double secs = elapsed.total_microseconds() / 1.0e6;
+   cout << boost::format("%1$-10s %2$12d ops  %3$10.3f s  %4$12.0f ops/s  (checksum %5%)")
+      % name % operations % secs % (operations / secs) % unprocessed_total << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   size_t operations = 10000000, backlog = 1000, in_flight = 100;
+
+   try
+   {
+      if (argc > 1) { operations = boost::lexical_cast<size_t>(argv[1]); }
+      if (argc > 2) { backlog = boost::lexical_cast<size_t>(argv[2]); }
+      if (argc > 3) { in_flight = boost::lexical_cast<size_t>(argv[3]); }
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      std::cerr << "usage: " << argv[0] << " [operations] [backlog] [in-flight]" << endl;
+      return 1;
+   }
+
+   cout << boost::format("== Task queue benchmark: backlog=%1% in-flight=%2% ==")
+      % backlog % in_flight << endl << endl;
+
+   run<task_queue>("split", operations, backlog, in_flight);
+   run<legacy_task_queue>("legacy", operations, backlog, in_flight);
+
+   return 0;
+}
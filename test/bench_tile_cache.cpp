@@ -0,0 +1,214 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* simulation of the handler's tile cache, to see how much of the
+ * storage latency it saves for a given cache size.
+ *
+ * every request is either answered from the cache, which is timed for
+ * real, or goes to storage, which takes a made-up time: usually a few
+ * milliseconds, with a long tail as a busy disk or a distant storage
+ * node would have. the tile which storage returns is put in the cache.
+ * the same requests are also run without the cache, where every one
+ * of them goes to storage.
+ *
+ * the requests can be replayed from a file with one request per line,
+ * giving "<z> <x> <y>" and optionally the style, in order of arrival.
+ * otherwise they're made up, with the popularity of the tiles falling
+ * off as a power law, as it does for real map traffic. requests
+ * arrive at a fixed rate, so that the cache's time to live matters.
+ *
+ * usage: bench_tile_cache [cache size MB] [requests per second] [request log]
+ */
+
+#include "tile_cache.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using rendermq::tile_cache;
+using rendermq::tile_protocol;
+using rendermq::cmdRender;
+using rendermq::cmdDone;
+using rendermq::fmtPNG;
+using boost::optional;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bt = boost::posix_time;
+
+namespace {
+
+// the size of the tiles storage returns, and how long to keep them.
+const size_t tile_size = 20000;
+const int cache_ttl = 60;
+
+/* read a request log, one "<z> <x> <y> [style]" per line.
+ */
+vector<tile_protocol> read_log(const string &file)
+{
+   vector<tile_protocol> requests;
+   std::ifstream in(file.c_str());
+   if (!in) { throw std::runtime_error("Unable to open request log `" + file + "'."); }
+
+   string line;
+   while (std::getline(in, line))
+   {
+      std::istringstream fields(line);
+      int z, x, y;
+      string style = "map";
+      if (!(fields >> z >> x >> y)) { continue; }
+      fields >> style;
+      requests.push_back(tile_protocol(cmdRender, x, y, z, 0, style, fmtPNG));
+   }
+   return requests;
+}
+
+/* a cheap, deterministic source of numbers between 0 and 1.
+ */
+struct uniform_generator
+{
+   uniform_generator(unsigned int seed) : state(seed) {}
+
+   double next()
+   {
+      state = state * 1103515245u + 12345u;
+      return (((state >> 8) & 0xffffff) + 0.5) / 16777216.0;
+   }
+
+   unsigned int state;
+};
+
+/* a million requests over a million distinct tiles, where the n'th
+ * most popular tile is requested in proportion to 1/n.
+ */
+vector<tile_protocol> make_up_log()
+{
+   const size_t num_tiles = 1000000, num_requests = 1000000;
+   vector<tile_protocol> requests;
+   uniform_generator gen(12345);
+
+   for (size_t i = 0; i < num_requests; ++i)
+   {
+      // inverse of the (continuous) cumulative distribution of 1/n.
+      const size_t rank = size_t(std::pow(double(num_tiles), gen.next())) - 1;
+      const int x = int(rank % 1024), y = int(rank / 1024);
+      requests.push_back(tile_protocol(cmdRender, x, y, 18, 0, "map", fmtPNG));
+   }
+   return requests;
+}
+
+/* the time, in microseconds, a storage lookup takes: a few milliseconds
+ * with one in fifty taking around ten times as long.
+ */
+double storage_latency(uniform_generator &gen)
+{
+   const double base = 2000.0 - 2000.0 * std::log(gen.next());
+   return (gen.next() < 0.02) ? 10.0 * base : base;
+}
+
+// the value at the given fraction of the way through a sorted list.
+double percentile(const vector<double> &sorted, double p)
+{
+   if (sorted.empty()) { return 0.0; }
+   return sorted[size_t(p * (sorted.size() - 1) + 0.5)];
+}
+
+void simulate(const string &name, size_t cache_bytes, const vector<tile_protocol> &requests,
+              size_t requests_per_second)
+{
+   tile_cache cache(cache_bytes, cache_ttl);
+   uniform_generator gen(54321);
+   vector<double> latencies;
+   latencies.reserve(requests.size());
+   const string data(tile_size, 'x');
+   const std::time_t start = 1000000;
+
+   for (size_t i = 0; i < requests.size(); ++i)
+   {
+      const std::time_t now = start + std::time_t(i / requests_per_second);
+      const tile_protocol &request = requests[i];
+
+      bt::ptime before = bt::microsec_clock::universal_time();
+      optional<tile_protocol const &> hit = cache.find(request, now);
+      double latency = (bt::microsec_clock::universal_time() - before).total_microseconds();
+
+      if (!hit)
+      {
+         latency += storage_latency(gen);
+         tile_protocol result(request);
+         result.status = cmdDone;
+         result.last_modified = now;
+         result.set_data(data);
+         cache.insert(result, now);
+      }
+      latencies.push_back(latency);
+   }
+
+   std::sort(latencies.begin(), latencies.end());
+   const size_t lookups = cache.hits() + cache.misses();
+   cout << boost::format("%1$-10s p50 %2$8.0f us  p99 %3$8.0f us  hit ratio %4$5.1f%%  "
+                         "%5$7d tiles  %6$6.1f MB  %7$8d evictions")
+      % name % percentile(latencies, 0.5) % percentile(latencies, 0.99)
+      % (lookups > 0 ? 100.0 * cache.hits() / lookups : 0.0)
+      % cache.size() % (cache.bytes() / (1024.0 * 1024.0)) % cache.evictions() << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   double cache_mb = 64;
+   size_t requests_per_second = 1000;
+   vector<tile_protocol> requests;
+
+   try
+   {
+      if (argc > 1) { cache_mb = boost::lexical_cast<double>(argv[1]); }
+      if (argc > 2) { requests_per_second = std::max<size_t>(1, boost::lexical_cast<size_t>(argv[2])); }
+      requests = (argc > 3) ? read_log(argv[3]) : make_up_log();
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << e.what() << endl;
+      std::cerr << "usage: " << argv[0] << " [cache size MB] [requests per second] [request log]" << endl;
+      return 1;
+   }
+
+   cout << boost::format("== Tile cache simulation: %1% requests, %2% requests/s, %3% MB cache ==")
+      % requests.size() % requests_per_second % cache_mb << endl << endl;
+
+   simulate("no cache", 0, requests, requests_per_second);
+   simulate("cache", size_t(cache_mb * 1024 * 1024), requests, requests_per_second);
+
+   return 0;
+}
@@ -0,0 +1,174 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "admission_control.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+
+using rendermq::admission_control;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+
+/* test that the thresholds start as configured, and stay that way when
+ * there's no target, however bad the latency gets.
+ */
+void test_fixed() {
+  admission_control ac(100, 500, 1000, 0, 1000, 0);
+
+  if (ac.adaptive() || ac.threshold_stale() != 100 || 
+      ac.threshold_satisfy() != 500 || ac.threshold_max() != 1000) {
+    throw runtime_error("Thresholds should start as configured.");
+  }
+
+  for (int i = 1; i <= 10; ++i) {
+    ac.render_latency(60000);
+    ac.held_back();
+    ac.update(0, i * 1000);
+  }
+  if (ac.threshold_max() != 1000 || ac.latency() != 60000) {
+    throw runtime_error("Thresholds shouldn't change without a target.");
+  }
+}
+
+/* test that a threshold configured as zero stays at zero, with or
+ * without a target.
+ */
+void test_zero_threshold() {
+  admission_control fixed(0, 500, 1000, 0, 1000, 0);
+  if (fixed.threshold_stale() != 0) {
+    throw runtime_error("Zero threshold should stay zero without a target.");
+  }
+
+  admission_control ac(0, 500, 1000, 2000, 1000, 0);
+  if (ac.threshold_stale() != 0) {
+    throw runtime_error("Zero threshold should start as configured.");
+  }
+  ac.render_latency(5000);
+  ac.update(0, 1000);
+  if (ac.threshold_stale() != 0 || ac.threshold_max() != 750) {
+    throw runtime_error("Zero threshold shouldn't be scaled up.");
+  }
+}
+
+/* test that nothing happens until the interval is over.
+ */
+void test_interval() {
+  admission_control ac(100, 500, 1000, 2000, 1000, 0);
+
+  ac.render_latency(5000);
+  if (ac.update(0, 999) || ac.threshold_max() != 1000) {
+    throw runtime_error("Thresholds shouldn't change before the interval is over.");
+  }
+  if (!ac.update(0, 1000) || ac.threshold_max() != 750) {
+    throw runtime_error("Thresholds should be cut at the end of the interval.");
+  }
+}
+
+/* test that the thresholds are cut by a constant factor, all together,
+ * when the shortest latency is over the target, but not when only some
+ * renders were slow.
+ */
+void test_decrease() {
+  admission_control ac(100, 500, 1000, 2000, 1000, 0);
+
+  ac.render_latency(3000);
+  ac.render_latency(2500);
+  ac.update(0, 1000);
+  if (ac.threshold_stale() != 75 || ac.threshold_satisfy() != 375 || 
+      ac.threshold_max() != 750 || ac.latency() != 2500) {
+    throw runtime_error("All thresholds should be cut when latency is over the target.");
+  }
+
+  ac.render_latency(30000);
+  ac.render_latency(500);
+  ac.update(0, 2000);
+  if (ac.threshold_max() != 750) {
+    throw runtime_error("A few slow renders shouldn't cut the thresholds.");
+  }
+
+  // the thresholds can't be cut to nothing.
+  for (int i = 3; i < 100; ++i) {
+    ac.render_latency(60000);
+    ac.update(0, i * 1000);
+  }
+  if (ac.threshold_stale() != 10 || ac.threshold_max() != 100) {
+    throw runtime_error("Thresholds should stop at the minimum scale.");
+  }
+}
+
+/* test that the thresholds are raised when requests are being held back
+ * and the latency is under the target, but only while the queue isn't
+ * growing.
+ */
+void test_increase() {
+  admission_control ac(100, 500, 1000, 2000, 1000, 0);
+
+  // nothing was held back, so there's no reason to raise them.
+  ac.render_latency(500);
+  ac.update(10, 1000);
+  if (ac.threshold_max() != 1000) {
+    throw runtime_error("Thresholds shouldn't be raised when nothing is held back.");
+  }
+
+  ac.render_latency(500);
+  ac.held_back();
+  ac.update(10, 2000);
+  if (ac.threshold_max() != 1050 || ac.threshold_stale() != 105) {
+    throw runtime_error("Thresholds should be raised by a step when holding back requests.");
+  }
+
+  // the queue grew, so hold steady.
+  ac.held_back();
+  ac.update(50, 3000);
+  if (ac.threshold_max() != 1050 || ac.growth() != 40) {
+    throw runtime_error("Thresholds shouldn't be raised while the queue is growing.");
+  }
+
+  // with no renders finishing, there's no latency to go on, but the
+  // queue is shrinking.
+  ac.held_back();
+  ac.update(20, 4000);
+  if (ac.threshold_max() != 1100 || ac.latency() != 0) {
+    throw runtime_error("Thresholds should be raised while the queue shrinks.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Admission Control ==" << endl << endl;
+
+  tests_failed += test::run("test_fixed", &test_fixed);
+  tests_failed += test::run("test_zero_threshold", &test_zero_threshold);
+  tests_failed += test::run("test_interval", &test_interval);
+  tests_failed += test::run("test_decrease", &test_decrease);
+  tests_failed += test::run("test_increase", &test_increase);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "bulk_spill.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <string>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+
+using rendermq::bulk_spill;
+using rendermq::tile_protocol;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::cmdRenderBulk;
+using rendermq::fmtPNG;
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+/* a temporary directory for the spill, removed again afterwards.
+ */
+class tmp_dir
+{
+public:
+  tmp_dir() : m_dir(fs::path("/tmp") / fs::unique_path()) {}
+  ~tmp_dir() { fs::remove_all(m_dir); }
+  const fs::path &dir() const { return m_dir; }
+
+private:
+  fs::path m_dir;
+};
+
+tile_protocol bulk(int i) {
+  return tile_protocol(cmdRenderBulk, i * 8, i * 16, 12, i, "map", fmtPNG);
+}
+
+// pop the next request and check that it's the i-th one pushed.
+void expect_next(bulk_spill &spill, int i) {
+  tile_protocol tile;
+  string address;
+  std::time_t arrived = 0;
+  if (!spill.pop(tile, address, arrived)) {
+    throw runtime_error("Expected a request in the spill.");
+  }
+  const tile_protocol expected = bulk(i);
+  if (tile != expected || tile.status != cmdRenderBulk) {
+    throw runtime_error("Request came back out of the spill different or out of order.");
+  }
+  if (address != (i % 2 ? "handler-a" : "handler-b") || arrived != 1000 + i) {
+    throw runtime_error("Request came back with the wrong address or arrival time.");
+  }
+}
+
+void push(bulk_spill &spill, int i) {
+  spill.push(bulk(i), (i % 2 ? "handler-a" : "handler-b"), 1000 + i);
+}
+
+size_t count_segments(const fs::path &dir) {
+  size_t count = 0;
+  for (fs::directory_iterator itr(dir); itr != fs::directory_iterator(); ++itr) {
+    ++count;
+  }
+  return count;
+}
+
+}
+
+/* test that requests come back out in the order they went in, across
+ * several segments, and that the segments are removed once read.
+ */
+void test_round_trip() {
+  tmp_dir tmp;
+  bulk_spill spill(tmp.dir().string(), 256);
+
+  for (int i = 0; i < 50; ++i) { push(spill, i); }
+  if (spill.size() != 50) { throw runtime_error("Wrong size after pushing."); }
+  if (count_segments(tmp.dir()) < 2) { throw runtime_error("Expected the spill to use several segments."); }
+
+  for (int i = 0; i < 20; ++i) { expect_next(spill, i); }
+
+  // pushing while reading carries on at the end.
+  for (int i = 50; i < 60; ++i) { push(spill, i); }
+  for (int i = 20; i < 60; ++i) { expect_next(spill, i); }
+
+  tile_protocol tile;
+  string address;
+  std::time_t arrived;
+  if (!spill.empty() || spill.pop(tile, address, arrived)) {
+    throw runtime_error("Spill should be empty.");
+  }
+  if (count_segments(tmp.dir()) > 1) {
+    throw runtime_error("Segments which have been read should be removed.");
+  }
+}
+
+/* test that requests left in the directory are picked up again when
+ * the spill is re-opened, e.g: after the broker restarts.
+ */
+void test_reopen() {
+  tmp_dir tmp;
+  {
+    bulk_spill spill(tmp.dir().string(), 256);
+    for (int i = 0; i < 30; ++i) { push(spill, i); }
+  }
+
+  bulk_spill spill(tmp.dir().string(), 256);
+  if (spill.size() != 30) { throw runtime_error("Re-opened spill should have all the requests."); }
+  for (int i = 0; i < 10; ++i) { expect_next(spill, i); }
+  push(spill, 30);
+  for (int i = 10; i < 31; ++i) { expect_next(spill, i); }
+}
+
+/* test that a record which was only partly written is ignored.
+ */
+void test_partial_record() {
+  tmp_dir tmp;
+  {
+    bulk_spill spill(tmp.dir().string(), 1 << 20);
+    for (int i = 0; i < 3; ++i) { push(spill, i); }
+  }
+
+  // chop a few bytes off the end of the last record.
+  const fs::path segment = fs::directory_iterator(tmp.dir())->path();
+  fs::resize_file(segment, fs::file_size(segment) - 3);
+
+  bulk_spill spill(tmp.dir().string(), 1 << 20);
+  if (spill.size() != 2) { throw runtime_error("Partial record shouldn't be counted."); }
+  expect_next(spill, 0);
+  expect_next(spill, 1);
+
+  tile_protocol tile;
+  string address;
+  std::time_t arrived;
+  if (spill.pop(tile, address, arrived)) { throw runtime_error("Partial record shouldn't be read."); }
+}
+
+/* test that clearing the spill removes everything.
+ */
+void test_clear() {
+  tmp_dir tmp;
+  bulk_spill spill(tmp.dir().string(), 256);
+  for (int i = 0; i < 30; ++i) { push(spill, i); }
+  expect_next(spill, 0);
+
+  spill.clear();
+  if (!spill.empty() || count_segments(tmp.dir()) != 0) {
+    throw runtime_error("Cleared spill should be empty.");
+  }
+  push(spill, 5);
+  expect_next(spill, 5);
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Bulk Spill ==" << endl << endl;
+
+  tests_failed += test::run("test_round_trip", &test_round_trip);
+  tests_failed += test::run("test_reopen", &test_reopen);
+  tests_failed += test::run("test_partial_record", &test_partial_record);
+  tests_failed += test::run("test_clear", &test_clear);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
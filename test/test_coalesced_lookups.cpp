@@ -0,0 +1,139 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "coalesced_lookups.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using rendermq::coalesced_lookups;
+using rendermq::tile_protocol;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using rendermq::cmdRender;
+using rendermq::cmdRenderPrio;
+using rendermq::cmdDirty;
+using rendermq::cmdDone;
+using rendermq::cmdStatus;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+
+namespace {
+
+tile_protocol request(int id, int x, int y, rendermq::protoCmd status = cmdRender, 
+                      rendermq::protoFmt fmt = fmtPNG) {
+  return tile_protocol(status, x, y, 10, id, "map", fmt, 0, 100 + id);
+}
+
+}
+
+/* test that concurrent requests for the same tile share one lookup,
+ * and each gets the result with its own id.
+ */
+void test_coalesce() {
+  coalesced_lookups lookups;
+
+  if (!lookups.add(request(1, 3, 5))) {
+    throw runtime_error("First request for a tile should be looked up.");
+  }
+  if (lookups.add(request(2, 3, 5)) || lookups.add(request(3, 3, 5, cmdRenderPrio))) {
+    throw runtime_error("Later requests for the same tile should wait on the first.");
+  }
+  if (lookups.size() != 1 || lookups.lookups() != 3 || lookups.coalesced() != 2) {
+    throw runtime_error("Wrong lookup counts.");
+  }
+
+  tile_protocol result = request(1, 3, 5);
+  result.status = cmdDone;
+  result.last_modified = 1000;
+  result.set_data("tile data");
+
+  vector<tile_protocol> replies;
+  lookups.complete(result, replies);
+  if (replies.size() != 2 || lookups.size() != 0) {
+    throw runtime_error("Expected a reply for each waiting request.");
+  }
+  for (size_t i = 0; i < replies.size(); ++i) {
+    const tile_protocol &reply = replies[i];
+    if (reply.id != int(i) + 2 || reply.request_last_modified != 102 + int(i)) {
+      throw runtime_error("Reply should have the id and headers of the waiting request.");
+    }
+    if (reply.status != cmdDone || reply.last_modified != 1000 || reply.data() != "tile data") {
+      throw runtime_error("Reply should have the result of the lookup.");
+    }
+  }
+
+  // once complete, the next request has to be looked up again.
+  if (!lookups.add(request(4, 3, 5))) {
+    throw runtime_error("Request after the lookup completed should be looked up.");
+  }
+}
+
+/* test that requests which would get different results aren't
+ * coalesced.
+ */
+void test_distinct() {
+  coalesced_lookups lookups;
+
+  lookups.add(request(1, 3, 5));
+  if (!lookups.add(request(2, 3, 6)) || 
+      !lookups.add(request(3, 3, 5, cmdRender, fmtJPEG)) ||
+      !lookups.add(request(4, 3, 5, cmdStatus))) {
+    throw runtime_error("Requests for different tiles, formats or status shouldn't coalesce.");
+  }
+  if (!lookups.add(request(5, 3, 5, cmdDirty)) || !lookups.add(request(6, 3, 5, cmdDirty))) {
+    throw runtime_error("Dirty requests should never be coalesced.");
+  }
+  if (lookups.size() != 4 || lookups.coalesced() != 0) {
+    throw runtime_error("Wrong number of lookups in progress.");
+  }
+
+  // the status result is matched to the status request only.
+  vector<tile_protocol> replies;
+  lookups.add(request(7, 3, 5, cmdStatus));
+  lookups.complete(request(4, 3, 5, cmdStatus), replies);
+  if (replies.size() != 1 || replies[0].id != 7 || lookups.size() != 3) {
+    throw runtime_error("Status result should only answer the status requests.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Coalesced Lookups ==" << endl << endl;
+
+  tests_failed += test::run("test_coalesce", &test_coalesce);
+  tests_failed += test::run("test_distinct", &test_distinct);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "fair_drain.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#include <boost/bind.hpp>
+
+using rendermq::fair_drain;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+namespace {
+
+/* a source with some number of messages waiting, which records the
+ * order in which messages were handled.
+ */
+struct fake_source {
+  fake_source(char n, size_t w, string &l) : name(n), waiting(w), log(l) {}
+
+  bool ready() const { return waiting > 0; }
+  void handle() { --waiting; log += name; }
+
+  char name;
+  size_t waiting;
+  string &log;
+};
+
+void add(fair_drain &drain, fake_source &s) {
+  drain.add_source(boost::bind(&fake_source::ready, &s), 
+                   boost::bind(&fake_source::handle, &s));
+}
+
+}
+
+/* test that each source gives up to the budget of messages, and that
+ * sources with fewer are emptied.
+ */
+void test_budget() {
+  string log;
+  fake_source a('a', 5, log), b('b', 1, log), c('c', 0, log);
+  fair_drain drain(3);
+  add(drain, a); add(drain, b); add(drain, c);
+
+  if (drain() != 4 || log != "aaab") {
+    throw runtime_error("Expected three from the first source and one from the second, not `" + log + "'.");
+  }
+  if (a.waiting != 2 || b.waiting != 0) {
+    throw runtime_error("Wrong number of messages left on the sources.");
+  }
+}
+
+/* test that the source which goes first is rotated, so that a flood
+ * on one source doesn't always go ahead of the others.
+ */
+void test_rotation() {
+  string log;
+  fake_source a('a', 100, log), b('b', 100, log), c('c', 100, log);
+  fair_drain drain(2);
+  add(drain, a); add(drain, b); add(drain, c);
+
+  drain(); drain(); drain(); drain();
+  if (log != "aabbcc" "bbccaa" "ccaabb" "aabbcc") {
+    throw runtime_error("Sources weren't rotated: `" + log + "'.");
+  }
+}
+
+/* test that a budget of zero still makes progress.
+ */
+void test_zero_budget() {
+  string log;
+  fake_source a('a', 2, log);
+  fair_drain drain(0);
+  add(drain, a);
+
+  if (drain.budget() != 1 || drain() != 1) {
+    throw runtime_error("Zero budget should be treated as one.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Fair Drain ==" << endl << endl;
+
+  tests_failed += test::run("test_budget", &test_budget);
+  tests_failed += test::run("test_rotation", &test_rotation);
+  tests_failed += test::run("test_zero_budget", &test_zero_budget);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
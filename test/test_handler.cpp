@@ -24,12 +24,15 @@
  *-----------------------------------------------------------------------------*/
 
 #include "tile_path_parser.hpp"
+#include "mongrel_request_parser.hpp"
 #include "tile_protocol.hpp"
 #include "test/common.hpp"
 #include "http/http_date_parser.hpp"
 #include "http/http_date_formatter.hpp"
+#include "http/http_reply.hpp"
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
 #include <iterator>
 #include <map>
 #include <limits>
@@ -37,6 +40,8 @@
 #include <boost/format.hpp>
 
 using rendermq::tile_path_parser;
+using rendermq::request_view_parser;
+using rendermq::mongrel_request_view;
 using rendermq::tile_protocol;
 using boost::function;
 using boost::optional;
@@ -57,16 +62,39 @@ using rendermq::fmtJPEG;
 using rendermq::fmtJSON;
 
 namespace {
-/* little utility class to make things look nicer in the tests below. */
+/* little utility class to make things look nicer in the tests below.
+ * the path is parsed both on its own and as part of a whole mongrel2
+ * request, which should always agree.
+ */
 class url {
 private:
    string url_;
    tile_path_parser path_parser;
+   request_view_parser view_parser;
+
+   bool parse_request(tile_protocol &tile) const {
+      const string headers = "{\"PATH\":\"" + url_ + "\"}";
+      const string msg = (boost::format("MONGREL2 1 %1% %2%:%3%,0:,") 
+                          % url_ % headers.size() % headers).str();
+      mongrel_request_view request;
+      if (!view_parser(request, msg.data(), msg.data() + msg.size())) {
+         throw runtime_error((boost::format("Request for URL (%1%) should be a valid mongrel2 request.")
+                              % url_).str());
+      }
+      tile = request.tile;
+      return request.is_tile;
+   }
 
 public:
    url(const string &u) : url_(u) {}
    void should_give(const tile_protocol &tile) const {
-      tile_protocol parsed;
+      tile_protocol parsed, parsed_request;
+      if (!parse_request(parsed_request) || tile != parsed_request ||
+          tile.status != parsed_request.status) {
+         throw runtime_error(
+            (boost::format("Parsed tile request from mongrel2 request for URL (%1%) is not what was expected.")
+             % url_).str());
+      }
       if (!path_parser(parsed, url_)) {
          throw runtime_error(
             (boost::format("Cannot parse URL (%1%) which is expected to be valid.")
@@ -80,6 +108,10 @@ public:
    }
    void should_be_invalid() const {
       tile_protocol parsed;
+      if (parse_request(parsed)) {
+         throw runtime_error((boost::format("URL (%1%) was expected to be invalid, but has parsed OK "
+                                            "from a mongrel2 request (as %2%).") % url_ % parsed).str());
+      }
       if (path_parser(parsed, url_)) {
          throw runtime_error((boost::format("URL (%1%) was expected to be invalid, but has parsed OK (as %2%).")
                               % url_ % parsed).str());
@@ -111,6 +143,18 @@ void check_format_time(const std::string &expected, std::time_t time)
       throw runtime_error((boost::format("Formatted string (%1%) from time %2%, but expected %3%.")
                            % ostr.str() % time % expected).str());
    }  
+
+   char buf[HTTP_DATE_LENGTH];
+   rendermq::format_http_date(buf, time);
+   if (string(buf, HTTP_DATE_LENGTH) != expected) {
+      throw runtime_error((boost::format("Quick formatted string (%1%) from time %2%, but expected %3%.")
+                           % string(buf, HTTP_DATE_LENGTH) % time % expected).str());
+   }
+}
+
+string message_string(zmq::message_t &msg)
+{
+   return string(static_cast<const char *>(msg.data()), msg.size());
 }
 
 }
@@ -236,6 +280,48 @@ void test_date_formatting()
    check_format_time("Fri, 03 Jun 2011 13:42:17 GMT", 1307108537);
 }
 
+/* check that the replies made from templates have exactly the same
+ * headers as the ones which are formatted for each response.
+ */
+void test_reply_templates()
+{
+   rendermq::http_date_formatter formatter;
+   rendermq::http_reply_templates templates(3600);
+   const string data("\x89PNG tile data");
+   const std::time_t last_modified = 1307108537, now = 1307112345;
+
+   std::ostringstream tile;
+   tile << "MONGREL2 4:1234, HTTP/1.1 200 OK\r\n"
+        << "Content-Type: image/png\r\nContent-Length: " << data.size() << "\r\n"
+        << "Cache-Control: max-age=3600\r\nEdge-Control: downstream-ttl=3600\r\n"
+        << "Last-Modified: ";
+   formatter(tile, last_modified);
+   tile << "\r\nExpires: ";
+   formatter(tile, now + 3600);
+   tile << "\r\nServer: Mapnik2/0.8.0\r\nAccess-Control-Allow-Origin: *\r\n\r\n" << data;
+
+   // twice, so that the cached dates are used the second time.
+   for (int i = 0; i < 2; ++i) {
+      zmq::message_t msg;
+      templates.tile_message(msg, "MONGREL2", 1234, last_modified, now + 3600, data, "image/png");
+      if (message_string(msg) != tile.str()) {
+         throw runtime_error("Tile reply was `" + message_string(msg) + "' but expected `" + tile.str() + "'.");
+      }
+   }
+
+   std::ostringstream not_modified;
+   not_modified << "MONGREL2 1:7, HTTP/1.1 304 Not Modified\r\nContent-Type: image/jpeg\r\nDate: ";
+   formatter(not_modified, now);
+   not_modified << "\r\nServer: Mapnik2/0.8.0\r\n\r\n";
+
+   zmq::message_t msg;
+   templates.not_modified_message(msg, "MONGREL2", 7, now, "image/jpeg");
+   if (message_string(msg) != not_modified.str()) {
+      throw runtime_error("Not modified reply was `" + message_string(msg) + "' but expected `" + 
+                          not_modified.str() + "'.");
+   }
+}
+
 int main() {
    int tests_failed = 0;
 
@@ -249,6 +335,7 @@ int main() {
    tests_failed += test::run("test_path_parsing_version", &test_path_parsing_version);
    tests_failed += test::run("test_date_parsing", &test_date_parsing);
    tests_failed += test::run("test_date_formatting", &test_date_formatting);
+   tests_failed += test::run("test_reply_templates", &test_reply_templates);
    //tests_failed += test::run("test_", &test_);
 
    cout << " >> Tests failed: " << tests_failed << endl << endl;
@@ -0,0 +1,173 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "idle_workers.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#include <set>
+
+using rendermq::idle_workers;
+using rendermq::waiting_worker;
+using boost::optional;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::list;
+
+namespace {
+
+waiting_worker worker(const string &id, boost::uint32_t num_jobs, rendermq::timer_wheel::timer_id timer) {
+  list<string> addresses;
+  addresses.push_back(id);
+  addresses.push_back("router");
+  return waiting_worker(addresses, num_jobs, timer);
+}
+
+}
+
+/* test that the worker which has been waiting the longest is the first
+ * to be given a job.
+ */
+void test_longest_waiting_first() {
+  idle_workers idle;
+  idle.wait(worker("A", 1, 10));
+  idle.wait(worker("B", 4, 11));
+  idle.wait(worker("C", 1, 12));
+
+  if (idle.size() != 3 || idle.front()->id() != "A") {
+    throw runtime_error("Expected three workers waiting, with A at the front.");
+  }
+
+  optional<waiting_worker> w = idle.pop();
+  if (!w || w->id() != "A" || w->num_jobs != 1 || w->timer != 10) {
+    throw runtime_error("Expected A to be popped first.");
+  }
+  if (w->addresses.size() != 2 || w->addresses.back() != "router") {
+    throw runtime_error("Routing headers should be kept with the request.");
+  }
+  w = idle.pop();
+  if (!w || w->id() != "B" || w->num_jobs != 4) {
+    throw runtime_error("Expected B to be popped second.");
+  }
+  w = idle.pop();
+  if (!w || w->id() != "C") {
+    throw runtime_error("Expected C to be popped last.");
+  }
+  if (idle.pop() || !idle.empty() || idle.front()) {
+    throw runtime_error("Nothing should be left waiting.");
+  }
+}
+
+/* test that a worker asking again replaces its earlier request and goes
+ * to the back of the queue.
+ */
+void test_wait_again() {
+  idle_workers idle;
+  idle.wait(worker("A", 1, 10));
+  idle.wait(worker("B", 1, 11));
+
+  optional<waiting_worker> previous = idle.wait(worker("A", 2, 12));
+  if (!previous || previous->timer != 10) {
+    throw runtime_error("Waiting again should return the earlier request.");
+  }
+  if (idle.wait(worker("C", 1, 13))) {
+    throw runtime_error("A new worker shouldn't have an earlier request.");
+  }
+
+  if (idle.size() != 3 || idle.pop()->id() != "B") {
+    throw runtime_error("Worker waiting again should go to the back.");
+  }
+  optional<waiting_worker> w = idle.pop();
+  if (!w || w->id() != "A" || w->num_jobs != 2 || w->timer != 12) {
+    throw runtime_error("Expected the later request from A.");
+  }
+}
+
+/* test that a worker can be removed from anywhere in the queue.
+ */
+void test_remove() {
+  idle_workers idle;
+  idle.wait(worker("A", 1, 10));
+  idle.wait(worker("B", 1, 11));
+  idle.wait(worker("C", 1, 12));
+
+  optional<waiting_worker> w = idle.remove("B");
+  if (!w || w->timer != 11) {
+    throw runtime_error("Removing a waiting worker should return its request.");
+  }
+  if (idle.remove("B") || idle.remove("D")) {
+    throw runtime_error("Removing a worker which isn't waiting should do nothing.");
+  }
+  if (idle.size() != 2 || idle.pop()->id() != "A" || idle.pop()->id() != "C") {
+    throw runtime_error("The other workers should still be waiting in order.");
+  }
+}
+
+/* test that the waiting workers can be looked through in order for one
+ * which can render a style, and taken from the middle of the queue.
+ */
+void test_styles() {
+  idle_workers idle;
+  std::set<string> aerial;
+  aerial.insert("aerial");
+  list<string> addresses(1, "B");
+  idle.wait(waiting_worker(addresses, 1, 11, aerial));
+  idle.wait(worker("A", 1, 10));
+
+  if (idle.begin()->renders("map") || !idle.begin()->renders("aerial")) {
+    throw runtime_error("Worker with a list of styles should only render those.");
+  }
+  if (idle.front()->id() != "B" || idle.front()->styles.size() != 1) {
+    throw runtime_error("Expected B, with its styles, at the front.");
+  }
+
+  idle_workers::iterator itr = idle.begin();
+  while (itr != idle.end() && !itr->renders("map")) { ++itr; }
+  if (itr == idle.end() || itr->id() != "A" || !itr->renders("terrain")) {
+    throw runtime_error("Worker without a list of styles should render any.");
+  }
+  idle.remove(itr->id());
+  if (idle.size() != 1 || idle.front()->id() != "B") {
+    throw runtime_error("Expected B to still be waiting.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Idle Workers ==" << endl << endl;
+
+  tests_failed += test::run("test_longest_waiting_first", &test_longest_waiting_first);
+  tests_failed += test::run("test_wait_again", &test_wait_again);
+  tests_failed += test::run("test_remove", &test_remove);
+  tests_failed += test::run("test_styles", &test_styles);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,200 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "metatile_cache.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+
+using rendermq::metatile_cache;
+using rendermq::cached_metatile;
+using rendermq::shared_metatile_t;
+using rendermq::tile_protocol;
+using boost::optional;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::cmdRender;
+using rendermq::cmdDone;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+
+namespace {
+
+shared_metatile_t make_data(size_t size) {
+  return shared_metatile_t(new string(size, 'x'));
+}
+
+tile_protocol done(int x, int y, int z, int fmt) {
+  return tile_protocol(cmdDone, x, y, z, 0, "map", rendermq::protoFmt(fmt), 1000);
+}
+
+tile_protocol request(int x, int y, int z, rendermq::protoFmt fmt) {
+  return tile_protocol(cmdRender, x, y, z, 0, "map", fmt);
+}
+
+}
+
+/* test that any tile within a cached metatile hits, and that the
+ * result of the render comes back.
+ */
+void test_hit_within_metatile() {
+  metatile_cache cache(1024, 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(done(8, 16, 10, fmtPNG | fmtJPEG), make_data(100), now);
+
+  optional<const cached_metatile &> hit = cache.find(request(13, 21, 10, fmtJPEG), now);
+  if (!hit) { throw runtime_error("Expected tile within the metatile to hit."); }
+  if (hit->tile.status != cmdDone || hit->tile.last_modified != 1000) {
+    throw runtime_error("Cached result should keep the status and last modified time.");
+  }
+  if (hit->data->size() != 100) { throw runtime_error("Wrong data in cached metatile."); }
+
+  if (cache.find(request(16, 16, 10, fmtPNG), now)) {
+    throw runtime_error("Tile in a neighbouring metatile shouldn't hit.");
+  }
+  if (cache.find(request(8, 16, 11, fmtPNG), now)) {
+    throw runtime_error("Tile at a different zoom shouldn't hit.");
+  }
+  if (cache.hits() != 1 || cache.misses() != 2) {
+    throw runtime_error("Wrong hit or miss count.");
+  }
+}
+
+/* test that a cached metatile doesn't answer requests for a format it
+ * wasn't rendered in.
+ */
+void test_format_miss() {
+  metatile_cache cache(1024, 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(done(0, 0, 5, fmtPNG), make_data(100), now);
+  if (cache.find(request(0, 0, 5, fmtJPEG), now)) {
+    throw runtime_error("Request for a format which wasn't rendered shouldn't hit.");
+  }
+  if (!cache.find(request(0, 0, 5, fmtPNG), now)) {
+    throw runtime_error("Request for a format which was rendered should hit.");
+  }
+}
+
+/* test that entries expire after their time to live.
+ */
+void test_expiry() {
+  metatile_cache cache(1024, 10);
+  const std::time_t now = 1000000;
+
+  cache.insert(done(0, 0, 5, fmtPNG), make_data(100), now);
+  if (!cache.find(request(0, 0, 5, fmtPNG), now + 9)) {
+    throw runtime_error("Entry shouldn't have expired yet.");
+  }
+  if (cache.find(request(0, 0, 5, fmtPNG), now + 10)) {
+    throw runtime_error("Entry should have expired.");
+  }
+  if (cache.size() != 0 || cache.bytes() != 0) {
+    throw runtime_error("Expired entry should have been removed.");
+  }
+}
+
+/* test that the least recently used entries are evicted to keep the
+ * cache within its size limit.
+ */
+void test_lru_eviction() {
+  metatile_cache cache(300, 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(done(0, 0, 5, fmtPNG), make_data(100), now);
+  cache.insert(done(8, 0, 5, fmtPNG), make_data(100), now);
+  cache.insert(done(16, 0, 5, fmtPNG), make_data(100), now);
+
+  // touch the first, so that the second is least recently used.
+  cache.find(request(0, 0, 5, fmtPNG), now);
+  cache.insert(done(24, 0, 5, fmtPNG), make_data(100), now);
+
+  if (cache.size() != 3 || cache.bytes() != 300 || cache.evictions() != 1) {
+    throw runtime_error("Cache should have evicted one entry to stay within its limit.");
+  }
+  if (cache.find(request(8, 0, 5, fmtPNG), now)) {
+    throw runtime_error("Least recently used entry should have been evicted.");
+  }
+  if (!cache.find(request(0, 0, 5, fmtPNG), now)) {
+    throw runtime_error("Recently used entry shouldn't have been evicted.");
+  }
+
+  // things too big to ever fit aren't cached at all.
+  cache.insert(done(32, 0, 5, fmtPNG), make_data(301), now);
+  if (cache.size() != 3 || cache.find(request(32, 0, 5, fmtPNG), now)) {
+    throw runtime_error("Oversized metatile shouldn't be cached.");
+  }
+}
+
+/* test that erasing (e.g: for a dirty request) and re-inserting keep
+ * the byte count right.
+ */
+void test_erase_and_replace() {
+  metatile_cache cache(1024, 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(done(0, 0, 5, fmtPNG), make_data(100), now);
+  cache.insert(done(0, 0, 5, fmtPNG), make_data(200), now);
+  if (cache.size() != 1 || cache.bytes() != 200) {
+    throw runtime_error("Re-inserting a metatile should replace it.");
+  }
+
+  cache.erase(request(3, 3, 5, fmtPNG));
+  if (cache.size() != 0 || cache.bytes() != 0) {
+    throw runtime_error("Erasing any tile in the metatile should remove it.");
+  }
+}
+
+/* test that a zero-sized cache doesn't keep anything.
+ */
+void test_disabled() {
+  metatile_cache cache(0, 60);
+  cache.insert(done(0, 0, 5, fmtPNG), make_data(100), 1000000);
+  if (cache.size() != 0 || cache.find(request(0, 0, 5, fmtPNG), 1000000)) {
+    throw runtime_error("Disabled cache shouldn't hold anything.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Metatile Cache ==" << endl << endl;
+
+  tests_failed += test::run("test_hit_within_metatile", &test_hit_within_metatile);
+  tests_failed += test::run("test_format_miss", &test_format_miss);
+  tests_failed += test::run("test_expiry", &test_expiry);
+  tests_failed += test::run("test_lru_eviction", &test_lru_eviction);
+  tests_failed += test::run("test_erase_and_replace", &test_erase_and_replace);
+  tests_failed += test::run("test_disabled", &test_disabled);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
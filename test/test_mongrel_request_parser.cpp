@@ -31,6 +31,7 @@
 #include <stdexcept>
 #include <iostream>
 #include <boost/format.hpp>
+#include <boost/foreach.hpp>
 #include <cmath>
 
 using std::runtime_error;
@@ -41,10 +42,25 @@ using std::endl;
 using std::string;
 using std::vector;
 using rendermq::mongrel_request;
+using rendermq::mongrel_request_view;
 
 namespace 
 {
 
+string str(const mongrel_request_view::range_type &r)
+{
+   return string(r.begin(), r.end());
+}
+
+// a mongrel2 request for the path with some headers.
+string message(const string &path, const string &extra_headers)
+{
+   string headers = "{\"PATH\":\"" + path + "\",\"host\":\"localhost\"";
+   if (!extra_headers.empty()) { headers += "," + extra_headers; }
+   headers += "}";
+   return (boost::format("MONGREL2 12 %1% %2%:%3%,0:,") % path % headers.size() % headers).str();
+}
+
 void assert_equal(const string &actual, const string &expected)
 {
    if (actual != expected)
@@ -54,9 +70,7 @@ void assert_equal(const string &actual, const string &expected)
    }
 }
 
-void test_escape_handling() 
-{
-   const string input = 
+const string escaped_input = 
       "MONGREL2 1208 /layer/search/sic:-541103,541105,581208%5Brgb(162,91,156):255:"
       "rgb(0,0,0):1:120:7%5D/tile 931:{\"PATH\":\"/layer/search/sic:-541103,541105,"
       "581208%5Brgb(162,91,156):255:rgb(0,0,0):1:120:7%5D/tile\",\"x-forwarded-for\""
@@ -72,6 +86,10 @@ void test_escape_handling()
       "541103,541105,581208%5Brgb(162,91,156):255:rgb(0,0,0):1:120:7%5D/tile?s=13&y="
       "3076&x=2411&p=sm\",\"QUERY\":\"s=13&y=3076&x=2411&p=sm\",\"PATTERN\":\"/layer"
       "/search\"},0:,";
+
+void test_escape_handling() 
+{
+   const string &input = escaped_input;
    
    rendermq::request_parser parser;
    rendermq::mongrel_request req;
@@ -103,6 +121,104 @@ void test_escape_handling()
                 "1; s_sess=%20s_cc%3Dtrue%3B%20s_sq%3D%3B");
 }
 
+/* check that the view parser gives the same results as the original
+ * parser, without copying anything out of the message.
+ */
+void test_view_escape_handling() 
+{
+   const string &input = escaped_input;
+   rendermq::request_view_parser parser;
+   mongrel_request_view req;
+
+   if (!parser(req, input.data(), input.data() + input.size()))
+   {
+      throw std::runtime_error("Expected request to parse OK, but didn't");
+   }
+
+   assert_equal(str(req.uuid), "MONGREL2");
+   assert_equal(str(req.id), "1208");
+   assert_equal(str(req.path), "/layer/search/sic:-541103,541105,581208%5B"
+                "rgb(162,91,156):255:rgb(0,0,0):1:120:7%5D/tile");
+   if (req.client_id != 1208 || req.is_tile || !req.body.empty())
+   {
+      throw std::runtime_error("Wrong client id, tile or body parsed from request.");
+   }
+
+   string value;
+   if (!req.header("QUERY", value)) 
+   {
+      throw std::runtime_error("Expected to find query header, but didn't");
+   }
+   assert_equal(value, "s=13&y=3076&x=2411&p=sm");
+   if (!req.header("cookie", value))
+   {
+      throw std::runtime_error("Expected to find cookie header, but didn't");
+   }
+   if (value.find("psession=\"ewSvbhLzV9Ysb+u/Msf1ymiW8GE=\";") == string::npos)
+   {
+      throw std::runtime_error("Escapes in cookie header weren't handled: " + value);
+   }
+   if (req.header("missing", value))
+   {
+      throw std::runtime_error("Shouldn't find a header which isn't there");
+   }
+}
+
+/* check that tile paths are parsed along with the request, and that
+ * repeated headers (which mongrel2 sends as arrays) don't stop it.
+ */
+void test_view_tile() 
+{
+   rendermq::request_view_parser parser;
+   mongrel_request_view req;
+
+   const string input = message("/tiles/1.0.0/vx/map/13/2353/3085.png/dirty", 
+                                "\"accept\":[\"a\", \"b\"]");
+   if (!parser(req, input.data(), input.data() + input.size()) || !req.is_tile)
+   {
+      throw std::runtime_error("Expected tile request to parse OK, but didn't");
+   }
+   const rendermq::tile_protocol expected(rendermq::cmdDirty, 2353, 3085, 13, 0, "vx/map", rendermq::fmtPNG);
+   if (req.tile != expected || req.tile.status != rendermq::cmdDirty)
+   {
+      throw std::runtime_error((boost::format("Expected tile %1% but got %2%.") % expected % req.tile).str());
+   }
+   string value;
+   if (!req.header("host", value) || value != "localhost")
+   {
+      throw std::runtime_error("Header after a repeated header wasn't found.");
+   }
+}
+
+/* check that malformed messages aren't accepted.
+ */
+void test_view_invalid() 
+{
+   rendermq::request_view_parser parser;
+   mongrel_request_view req;
+   const string path = "/tiles/1.0.0/map/0/0/0.png";
+   const string good = message(path, "");
+
+   vector<string> inputs;
+   inputs.push_back("");
+   inputs.push_back(good.substr(0, good.size() - 1));
+   inputs.push_back(good + " ");
+   inputs.push_back("MONGREL2 12x " + path + " 2:{},0:,");
+   inputs.push_back("MONGREL2 12 " + path + " 3:{},0:,");
+   inputs.push_back("MONGREL2 12 " + path + " 2:[],0:,");
+   inputs.push_back("MONGREL2 12 " + path + " 9:{\"a\":\"b},0:,");
+   inputs.push_back("MONGREL2 12 " + path + " 11:{\"a\":\"\\q\"},0:,");
+   inputs.push_back("MONGREL2 12 " + path + " 12:{\"a\":\"b\" \"c\"},0:,");
+
+   BOOST_FOREACH(const string &input, inputs)
+   {
+      if (parser(req, input.data(), input.data() + input.size()))
+      {
+         throw std::runtime_error("Expected `" + input + "' to be invalid, but it parsed.");
+      }
+   }
+}
+
 } // anonymous namespace
 
 int main() 
@@ -112,6 +228,9 @@ int main()
    cout << "== Testing Mongrel Request Parsing ==" << endl << endl;
    
    tests_failed += test::run("test_escape_handling", &test_escape_handling);
+   tests_failed += test::run("test_view_escape_handling", &test_view_escape_handling);
+   tests_failed += test::run("test_view_tile", &test_view_tile);
+   tests_failed += test::run("test_view_invalid", &test_view_invalid);
    //tests_failed += test::run("test_", &test_);
    
    cout << " >> Tests failed: " << tests_failed << endl << endl;
@@ -0,0 +1,179 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "mongrel_servers.hpp"
+#include "tile_protocol.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#include <cstring>
+
+using rendermq::mongrel_servers;
+using rendermq::tile_protocol;
+using boost::optional;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+namespace {
+
+mongrel_servers::range_type range(const char *s) {
+  return mongrel_servers::range_type(s, s + std::strlen(s));
+}
+
+}
+
+/* test that clients with the same connection id on different servers
+ * get different ids, and that each leads back to its own server.
+ */
+void test_route_to_server() {
+  mongrel_servers servers;
+
+  optional<int64_t> a = servers.client_id(range("server-a"), 5);
+  optional<int64_t> b = servers.client_id(range("server-b"), 5);
+  optional<int64_t> a2 = servers.client_id(range("server-a"), 6);
+  if (!a || !b || !a2) {
+    throw runtime_error("Clients should be given ids.");
+  }
+  if (*a == *b || servers.size() != 2) {
+    throw runtime_error("Same connection on different servers should have different ids.");
+  }
+  if (servers.uuid(*a) != "server-a" || servers.uuid(*b) != "server-b" || servers.uuid(*a2) != "server-a") {
+    throw runtime_error("Ids should lead back to the right server.");
+  }
+  if (servers.connection(*a) != 5 || servers.connection(*b) != 5 || servers.connection(*a2) != 6) {
+    throw runtime_error("Ids should lead back to the right connection.");
+  }
+}
+
+/* test that the ids of real clients are always positive, so they can't
+ * be confused with background renders, that any connection id can be
+ * routed, and that bad ids are caught.
+ */
+void test_ids() {
+  mongrel_servers servers;
+
+  optional<int64_t> zero = servers.client_id(range("server-a"), 0);
+  optional<int64_t> big = servers.client_id(range("server-a"), 0x7fffffffLL);
+  optional<int64_t> huge = servers.client_id(range("server-a"), 0x123456789LL);
+  if (!zero || *zero <= 0 || !big || *big <= 0 || !huge || *huge <= 0) {
+    throw runtime_error("Client ids should be positive.");
+  }
+  if (servers.connection(*big) != 0x7fffffffLL || servers.connection(*huge) != 0x123456789LL) {
+    throw runtime_error("Large connection ids should survive the round trip.");
+  }
+  if (!servers.known(*zero) || servers.known(-1) || servers.known(0) || servers.known(*huge + 1)) {
+    throw runtime_error("Only ids of waiting clients should be known.");
+  }
+
+  bool thrown = false;
+  try {
+    servers.uuid(*huge + 1);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  if (!thrown) {
+    throw runtime_error("Looking up an unknown id should throw.");
+  }
+}
+
+/* test that the ids of clients which have been answered are re-used,
+ * oldest first, so that the ids stay small however many requests come
+ * in, and that an answered client isn't known any more.
+ */
+void test_release() {
+  mongrel_servers servers;
+
+  optional<int64_t> a = servers.client_id(range("server-a"), 1);
+  optional<int64_t> b = servers.client_id(range("server-a"), 2);
+  servers.release(*a);
+  servers.release(*b);
+  servers.release(*b);
+  if (servers.known(*a) || servers.known(*b) || servers.waiting() != 0) {
+    throw runtime_error("Answered clients shouldn't be known.");
+  }
+
+  optional<int64_t> c = servers.client_id(range("server-b"), 3);
+  optional<int64_t> d = servers.client_id(range("server-a"), 4);
+  optional<int64_t> e = servers.client_id(range("server-a"), 5);
+  if (!c || !d || !e || *c != *a || *d != *b || servers.waiting() != 3) {
+    throw runtime_error("Ids should be re-used, oldest first.");
+  }
+  if (servers.uuid(*c) != "server-b" || servers.connection(*c) != 3) {
+    throw runtime_error("Re-used id should lead to the new client.");
+  }
+
+  for (int i = 0; i < 100000; ++i) {
+    optional<int64_t> id = servers.client_id(range("server-a"), 1000000 + i);
+    servers.release(*id);
+  }
+  servers.release(*c);
+  servers.release(*d);
+  servers.release(*e);
+  if (servers.waiting() != 0) {
+    throw runtime_error("All clients have been answered.");
+  }
+  optional<int64_t> f = servers.client_id(range("server-a"), 6);
+  if (!f || *f > 4) {
+    throw runtime_error("Ids shouldn't grow with the number of requests.");
+  }
+}
+
+/* test that the client id survives being sent through storage and the
+ * queue, which carry it as an int32.
+ */
+void test_serialise_round_trip() {
+  mongrel_servers servers;
+  servers.client_id(range("server-a"), 1);
+  optional<int64_t> id = servers.client_id(range("server-b"), 0x123456789LL);
+
+  tile_protocol tile(rendermq::cmdRender, 1, 2, 3, *id, "map", rendermq::fmtPNG);
+  string buf;
+  tile_protocol parsed;
+  if (!serialise(tile, buf) || !unserialise(buf, parsed)) {
+    throw runtime_error("Tile should serialise and parse back.");
+  }
+  if (parsed.id != *id || !servers.known(parsed.id) || 
+      servers.uuid(parsed.id) != "server-b" || servers.connection(parsed.id) != 0x123456789LL) {
+    throw runtime_error("Client id should lead back to its client after a round trip.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Mongrel Servers ==" << endl << endl;
+
+  tests_failed += test::run("test_route_to_server", &test_route_to_server);
+  tests_failed += test::run("test_ids", &test_ids);
+  tests_failed += test::run("test_release", &test_release);
+  tests_failed += test::run("test_serialise_round_trip", &test_serialise_round_trip);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "pending_renders.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <boost/property_tree/ini_parser.hpp>
+
+using rendermq::pending_renders;
+using rendermq::pending_render;
+using rendermq::render_timeouts;
+using rendermq::tile_protocol;
+using boost::optional;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+namespace pt = boost::property_tree;
+
+using rendermq::cmdRender;
+using rendermq::cmdNotDone;
+using rendermq::cmdIgnore;
+using rendermq::fmtPNG;
+
+namespace {
+
+tile_protocol request(int x, int y, int z, int64_t id, const string &style = "map") {
+  return tile_protocol(cmdRender, x, y, z, id, style, fmtPNG);
+}
+
+pt::ptree read_conf(const string &ini) {
+  std::istringstream in(ini);
+  pt::ptree conf;
+  pt::read_ini(in, conf);
+  return conf;
+}
+
+}
+
+/* test that the most specific timeout for the tile is used, and that
+ * the default is used for anything which isn't configured.
+ */
+void test_timeout_lookup() {
+  render_timeouts timeouts(read_conf(
+    "[render_timeout]\n"
+    "map = 20\n"
+    "map:18 = 5\n"
+    "*:18 = 10\n"
+    "*:17 = 0.5\n"), 30);
+
+  if (timeouts.timeout(request(0, 0, 12, 1)) != 20000) {
+    throw runtime_error("Style's timeout should apply at any zoom.");
+  }
+  if (timeouts.timeout(request(0, 0, 18, 1)) != 5000) {
+    throw runtime_error("Style and zoom timeout should take precedence.");
+  }
+  if (timeouts.timeout(request(0, 0, 18, 1, "hyb")) != 10000) {
+    throw runtime_error("Zoom timeout should apply to any style.");
+  }
+  if (timeouts.timeout(request(0, 0, 17, 1)) != 500) {
+    throw runtime_error("Zoom timeout should take precedence over the style's.");
+  }
+  if (timeouts.timeout(request(0, 0, 12, 1, "hyb")) != 30000) {
+    throw runtime_error("Default timeout should apply to anything else.");
+  }
+  if (render_timeouts(pt::ptree(), 2).timeout(request(0, 0, 18, 1)) != 2000) {
+    throw runtime_error("Default timeout should apply without a config section.");
+  }
+}
+
+/* test that bad timeouts are rejected when the config is read.
+ */
+void test_bad_timeouts() {
+  const char *bad[] = { "map = 0\n", "map = -1\n", "map:z18 = 5\n" };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+    bool thrown = false;
+    try {
+      render_timeouts timeouts(read_conf(string("[render_timeout]\n") + bad[i]), 30);
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    if (!thrown) {
+      throw runtime_error("Bad render timeout `" + string(bad[i]) + "' should have been rejected.");
+    }
+  }
+}
+
+/* test that requests are matched to results by client and tile, and
+ * that each is only given up once.
+ */
+void test_add_and_remove() {
+  pending_renders pending;
+
+  tile_protocol stale = request(1, 2, 10, 7);
+  stale.status = cmdIgnore;
+  stale.set_data("stale tile");
+  if (pending.add(pending_render(stale, 100, 5000))) {
+    throw runtime_error("First request shouldn't replace anything.");
+  }
+  pending.add(pending_render(request(1, 2, 10, 8), 101, 0));
+  if (pending.size() != 2) {
+    throw runtime_error("Requests from different clients should both be waiting.");
+  }
+
+  // the result is for the same tile, but from the queue.
+  tile_protocol result = request(1, 2, 10, 7);
+  result.status = rendermq::cmdDone;
+  optional<pending_render> waiting = pending.remove(result);
+  if (!waiting || waiting->timer != 100 || waiting->sent != 5000 || 
+      waiting->tile.data() != "stale tile") {
+    throw runtime_error("Result should have found the request with its timer, time and stale tile.");
+  }
+  if (pending.remove(result)) {
+    throw runtime_error("Request should only be removed once.");
+  }
+  if (pending.remove(request(1, 3, 10, 8)) || pending.remove(request(1, 2, 10, 9))) {
+    throw runtime_error("Results for other tiles or clients shouldn't match.");
+  }
+  if (pending.size() != 1) {
+    throw runtime_error("Other client's request should still be waiting.");
+  }
+}
+
+/* test that the same client asking for the same tile again replaces
+ * its earlier request, which is returned so its timer can be cancelled.
+ */
+void test_replace() {
+  pending_renders pending;
+
+  tile_protocol first = request(0, 0, 5, 3);
+  first.status = cmdNotDone;
+  pending.add(pending_render(first, 1, 0));
+  optional<pending_render> previous = pending.add(pending_render(request(0, 0, 5, 3), 2, 0));
+  if (!previous || previous->timer != 1) {
+    throw runtime_error("Earlier request should have been returned.");
+  }
+  optional<pending_render> waiting = pending.remove(request(0, 0, 5, 3));
+  if (!waiting || waiting->timer != 2 || pending.size() != 0) {
+    throw runtime_error("Only the later request should have been waiting.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Pending Renders ==" << endl << endl;
+
+  tests_failed += test::run("test_timeout_lookup", &test_timeout_lookup);
+  tests_failed += test::run("test_bad_timeouts", &test_bad_timeouts);
+  tests_failed += test::run("test_add_and_remove", &test_add_and_remove);
+  tests_failed += test::run("test_replace", &test_replace);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
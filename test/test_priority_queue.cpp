@@ -31,6 +31,7 @@
 #include <iterator>
 #include <set>
 #include <list>
+#include <map>
 #include <boost/function.hpp>
 #include <boost/format.hpp>
 #include <boost/foreach.hpp>
@@ -38,6 +39,9 @@
 using rendermq::task_queue;
 using rendermq::tile_protocol;
 using rendermq::task;
+using rendermq::scheduling_policy;
+using rendermq::aging_policy;
+using rendermq::deadline_policy;
 using boost::optional;
 using boost::function;
 using std::runtime_error;
@@ -54,7 +58,9 @@ using std::list;
 using rendermq::cmdIgnore;
 using rendermq::cmdDone;
 using rendermq::cmdRender;
+using rendermq::cmdDirty;
 using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
 
 namespace {
 /* utility method to check that the front item of a queue is as-expected.
@@ -62,7 +68,7 @@ namespace {
 void assert_pop(task_queue &q, const tile_protocol &t) {
   optional<const task &> tsk = q.front();
   if (!tsk) { throw runtime_error("Queue prematurely empty."); }
-  const tile_protocol &t2 = static_cast<const tile_protocol &>(tsk.get());
+  const tile_protocol t2 = q.tile(tsk.get());
   //cout << " >> Expecting: " << t << endl;
   //cout << " << Actual:    " << t2 << endl;
   if (!(t == t2)) { throw runtime_error("Job at front of queue is different from expected."); }
@@ -81,7 +87,7 @@ void assert_subscribers(task_queue &q, const tile_protocol &t, const set<string>
     throw runtime_error("Differing count of subscribers between expected and actual.");
   }
   for (task::iterator itr = subs.first; itr != subs.second; ++itr) {
-    if (s.count(itr->second) != 1) {
+    if (s.count(q.address(*itr)) != 1) {
       throw runtime_error("Subscriber count differs between expected and actual.");
     }
   }
@@ -214,20 +220,23 @@ void test_subscribers() {
 void test_resubmit()
 {
   task_queue q;
+  const std::time_t now = std::time(0);
 
   q.push(tile_protocol(cmdRender, 1, 1, 1, 0, "", fmtPNG), "A", 100);
   optional<const task &> tsk = q.front();
-  tile_protocol proto = static_cast<tile_protocol>(*tsk);
-  q.set_processed(proto);
+  tile_protocol proto = q.tile(*tsk);
+  q.set_processed(proto, "W", now + 1);
 
-  usleep(1500000);
+  if (q.resubmit_expired(now) != 0 || q.front()) {
+    throw runtime_error("Task resubmitted before its lease expired.");
+  }
 
-  q.resubmit_older_than(1);
+  q.resubmit_expired(now + 1);
   optional<const task &> tsk2 = q.front();
   if (!tsk2) { throw runtime_error("Task not resubmitted"); }
-  tile_protocol proto2 = static_cast<tile_protocol>(*tsk2);
+  tile_protocol proto2 = q.tile(*tsk2);
   if (proto != proto2) { throw runtime_error("Resubmitted task not equal to original task."); }
-  q.set_processed(proto2);
+  q.set_processed(proto2, "W", now + 2);
 
   proto.status = cmdDone;
   optional<const task &> tsk3 = q.get(proto);
@@ -269,12 +278,13 @@ void test_collision()
                   {
                      task_range range = collided_with.get().subscribers();
                      for (task_iterator itr = range.first; itr != range.second; ++itr) {
-                        LOG_DEBUG(boost::format("COLLIDE: %1%, addr=%2%") % itr->first % itr->second);
+                        LOG_DEBUG(boost::format("COLLIDE: %1%, addr=%2%") 
+                                  % q.subscriber_tile(collided_with.get(), *itr) % q.address(*itr));
                      }
 
                      throw std::runtime_error(
                         (boost::format("collision in task queue on tile %1% with %2%") 
-                         % t % collided_with.get()).str());
+                         % t % q.tile(collided_with.get())).str());
                   }
                   else
                   {
@@ -290,6 +300,7 @@ void test_collision()
 void test_front_processing()
 {
    task_queue q;
+   const std::time_t now = std::time(0);
    size_t count_gen = 0, count_proc = 0;
    int z = 18;
    const string style = "map";
@@ -309,8 +320,8 @@ void test_front_processing()
    while (true) {
       boost::optional<const task &> t = q.front();
       if (t) {
-         tile_protocol proto = static_cast<tile_protocol>(*t);
-         q.set_processed(proto);
+         tile_protocol proto = q.tile(*t);
+         q.set_processed(proto, "W", now + 300);
          count_proc += 64;
 
       } else {
@@ -322,8 +333,620 @@ void test_front_processing()
       throw std::runtime_error((boost::format("Difference between number generated (%1%) and number processed (%2%) - error in queue logic!") % count_gen % count_proc).str());
    }
 }
+
+/* test that tasks with leases which expire later, as for the later
+ * tasks in a batch, aren't resubmitted until their own lease expires.
+ */
+void test_deferred_lease()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+
+   q.push(tile_protocol(cmdRender, 0, 0, 10, 0, "map", fmtPNG), "A", 100);
+   q.push(tile_protocol(cmdRender, 8, 0, 10, 0, "map", fmtPNG), "A", 100);
+   q.set_processed(tile_protocol(cmdRender, 0, 0, 10, 0, "map", fmtPNG), "W", now + 5);
+   q.set_processed(tile_protocol(cmdRender, 8, 0, 10, 0, "map", fmtPNG), "W", now + 10);
+
+   if (q.resubmit_expired(now + 5) != 1 || q.count_unprocessed() != 1) {
+      throw runtime_error("Only the expired lease should have been resubmitted.");
+   }
+   optional<const task &> tsk = q.front();
+   if (!tsk || tsk->x() != 0) {
+      throw runtime_error("Wrong task resubmitted.");
+   }
+}
+
+/* test that the per-priority counts of unprocessed tasks track the
+ * pushes, merges, processing and resubmission of tasks.
+ */
+void test_unprocessed_counts()
+{
+   task_queue q;
+   const string style = "map";
+
+   q.push(tile_protocol(cmdRender, 0, 0, 10, 0, style, fmtPNG), "A", 50);
+   q.push(tile_protocol(cmdRender, 8, 0, 10, 0, style, fmtPNG), "A", 50);
+   q.push(tile_protocol(cmdRender, 0, 8, 10, 0, style, fmtPNG), "A", 100);
+
+   if (q.count_unprocessed(50) != 2 || q.count_unprocessed(100) != 1) {
+      throw runtime_error("Wrong per-priority counts after pushing.");
+   }
+
+   // merging a higher priority request should move the task between
+   // the priority buckets.
+   q.push(tile_protocol(cmdRender, 1, 1, 10, 0, style, fmtPNG), "B", 100);
+   if (q.count_unprocessed(50) != 1 || q.count_unprocessed(100) != 2) {
+      throw runtime_error("Wrong per-priority counts after merging.");
+   }
+
+   // processed tasks shouldn't be counted, and shouldn't be at the
+   // front of the queue.
+   const std::time_t now = std::time(0);
+   q.set_processed(tile_protocol(cmdRender, 0, 0, 10, 0, style, fmtPNG), "W", now + 10);
+   q.set_processed(tile_protocol(cmdRender, 0, 8, 10, 0, style, fmtPNG), "W", now + 10);
+   if (q.count_unprocessed(100) != 0 || q.count_unprocessed() != 1 || q.size() != 3) {
+      throw runtime_error("Processed tasks shouldn't be counted as unprocessed.");
+   }
+   if (q.unprocessed_priority_counts().size() != 1) {
+      throw runtime_error("Empty priority buckets should be removed.");
+   }
+   optional<const task &> tsk = q.front();
+   if (!tsk || tsk->x() != 8 || tsk->y() != 0) {
+      throw runtime_error("Front of queue should skip processed tasks.");
+   }
+
+   // requests for tasks which are being processed are merged with
+   // them, and not counted.
+   if (q.push(tile_protocol(cmdRender, 2, 2, 10, 0, style, fmtPNG), "C", 150)) {
+      throw runtime_error("Request for processed task should be merged.");
+   }
+   if (q.count_unprocessed(150) != 0 || q.count_unprocessed() != 1) {
+      throw runtime_error("Merging into processed task shouldn't change counts.");
+   }
+
+   // resubmitted tasks are counted again, at their merged priority.
+   q.resubmit_expired(now + 10);
+   if (q.count_unprocessed(150) != 1 || q.count_unprocessed(100) != 1 ||
+       q.count_unprocessed(50) != 1 || q.count_unprocessed() != 3) {
+      throw runtime_error("Wrong per-priority counts after resubmitting.");
+   }
+   // the subscribers should have survived the moves between processed
+   // and unprocessed.
+   set<string> subs;
+   subs.insert("A"); subs.insert("B"); subs.insert("C");
+   assert_subscribers(q, tile_protocol(cmdRender, 0, 0, 10, 0, style, fmtPNG), subs);
+
+   q.erase(tile_protocol(cmdRender, 8, 0, 10, 0, style, fmtPNG));
+   if (q.count_unprocessed(50) != 0 || q.count_unprocessed() != 1 || q.size() != 1) {
+      throw runtime_error("Wrong per-priority counts after erasing.");
+   }
+
+   q.clear();
+   if (q.size() != 0 || !q.unprocessed_priority_counts().empty()) {
+      throw runtime_error("Queue should now be empty.");
+   }
+}
+
+/* test that a worker can renew the leases it holds, but not anyone
+ * else's, and that renewed leases don't expire at the old time.
+ */
+void test_lease_renewal()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+   const tile_protocol tile(cmdRender, 0, 0, 10, 0, "map", fmtPNG);
+
+   q.push(tile, "A", 100);
+   q.set_processed(tile, "W1", now + 10);
+
+   if (q.renew(tile, "W2", now + 100)) {
+      throw runtime_error("Worker shouldn't be able to renew another worker's lease.");
+   }
+   if (!q.renew(tile, "W1", now + 30)) {
+      throw runtime_error("Worker should be able to renew its own lease.");
+   }
+   if (q.resubmit_expired(now + 10) != 0 || q.count_unprocessed() != 0) {
+      throw runtime_error("Renewed lease shouldn't expire at the old time.");
+   }
+   if (q.resubmit_expired(now + 30) != 1 || q.count_unprocessed() != 1) {
+      throw runtime_error("Renewed lease should expire at the new time.");
+   }
+
+   // once the task has been resubmitted, the old lease can't be renewed.
+   if (q.renew(tile, "W1", now + 60)) {
+      throw runtime_error("Expired lease shouldn't be renewable.");
+   }
+   q.set_processed(tile, "W2", now + 60);
+   if (q.renew(tile, "W1", now + 90)) {
+      throw runtime_error("Lease now belongs to a different worker.");
+   }
+}
+
+/* test that releasing a worker's leases makes all its tasks, and only
+ * its tasks, available again straight away.
+ */
+void test_release_worker()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+   const string style = "map";
+
+   for (int x = 0; x < 32; x += 8) {
+      q.push(tile_protocol(cmdRender, x, 0, 10, 0, style, fmtPNG), "A", 100);
+   }
+   q.set_processed(tile_protocol(cmdRender, 0, 0, 10, 0, style, fmtPNG), "W1", now + 10);
+   q.set_processed(tile_protocol(cmdRender, 8, 0, 10, 0, style, fmtPNG), "W2", now + 10);
+   q.set_processed(tile_protocol(cmdRender, 16, 0, 10, 0, style, fmtPNG), "W1", now + 300);
+
+   if (q.release("W1") != 2) {
+      throw runtime_error("Should have released both of the worker's tasks.");
+   }
+   if (q.count_unprocessed() != 3 || q.count_unprocessed(100) != 3 || q.size() != 4) {
+      throw runtime_error("Released tasks should be available again.");
+   }
+   if (q.release("W1") != 0) {
+      throw runtime_error("Worker shouldn't have any tasks left to release.");
+   }
+   if (!q.renew(tile_protocol(cmdRender, 8, 0, 10, 0, style, fmtPNG), "W2", now + 20)) {
+      throw runtime_error("Other worker's lease should be untouched.");
+   }
+}
+
+/* test that with priority aging, a low priority task which has waited
+ * long enough goes ahead of newer high priority tasks.
+ */
+void test_aging_policy()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+   const string style = "map";
+
+   q.set_scheduling_policy(boost::shared_ptr<const scheduling_policy>(new aging_policy(1.0)));
+   q.push(tile_protocol(cmdRender, 0, 0, 10, 0, style, fmtPNG), "A", 0, now);
+   q.push(tile_protocol(cmdRender, 8, 0, 10, 0, style, fmtPNG), "A", 0, now + 1);
+   q.push(tile_protocol(cmdRender, 16, 0, 10, 0, style, fmtPNG), "A", 100, now + 50);
+
+   // the low priority tasks haven't waited long enough yet.
+   optional<const task &> tsk = q.front(now + 50);
+   if (!tsk || tsk->x() != 16) {
+      throw runtime_error("High priority task should go first.");
+   }
+   q.set_processed(tile_protocol(cmdRender, 16, 0, 10, 0, style, fmtPNG), "W", now + 80);
+
+   // but they have now, compared to this one.
+   q.push(tile_protocol(cmdRender, 24, 0, 10, 0, style, fmtPNG), "A", 100, now + 150);
+   tsk = q.front(now + 150);
+   if (!tsk || tsk->x() != 0) {
+      throw runtime_error("Oldest low priority task should go first once it has aged.");
+   }
+
+   // without a policy, it's strict priority order again.
+   q.set_scheduling_policy(boost::shared_ptr<const scheduling_policy>());
+   tsk = q.front(now + 150);
+   if (!tsk || tsk->x() != 24) {
+      throw runtime_error("High priority task should go first without a policy.");
+   }
+}
+
+/* test that a task which goes back to the queue, because its lease ran
+ * out or was released, keeps the time it was first queued, so it isn't
+ * put behind tasks which were queued after it.
+ */
+void test_requeue_keeps_age()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+   const string style = "map";
+   tile_protocol t0(cmdRender, 0, 0, 10, 0, style, fmtPNG);
+   tile_protocol t1(cmdRender, 8, 0, 10, 0, style, fmtPNG);
+
+   q.set_scheduling_policy(boost::shared_ptr<const scheduling_policy>(new aging_policy(1.0)));
+   q.push(t0, "A", 0, now);
+   q.set_processed(t0, "W", now + 5);
+   q.push(t1, "A", 0, now + 10);
+
+   q.resubmit_expired(now + 20);
+   optional<const task &> tsk = q.front(now + 20);
+   if (!tsk || tsk->x() != 0 || tsk->timestamp() != now) {
+      throw runtime_error("Resubmitted task should keep the time it was queued.");
+   }
+
+   q.set_processed(t0, "W", now + 60);
+   q.release("W");
+   tsk = q.front(now + 20);
+   if (!tsk || tsk->x() != 0 || tsk->timestamp() != now) {
+      throw runtime_error("Released task should keep the time it was queued.");
+   }
+}
+
+/* test that with earliest deadline first, the task whose deadline is
+ * soonest goes first, whatever its priority.
+ */
+void test_deadline_policy()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+   const string style = "map";
+
+   std::map<int, int> deadlines;
+   deadlines[0] = 3600;
+   deadlines[100] = 30;
+   q.set_scheduling_policy(boost::shared_ptr<const scheduling_policy>(new deadline_policy(deadlines, 600)));
+
+   q.push(tile_protocol(cmdRender, 0, 0, 10, 0, style, fmtPNG), "A", 0);
+   q.push(tile_protocol(cmdRender, 8, 0, 10, 0, style, fmtPNG), "A", 50);
+   q.push(tile_protocol(cmdRender, 16, 0, 10, 0, style, fmtPNG), "A", 100);
+
+   // render is due first, then dirty (on the default) and then bulk.
+   const int expected[] = { 16, 8, 0 };
+   for (int i = 0; i < 3; ++i) {
+      optional<const task &> tsk = q.front(now);
+      if (!tsk || tsk->x() != expected[i]) {
+         throw runtime_error("Tasks should be handed out in deadline order.");
+      }
+      tile_protocol proto = q.tile(*tsk);
+      q.set_processed(proto, "W", now + 30);
+   }
+   if (q.front(now)) {
+      throw runtime_error("All the tasks should have been handed out.");
+   }
+}
       
    
+/* test that a worker is given a task near its last one, of the same
+ * priority as the front of the queue, when there is one.
+ */
+void test_locality()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+   const string style = "map";
+   q.set_locality_radius(2);
+
+   // queued in order of age, so the far one is at the front.
+   q.push(tile_protocol(cmdRender, 800, 800, 10, 0, style, fmtPNG), "A", 0, now - 3);
+   q.push(tile_protocol(cmdRender, 16, 8, 10, 0, style, fmtPNG), "A", 0, now - 2);
+   q.push(tile_protocol(cmdRender, 8, 8, 11, 0, style, fmtPNG), "A", 0, now - 1);
+   q.push(tile_protocol(cmdRender, 8, 0, 10, 0, style, fmtPNG), "A", 0, now);
+
+   const tile_protocol last(cmdRender, 3, 5, 10, 0, style, fmtPNG);
+   optional<const task &> tsk = q.front(now, last);
+   if (!tsk || tsk->x() != 8 || tsk->y() != 0 || tsk->z() != 10) {
+      throw runtime_error("Expected the task next to the worker's last one.");
+   }
+   tile_protocol proto = q.tile(*tsk);
+   q.set_processed(proto, "W", now + 30);
+
+   tsk = q.front(now, last);
+   if (!tsk || tsk->x() != 16 || tsk->y() != 8 || tsk->z() != 10) {
+      throw runtime_error("Expected the next nearest task within the radius.");
+   }
+   proto = q.tile(*tsk);
+   q.set_processed(proto, "W", now + 30);
+
+   // nothing else nearby at this zoom, so the oldest task goes next.
+   tsk = q.front(now, last);
+   if (!tsk || tsk->x() != 800) {
+      throw runtime_error("Expected the front of the queue when nothing is near.");
+   }
+
+   // higher priority tasks still come first, however far away.
+   q.push(tile_protocol(cmdRender, 4000, 4000, 10, 0, style, fmtPNG), "A", 100, now);
+   tsk = q.front(now, last);
+   if (!tsk || tsk->x() != 4000) {
+      throw runtime_error("Locality shouldn't override priority.");
+   }
+
+   q.set_locality_radius(0);
+   q.push(tile_protocol(cmdRender, 0, 0, 10, 0, style, fmtPNG), "A", 100, now);
+   tsk = q.front(now, last);
+   if (!tsk || tsk->x() != 4000) {
+      throw runtime_error("Locality radius of zero should turn locality off.");
+   }
+}
+
+/* test that the tasks at a priority are shared out between the styles
+ * in proportion to their weights, however many of each are queued.
+ */
+void test_style_fair_share()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+
+   std::map<string, double> weights;
+   weights["map"] = 3.0;
+   q.set_style_weights(weights);
+
+   // the "map" tasks are all older, so would all go first without the
+   // weights. "hyb" has the default weight of 1.
+   for (int i = 0; i < 40; ++i) {
+      q.push(tile_protocol(cmdRender, i * 8, 0, 10, 0, "map", fmtPNG), "A", 0, now - 1);
+   }
+   for (int i = 0; i < 40; ++i) {
+      q.push(tile_protocol(cmdRender, i * 8, 0, 10, 0, "hyb", fmtPNG), "A", 0, now);
+   }
+   // a higher priority task still goes first, whatever its style.
+   q.push(tile_protocol(cmdRender, 0, 8, 10, 0, "hyb", fmtPNG), "A", 100, now);
+
+   std::map<string, int> handed_out;
+   for (int i = 0; i < 41; ++i) {
+      optional<const task &> tsk = q.front(now);
+      if (!tsk) { throw runtime_error("Expected a task."); }
+      if (i == 0 && tsk->priority() != 100) {
+         throw runtime_error("Weights shouldn't override priority.");
+      }
+      if (i > 0) { ++handed_out[q.tile(*tsk).style]; }
+      tile_protocol proto = q.tile(*tsk);
+      q.set_processed(proto, "W", now + 30);
+   }
+   if (handed_out["map"] != 30 || handed_out["hyb"] != 10) {
+      throw runtime_error((boost::format("Expected tasks to be shared 3:1 between the styles, but got %1%:%2%.") 
+                           % handed_out["map"] % handed_out["hyb"]).str());
+   }
+}
+
+/* test the counts of queued, in-flight and completed tasks by style.
+ */
+void test_style_counts()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+
+   tile_protocol t0(cmdRender, 0, 0, 10, 0, "map", fmtPNG);
+   tile_protocol t1(cmdRender, 8, 0, 10, 0, "map", fmtPNG);
+   tile_protocol t2(cmdRender, 0, 0, 10, 0, "hyb", fmtPNG);
+   q.push(t0, "A", 0, now);
+   q.push(t1, "A", 0, now);
+   q.push(t1, "B", 0, now);
+   q.push(t2, "A", 0, now);
+   q.set_processed(t0, "W", now + 30);
+   q.set_processed(t2, "W", now + 30);
+   q.erase(t0);
+   q.release("W");
+
+   const std::map<string, rendermq::style_counts> &counts = q.counts_by_style();
+   std::map<string, rendermq::style_counts>::const_iterator map = counts.find("map");
+   std::map<string, rendermq::style_counts>::const_iterator hyb = counts.find("hyb");
+   if (map == counts.end() || hyb == counts.end()) {
+      throw runtime_error("Expected counts for both styles.");
+   }
+   if (map->second.queued != 1 || map->second.in_flight != 0 || map->second.completed != 1) {
+      throw runtime_error("Wrong counts for the \"map\" style.");
+   }
+   if (hyb->second.queued != 1 || hyb->second.in_flight != 0 || hyb->second.completed != 0) {
+      throw runtime_error("Wrong counts for the \"hyb\" style.");
+   }
+}
+
+/* test that the tiles which come back out of the queue's compact tasks
+ * are the ones which went in, right up to the deepest zoom levels.
+ */
+void test_compact_task()
+{
+   task_queue q;
+   const int z = 30, max = (1 << z) - 1;
+   tile_protocol t1(cmdRender, max, max - 9, z, 1234, "map", fmtPNG, 0, 1300000000);
+   tile_protocol t2(cmdDirty, max - 1, max - 15, z, 5678, "map", fmtJPEG);
+   q.push(t1, "A", 100);
+   q.push(t2, "B", 50);
+
+   optional<const task &> tsk = q.get(t1);
+   if (!tsk) { throw runtime_error("Expected to find the task."); }
+
+   const tile_protocol job = q.tile(*tsk);
+   if (job.x != (max & ~7) || job.y != ((max - 9) & ~7) || job.z != z || job.style != "map" ||
+       job.status != cmdRender || job.format != (fmtPNG | fmtJPEG) || job.id != 1234 || 
+       job.request_last_modified != 1300000000) {
+      throw runtime_error((boost::format("Wrong job for the task: %1%") % job).str());
+   }
+
+   pair<task::iterator, task::iterator> subs = tsk->subscribers();
+   if (distance(subs.first, subs.second) != 2) { throw runtime_error("Expected two subscribers."); }
+   const tile_protocol s1 = q.subscriber_tile(*tsk, *subs.first);
+   const tile_protocol s2 = q.subscriber_tile(*tsk, *(subs.first + 1));
+   if (s1 != t1 || s1.status != cmdRender || s1.request_last_modified != 1300000000 || 
+       q.address(*subs.first) != "A") {
+      throw runtime_error("First subscriber should have the first request's tile.");
+   }
+   if (s2 != t2 || s2.status != cmdDirty || q.address(*(subs.first + 1)) != "B") {
+      throw runtime_error("Second subscriber should have the second request's tile.");
+   }
+}
+
+/* test that the queue knows which metatiles it has tasks for, whether
+ * or not they've been handed out.
+ */
+void test_contains()
+{
+   task_queue q;
+   tile_protocol t1(cmdRender, 8, 8, 10, 0, "map", fmtPNG);
+   tile_protocol t2(cmdRender, 16, 8, 10, 0, "map", fmtPNG);
+   q.push(t1, "A", 100);
+   q.push(t2, "A", 100);
+   q.set_processed(t2, "worker", std::time(0) + 30);
+
+   if (!q.contains(tile_protocol(cmdRender, 13, 11, 10, 0, "map", fmtPNG))) {
+      throw runtime_error("Queue should contain the unprocessed metatile.");
+   }
+   if (!q.contains(t2)) {
+      throw runtime_error("Queue should contain the processed metatile.");
+   }
+   if (q.contains(tile_protocol(cmdRender, 8, 8, 11, 0, "map", fmtPNG)) ||
+       q.contains(tile_protocol(cmdRender, 8, 8, 10, 0, "other", fmtPNG))) {
+      throw runtime_error("Queue shouldn't contain other metatiles or styles.");
+   }
+}
+
+/* test that the next lease expiry is the earliest of the leases on
+ * tasks being processed.
+ */
+void test_next_lease_expiry()
+{
+   task_queue q;
+   tile_protocol t1(cmdRender, 8, 8, 10, 0, "map", fmtPNG);
+   tile_protocol t2(cmdRender, 16, 8, 10, 0, "map", fmtPNG);
+   q.push(t1, "A", 100);
+   q.push(t2, "A", 100);
+
+   if (q.next_lease_expiry()) {
+      throw runtime_error("Queue with nothing being processed shouldn't have a lease expiry.");
+   }
+
+   q.set_processed(t1, "worker", 1060);
+   q.set_processed(t2, "worker", 1030);
+   if (q.next_lease_expiry() != std::time_t(1030)) {
+      throw runtime_error("Next lease expiry should be the earliest lease.");
+   }
+
+   q.erase(t2);
+   if (q.next_lease_expiry() != std::time_t(1060)) {
+      throw runtime_error("Next lease expiry should move on when the task is finished.");
+   }
+}
+
+/* test that, with a cost model, the cheapest of the tasks queued in the
+ * same second goes first, but not ahead of older tasks or ones with a 
+ * higher priority.
+ */
+void test_cheapest_first()
+{
+   boost::shared_ptr<rendermq::render_cost_model> model(new rendermq::render_cost_model(1000.0, 0.5));
+   model->record("map", 12, 5000.0);
+   model->record("map", 15, 200.0);
+   model->record("map", 18, 50.0);
+
+   task_queue q;
+   q.set_cost_model(model);
+   q.set_cheapest_first(100, 8);
+
+   tile_protocol old12(cmdRender, 0, 0, 12, 0, "map", fmtPNG);
+   tile_protocol new12(cmdRender, 8, 0, 12, 0, "map", fmtPNG);
+   tile_protocol new15(cmdRender, 0, 0, 15, 0, "map", fmtPNG);
+   tile_protocol new18(cmdRender, 0, 0, 18, 0, "map", fmtPNG);
+   tile_protocol bulk12(cmdRender, 16, 0, 12, 0, "map", fmtPNG);
+   tile_protocol bulk18(cmdRender, 8, 0, 18, 0, "map", fmtPNG);
+
+   q.push(old12, "A", 100, 1000);
+   q.push(new12, "A", 100, 1001);
+   q.push(new15, "A", 100, 1001);
+   q.push(new18, "A", 100, 1001);
+   q.push(bulk12, "A", 0, 1001);
+   q.push(bulk18, "A", 0, 1001);
+
+   // older tasks still go first, then the cheapest of the same second.
+   assert_pop(q, old12);
+   assert_pop(q, new18);
+   assert_pop(q, new15);
+   assert_pop(q, new12);
+
+   // below the minimum priority, the order is unchanged.
+   assert_pop(q, bulk12);
+   assert_pop(q, bulk18);
+}
+
+/* test that the expected cost of the queue follows the tasks waiting
+ * in it, and the estimates.
+ */
+void test_expected_cost()
+{
+   boost::shared_ptr<rendermq::render_cost_model> model(new rendermq::render_cost_model(1000.0, 0.5));
+   task_queue q;
+
+   tile_protocol t1(cmdRender, 0, 0, 12, 0, "map", fmtPNG);
+   tile_protocol t2(cmdRender, 8, 0, 12, 0, "map", fmtPNG);
+   tile_protocol t3(cmdRender, 0, 0, 18, 0, "map", fmtPNG);
+   q.push(t1, "A", 100);
+   q.push(t2, "A", 100);
+   q.push(t3, "A", 0);
+
+   if (q.expected_cost() != 0.0) {
+      throw runtime_error("Queue without a cost model shouldn't have an expected cost.");
+   }
+
+   // nothing known yet, so all are at the default.
+   q.set_cost_model(model);
+   if (q.expected_cost() != 3000.0) {
+      throw runtime_error("Expected tasks to cost the default.");
+   }
+
+   model->record("map", 12, 400.0);
+   model->record("map", 18, 100.0);
+   if (q.expected_cost() != 900.0) {
+      throw runtime_error("Expected cost should follow the estimates.");
+   }
+
+   // in-flight tasks don't count, until they're made available again.
+   q.set_processed(t1, "worker", 1030);
+   if (q.expected_cost() != 500.0) {
+      throw runtime_error("Task being processed shouldn't count.");
+   }
+   q.resubmit_expired(1030);
+   q.erase(t3);
+   if (q.expected_cost() != 800.0) {
+      throw runtime_error("Expected cost should follow tasks being resubmitted and erased.");
+   }
+
+   q.clear();
+   if (q.expected_cost() != 0.0) {
+      throw runtime_error("Empty queue should have no expected cost.");
+   }
+}
+
+/* test that a worker which can only render some styles is only given
+ * tasks of those styles, in the order it would otherwise get them.
+ */
+void test_worker_styles()
+{
+   task_queue q;
+   const std::time_t now = std::time(0);
+
+   q.push(tile_protocol(cmdRender, 0, 0, 10, 0, "aerial", fmtPNG), "A", 100, now - 2);
+   q.push(tile_protocol(cmdRender, 8, 0, 10, 0, "map", fmtPNG), "A", 50, now - 2);
+   q.push(tile_protocol(cmdRender, 16, 0, 10, 0, "terrain", fmtPNG), "A", 50, now - 1);
+   q.push(tile_protocol(cmdRender, 24, 0, 10, 0, "map", fmtPNG), "A", 0, now - 3);
+
+   rendermq::style_set map_only, map_or_terrain, unknown;
+   map_only.insert("map");
+   map_or_terrain.insert("terrain");
+   map_or_terrain.insert("map");
+   unknown.insert("hyb");
+
+   optional<const task &> tsk = q.front(now, map_only);
+   if (!tsk || q.tile(*tsk).style != "map" || tsk->priority() != 50) {
+      throw runtime_error("Expected the highest priority task of the worker's style.");
+   }
+   tsk = q.front(now, map_or_terrain);
+   if (!tsk || q.tile(*tsk).x != 8) {
+      throw runtime_error("Expected the oldest task of the worker's styles at the highest priority.");
+   }
+   if (q.front(now, unknown)) {
+      throw runtime_error("Worker shouldn't be given a style it can't render.");
+   }
+   tsk = q.front(now, rendermq::style_set());
+   if (!tsk || q.tile(*tsk).style != "aerial") {
+      throw runtime_error("Worker without a list of styles should be given any task.");
+   }
+
+   // a worker's last style is only preferred if it can still render it.
+   tile_protocol last(cmdRender, 0, 0, 10, 0, "aerial", fmtPNG);
+   q.set_locality_radius(4);
+   tsk = q.front(now, last, map_only);
+   if (!tsk || q.tile(*tsk).style != "map") {
+      throw runtime_error("Worker shouldn't be given a nearby task of a style it can't render.");
+   }
+
+   // the lower priority tasks come through as the others go.
+   q.set_processed(tile_protocol(cmdRender, 8, 0, 10, 0, "map", fmtPNG), "W", now + 30);
+   tsk = q.front(now, map_only);
+   if (!tsk || q.tile(*tsk).x != 24) {
+      throw runtime_error("Expected the remaining task of the worker's style.");
+   }
+   q.set_processed(q.tile(*tsk), "W", now + 30);
+   if (q.front(now, map_only)) {
+      throw runtime_error("Worker's styles have no more tasks.");
+   }
+}
+
 int main() {
   int tests_failed = 0;
 
@@ -336,6 +959,22 @@ int main() {
   tests_failed += test::run("test_resubmit", &test_resubmit);
   tests_failed += test::run("test_collision", &test_collision);
   tests_failed += test::run("test_front_processing", &test_front_processing);
+  tests_failed += test::run("test_unprocessed_counts", &test_unprocessed_counts);
+  tests_failed += test::run("test_deferred_lease", &test_deferred_lease);
+  tests_failed += test::run("test_lease_renewal", &test_lease_renewal);
+  tests_failed += test::run("test_release_worker", &test_release_worker);
+  tests_failed += test::run("test_aging_policy", &test_aging_policy);
+  tests_failed += test::run("test_deadline_policy", &test_deadline_policy);
+  tests_failed += test::run("test_requeue_keeps_age", &test_requeue_keeps_age);
+  tests_failed += test::run("test_locality", &test_locality);
+  tests_failed += test::run("test_style_fair_share", &test_style_fair_share);
+  tests_failed += test::run("test_style_counts", &test_style_counts);
+  tests_failed += test::run("test_compact_task", &test_compact_task);
+  tests_failed += test::run("test_contains", &test_contains);
+  tests_failed += test::run("test_next_lease_expiry", &test_next_lease_expiry);
+  tests_failed += test::run("test_cheapest_first", &test_cheapest_first);
+  tests_failed += test::run("test_expected_cost", &test_expected_cost);
+  tests_failed += test::run("test_worker_styles", &test_worker_styles);
 
   cout << " >> Tests failed: " << tests_failed << endl << endl;
 
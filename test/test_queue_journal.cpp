@@ -0,0 +1,377 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "queue_journal.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+using rendermq::queue_journal;
+using rendermq::task_queue;
+using rendermq::task;
+using rendermq::tile_protocol;
+using boost::optional;
+using boost::shared_ptr;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::cmdRender;
+using rendermq::cmdRenderBulk;
+using rendermq::cmdDirty;
+using rendermq::fmtPNG;
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+/* a temporary directory for the journal, removed again afterwards.
+ */
+class tmp_dir
+{
+public:
+  tmp_dir() : m_dir(fs::path("/tmp") / fs::unique_path()) {}
+  ~tmp_dir() { fs::remove_all(m_dir); }
+  const fs::path &dir() const { return m_dir; }
+
+private:
+  fs::path m_dir;
+};
+
+// open the journal in the directory, rebuilding the queue from it and
+// then journalling any further changes to the queue.
+shared_ptr<queue_journal> open(const tmp_dir &tmp, task_queue &q, int commit_interval = 1000) {
+  shared_ptr<queue_journal> journal(new queue_journal(tmp.dir().string(), commit_interval));
+  journal->recover(q);
+  journal->snapshot(q);
+  q.set_listener(journal);
+  return journal;
+}
+
+tile_protocol request(int x, int y, rendermq::protoCmd cmd = cmdRender) {
+  return tile_protocol(cmd, x, y, 12, x + y, "map", fmtPNG);
+}
+
+// check that two queues have the same tasks, in the same states.
+void expect_same(const task_queue &a, const task_queue &b) {
+  if (a.size() != b.size() || a.count_unprocessed() != b.count_unprocessed()) {
+    throw runtime_error("Recovered queue has a different number of tasks.");
+  }
+  if (a.count_unprocessed(0) != b.count_unprocessed(0) || a.count_unprocessed(100) != b.count_unprocessed(100)) {
+    throw runtime_error("Recovered queue has tasks at different priorities.");
+  }
+
+  optional<const task &> fa = a.front(), fb = b.front();
+  if (bool(fa) != bool(fb) || (fa && (a.tile(*fa) != b.tile(*fb)))) {
+    throw runtime_error("Recovered queue has a different front.");
+  }
+}
+
+}
+
+/* test that pushes, hand outs and erases are all replayed.
+ */
+void test_replay() {
+  tmp_dir tmp;
+  task_queue original;
+  {
+    shared_ptr<queue_journal> journal = open(tmp, original);
+    original.push(request(0, 0), "handler-a", 100);
+    original.push(request(3, 3), "handler-b", 100);
+    original.push(request(8, 0, cmdRenderBulk), "handler-a", 0);
+    original.push(request(16, 0, cmdDirty), "handler-b", 50);
+    original.push(request(24, 0), "handler-a", 100);
+    original.set_processed(request(8, 0), "worker", 2000000000);
+    original.erase(request(24, 0));
+    original.set_listener(shared_ptr<queue_journal>());
+  }
+
+  task_queue recovered;
+  shared_ptr<queue_journal> journal = open(tmp, recovered);
+  expect_same(original, recovered);
+
+  optional<const task &> t = recovered.get(request(0, 0));
+  if (!t || std::distance(t->subscribers().first, t->subscribers().second) != 2) {
+    throw runtime_error("Merged task should have both subscribers.");
+  }
+  t = recovered.get(request(8, 0));
+  if (!t || !t->processed() || recovered.worker(*t) != "worker" || t->lease_expiry() != 2000000000) {
+    throw runtime_error("Processed task should still be leased to the worker.");
+  }
+  if (recovered.get(request(24, 0))) {
+    throw runtime_error("Erased task shouldn't be recovered.");
+  }
+}
+
+/* test that tasks going back to the queue, because their leases ran
+ * out or were released, are replayed, as are the bulk tasks which are
+ * dropped when their leases run out.
+ */
+void test_requeue() {
+  tmp_dir tmp;
+  task_queue original;
+  {
+    shared_ptr<queue_journal> journal = open(tmp, original);
+    original.push(request(0, 0), "handler", 100);
+    original.push(request(8, 0, cmdRenderBulk), "handler", 0);
+    original.push(request(16, 0), "handler", 100);
+    original.push(request(24, 0), "handler", 100);
+    original.set_processed(request(0, 0), "worker-a", 1000);
+    original.set_processed(request(8, 0), "worker-a", 1000);
+    original.set_processed(request(16, 0), "worker-b", 2000000000);
+    original.set_processed(request(24, 0), "worker-a", 2000000000);
+    original.resubmit_expired(1000);
+    original.release("worker-b");
+    original.set_listener(shared_ptr<queue_journal>());
+  }
+
+  task_queue recovered;
+  shared_ptr<queue_journal> journal = open(tmp, recovered);
+  expect_same(original, recovered);
+
+  optional<const task &> t = recovered.get(request(0, 0));
+  if (!t || t->processed()) {
+    throw runtime_error("Task whose lease ran out should be back on the queue.");
+  }
+  t = recovered.get(request(16, 0));
+  if (!t || t->processed()) {
+    throw runtime_error("Released task should be back on the queue.");
+  }
+  t = recovered.get(request(24, 0));
+  if (!t || !t->processed()) {
+    throw runtime_error("Task still leased should be processed.");
+  }
+  if (recovered.get(request(8, 0))) {
+    throw runtime_error("Dropped bulk task shouldn't be recovered.");
+  }
+}
+
+/* test that a snapshot replaces the journal, and the queue can be 
+ * recovered from it and the journal after it.
+ */
+void test_snapshot() {
+  tmp_dir tmp;
+  task_queue original;
+  {
+    shared_ptr<queue_journal> journal = open(tmp, original);
+    for (int i = 0; i < 1000; ++i) {
+      original.push(request(i * 8, 0), "handler", (i % 2) ? 100 : 0);
+    }
+    for (int i = 0; i < 900; ++i) {
+      original.erase(request(i * 8, 0));
+    }
+    journal->snapshot(original);
+    if (journal->journal_bytes() != 0) {
+      throw runtime_error("Journal should be empty after a snapshot.");
+    }
+    original.push(request(0, 8), "handler", 150);
+    original.set_processed(request(8 * 950, 0), "worker", 2000000000);
+    original.set_listener(shared_ptr<queue_journal>());
+  }
+
+  size_t files = 0;
+  for (fs::directory_iterator itr(tmp.dir()); itr != fs::directory_iterator(); ++itr) { ++files; }
+  if (files != 2) {
+    throw runtime_error("Only the latest snapshot and journal should be kept.");
+  }
+
+  task_queue recovered;
+  shared_ptr<queue_journal> journal = open(tmp, recovered);
+  expect_same(original, recovered);
+  if (!recovered.get(request(8 * 950, 0))->processed()) {
+    throw runtime_error("Task handed out after the snapshot should be processed.");
+  }
+}
+
+/* test that once the journal grows big enough, it's compacted in the
+ * background, leaving only the new snapshot and journal, which the 
+ * queue can be recovered from.
+ */
+void test_background_compaction() {
+  tmp_dir tmp;
+  task_queue original;
+  {
+    shared_ptr<queue_journal> journal(new queue_journal(tmp.dir().string(), 10, 1024));
+    journal->recover(original);
+    journal->snapshot(original);
+    original.set_listener(journal);
+    for (int i = 0; i < 100; ++i) {
+      original.push(request(i * 8, 0), "handler", (i % 2) ? 100 : 0);
+    }
+    original.set_processed(request(8, 0), "worker", 2000000000);
+    for (int i = 50; i < 100; ++i) {
+      original.erase(request(i * 8, 0));
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    if (journal->journal_bytes() >= 1024) {
+      throw runtime_error("Journal should have been compacted by now.");
+    }
+    original.set_listener(shared_ptr<queue_journal>());
+  }
+
+  size_t files = 0;
+  for (fs::directory_iterator itr(tmp.dir()); itr != fs::directory_iterator(); ++itr) {
+    if (itr->path().filename().string() == "snapshot-0000000000000001") {
+      throw runtime_error("Snapshot from before the compaction should have been removed.");
+    }
+    ++files;
+  }
+  if (files != 2) {
+    throw runtime_error("Only the latest snapshot and journal should be kept.");
+  }
+
+  task_queue recovered;
+  shared_ptr<queue_journal> journal = open(tmp, recovered);
+  expect_same(original, recovered);
+  if (!recovered.get(request(8, 0))->processed()) {
+    throw runtime_error("Processed task should still be processed.");
+  }
+}
+
+/* test that if the broker stops after a new journal was started but
+ * before the snapshot of the one before it was written, the queue is
+ * recovered from the previous snapshot and both journals.
+ */
+void test_unfinished_compaction() {
+  tmp_dir tmp;
+  const fs::path saved = tmp.dir() / "saved";
+  {
+    task_queue q;
+    shared_ptr<queue_journal> journal = open(tmp, q);
+    q.push(request(0, 0), "handler", 100);
+    q.set_listener(shared_ptr<queue_journal>());
+  }
+  fs::create_directory(saved);
+  for (fs::directory_iterator itr(tmp.dir()); itr != fs::directory_iterator(); ++itr) {
+    if (itr->path() != saved) { fs::copy_file(itr->path(), saved / itr->path().filename()); }
+  }
+  {
+    task_queue q;
+    shared_ptr<queue_journal> journal = open(tmp, q);
+    q.push(request(8, 0), "handler", 100);
+    q.set_listener(shared_ptr<queue_journal>());
+  }
+
+  // put back the previous generation and take away the new snapshot.
+  fs::remove(tmp.dir() / "snapshot-0000000000000002");
+  for (fs::directory_iterator itr(saved); itr != fs::directory_iterator(); ++itr) {
+    fs::copy_file(itr->path(), tmp.dir() / itr->path().filename());
+  }
+  fs::remove_all(saved);
+
+  task_queue recovered;
+  shared_ptr<queue_journal> journal = open(tmp, recovered);
+  if (recovered.size() != 2 || !recovered.get(request(0, 0)) || !recovered.get(request(8, 0))) {
+    throw runtime_error("Changes from both journals should be recovered.");
+  }
+}
+
+/* test that a record which was only partly written is ignored, along
+ * with anything after it.
+ */
+void test_partial_record() {
+  tmp_dir tmp;
+  {
+    task_queue q;
+    shared_ptr<queue_journal> journal = open(tmp, q);
+    q.push(request(0, 0), "handler", 100);
+    q.push(request(8, 0), "handler", 100);
+    q.set_listener(shared_ptr<queue_journal>());
+  }
+
+  for (fs::directory_iterator itr(tmp.dir()); itr != fs::directory_iterator(); ++itr) {
+    if (itr->path().filename().string().compare(0, 8, "journal-") == 0) {
+      fs::resize_file(itr->path(), fs::file_size(itr->path()) - 3);
+    }
+  }
+
+  task_queue recovered;
+  shared_ptr<queue_journal> journal = open(tmp, recovered);
+  if (recovered.size() != 1 || !recovered.get(request(0, 0))) {
+    throw runtime_error("Only the complete record should be recovered.");
+  }
+}
+
+/* test that clearing the queue is replayed.
+ */
+void test_clear() {
+  tmp_dir tmp;
+  {
+    task_queue q;
+    shared_ptr<queue_journal> journal = open(tmp, q);
+    q.push(request(0, 0), "handler", 100);
+    q.clear();
+    q.push(request(8, 0), "handler", 100);
+    q.set_listener(shared_ptr<queue_journal>());
+  }
+
+  task_queue recovered;
+  shared_ptr<queue_journal> journal = open(tmp, recovered);
+  if (recovered.size() != 1 || !recovered.get(request(8, 0))) {
+    throw runtime_error("Only the task pushed after the clear should be recovered.");
+  }
+}
+
+/* test that changes are committed to disk in the background, without
+ * the journal having to be closed.
+ */
+void test_group_commit() {
+  tmp_dir tmp;
+  task_queue q;
+  shared_ptr<queue_journal> journal = open(tmp, q, 10);
+  q.push(request(0, 0), "handler", 100);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+
+  task_queue recovered;
+  queue_journal reader(tmp.dir().string(), 10);
+  if (reader.recover(recovered) != 1 || recovered.size() != 1) {
+    throw runtime_error("Change should have been committed by now.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Queue Journal ==" << endl << endl;
+
+  tests_failed += test::run("test_replay", &test_replay);
+  tests_failed += test::run("test_requeue", &test_requeue);
+  tests_failed += test::run("test_snapshot", &test_snapshot);
+  tests_failed += test::run("test_background_compaction", &test_background_compaction);
+  tests_failed += test::run("test_unfinished_compaction", &test_unfinished_compaction);
+  tests_failed += test::run("test_partial_record", &test_partial_record);
+  tests_failed += test::run("test_clear", &test_clear);
+  tests_failed += test::run("test_group_commit", &test_group_commit);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
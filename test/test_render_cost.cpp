@@ -0,0 +1,114 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "render_cost.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+
+using rendermq::render_cost_model;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+namespace fs = boost::filesystem;
+
+/* test that the estimates follow the render times, and that anything
+ * not seen yet is estimated at the average.
+ */
+void test_estimates() {
+  render_cost_model model(1000.0, 0.5);
+
+  if (model.cost("map", 12) != 1000.0 || model.default_cost() != 1000.0) {
+    throw runtime_error("Expected the default cost before anything is known.");
+  }
+
+  model.record("map", 12, 4000.0);
+  if (model.cost("map", 12) != 4000.0) {
+    throw runtime_error("First render time should be the estimate.");
+  }
+  model.record("map", 12, 2000.0);
+  if (model.cost("map", 12) != 3000.0) {
+    throw runtime_error("Estimate should move towards later render times.");
+  }
+
+  model.record("map", 18, 1000.0);
+  if (model.cost("other", 12) != 2000.0 || model.size() != 2) {
+    throw runtime_error("Unknown style and zoom should be estimated at the average.");
+  }
+}
+
+/* test that the estimates can be saved and loaded again.
+ */
+void test_save_load() {
+  const fs::path file = fs::path("/tmp") / fs::unique_path();
+
+  render_cost_model model(1000.0, 0.5);
+  model.record("map", 12, 4000.0);
+  model.record("map", 12, 2000.0);
+  model.record("other", 18, 100.0);
+  model.save(file.string());
+
+  render_cost_model loaded(1000.0, 0.5);
+  if (!loaded.load(file.string())) {
+    fs::remove(file);
+    throw runtime_error("Unable to load saved render costs.");
+  }
+  fs::remove(file);
+
+  if (loaded.size() != 2 || loaded.cost("map", 12) != 3000.0 || loaded.cost("other", 18) != 100.0) {
+    throw runtime_error("Loaded estimates don't match those saved.");
+  }
+  if (loaded.default_cost() != 1550.0) {
+    throw runtime_error("Loaded estimates should count towards the average.");
+  }
+
+  // the sample counts are kept, so later times are averaged in.
+  loaded.record("map", 12, 1000.0);
+  if (loaded.cost("map", 12) != 2000.0) {
+    throw runtime_error("Loaded estimate should be averaged with later times.");
+  }
+
+  if (loaded.load(file.string())) {
+    throw runtime_error("Loading a missing file should fail.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Render Cost Model ==" << endl << endl;
+
+  tests_failed += test::run("test_estimates", &test_estimates);
+  tests_failed += test::run("test_save_load", &test_save_load);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
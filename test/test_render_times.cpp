@@ -0,0 +1,99 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "render_times.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+
+using rendermq::render_times;
+using boost::optional;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+
+/* test that the percentiles come from the times for the right style and
+ * zoom, and only once there are enough of them.
+ */
+void test_percentile() {
+  render_times times(100, 10);
+
+  for (int i = 1; i <= 9; ++i) {
+    times.record("map", 12, i * 100);
+  }
+  if (times.percentile("map", 12, 0.5)) {
+    throw runtime_error("Shouldn't give a percentile with too few times.");
+  }
+
+  times.record("map", 12, 1000);
+  times.record("map", 13, 50000);
+  times.record("other", 12, 50000);
+
+  optional<boost::uint64_t> median = times.percentile("map", 12, 0.5);
+  optional<boost::uint64_t> top = times.percentile("map", 12, 1.0);
+  optional<boost::uint64_t> bottom = times.percentile("map", 12, 0.0);
+  if (!median || *median < 500 || *median > 600) {
+    throw runtime_error("Wrong median render time.");
+  }
+  if (!top || *top != 1000 || !bottom || *bottom != 100) {
+    throw runtime_error("Wrong extreme render times.");
+  }
+  if (times.count("map", 12) != 10 || times.count("map", 13) != 1 || times.count("map", 14) != 0) {
+    throw runtime_error("Wrong counts of render times.");
+  }
+}
+
+/* test that only the most recent times are kept, so that the statistics
+ * follow changes in how long renders take.
+ */
+void test_recent_only() {
+  render_times times(10, 5);
+
+  for (int i = 0; i < 10; ++i) {
+    times.record("map", 12, 100);
+  }
+  for (int i = 0; i < 10; ++i) {
+    times.record("map", 12, 5000);
+  }
+
+  optional<boost::uint64_t> bottom = times.percentile("map", 12, 0.0);
+  if (times.count("map", 12) != 10 || !bottom || *bottom != 5000) {
+    throw runtime_error("Older render times should have been replaced.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Render Times ==" << endl << endl;
+
+  tests_failed += test::run("test_percentile", &test_percentile);
+  tests_failed += test::run("test_recent_only", &test_recent_only);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
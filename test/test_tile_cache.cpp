@@ -0,0 +1,203 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "tile_cache.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <string>
+
+using rendermq::tile_cache;
+using rendermq::tile_protocol;
+using boost::optional;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::cmdRender;
+using rendermq::cmdDone;
+using rendermq::cmdIgnore;
+using rendermq::cmdNotDone;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+
+namespace {
+
+tile_protocol tile(rendermq::protoCmd status, int x, int y, int z, rendermq::protoFmt fmt, size_t size) {
+  tile_protocol t(status, x, y, z, 123, "map", fmt, 1000, 900);
+  t.set_data(string(size, 'x'));
+  return t;
+}
+
+tile_protocol request(int x, int y, int z, rendermq::protoFmt fmt) {
+  return tile_protocol(cmdRender, x, y, z, 0, "map", fmt);
+}
+
+// the memory an entry of the given size uses in the cache.
+size_t entry(size_t size) {
+  return size + 3 + sizeof(rendermq::cached_tile);
+}
+
+}
+
+/* test that a tile only hits in the same position, style and format,
+ * and that the cached copy keeps the data and status.
+ */
+void test_hit() {
+  tile_cache cache(1024 * 1024, 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(tile(cmdDone, 3, 5, 10, fmtPNG, 100), now);
+  cache.insert(tile(cmdIgnore, 4, 5, 10, fmtPNG, 50), now);
+
+  optional<const tile_protocol &> hit = cache.find(request(3, 5, 10, fmtPNG), now);
+  if (!hit) { throw runtime_error("Expected the cached tile to hit."); }
+  if (hit->status != cmdDone || hit->last_modified != 1000 || hit->data().size() != 100) {
+    throw runtime_error("Cached tile should keep its status, last modified time and data.");
+  }
+  if (hit->id != 0 || hit->request_last_modified != 0) {
+    throw runtime_error("Cached tile shouldn't keep the client's request details.");
+  }
+
+  hit = cache.find(request(4, 5, 10, fmtPNG), now);
+  if (!hit || hit->status != cmdIgnore) {
+    throw runtime_error("Expired tile should be cached as expired.");
+  }
+
+  if (cache.find(request(3, 5, 10, fmtJPEG), now) || cache.find(request(2, 5, 10, fmtPNG), now) ||
+      cache.find(request(3, 5, 11, fmtPNG), now)) {
+    throw runtime_error("Other formats and positions shouldn't hit.");
+  }
+  if (cache.hits() != 2 || cache.misses() != 3) {
+    throw runtime_error("Wrong hit or miss count.");
+  }
+}
+
+/* test that only tiles with data which are done or expired are kept.
+ */
+void test_uncacheable() {
+  tile_cache cache(1024 * 1024, 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(tile(cmdNotDone, 0, 0, 5, fmtPNG, 100), now);
+  cache.insert(tile(cmdDone, 1, 0, 5, fmtPNG, 0), now);
+  if (cache.size() != 0 || cache.bytes() != 0) {
+    throw runtime_error("Tiles which aren't done or have no data shouldn't be cached.");
+  }
+}
+
+/* test that entries expire after their time to live.
+ */
+void test_expiry() {
+  tile_cache cache(1024 * 1024, 10);
+  const std::time_t now = 1000000;
+
+  cache.insert(tile(cmdDone, 0, 0, 5, fmtPNG, 100), now);
+  if (!cache.find(request(0, 0, 5, fmtPNG), now + 9)) {
+    throw runtime_error("Entry shouldn't have expired yet.");
+  }
+  if (cache.find(request(0, 0, 5, fmtPNG), now + 10)) {
+    throw runtime_error("Entry should have expired.");
+  }
+  if (cache.size() != 0 || cache.bytes() != 0) {
+    throw runtime_error("Expired entry should have been removed.");
+  }
+}
+
+/* test that the least recently used entries are evicted to keep the
+ * cache within its memory limit.
+ */
+void test_lru_eviction() {
+  tile_cache cache(3 * entry(100), 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(tile(cmdDone, 0, 0, 5, fmtPNG, 100), now);
+  cache.insert(tile(cmdDone, 1, 0, 5, fmtPNG, 100), now);
+  cache.insert(tile(cmdDone, 2, 0, 5, fmtPNG, 100), now);
+
+  // touch the first, so that the second is least recently used.
+  cache.find(request(0, 0, 5, fmtPNG), now);
+  cache.insert(tile(cmdDone, 3, 0, 5, fmtPNG, 100), now);
+
+  if (cache.size() != 3 || cache.bytes() != 3 * entry(100) || cache.evictions() != 1) {
+    throw runtime_error("Cache should have evicted one entry to stay within its limit.");
+  }
+  if (cache.find(request(1, 0, 5, fmtPNG), now)) {
+    throw runtime_error("Least recently used entry should have been evicted.");
+  }
+  if (!cache.find(request(0, 0, 5, fmtPNG), now)) {
+    throw runtime_error("Recently used entry shouldn't have been evicted.");
+  }
+}
+
+/* test that erasing a metatile removes all its tiles in all formats,
+ * and only those.
+ */
+void test_erase_metatile() {
+  tile_cache cache(1024 * 1024, 60);
+  const std::time_t now = 1000000;
+
+  cache.insert(tile(cmdDone, 8, 8, 10, fmtPNG, 100), now);
+  cache.insert(tile(cmdDone, 15, 15, 10, fmtPNG, 100), now);
+  cache.insert(tile(cmdDone, 9, 10, 10, fmtJPEG, 100), now);
+  cache.insert(tile(cmdDone, 16, 8, 10, fmtPNG, 100), now);
+  cache.insert(tile(cmdDone, 8, 8, 11, fmtPNG, 100), now);
+
+  cache.erase_metatile(request(12, 12, 10, fmtPNG));
+  if (cache.size() != 2 || cache.bytes() != 2 * entry(100)) {
+    throw runtime_error("Expected all the tiles in the metatile to be erased.");
+  }
+  if (!cache.find(request(16, 8, 10, fmtPNG), now) || !cache.find(request(8, 8, 11, fmtPNG), now)) {
+    throw runtime_error("Tiles in other metatiles shouldn't be erased.");
+  }
+}
+
+/* test that a zero-sized cache doesn't keep anything.
+ */
+void test_disabled() {
+  tile_cache cache(0, 60);
+  cache.insert(tile(cmdDone, 0, 0, 5, fmtPNG, 100), 1000000);
+  if (cache.size() != 0 || cache.find(request(0, 0, 5, fmtPNG), 1000000)) {
+    throw runtime_error("Disabled cache shouldn't hold anything.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Tile Cache ==" << endl << endl;
+
+  tests_failed += test::run("test_hit", &test_hit);
+  tests_failed += test::run("test_uncacheable", &test_uncacheable);
+  tests_failed += test::run("test_expiry", &test_expiry);
+  tests_failed += test::run("test_lru_eviction", &test_lru_eviction);
+  tests_failed += test::run("test_erase_metatile", &test_erase_metatile);
+  tests_failed += test::run("test_disabled", &test_disabled);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
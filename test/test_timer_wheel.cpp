@@ -0,0 +1,190 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "timer_wheel.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <vector>
+#include <boost/bind.hpp>
+
+using rendermq::timer_wheel;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::vector;
+
+namespace {
+
+void record(vector<int> &fired, int n) {
+  fired.push_back(n);
+}
+
+// a timer which schedules itself again every period.
+struct repeating {
+  repeating(timer_wheel &w, boost::uint64_t p) : wheel(w), period(p), count(0), next(0) {}
+
+  void start(boost::uint64_t when) {
+    next = when;
+    wheel.schedule(next, boost::bind(&repeating::fire, this));
+  }
+
+  void fire() {
+    ++count;
+    start(next + period);
+  }
+
+  timer_wheel &wheel;
+  boost::uint64_t period;
+  int count;
+  boost::uint64_t next;
+};
+
+}
+
+/* test that timers go off at the right time and in the right order,
+ * and not before.
+ */
+void test_expire_in_order() {
+  timer_wheel wheel(16, 1, 1000);
+  vector<int> fired;
+
+  wheel.schedule(1010, boost::bind(&record, boost::ref(fired), 3));
+  wheel.schedule(1005, boost::bind(&record, boost::ref(fired), 1));
+  wheel.schedule(1005, boost::bind(&record, boost::ref(fired), 2));
+  wheel.schedule(1020, boost::bind(&record, boost::ref(fired), 4));
+
+  if (wheel.expire(1004) != 0 || !fired.empty()) {
+    throw runtime_error("Timers shouldn't go off early.");
+  }
+  if (wheel.expire(1012) != 3) {
+    throw runtime_error("Expected three timers to go off.");
+  }
+  if (fired.size() != 3 || fired[0] != 1 || fired[1] != 2 || fired[2] != 3) {
+    throw runtime_error("Timers went off in the wrong order.");
+  }
+  if (wheel.size() != 1 || wheel.expire(1020) != 1 || wheel.size() != 0) {
+    throw runtime_error("Last timer should have gone off.");
+  }
+}
+
+/* test that the timeout is the time until the next timer is due, 
+ * including for timers more than one turn of the wheel away.
+ */
+void test_timeout() {
+  timer_wheel wheel(16, 1, 1000);
+  vector<int> fired;
+
+  if (wheel.timeout(1000) != -1) {
+    throw runtime_error("No timers should mean no timeout.");
+  }
+
+  wheel.schedule(1100, boost::bind(&record, boost::ref(fired), 1));
+  // far away, so it only wakes up once per turn to check.
+  if (wheel.timeout(1000) != 16) {
+    throw runtime_error("Expected to wake up after a turn of the wheel.");
+  }
+  wheel.schedule(1003, boost::bind(&record, boost::ref(fired), 2));
+  if (wheel.timeout(1000) != 3 || wheel.timeout(1002) != 1 || wheel.timeout(1005) != 0) {
+    throw runtime_error("Expected timeout to be until the next timer.");
+  }
+
+  // go round the wheel, checking that the far timer only goes off when
+  // it's due.
+  boost::uint64_t now = 1000;
+  while (fired.size() < 2 && now < 2000) {
+    now += std::max(wheel.timeout(now), 1L);
+    wheel.expire(now);
+  }
+  if (fired.size() != 2 || fired[1] != 1 || now != 1100) {
+    throw runtime_error("Far timer should go off exactly when it's due.");
+  }
+}
+
+/* test that cancelled timers don't go off.
+ */
+void test_cancel() {
+  timer_wheel wheel(16, 1, 1000);
+  vector<int> fired;
+
+  timer_wheel::timer_id id = wheel.schedule(1005, boost::bind(&record, boost::ref(fired), 1));
+  wheel.schedule(1006, boost::bind(&record, boost::ref(fired), 2));
+  if (!wheel.cancel(id) || wheel.cancel(id)) {
+    throw runtime_error("Timer should only be cancelled once.");
+  }
+  wheel.expire(1100);
+  if (fired.size() != 1 || fired[0] != 2) {
+    throw runtime_error("Cancelled timer shouldn't go off.");
+  }
+}
+
+/* test that a timer which is scheduled in the past, or a long time 
+ * after the last expiry, still goes off.
+ */
+void test_late() {
+  timer_wheel wheel(16, 10, 1000);
+  vector<int> fired;
+
+  wheel.schedule(900, boost::bind(&record, boost::ref(fired), 1));
+  if (wheel.timeout(1000) != 10) {
+    throw runtime_error("Timer in the past should go off at the next tick.");
+  }
+  wheel.schedule(1500, boost::bind(&record, boost::ref(fired), 2));
+  wheel.expire(100000);
+  if (fired.size() != 2) {
+    throw runtime_error("Timers should go off however late expire is called.");
+  }
+}
+
+/* test that callbacks can schedule timers, e.g: to repeat.
+ */
+void test_repeating() {
+  timer_wheel wheel(8, 1, 0);
+  repeating r(wheel, 5);
+  r.start(5);
+
+  for (boost::uint64_t now = 0; now <= 100; ++now) {
+    wheel.expire(now);
+  }
+  if (r.count != 20) {
+    throw runtime_error("Repeating timer should have gone off every period.");
+  }
+}
+
+int main() {
+  int tests_failed = 0;
+
+  cout << "== Testing Timer Wheel ==" << endl << endl;
+
+  tests_failed += test::run("test_expire_in_order", &test_expire_in_order);
+  tests_failed += test::run("test_timeout", &test_timeout);
+  tests_failed += test::run("test_cancel", &test_cancel);
+  tests_failed += test::run("test_late", &test_late);
+  tests_failed += test::run("test_repeating", &test_repeating);
+
+  cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -44,6 +44,7 @@
 #include <set>
 #include <sstream>
 #include <cstdio>
+#include <ctime>
 
 using boost::function;
 using boost::shared_ptr;
@@ -101,6 +102,9 @@ struct test_base {
 
   void setup_broker_configs(pt::ptree &config);
 
+  // override this to change the config before anything is set up.
+  virtual void configure(pt::ptree &config);
+
   list<string> broker_names;
   unsigned int num_workers;
   unsigned int num_handlers;
@@ -152,6 +156,10 @@ test_base::setup_broker_configs(pt::ptree &config) {
   }
 }
 
+void
+test_base::configure(pt::ptree &) {
+}
+
 void
 test_base::operator()() {
   // set up a fake config with ipc:// sockets in /tmp
@@ -161,10 +169,12 @@ test_base::operator()() {
   
   config.put("backend.type", "zmq");
   config.put("zmq.heartbeat_time", heartbeat_time);
+  config.put("zmq.lease_time", 5);
   config.put("zmq.zombie_time", 5);
   config.put("zmq.liveness_time", 3 * heartbeat_time);
   config.put("worker.poll_timeout", "1");
   setup_broker_configs(config);
+  configure(config);
 
   try {
     zmq::context_t ctx(1);
@@ -449,6 +459,11 @@ struct test_worker_failure
   }
   virtual ~test_worker_failure() {}
 
+  // the failed worker doesn't renew its lease, as if it had hung.
+  void configure(pt::ptree &config) {
+    config.put("worker.lease_renew_interval", 0);
+  }
+
   void do_test(list<shared_ptr<dqueue::zmq_backend_handler> > &handlers,
                list<shared_ptr<dqueue::zmq_backend_worker> > &workers) {
     dqueue::zmq_backend_worker &first_worker = **workers.begin();
@@ -850,6 +865,248 @@ struct test_multi_handler_data
     }
   }
 };
+/* checks that a worker which leases jobs in batches and keeps them in
+ * its buffer gets each job exactly once and gets all the results back
+ * to the handler.
+ */
+struct test_prefetch_batch
+  : public test_base {
+  test_prefetch_batch() {
+    broker_names.push_back("broker1");
+    num_workers = 1;
+    num_handlers = 1;
+  }
+  virtual ~test_prefetch_batch() {}
+
+  void configure(pt::ptree &config) {
+    config.put("worker.prefetch", 4);
+  }
+
+  void do_test(list<shared_ptr<dqueue::zmq_backend_handler> > &handlers,
+               list<shared_ptr<dqueue::zmq_backend_worker> > &workers) {
+    dqueue::zmq_backend_worker &worker = **workers.begin();
+    dqueue::zmq_backend_handler &handler = **handlers.begin();
+    const size_t num_jobs = 10;
+
+    // send several jobs, each for a different metatile.
+    for (size_t i = 0; i < num_jobs; ++i) {
+      rendermq::tile_protocol job(cmdRender, 8 * i, 0, 10, i, "foo", fmtPNG);
+      handler.send(job);
+    }
+
+    // wait for broker to catch up and process the jobs.
+    usleep(10000);
+
+    set<int> seen;
+    for (size_t i = 0; i < num_jobs; ++i) {
+      rendermq::tile_protocol job_get = worker.get_job();
+      if (!seen.insert(job_get.x).second) {
+        throw runtime_error("worker was given the same job twice.");
+      }
+
+      job_get.status = cmdDone;
+      worker.notify(job_get);
+    }
+
+    // let worker events percolate a little
+    usleep(100000);
+
+    size_t count = 0;
+    for (size_t i = 0; i < (num_jobs + 5); ++i) {
+      list<rendermq::tile_protocol> rv_job_list;
+      poll_handler(handler, rv_job_list);
+      count += rv_job_list.size();
+    }
+    if (count != num_jobs) {
+      throw runtime_error("didn't get all tile responses from worker.");
+    }
+  }
+};
+
+/* checks that a broker which splits its queue over several shards
+ * looks the same as any other broker to the handlers and workers, and
+ * that its stats cover all the shards.
+ */
+struct test_sharded_broker
+  : public test_base {
+  test_sharded_broker() {
+    broker_names.push_back("broker1");
+    num_workers = 1;
+    num_handlers = 1;
+  }
+  virtual ~test_sharded_broker() {}
+
+  void configure(pt::ptree &config) {
+    config.put("broker1.shards", 4);
+  }
+
+  void do_test(list<shared_ptr<dqueue::zmq_backend_handler> > &handlers,
+               list<shared_ptr<dqueue::zmq_backend_worker> > &workers) {
+    dqueue::zmq_backend_worker &worker = **workers.begin();
+    dqueue::zmq_backend_handler &handler = **handlers.begin();
+    const size_t num_jobs = 16;
+
+    // send jobs for different metatiles, which should be spread over
+    // the shards.
+    for (size_t i = 0; i < num_jobs; ++i) {
+      rendermq::tile_protocol job(cmdRender, 8 * i, 8 * i, 10, i, "foo", fmtPNG);
+      handler.send(job);
+    }
+
+    // wait for broker to catch up and process the jobs.
+    usleep(10000);
+
+    set<int> seen;
+    for (size_t i = 0; i < num_jobs; ++i) {
+      rendermq::tile_protocol job_get = worker.get_job();
+      if (!seen.insert(job_get.x).second) {
+        throw runtime_error("worker was given the same job twice.");
+      }
+
+      fake_tile meta(job_get.x, job_get.y, job_get.z, fmtPNG);
+      job_get.set_data(string(meta.ptr, meta.total_size));
+      job_get.status = cmdDone;
+      worker.notify(job_get);
+    }
+
+    // let worker events percolate a little
+    usleep(100000);
+
+    size_t count = 0;
+    for (size_t i = 0; i < (num_jobs + 5); ++i) {
+      list<rendermq::tile_protocol> rv_job_list;
+      poll_handler(handler, rv_job_list);
+      count += rv_job_list.size();
+      BOOST_FOREACH(rendermq::tile_protocol tile, rv_job_list) {
+        char str[17];
+        snprintf(str, 17, "%03d|%06d|%06d", tile.z, tile.x, tile.y);
+        if (tile.data() != string(str)) {
+          throw runtime_error(
+            (boost::format("Tile data `%1%' != expected `%2%'")
+             % tile.data() % str).str());
+        }
+      }
+    }
+    if (count != num_jobs) {
+      throw runtime_error("didn't get all tile responses from worker.");
+    }
+
+    // the stats should be for the whole broker, which now has nothing
+    // left in its queue.
+    string stats("STATS");
+    (*cmd_sockets.front()) << stats;
+    (*cmd_sockets.front()) >> stats;
+    if ((stats.find("shards=4") == string::npos) ||
+        (stats.find("num_tasks=0 ") == string::npos)) {
+      throw runtime_error((boost::format("Unexpected stats from sharded broker: `%1%'") % stats).str());
+    }
+  }
+};
+
+/* checks that a worker which is still busy with a job renews its lease,
+ * so that the job isn't given to another worker.
+ */
+struct test_lease_renewal
+  : public test_base {
+  test_lease_renewal() {
+    broker_names.push_back("broker1");
+    num_workers = 2;
+    num_handlers = 1;
+  }
+  virtual ~test_lease_renewal() {}
+
+  void configure(pt::ptree &config) {
+    config.put("zmq.lease_time", 2);
+    config.put("zmq.resubmit_interval", 1);
+    config.put("worker.lease_renew_interval", 0.5);
+  }
+
+  void do_test(list<shared_ptr<dqueue::zmq_backend_handler> > &handlers,
+               list<shared_ptr<dqueue::zmq_backend_worker> > &workers) {
+    dqueue::zmq_backend_worker &worker = **workers.begin();
+    dqueue::zmq_backend_handler &handler = **handlers.begin();
+
+    handler.send(rendermq::tile_protocol(cmdRender, 0, 0, 4, 101010, "foo", fmtPNG));
+    rendermq::tile_protocol job_get = worker.get_job();
+
+    // take several lease times over the job.
+    sleep(5);
+
+    string stats("STATS");
+    (*cmd_sockets.front()) << stats;
+    (*cmd_sockets.front()) >> stats;
+    if (stats.find("num_tasks=1 num_unprocessed=0 ") == string::npos) {
+      throw runtime_error((boost::format("Job resubmitted while still being worked on: `%1%'") % stats).str());
+    }
+
+    job_get.status = cmdDone;
+    worker.notify(job_get);
+    usleep(100000);
+
+    list<rendermq::tile_protocol> rv_job_list;
+    poll_handler(handler, rv_job_list);
+    if (rv_job_list.size() != 1) {
+      throw runtime_error("didn't get the tile response from worker.");
+    }
+  }
+};
+
+/* checks that the jobs held by a worker which shuts down go straight
+ * to another worker, rather than waiting for their leases to run out.
+ */
+struct test_worker_release
+  : public test_base {
+  test_worker_release() {
+    broker_names.push_back("broker1");
+    num_workers = 2;
+    num_handlers = 1;
+  }
+  virtual ~test_worker_release() {}
+
+  void configure(pt::ptree &config) {
+    config.put("zmq.lease_time", 60);
+    config.put("worker.prefetch", 2);
+  }
+
+  void do_test(list<shared_ptr<dqueue::zmq_backend_handler> > &handlers,
+               list<shared_ptr<dqueue::zmq_backend_worker> > &workers) {
+    dqueue::zmq_backend_handler &handler = **handlers.begin();
+    const size_t num_jobs = 4;
+
+    for (size_t i = 0; i < num_jobs; ++i) {
+      handler.send(rendermq::tile_protocol(cmdRender, 8 * i, 0, 10, i, "foo", fmtPNG));
+    }
+    usleep(10000);
+
+    // the first worker takes a job, and some more into its buffer, then
+    // goes away without finishing any of them.
+    workers.front()->get_job();
+    usleep(100000);
+    workers.pop_front();
+
+    dqueue::zmq_backend_worker &worker = **workers.begin();
+    const std::time_t start = std::time(0);
+    for (size_t i = 0; i < num_jobs; ++i) {
+      rendermq::tile_protocol job_get = worker.get_job();
+      job_get.status = cmdDone;
+      worker.notify(job_get);
+    }
+    if (std::time(0) - start > 30) {
+      throw runtime_error("released jobs should be available straight away.");
+    }
+
+    usleep(100000);
+    size_t count = 0;
+    for (size_t i = 0; i < (num_jobs + 5); ++i) {
+      list<rendermq::tile_protocol> rv_job_list;
+      poll_handler(handler, rv_job_list);
+      count += rv_job_list.size();
+    }
+    if (count != num_jobs) {
+      throw runtime_error("didn't get all tile responses from worker.");
+    }
+  }
+};
 } // anonymous namespace
 
 int main() {
@@ -866,6 +1123,10 @@ int main() {
   tests_failed += test::run("test_multi_handler", test_multi_handler());
   tests_failed += test::run("test_multi_handler_interleaved", test_multi_handler_interleaved());
   tests_failed += test::run("test_multi_handler_data", test_multi_handler_data());
+  tests_failed += test::run("test_prefetch_batch", test_prefetch_batch());
+  tests_failed += test::run("test_sharded_broker", test_sharded_broker());
+  tests_failed += test::run("test_lease_renewal", test_lease_renewal());
+  tests_failed += test::run("test_worker_release", test_worker_release());
   //tests_failed += test::run("test_", &test_);
 
   cout << " >> Tests failed: " << tests_failed << endl << endl;
@@ -26,6 +26,13 @@
 #include "tile_broker_impl.hpp"
 
 #include "task_queue.hpp"
+#include "metatile_cache.hpp"
+#include "bulk_spill.hpp"
+#include "queue_journal.hpp"
+#include "timer_wheel.hpp"
+#include "idle_workers.hpp"
+#include "render_times.hpp"
+#include "render_cost.hpp"
 #include "zstream.hpp"
 #include "zmq_utils.hpp"
 #include "tile_protocol.hpp"
@@ -34,14 +41,26 @@
 #include "logging/logger.hpp"
 
 #include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 #include <boost/utility.hpp>
 #include <boost/array.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/property_tree/ini_parser.hpp>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 
 #include <map>
+#include <deque>
 #include <queue>
+#include <vector>
+#include <ctime>
+#include <cstdlib>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include "storage/meta_tile.hpp"
@@ -55,186 +74,1815 @@ using boost::format;
 namespace manip = zstream::manip;
 namespace pt = boost::property_tree;
 
-// the amount of time that a task has to be in the queue without being
-// completed before the worker running it is considered to be dead and
-// the task assigned to it should be resubmitted to the queue to go to
-// a different worker.
+// the length of the lease a worker gets on a task. if the worker hasn't
+// completed or renewed it in that time then the task should be
+// resubmitted to the queue to go to a different worker. workers renew
+// their leases well within this time, so it only needs to be long
+// enough to cover a missed renewal or two.
+#define DEFAULT_LEASE_TIME (30)
+
+// the amount of time that a worker can go without being heard from
+// before it's considered to be dead, and all the tasks leased to it 
+// (including ones whose leases haven't yet run out) are resubmitted to
+// the queue to go to a different worker.
 #define DEFAULT_ZOMBIE_TIME (300)
 
+// the most jobs which will be leased to a worker in one go, however many
+// it asks for. this bounds the amount of work which is stuck in a single
+// worker's buffer if that worker dies.
+#define DEFAULT_MAX_LEASE_JOBS (16)
+
+// the size, in megabytes, of the cache of recently completed metatiles
+// and the number of seconds they're kept for. requests for a metatile
+// which has just been rendered are answered from this cache.
+#define DEFAULT_COMPLETED_CACHE_SIZE (64)
+#define DEFAULT_COMPLETED_CACHE_TTL (10)
+
+// the order in which waiting jobs are handed out to workers. this is
+// "priority" for strict priority order, "aging" to raise the priority of
+// jobs the longer they wait, or "deadline" for earliest deadline first.
+#define DEFAULT_SCHEDULER "priority"
+
+// for aging, the priority gained for each second spent waiting. the 
+// request types are 50 apart, so this is 50 / seconds to catch up.
+#define DEFAULT_AGING_RATE (0.1)
+
+// for deadline, the number of seconds each type of request should be 
+// handed out within.
+#define DEFAULT_DEADLINE_PRIO (10)
+#define DEFAULT_DEADLINE_RENDER (60)
+#define DEFAULT_DEADLINE_DIRTY (3600)
+#define DEFAULT_DEADLINE_BULK (86400)
+
+// a worker is given a job near to its last one, when there is one of
+// the same priority within this many metatiles, as its caches will be
+// warm. zero turns this off.
+#define DEFAULT_LOCALITY_RADIUS (4)
+
+// the number of bulk jobs to keep in memory when there's a directory
+// configured to spill the rest to, and the size in MB of each segment
+// file they're spilled into.
+#define DEFAULT_BULK_MEMORY_LIMIT (1000000)
+#define DEFAULT_BULK_SPILL_SEGMENT_SIZE (64)
+
+// how often, in milliseconds, the changes to the queue are committed
+// to the journal when there's a directory configured for it, and how
+// big in MB the journal gets before it's replaced by a snapshot.
+#define DEFAULT_JOURNAL_COMMIT_INTERVAL (100)
+#define DEFAULT_JOURNAL_SNAPSHOT_SIZE (256)
+
+// a worker which asks for jobs when there aren't any waits this many
+// seconds for some to come in, before being told to ask again. this 
+// needs to be well inside the workers' broker_timeout.
+#define DEFAULT_JOB_WAIT_TIME (10)
+
+// a job with clients waiting for it which has been rendering for longer
+// than this fraction of recent renders of the same style and zoom is 
+// also given to a waiting worker, and whichever result comes back first
+// is used. zero turns this off. the render times are the most recent
+// STRAGGLER_SAMPLES for each style and zoom, once there are at least
+// STRAGGLER_MIN_SAMPLES of them.
+#define DEFAULT_STRAGGLER_PERCENTILE (0.95)
+#define STRAGGLER_SAMPLES (256)
+#define STRAGGLER_MIN_SAMPLES (20)
+
+// the number of milliseconds a render is expected to take before any
+// have been timed, and the weight given to each new render time in the
+// estimates of how long renders take.
+#define DEFAULT_RENDER_COST (1000)
+#define RENDER_COST_SMOOTHING (0.1)
+
+// render and prio jobs which were queued in the same second can be
+// handed out cheapest first, judging by those estimates, looking at up
+// to this many of them. zero, the default, turns this off.
+#define DEFAULT_CHEAPEST_FIRST_WINDOW (0)
+#define CHEAPEST_FIRST_MIN_PRIORITY (100)
+
+// how often, in milliseconds, to look for jobs taking too long.
+#define STRAGGLER_CHECK_INTERVAL (1000)
+
+// the broker's timers are kept on a wheel of this many slots, each a
+// millisecond long.
+#define TIMER_WHEEL_SLOTS (4096)
+
 namespace {
 
-/* thread which runs to send messages to the main thread reminding it
- * to heartbeat. this, bizarrely, makes things simpler in 0MQ, since 
- * the main thread no longer has to deal with timers and interleaving
- * them into the message loop - effectively this thread converts timer
- * expiry into a 0MQ message.
+using rendermq::shared_metatile_t;
+
+/* set up the scheduling policy from the config. the priorities here 
+ * need to match the ones given to each type of request in the broker 
+ * loop.
  */
-struct task_monitor
-{
-  explicit task_monitor(zmq::context_t & ctx, 
-                        unsigned int beat_interval, 
-                        unsigned int resub_interval,
-                        bool &sd_req, 
-                        const string &name)
-    : ctx_(ctx), heartbeat_interval(beat_interval),
-      resubmit_interval(resub_interval),
-      shutdown_requested(sd_req), broker_name(name) {}
-    
-    void operator() ()
-    {
-       LOG_DEBUG(boost::format("Starting heartbeat thread ... (%1%, %2%)") 
-                 % heartbeat_interval % resubmit_interval);
+boost::shared_ptr<const rendermq::scheduling_policy> 
+make_scheduling_policy(const pt::ptree &config) {
+  const string scheduler = config.get<string>("zmq.scheduler", DEFAULT_SCHEDULER);
 
-        zstream::socket::req cmd(ctx_);
+  if (scheduler == "priority") {
+    return boost::shared_ptr<const rendermq::scheduling_policy>();
 
-        // counters to keep track of which event(s) should be processed at
-        // each moment in time.
-        unsigned int next_heartbeat = 0, next_resubmit = resubmit_interval;
+  } else if (scheduler == "aging") {
+    return boost::shared_ptr<const rendermq::scheduling_policy>(
+      new rendermq::aging_policy(config.get<double>("zmq.aging_rate", DEFAULT_AGING_RATE)));
 
-        // use the broker name to disambiguate the monitor addresses if there
-        // is more than one broker running in this process, as can happen when
-        // we're testing.
-        cmd.connect("inproc://monitor-" + broker_name); 
+  } else if (scheduler == "deadline") {
+    std::map<int, int> deadlines;
+    deadlines[0] = config.get<int>("zmq.deadline_bulk", DEFAULT_DEADLINE_BULK);
+    deadlines[50] = config.get<int>("zmq.deadline_dirty", DEFAULT_DEADLINE_DIRTY);
+    deadlines[100] = config.get<int>("zmq.deadline_render", DEFAULT_DEADLINE_RENDER);
+    deadlines[150] = config.get<int>("zmq.deadline_prio", DEFAULT_DEADLINE_PRIO);
+    return boost::shared_ptr<const rendermq::scheduling_policy>(
+      new rendermq::deadline_policy(deadlines, deadlines[100]));
+  }
 
-        while (!shutdown_requested) {
-          string reply;
+  throw std::runtime_error((boost::format("Unknown scheduler `%1%' in config.") % scheduler).str());
+}
 
-          if (next_heartbeat == 0) {
-            cmd << "HEARTBEAT";
-            cmd >> reply; // which we just discard...
-            next_heartbeat = heartbeat_interval;
-          }
+/* read the weights of each style's share of the workers from the 
+ * [style_weights] section of the config, if there is one.
+ */
+std::map<string, double> make_style_weights(const pt::ptree &config) {
+  std::map<string, double> weights;
+  boost::optional<const pt::ptree &> section = config.get_child_optional("style_weights");
+  if (section) {
+    BOOST_FOREACH(const pt::ptree::value_type &entry, *section) {
+      const double weight = entry.second.get_value<double>();
+      if (weight <= 0.0) {
+        throw std::runtime_error((boost::format("Weight for style `%1%' must be positive.") % entry.first).str());
+      }
+      weights[entry.first] = weight;
+    }
+  }
+  return weights;
+}
 
-          if (next_resubmit == 0) {
-            cmd << "RESUBMIT ZOMBIE TASKS";
-            cmd >> reply;
-            next_resubmit = resubmit_interval;
-          }
+// called by 0MQ when it has finished sending a message which references
+// the metatile, to release that message's reference.
+void release_metatile(void *, void *hint) {
+  delete static_cast<shared_metatile_t *>(hint);
+}
 
-          unsigned int sleep_interval = std::min(next_heartbeat, next_resubmit);
-          next_heartbeat -= sleep_interval;
-          next_resubmit -= sleep_interval;
-          sleep(sleep_interval);
-        }
-    }
-    
-    zmq::context_t & ctx_;  
-  unsigned int heartbeat_interval, resubmit_interval;
-  bool &shutdown_requested;
-  string broker_name;
-};
+/* sends a single tile from the metatile to the handler which asked for
+ * it. the result gives the status and last modified time which the
+ * worker sent back and the reader, if set, is for the format of the
+ * tile.
+ */
+void send_tile_to_subscriber(zstream::socket::xrep &frontend_rep,
+                             const rendermq::tile_protocol &tile_for_subscriber,
+                             const std::string &address,
+                             const rendermq::tile_protocol &result,
+                             const shared_metatile_t &metatile,
+                             const boost::optional<rendermq::metatile_reader> &reader) {
+  typedef std::pair<string::const_iterator, string::const_iterator> string_const_range;
+
+  rendermq::tile_protocol tile_for_handler(tile_for_subscriber);
+  LOG_FINER(boost::format("with tile = %1%") % tile_for_handler);
+
+  tile_for_handler.status = result.status;
+  tile_for_handler.last_modified = result.last_modified;
+
+  string_const_range tile_range(metatile->end(), metatile->end());
+  if (reader) {
+    tile_range = reader->get(tile_for_handler.x, tile_for_handler.y);
+    // TODO: add error handling when range is zero?
+  }
+
+  if (tile_range.first == tile_range.second) {
+    frontend_rep.to(address) << tile_for_handler;
+
+  } else {
+    // the tile's data goes in a separate frame after the tile,
+    // which points into the metatile rather than copying it.
+    const size_t offset = tile_range.first - metatile->begin();
+    const size_t size = tile_range.second - tile_range.first;
+    zmq::message_t body(const_cast<char *>(metatile->data()) + offset, size,
+                        &release_metatile, new shared_metatile_t(metatile));
+    frontend_rep.to(address) << manip::more << tile_for_handler << body;
+  }
+}
 
 void send_tile_to_listeners(rendermq::task_queue &queue,
+                            rendermq::metatile_cache &cache,
                             zstream::socket::xrep &frontend_rep,
                             rendermq::tile_protocol tile_from_worker,
                             const std::string &worker_address) {
   typedef rendermq::task::iterator task_iterator;
   typedef std::pair<task_iterator, task_iterator> task_range;
-  typedef std::pair<string::const_iterator, string::const_iterator> string_const_range;
+  typedef std::map<int, std::vector<task_iterator> > format_groups_t;
 
   boost::optional<const rendermq::task &> t = queue.get(tile_from_worker);
 
   if (t) {
+    // take the metatile out of the tile, so that the tiles sent on to the
+    // handlers can reference it without copying. it stays alive until 
+    // the last message referencing it has been sent.
+    boost::shared_ptr<string> metatile_data(new string);
+    tile_from_worker.swap_data(*metatile_data);
+    const shared_metatile_t metatile(metatile_data);
+
+    // group the subscribers by the format they asked for, so that the
+    // metatile header only needs to be read once for each format.
+    format_groups_t format_groups;
     task_range range = (*t).subscribers();
     for (task_iterator itr = range.first; itr != range.second; ++itr) {
-       LOG_FINER(boost::format("SUB %1% addr size: %2%") % itr->first % itr->second.size());
-       rendermq::tile_protocol tile_for_handler(itr->first);
-       LOG_FINER(boost::format("with tile = %1%") % tile_for_handler);
-                
-      if ((tile_for_handler.status != rendermq::cmdDirty) &&
-          (tile_for_handler.status != rendermq::cmdRenderBulk)) 
-      {
-         tile_for_handler.status = tile_from_worker.status;
-         tile_for_handler.last_modified = tile_from_worker.last_modified;
-
-         if (tile_from_worker.status != rendermq::cmdNotDone) 
-         {
-            rendermq::metatile_reader reader(tile_from_worker.data(), itr->first.format);
-            string_const_range range = reader.get(tile_for_handler.x, tile_for_handler.y);
-            // TODO: add error handling when range is zero?
-            tile_for_handler.set_data(string(range.first,range.second));
-         }
-         frontend_rep.to(itr->second) << tile_for_handler;
+       LOG_FINER(boost::format("SUB %1% addr size: %2%") % queue.subscriber_tile(*t, *itr) 
+                 % queue.address(*itr).size());
+       if ((itr->status != rendermq::cmdDirty) &&
+           (itr->status != rendermq::cmdRenderBulk)) 
+       {
+          format_groups[itr->format].push_back(itr);
+       }
+    }
+
+    for (format_groups_t::iterator group = format_groups.begin(); group != format_groups.end(); ++group) {
+      boost::optional<rendermq::metatile_reader> reader;
+      if (tile_from_worker.status != rendermq::cmdNotDone) {
+        reader = rendermq::metatile_reader(*metatile, group->first);
       }
+
+      BOOST_FOREACH(task_iterator itr, group->second) {
+        send_tile_to_subscriber(frontend_rep, queue.subscriber_tile(*t, *itr), queue.address(*itr),
+                                tile_from_worker, metatile, reader);
+      }
+    }
+
+    // keep hold of the metatile for a little while, in case more 
+    // requests for it arrive just after it's been rendered.
+    if ((tile_from_worker.status == rendermq::cmdDone) && !metatile->empty()) {
+      cache.insert(tile_from_worker, metatile, std::time(0));
     }
+
     // erase task
     queue.erase(tile_from_worker);
   }
 }
 
+// compares and hashes metatiles by their position and style only.
+struct metatile_equal {
+  bool operator()(const rendermq::tile_protocol &a, const rendermq::tile_protocol &b) const {
+    return (a.x == b.x && a.y == b.y && a.z == b.z && a.style == b.style);
+  }
+};
+
+struct metatile_hash {
+  size_t operator()(const rendermq::tile_protocol &t) const {
+    return hash_value(t);
+  }
+};
+
+// the inproc:// endpoints which the router and shards of a sharded
+// broker use to talk to each other.
+string shard_endpoint(const string &broker_name, unsigned int index, const string &socket) {
+  return (boost::format("inproc://broker-%1%-shard-%2%-%3%") % broker_name % index % socket).str();
+}
+
+string status_endpoint(const string &broker_name) {
+  return "inproc://broker-" + broker_name + "-status";
+}
+
+/* read just the position and style from a serialised tile, which is 
+ * enough to know which shard it belongs to, without copying the image 
+ * data out of it as parsing the whole tile would.
+ */
+bool peek_metatile(zmq::message_t &msg, rendermq::tile_protocol &tile) {
+  using google::protobuf::internal::WireFormatLite;
+  google::protobuf::io::CodedInputStream in(static_cast<const google::protobuf::uint8 *>(msg.data()), 
+                                            msg.size());
+  google::protobuf::uint32 tag, value;
+
+  while ((tag = in.ReadTag()) != 0) {
+    switch (WireFormatLite::GetTagFieldNumber(tag)) {
+    case 2:
+      if (!in.ReadVarint32(&value)) { return false; }
+      tile.x = int(value);
+      break;
+    case 3:
+      if (!in.ReadVarint32(&value)) { return false; }
+      tile.y = int(value);
+      break;
+    case 4:
+      if (!in.ReadVarint32(&value)) { return false; }
+      tile.z = int(value);
+      break;
+    case 7:
+      if (!WireFormatLite::ReadString(&in, &tile.style)) { return false; }
+      break;
+    default:
+      if (!WireFormatLite::SkipField(&in, tag)) { return false; }
+    }
+  }
+
+  return true;
+}
+
+// send msg, which has been read from in, and the rest of the multi-part
+// message it's part of to out.
+void forward(zstream::socket::isocket &in, zstream::socket::osocket &out, zmq::message_t &msg) {
+  while (in.has_more()) {
+    out << manip::more << msg;
+    in >> msg;
+  }
+  out << msg;
+}
+
+// throw away the rest of a multi-part message.
+void drain(zstream::socket::isocket &in) {
+  zmq::message_t msg;
+  while (in.has_more()) {
+    in >> msg;
+  }
+}
+
+// the poll timeout for a number of milliseconds, or -1 to wait for as
+// long as it takes. 0MQ before 3.0 takes the timeout in microseconds.
+long poll_timeout(long ms) {
+#if ZMQ_VERSION_MAJOR < 3
+  return (ms < 0) ? ms : ms * 1000;
+#else
+  return ms;
+#endif
+}
+
+unsigned int seconds_to_ms(double seconds) {
+  return (unsigned int)(seconds * 1000);
+}
+
+zmq::pollitem_t pollin(zstream::socket::basic_socket &s) {
+  zmq::pollitem_t item = { s.socket(), 0, ZMQ_POLLIN, 0 };
+  return item;
+}
+
+/* combine the STATS replies from the shards of a broker, along with
+ * the router's own. the counts are added up, except for the highest 
+ * priority which is the highest of any of the shards.
+ */
+string aggregate_stats(const std::vector<string> &replies, const string &router_stats) {
+  std::vector<string> keys;
+  map<string, long long> values;
+
+  std::vector<string> all_stats(replies);
+  all_stats.push_back(router_stats);
+
+  BOOST_FOREACH(const string &reply, all_stats) {
+    std::istringstream in(reply);
+    string field;
+    while (in >> field) {
+      const string::size_type eq = field.find('=');
+      if (eq == string::npos) { continue; }
+
+      const string key = field.substr(0, eq);
+      const long long value = std::strtoll(field.c_str() + eq + 1, 0, 10);
+      map<string, long long>::iterator itr = values.find(key);
+      if (itr == values.end()) {
+        keys.push_back(key);
+        values.insert(std::make_pair(key, value));
+      } else if (key.compare("highest_priority") == 0) {
+        itr->second = std::max(itr->second, value);
+      } else {
+        itr->second += value;
+      }
+    }
+  }
+
+  string stats = (boost::format("shards=%1%") % replies.size()).str();
+  BOOST_FOREACH(const string &key, keys) {
+    stats += (boost::format(" %1%=%2%") % key % values[key]).str();
+  }
+  return stats;
+}
+
 } // anonymous namespace
 
 namespace rendermq {
 
 struct broker_impl::pimpl {
+  /* the broker's state and sockets. a broker which isn't sharded has
+   * one of these, bound to the external sockets. a sharded broker has
+   * one bound to the external sockets which routes messages to the
+   * shards, each of which has another bound to inproc:// sockets. the
+   * cache is divided between the shards.
+   */
   pimpl(const pt::ptree &config, 
         const string &name,
-        zmq::context_t &ctx) 
+        zmq::context_t &ctx,
+        size_t num_shards = 1) 
     : context(ctx),
-      frontend_rep(context), frontend_pub(context), 
-      backend_rep(context), backend_pub(context),
+      frontend_pub(context), backend_pub(context),
       monitor(context),
-      heartbeat_interval(config.get<unsigned int>("zmq.heartbeat_time")),
-      resubmit_interval(config.get<unsigned int>("zmq.resubmit_interval", heartbeat_interval)),
+      heartbeat_interval(seconds_to_ms(config.get<double>("zmq.heartbeat_time"))),
+      resubmit_interval(seconds_to_ms(config.get<double>("zmq.resubmit_interval", heartbeat_interval / 1000.0))),
+      lease_time(config.get<unsigned int>("zmq.lease_time", DEFAULT_LEASE_TIME)),
       zombie_time(config.get<unsigned int>("zmq.zombie_time", DEFAULT_ZOMBIE_TIME)),
-      shutdown_requested(false),
-      broker_name(name) {
+      max_lease_jobs(config.get<size_t>("zmq.max_lease_jobs", DEFAULT_MAX_LEASE_JOBS)),
+      bulk_memory_limit(std::max(config.get<size_t>("zmq.bulk_memory_limit", DEFAULT_BULK_MEMORY_LIMIT) / num_shards, 
+                                 size_t(1))),
+      cache(size_t(config.get<double>("zmq.completed_cache_size", DEFAULT_COMPLETED_CACHE_SIZE) * 1024 * 1024) / num_shards,
+            config.get<int>("zmq.completed_cache_ttl", DEFAULT_COMPLETED_CACHE_TTL)),
+      job_wait_time(seconds_to_ms(config.get<double>("zmq.job_wait_time", DEFAULT_JOB_WAIT_TIME))),
+      num_wasted_job_requests(0),
+      num_jobs_leased(0),
+      durations(STRAGGLER_SAMPLES, STRAGGLER_MIN_SAMPLES),
+      straggler_percentile(config.get<double>("zmq.straggler_percentile", DEFAULT_STRAGGLER_PERCENTILE)),
+      num_backup_jobs(0),
+      num_discarded_results(0),
+      costs(new rendermq::render_cost_model(DEFAULT_RENDER_COST, RENDER_COST_SMOOTHING)),
+      costs_changed(false),
+      broker_name(name),
+      shard_index(0),
+      timers(TIMER_WHEEL_SLOTS, 1, rendermq::timer_wheel::now()) {
+    queue.set_scheduling_policy(make_scheduling_policy(config));
+    queue.set_locality_radius(config.get<int>("zmq.locality_radius", DEFAULT_LOCALITY_RADIUS));
+    queue.set_style_weights(make_style_weights(config));
+    queue.set_cost_model(costs);
+    queue.set_cheapest_first(CHEAPEST_FIRST_MIN_PRIORITY,
+      config.get<size_t>("zmq.cheapest_first_window", DEFAULT_CHEAPEST_FIRST_WINDOW));
   }
 
+  struct shard;
+
+  /* keep a journal of the changes to the queue, if there's a 
+   * directory configured for it, so that the queue survives a restart.
+   * each broker, and each shard of it, has its own subdirectory. the 
+   * queue is rebuilt from whatever is already in the journal.
+   */
+  void open_journal(const pt::ptree &config, const string &subdirectory) {
+    boost::optional<string> dir = config.get_optional<string>("zmq.journal_dir");
+    if (!dir) { return; }
+
+    string path = *dir + "/" + broker_name;
+    if (!subdirectory.empty()) { path += "/" + subdirectory; }
+    journal.reset(new rendermq::queue_journal(path, 
+      config.get<int>("zmq.journal_commit_interval", DEFAULT_JOURNAL_COMMIT_INTERVAL),
+      size_t(config.get<double>("zmq.journal_snapshot_size", DEFAULT_JOURNAL_SNAPSHOT_SIZE) * 1024 * 1024)));
+
+    const std::time_t start = std::time(0);
+    const size_t changes = journal->recover(queue);
+    journal->snapshot(queue);
+    queue.set_listener(journal);
+
+    if (changes > 0) {
+      LOG_INFO(boost::format("Recovered %1% jobs from %2% journalled changes in `%3%' in %4% s.") 
+               % queue.size() % changes % path % (std::time(0) - start));
+    }
+  }
+
+  /* keep the estimates of how long renders take in a file, if there's
+   * a directory configured for it, so that they don't have to be 
+   * learned again after a restart. each broker, and each shard of it,
+   * has its own subdirectory.
+   */
+  void open_render_costs(const pt::ptree &config, const string &subdirectory) {
+    boost::optional<string> dir = config.get_optional<string>("zmq.render_cost_dir");
+    if (!dir) { return; }
+
+    string path = *dir + "/" + broker_name;
+    if (!subdirectory.empty()) { path += "/" + subdirectory; }
+    boost::filesystem::create_directories(path);
+    costs_file = path + "/render_costs";
+
+    if (costs->load(*costs_file)) {
+      LOG_INFO(boost::format("Loaded %1% render cost estimates from `%2%'.") % costs->size() % *costs_file);
+    }
+  }
+
+  void save_render_costs() {
+    if (costs_file && costs_changed) {
+      try {
+        costs->save(*costs_file);
+        costs_changed = false;
+      } catch (const std::exception &e) {
+        LOG_ERROR(boost::format("Unable to save render cost estimates: %1%") % e.what());
+      }
+    }
+  }
+
+  /* the number of seconds the workers are expected to take to get 
+   * through the jobs waiting in the queue, judging by how long recent
+   * renders took. spilled bulk jobs are expected to take the average.
+   * each worker is taken to work on one job at a time.
+   */
+  uint64_t drain_time() const {
+    double cost = queue.expected_cost();
+    if (spill) { cost += spill->size() * costs->default_cost(); }
+    const size_t workers = std::max(worker_last_seen.size(), size_t(1));
+    return uint64_t(cost / 1000.0 / workers);
+  }
+
+  /* spill bulk jobs over the memory limit to disk, if there's a
+   * directory configured for it. each broker, and each shard of it,
+   * has its own subdirectory. jobs which were spilled before the broker
+   * last stopped are picked up again.
+   */
+  void open_spill(const pt::ptree &config, const string &subdirectory) {
+    boost::optional<string> dir = config.get_optional<string>("zmq.bulk_spill_dir");
+    if (!dir) { return; }
+
+    string path = *dir + "/" + broker_name;
+    if (!subdirectory.empty()) { path += "/" + subdirectory; }
+    spill.reset(new rendermq::bulk_spill(path, 
+      size_t(config.get<double>("zmq.bulk_spill_segment_size", DEFAULT_BULK_SPILL_SEGMENT_SIZE) * 1024 * 1024)));
+
+    if (!spill->empty()) {
+      LOG_INFO(boost::format("Recovered %1% spilled bulk jobs from `%2%'.") % spill->size() % path);
+    }
+    refill_bulk();
+  }
+
+  /* spill a bulk request to disk if there are already too many bulk 
+   * jobs in memory, or there are older ones already spilled. requests
+   * which would be merged with a job already in the queue aren't 
+   * spilled, as they don't take up any more space. returns true if 
+   * the request was spilled.
+   */
+  bool spill_bulk(const tile_protocol &tile, const string &address) {
+    if (!spill || (tile.status != cmdRenderBulk)) { return false; }
+    if (spill->empty() && (queue.count_unprocessed(0) < bulk_memory_limit)) { return false; }
+    if (queue.contains(tile)) { return false; }
+
+    spill->push(tile, address, std::time(0));
+    return true;
+  }
+
+  // bring spilled bulk jobs back into memory as the ones there drain.
+  void refill_bulk() {
+    if (!spill) { return; }
+
+    tile_protocol tile;
+    string address;
+    std::time_t arrived = 0;
+    while (!spill->empty() && (queue.count_unprocessed(0) < bulk_memory_limit)) {
+      try {
+        if (!spill->pop(tile, address, arrived)) { break; }
+        queue.push(tile, address, 0, arrived);
+
+      } catch (const std::exception &e) {
+        LOG_ERROR(boost::format("Unable to read spilled bulk job: %1%") % e.what());
+      }
+    }
+  }
+
+  // the number of jobs waiting to be handed out, including any which
+  // have been spilled to disk.
+  uint64_t count_unprocessed() const {
+    return queue.count_unprocessed() + (spill ? spill->size() : 0);
+  }
+
+  // set up the sockets which the handlers, workers and monitor use.
+  void bind(const dqueue::conf::broker &conf) {
+    frontend_rep.reset(new zstream::socket::xrep(context));
+    frontend_rep->set_identity(conf.in_identity.get_value_or(dqueue::util::make_uuid()));
+    frontend_rep->bind(conf.in_req);
+    frontend_pub.bind(conf.in_sub);
+
+    backend_rep.reset(new zstream::socket::xrep(context));
+    backend_rep->set_identity(conf.out_identity.get_value_or(dqueue::util::make_uuid()));
+    backend_rep->bind(conf.out_req);
+    backend_pub.bind(conf.out_sub);
+
+    monitor.bind(conf.monitor); // external monitor
+  }
+
+  // set up the sockets for a shard, which only the router talks to.
+  void bind_shard(unsigned int index) {
+    shard_index = index;
+
+    frontend_rep.reset(new zstream::socket::xpair(context));
+    frontend_rep->bind(shard_endpoint(broker_name, index, "frontend"));
+    backend_rep.reset(new zstream::socket::xpair(context));
+    backend_rep->bind(shard_endpoint(broker_name, index, "backend"));
+    monitor.bind(shard_endpoint(broker_name, index, "monitor"));
+
+    status_push.reset(new zstream::socket::push(context));
+    status_push->connect(status_endpoint(broker_name));
+  }
+
+  // start the shards' threads. this must be done after bind().
+  void start_shards(const pt::ptree &config, size_t num_shards);
+
   void publish_availability() {
+    // workers waiting for jobs are sent them directly, so only what's
+    // left after that, e.g: jobs which none of them can render, needs
+    // announcing to all the others.
+    if (!shards.empty()) {
+      route_to_waiting();
+    } else if (!status_push) {
+      dispatch_to_waiting();
+    }
+
+    uint32_t priority = 0;
+    uint64_t unprocessed = 0;
+
+    if (!shards.empty()) {
+      if (!shard_status(priority, unprocessed)) { return; }
+
+    } else if (status_push) {
+      // shards don't talk to the workers directly, the router does
+      // that on behalf of all the shards.
+      return;
+
+    } else {
+      boost::optional<const task &> t = queue.front();
+      if (!t) { return; }
+      priority = t->priority();
+      unprocessed = count_unprocessed();
+    }
+
+    LOG_FINER(boost::format("Publish: %1% jobs available at priority %2%") % unprocessed % priority);
+
+    // send own XREQ address followed by message about task availability, the highest
+    // priority item in the queue and the number of unprocessed items in the queue.
+    backend_pub 
+      << manip::more << backend_rep->identity() 
+      << manip::more << "JOBS AVAILABLE"
+      << manip::more << priority << unprocessed;
+  }
+
+  /* the next job to hand out to a worker, which is one near to the
+   * last job it was given if possible.
+   */
+  boost::optional<const task &> next_job(const string &worker) {
+    std::map<string, rendermq::style_set>::const_iterator styles = worker_styles.find(worker);
+    std::map<string, tile_protocol>::const_iterator itr = worker_last_job.find(worker);
+    if (styles == worker_styles.end()) {
+      if (itr == worker_last_job.end()) { return queue.front(); }
+      return queue.front(std::time(0), itr->second);
+    }
+    if (itr == worker_last_job.end()) { return queue.front(std::time(0), styles->second); }
+    return queue.front(std::time(0), itr->second, styles->second);
+  }
+
+  /* read the styles which follow a worker's STYLES message or request
+   * for jobs. these are the only styles the worker can render, or it
+   * can render any if there are none.
+   */
+  rendermq::style_set read_styles() {
+    rendermq::style_set styles;
+    while (backend_rep->has_more()) {
+      string style;
+      *backend_rep >> style;
+      styles.insert(style);
+    }
+    return styles;
+  }
+
+  void set_styles(const string &worker, const rendermq::style_set &styles) {
+    if (styles.empty()) {
+      worker_styles.erase(worker);
+    } else {
+      worker_styles[worker] = styles;
+    }
+  }
+
+
+  /* hand out up to num_requested jobs to a worker in one multi-part
+   * reply of "JOBS" followed by the jobs, or "NO JOBS" if there are
+   * none available.
+   *
+   * the worker processes the jobs in turn, so each one gets a lease
+   * which runs out after the earlier ones in the batch would have. 
+   * this stops jobs waiting in the worker's buffer from being 
+   * resubmitted while the worker is still healthy.
+   */
+  void lease_jobs(const list<string> &worker_addresses, uint32_t num_requested) {
+    std::vector<tile_protocol> jobs;
+    const std::time_t now = std::time(0);
+    const size_t limit = std::min(size_t(num_requested), max_lease_jobs);
+
+    while (jobs.size() < limit) {
+      boost::optional<const task &> t = next_job(worker_addresses.front());
+      if (!t) { break; }
+      tile_protocol proto = queue.tile(*t);
+      queue.set_processed(proto, worker_addresses.front(), now + std::time_t((jobs.size() + 1) * lease_time));
+      worker_last_job[worker_addresses.front()] = proto;
+      record_dispatch(proto, worker_addresses.front());
+      jobs.push_back(proto);
+    }
+
+    num_jobs_leased += jobs.size();
+
+    if (jobs.empty()) {
+      backend_rep->to(worker_addresses) << "NO JOBS";
+      ++num_wasted_job_requests;
+
+    } else {
+      zstream::socket::osocket &reply = backend_rep->to(worker_addresses);
+      reply << manip::more << "JOBS";
+      for (size_t i = 0; i < jobs.size(); ++i) {
+        if (i + 1 < jobs.size()) { reply << manip::more; }
+        reply << jobs[i];
+      }
+      LOG_FINER(boost::format("Leased %1% of %2% requested jobs to `%3%'.") 
+                % jobs.size() % num_requested % worker_addresses.front());
+    }
+  }
+
+  /* keep a worker which asked for jobs when there weren't any waiting
+   * for them to come in, for up to the job wait time.
+   */
+  void wait_for_jobs(const list<string> &worker_addresses, uint32_t num_requested,
+                     const rendermq::style_set &styles) {
+    const rendermq::timer_wheel::timer_id timer = 
+      timers.schedule(rendermq::timer_wheel::now() + job_wait_time,
+                      boost::bind(&pimpl::on_wait_timeout, this, worker_addresses.front()));
+    boost::optional<rendermq::waiting_worker> previous = 
+      idle.wait(rendermq::waiting_worker(worker_addresses, num_requested, timer, styles));
+    if (previous) { timers.cancel(previous->timer); }
+  }
+
+  // stop a worker waiting for jobs, e.g: because it's asked for them in
+  // some other way, or gone away.
+  void stop_waiting(const string &worker) {
+    boost::optional<rendermq::waiting_worker> w = idle.remove(worker);
+    if (w) { timers.cancel(w->timer); }
+  }
+
+  // nothing came in while the worker was waiting, so tell it to ask 
+  // again. this also lets it know that the broker is still there.
+  void on_wait_timeout(const string &worker) {
+    boost::optional<rendermq::waiting_worker> w = idle.remove(worker);
+    if (w) { backend_rep->to(w->addresses) << "NO JOBS"; }
+  }
+
+  // hand out jobs to the workers waiting for them, for as long as there
+  // are both. a worker which can't render any of the jobs keeps waiting,
+  // and the others are looked at in turn.
+  void dispatch_to_waiting() {
+    rendermq::idle_workers::iterator itr = idle.begin();
+    while ((itr != idle.end()) && (count_unprocessed() > 0)) {
+      const string worker = itr->id();
+      ++itr;
+      if (next_job(worker)) {
+        rendermq::waiting_worker w = *idle.remove(worker);
+        timers.cancel(w.timer);
+        lease_jobs(w.addresses, w.num_jobs);
+      }
+    }
+  }
+
+  // take the worker which has been waiting longest of those which can
+  // render the style, if there are any.
+  boost::optional<rendermq::waiting_worker> take_waiting(const string &style) {
+    for (rendermq::idle_workers::iterator itr = idle.begin(); itr != idle.end(); ++itr) {
+      if (itr->renders(style)) {
+        boost::optional<rendermq::waiting_worker> w = idle.remove(itr->id());
+        timers.cancel(w->timer);
+        return w;
+      }
+    }
+    return boost::none;
+  }
+
+  // whether jobs which are taking too long are given to a second
+  // worker. only a broker which isn't sharded has the waiting workers
+  // and the jobs to hand to them both.
+  bool speculative() const {
+    return (straggler_percentile > 0) && shards.empty() && !status_push;
+  }
+
+  /* note that a job was handed out, to time how long it takes. a worker
+   * works through the jobs it's given in turn, so a job which is behind
+   * others in the worker's buffer isn't timed until the one in front of
+   * it comes back. otherwise its time would include waiting for those.
+   */
+  void record_dispatch(const tile_protocol &job, const string &worker) {
+    dispatch_info &info = dispatched[job];
+    info.time = 0;
+    info.worker = worker;
+    info.started = false;
+    info.backup = false;
+    worker_jobs[worker].push_back(job);
+    start_next_job(worker);
+  }
+
+  // start the clock on the first job in the worker's buffer, skipping
+  // any which have come back, been given to another worker or aren't
+  // being timed any more.
+  void start_next_job(const string &worker) {
+    std::map<string, std::deque<tile_protocol> >::iterator jobs = worker_jobs.find(worker);
+    if (jobs == worker_jobs.end()) { return; }
+
+    while (!jobs->second.empty()) {
+      dispatched_t::iterator itr = dispatched.find(jobs->second.front());
+      if ((itr != dispatched.end()) && (itr->second.worker == worker)) {
+        if (!itr->second.started) {
+          itr->second.time = rendermq::timer_wheel::now();
+          itr->second.started = true;
+        }
+        return;
+      }
+      jobs->second.pop_front();
+    }
+    worker_jobs.erase(jobs);
+  }
+
+  // note how long a job took to come back from the worker it was given
+  // to. if the backup copy came back first then how long the original
+  // would have taken isn't known, so that isn't counted.
+  void record_render_time(const tile_protocol &meta, const string &worker) {
+    dispatched_t::iterator itr = dispatched.find(meta);
+    if (itr == dispatched.end()) { return; }
+
+    if ((itr->second.worker == worker) && itr->second.started) {
+      const boost::uint64_t time = rendermq::timer_wheel::now() - itr->second.time;
+      durations.record(meta.style, meta.z, time);
+      costs->record(meta.style, meta.z, double(time));
+      costs_changed = true;
+    }
+    dispatched.erase(itr);
+    start_next_job(worker);
+  }
+
+  // a result came back from a worker for a job which had already been
+  // answered, so the worker has moved on to the next job it holds.
+  void record_discarded(const tile_protocol &meta, const string &worker) {
+    dispatched_t::iterator itr = dispatched.find(meta);
+    if ((itr != dispatched.end()) && (itr->second.worker == worker)) {
+      dispatched.erase(itr);
+    }
+    start_next_job(worker);
+  }
+
+  /* give a backup copy of each job which has clients waiting for it,
+   * and has been rendering for longer than most renders of the same 
+   * style and zoom, to a waiting worker. the first result back is used
+   * and the other thrown away.
+   *
+   * the backup copy isn't leased, as the task can only be leased to one
+   * worker. the original worker keeps the lease, and if that runs out 
+   * then the job goes back on the queue as usual.
+   */
+  void redispatch_stragglers() {
+    const boost::uint64_t now = rendermq::timer_wheel::now();
+
+    dispatched_t::iterator itr = dispatched.begin();
+    while (itr != dispatched.end()) {
+      // forget jobs which have been answered or made available again.
+      boost::optional<const task &> t = queue.get(itr->first);
+      if (!t || !t->processed()) {
+        itr = dispatched.erase(itr);
+        continue;
+      }
+
+      // render and prio requests are the ones with clients waiting.
+      if (speculative() && !idle.empty() && itr->second.started && !itr->second.backup && 
+          (t->priority() >= 100)) {
+        boost::optional<boost::uint64_t> expected = 
+          durations.percentile(itr->first.style, itr->first.z, straggler_percentile);
+        boost::optional<rendermq::waiting_worker> w;
+        if (expected && (now - itr->second.time > *expected)) {
+          w = take_waiting(itr->first.style);
+        }
+
+        if (w) {
+          const tile_protocol job = queue.tile(*t);
+          backend_rep->to(w->addresses) << manip::more << "JOBS" << job;
+          worker_last_job[w->id()] = job;
+          itr->second.backup = true;
+          ++num_backup_jobs;
+
+          LOG_INFO(boost::format("Job %1% has taken %2% ms, more than the expected %3% ms, so "
+                                 "gave a backup copy to `%4%'.") 
+                   % job % (now - itr->second.time) % *expected % w->id());
+        }
+      }
+      ++itr;
+    }
+  }
+
+  void on_straggler_timer() {
+    redispatch_stragglers();
+    timers.schedule(rendermq::timer_wheel::now() + STRAGGLER_CHECK_INTERVAL, 
+                    boost::bind(&pimpl::on_straggler_timer, this));
+  }
+
+  /* make the jobs available again whose leases have run out. workers
+   * which haven't been heard from in the zombie time are presumed 
+   * dead, and any jobs they had waiting to be processed are released
+   * too, rather than waiting for those later leases to run out.
+   */
+  void reclaim_leases() {
+    const std::time_t now = std::time(0);
+    size_t count = queue.resubmit_expired(now);
+
+    std::map<string, std::time_t>::iterator itr = worker_last_seen.begin();
+    while (itr != worker_last_seen.end()) {
+      if (itr->second + std::time_t(zombie_time) <= now) {
+        count += queue.release(itr->first);
+        worker_last_job.erase(itr->first);
+        worker_jobs.erase(itr->first);
+        worker_styles.erase(itr->first);
+        stop_waiting(itr->first);
+        worker_last_seen.erase(itr++);
+      } else {
+        ++itr;
+      }
+    }
+
+    if (count > 0) {
+      LOG_INFO(boost::format("Reclaimed %1% jobs from expired leases.") % count);
+      publish_availability();
+    }
+  }
+
+  // tell the router the priority of the front of this shard's queue and
+  // how many unprocessed jobs there are, if that has changed since it
+  // was last told (or if forced to).
+  void report_status(bool force) {
     boost::optional<const task &> t = queue.front();
+    const uint32_t priority = t ? t->priority() : 0;
+    const uint64_t unprocessed = count_unprocessed();
+
+    if (force || !reported_status || 
+        (reported_status->first != priority) || (reported_status->second != unprocessed)) {
+      *status_push 
+        << manip::more << uint32_t(shard_index)
+        << manip::more << priority 
+        << manip::more << unprocessed
+        << drain_time();
+      reported_status = std::make_pair(priority, unprocessed);
+    }
+  }
+
+  void heartbeat() {
+    save_render_costs();
+
+    if (status_push) {
+      // a shard's heartbeat is its status, which the router 
+      // aggregates into the heartbeat for the whole broker.
+      report_status(true);
+
+    } else {
+      // send frontends a queue count, so they know how busy the queues
+      // are. this should allow them to make decisions about whether to 
+      // send clients old tiles or not.
+      frontend_pub 
+        << manip::more << frontend_rep->identity()
+        << manip::more << count_unprocessed()
+        << drain_time();
+
+      // publish availability information to the workers, so that they 
+      // can claim jobs if they want to.
+      publish_availability();
+    }
+  }
+
+  /* start the timers for the heartbeat and for reclaiming expired 
+   * leases. a shard leaves the heartbeat to the router, and the router
+   * leaves the leases to the shards.
+   */
+  void start_timers() {
+    const boost::uint64_t now = rendermq::timer_wheel::now();
+    if (!status_push) {
+      timers.schedule(now, boost::bind(&pimpl::on_heartbeat_timer, this, now));
+    }
+    if (shards.empty()) {
+      timers.schedule(now + resubmit_interval, boost::bind(&pimpl::on_reclaim_timer, this));
+    }
+    if (shards.empty()) {
+      timers.schedule(now + STRAGGLER_CHECK_INTERVAL, boost::bind(&pimpl::on_straggler_timer, this));
+    }
+  }
+
+  void on_heartbeat_timer(boost::uint64_t due) {
+    if (shards.empty()) {
+      heartbeat();
+    } else {
+      route_heartbeat();
+    }
 
-    if (t) {
-      uint32_t priority = t->priority();
-      uint64_t unprocessed = queue.count_unprocessed();
+    // keep to the schedule, rather than drifting by however late this
+    // timer went off, unless it's so late that a heartbeat was missed.
+    const boost::uint64_t next = std::max(due + heartbeat_interval, rendermq::timer_wheel::now());
+    timers.schedule(next, boost::bind(&pimpl::on_heartbeat_timer, this, next));
+  }
 
-      LOG_FINER(boost::format("Publish: %1% jobs available at priority %2%") % unprocessed % priority);
+  // reclaim expired leases every resubmit interval, or as soon as the
+  // next lease runs out if that's sooner.
+  void on_reclaim_timer() {
+    reclaim_leases();
 
-      // send own XREQ address followed by message about task availability, the highest
-      // priority item in the queue and the number of unprocessed items in the queue.
-      backend_pub 
-        << manip::more << backend_rep.identity() 
-        << manip::more << "JOBS AVAILABLE"
-        << manip::more << priority << unprocessed;
+    const boost::uint64_t now = rendermq::timer_wheel::now();
+    boost::uint64_t next = now + resubmit_interval;
+    boost::optional<std::time_t> expiry = queue.next_lease_expiry();
+    if (expiry) {
+      const std::time_t wait = std::max(*expiry - std::time(0), std::time_t(1));
+      next = std::min(next, now + boost::uint64_t(wait) * 1000);
     }
+    timers.schedule(next, boost::bind(&pimpl::on_reclaim_timer, this));
   }
 
+  // run the broker's event loop on the queue, until asked to shut down.
+  void run() {
+    start_timers();
+
+    while (true) {
+      //  Initialize poll set
+      zmq::pollitem_t items [] = {
+        // Always poll for worker activity on backend
+        { backend_rep->socket(),  0, ZMQ_POLLIN, 0 },
+        // Always poll front-end
+        { frontend_rep->socket(), 0, ZMQ_POLLIN, 0 },
+        // Monitoring socket
+        { monitor.socket(), 0, ZMQ_POLLIN, 0 },
+      };
+    
+      zmq::poll (&items [0], 3, poll_timeout(timers.timeout(rendermq::timer_wheel::now())));
+    
+      //  Handle worker activity on backend
+      if (items [0].revents & ZMQ_POLLIN) {
+        list<string> worker_addresses;
+        string command;
+      
+        // message parts are worker, client addresses then the returned metatile.
+        manip::routing_headers headers(worker_addresses);
+        *backend_rep >> headers >> command;
+        LOG_FINER(boost::format("Message from `%1%': %2%") % worker_addresses.front() % command);
+
+        if ((command.compare("RESULT") == 0) && backend_rep->has_more()) { 
+          // a job which was also given to another worker may already 
+          // have been answered, in which case the result is thrown away
+          // without parsing the image data out of it.
+          zmq::message_t msg;
+          tile_protocol meta;
+          *backend_rep >> msg;
+
+          if (!peek_metatile(msg, meta)) {
+            LOG_ERROR(boost::format("Unable to parse result from `%1%'.") % worker_addresses.front());
+
+          } else if (!queue.contains(meta)) {
+            LOG_FINER(boost::format("Discarding result for %1% from `%2%', which isn't queued.") 
+                      % meta % worker_addresses.front());
+            record_discarded(meta, worker_addresses.front());
+            ++num_discarded_results;
+
+          } else if (rendermq::unserialise(static_cast<const char *>(msg.data()), msg.size(), meta)) {
+            record_render_time(meta, worker_addresses.front());
+            send_tile_to_listeners(queue, cache, *frontend_rep, meta, worker_addresses.front());
+
+          } else {
+            LOG_ERROR(boost::format("Unable to parse result from `%1%'.") % worker_addresses.front());
+          }
+        }
+      
+        if ((command.compare("GET_JOB") == 0) || (command.compare("GET_JOBS") == 0) ||
+            (command.compare("CANCEL_WAIT") == 0)) {
+          stop_waiting(worker_addresses.front());
+        }
+
+        if (command.compare("STYLES") == 0) {
+          set_styles(worker_addresses.front(), read_styles());
+        }
+
+        if (command.compare("GET_JOB") == 0) {
+          set_styles(worker_addresses.front(), read_styles());
+          boost::optional<const task &> t = next_job(worker_addresses.front());
+          if (t) {
+            tile_protocol proto = queue.tile(*t);
+            backend_rep->to(worker_addresses) << manip::more << "JOB" << proto;
+            queue.set_processed(proto, worker_addresses.front(), std::time(0) + lease_time);
+            worker_last_job[worker_addresses.front()] = proto;
+            record_dispatch(proto, worker_addresses.front());
+            ++num_jobs_leased;
+          
+          } else {
+            backend_rep->to(worker_addresses) << "NO JOBS";
+            ++num_wasted_job_requests;
+          }
+          // TODO: do we need the "optimisation" of sending back whether there are
+          // any jobs when the worker gives us back a complete job?
+        }
+
+        if ((command.compare("GET_JOBS") == 0) && backend_rep->has_more()) {
+          // batched version of the above, which saves the worker a round
+          // trip per job when the jobs are quick to render.
+          uint32_t num_requested = 0;
+          *backend_rep >> num_requested;
+          set_styles(worker_addresses.front(), read_styles());
+          lease_jobs(worker_addresses, num_requested);
+        }
+
+        if ((command.compare("WAIT_JOBS") == 0) && backend_rep->has_more()) {
+          // as GET_JOBS, except that when there aren't any jobs the 
+          // worker waits for some to come in, instead of being told 
+          // there are none and waiting for the next announcement.
+          uint32_t num_requested = 0;
+          *backend_rep >> num_requested;
+          const rendermq::style_set styles = read_styles();
+          set_styles(worker_addresses.front(), styles);
+          if (next_job(worker_addresses.front())) {
+            lease_jobs(worker_addresses, num_requested);
+          } else {
+            wait_for_jobs(worker_addresses, num_requested, styles);
+          }
+        }
+
+        if (command.compare("RENEW") == 0) {
+          // the worker is still busy with these jobs, so they shouldn't
+          // be given to anyone else yet. they're in the order that the 
+          // worker will process them, as with a batch of jobs.
+          const std::time_t now = std::time(0);
+          std::time_t expiry = now;
+          while (backend_rep->has_more()) {
+            tile_protocol tile;
+            *backend_rep >> tile;
+            expiry += lease_time;
+            queue.renew(tile, worker_addresses.front(), expiry);
+          }
+        }
+
+        if (command.compare("RELEASE") == 0) {
+          // the worker is going away, so its jobs can go straight to
+          // other workers.
+          worker_last_seen.erase(worker_addresses.front());
+          worker_last_job.erase(worker_addresses.front());
+          worker_jobs.erase(worker_addresses.front());
+          worker_styles.erase(worker_addresses.front());
+          stop_waiting(worker_addresses.front());
+          if (queue.release(worker_addresses.front()) > 0) {
+            publish_availability();
+          }
+        } else {
+          worker_last_seen[worker_addresses.front()] = std::time(0);
+        }
+      }
+    
+      // frontend communications with the handlers
+      if (items [1].revents & ZMQ_POLLIN) {            
+        list<string> client_addresses;
+        tile_protocol tile;
+      
+        zstream::manip::routing_headers headers(client_addresses);
+        *frontend_rep >> headers >> tile;
+      
+        int priority = 100;
+        if (tile.status == cmdRenderBulk ) priority = 0;
+        else if (tile.status == cmdDirty) priority = 50;
+        else if (tile.status == cmdRenderPrio) priority = 150;
+
+        LOG_FINER(boost::format("Tile request: %1% priority=%2%") % tile % priority);
+
+        // requests for metatiles which have only just been rendered can
+        // be answered from the cache. bulk and dirty requests are how
+        // expired tiles get re-rendered, so they have to go to a worker
+        // and anything cached for the metatile is out of date.
+        boost::optional<const cached_metatile &> cached;
+        if ((tile.status == cmdRender) || (tile.status == cmdRenderPrio)) {
+          cached = cache.find(tile, std::time(0));
+        } else if ((tile.status == cmdRenderBulk) || (tile.status == cmdDirty)) {
+          cache.erase(tile);
+        }
+
+        if (cached) {
+          boost::optional<metatile_reader> reader = metatile_reader(*cached->data, tile.format);
+          send_tile_to_subscriber(*frontend_rep, tile, client_addresses.front(),
+                                  cached->tile, cached->data, reader);
+
+        } else if (!spill_bulk(tile, client_addresses.front())) {
+          // take a look at the highest priority task in the queue before we add this one.
+          boost::optional<const task &> front_task = queue.front();
+      
+          queue.push(tile, client_addresses.front(), priority);
+      
+          // we send out a notification to all listening workers if the priority of the 
+          // highest priority item in the queue has changed.
+          if ((!front_task) || (front_task->priority() < priority)) {
+            publish_availability();
+          }
+        }
+      }
+    
+      // monitor
+      if (items [2].revents & ZMQ_POLLIN) {
+        string str;
+        monitor >> str;
+      
+        if (str.compare("CLEAR TASK QUEUE") == 0) {
+          queue.clear();
+          if (spill) { spill->clear(); }
+          monitor << str;
+
+        } else if (str.compare("RESUBMIT ZOMBIE TASKS") == 0) {
+          reclaim_leases();
+          monitor << str;
+
+        } else if (str.compare("STATS") == 0) {
+          const size_t spilled = spill ? spill->size() : 0;
+          size_t size = queue.size() + spilled;
+          size_t unprocessed = count_unprocessed();
+          int priority = queue.front() ? queue.front()->priority() : -1;
+
+          string stats = (boost::format("num_tasks=%d num_unprocessed=%d highest_priority=%d num_spilled=%d") 
+                          % size % unprocessed % priority % spilled).str();
+
+          stats += (boost::format(" cache_hits=%d cache_misses=%d cache_evictions=%d"
+                                  " cache_entries=%d cache_bytes=%d") 
+                    % cache.hits() % cache.misses() % cache.evictions()
+                    % cache.size() % cache.bytes()).str();
+
+          stats += (boost::format(" waiting_workers=%d wasted_job_requests=%d jobs_leased=%d"
+                                  " backup_jobs=%d discarded_results=%d drain_time=%d")
+                    % idle.size() % num_wasted_job_requests % num_jobs_leased
+                    % num_backup_jobs % num_discarded_results % drain_time()).str();
+
+          // break down the unprocessed tasks by priority, highest first.
+          // the spilled tasks are all bulk.
+          typedef std::map<int, size_t> counts_t;
+          counts_t counts = queue.unprocessed_priority_counts();
+          if (spilled > 0) { counts[0] += spilled; }
+          for (counts_t::const_reverse_iterator itr = counts.rbegin(); itr != counts.rend(); ++itr) {
+            stats += (boost::format(" num_unprocessed_%d=%d") % itr->first % itr->second).str();
+          }
+
+          // and the tasks for each style.
+          typedef std::map<string, rendermq::style_counts> style_counts_t;
+          const style_counts_t &style_counts = queue.counts_by_style();
+          for (style_counts_t::const_iterator itr = style_counts.begin(); itr != style_counts.end(); ++itr) {
+            stats += (boost::format(" style_%1%_queued=%2% style_%1%_in_flight=%3% style_%1%_completed=%4%")
+                      % itr->first % itr->second.queued % itr->second.in_flight % itr->second.completed).str();
+          }
+          monitor << stats;
+        
+        } else if (str.compare("HEARTBEAT") == 0) {
+          heartbeat();
+          monitor << str;
+        
+        } else if (str.compare("SHUTDOWN") == 0) {
+          monitor << str;
+          break;
+        
+        } else {
+          monitor << "UNKNOWN";
+        }
+      }
+
+      timers.expire(rendermq::timer_wheel::now());
+
+      // page in spilled bulk jobs to replace any handed out.
+      refill_bulk();
+
+      dispatch_to_waiting();
+
+      if (status_push) {
+        report_status(false);
+      }
+    }
+
+    LOG_DEBUG(boost::format("Shutting down with %1% jobs still in the queue.") % queue.size());
+
+  }
+
+  // the highest priority of all the shards' unprocessed jobs and the 
+  // total number of them, as last reported by the shards. returns false
+  // if there are no unprocessed jobs.
+  bool shard_status(uint32_t &priority, uint64_t &unprocessed) const;
+
+  // the shard with the highest priority jobs, or the most jobs if there's
+  // a tie, or null if none of the shards have any jobs.
+  shard *shard_with_jobs() const;
+
+  // the shard which owns the queue for the metatile containing the tile.
+  shard &shard_for(const tile_protocol &tile) const;
+
+  // send a command to all the shards' monitors and return the replies.
+  std::vector<string> broadcast(const string &command);
+
+  void route_backend();
+  void route_job_request(shard &s, const list<string> &worker_addresses, 
+                         const string &command, uint32_t num_requested,
+                         const rendermq::style_set &styles);
+  void route_to_waiting();
+  void route_frontend();
+  void route_status();
+  bool route_monitor();
+  void route_heartbeat();
+
+  // run the router's event loop, passing messages between the external
+  // sockets and the shards, until asked to shut down.
+  void route();
+
   // the external context to use for the broker
   zmq::context_t &context;
 
   // frontend (handler) communication sockets
-  zstream::socket::xrep frontend_rep;
+  boost::scoped_ptr<zstream::socket::xrep> frontend_rep;
   zstream::socket::pub frontend_pub;
 
   // backend (worker) communication sockets
-  zstream::socket::xrep backend_rep;
+  boost::scoped_ptr<zstream::socket::xrep> backend_rep;
   zstream::socket::pub backend_pub;
 
   // control socket for sending the running broker commands
   zstream::socket::rep monitor;
 
-  // number of seconds between heartbeats
+  // number of milliseconds between heartbeats
   unsigned int heartbeat_interval;
 
-  // number of seconds between resubmits of zombie tasks (tasks
-  // which haven't been completed within some interval and are
-  // likely to be dead workers).
+  // number of milliseconds between resubmits of zombie tasks (tasks
+  // whose leases have run out, and are likely to be on dead workers).
   unsigned int resubmit_interval;
 
+  // number of seconds a worker gets to complete or renew a task
+  // before it's resubmitted.
+  unsigned int lease_time;
+
   // number of seconds before a worker is considered dead, and
   // tasks assigned to it are considered zombies.
   unsigned int zombie_time;
 
-  // flag to shut down the heartbeat thread cleanly.
-  bool shutdown_requested;
+  // maximum number of jobs handed out in reply to a single GET_JOBS.
+  size_t max_lease_jobs;
+
+  // maximum number of bulk jobs to keep in memory, when there's a
+  // spill for the rest.
+  size_t bulk_memory_limit;
 
   // queue of jobs being processed or waiting to be processed
   rendermq::task_queue queue;
 
+  // metatiles which have been rendered recently
+  rendermq::metatile_cache cache;
+
+  // bulk jobs which have been spilled to disk, if enabled.
+  boost::scoped_ptr<rendermq::bulk_spill> spill;
+
+  // journal of the changes to the queue, if enabled.
+  boost::shared_ptr<rendermq::queue_journal> journal;
+
+  // when each worker was last heard from, so that the leases of workers
+  // which have died can be released.
+  std::map<string, std::time_t> worker_last_seen;
+
+  // the last job handed out to each worker, so that the next can be
+  // near to it.
+  std::map<string, tile_protocol> worker_last_job;
+
+  // the styles each worker can render, for those which can't render
+  // all of them.
+  std::map<string, rendermq::style_set> worker_styles;
+
+  // workers waiting for jobs to come in, and how long, in milliseconds,
+  // they're kept waiting before being told to ask again.
+  rendermq::idle_workers idle;
+  unsigned int job_wait_time;
+
+  // requests for jobs which were answered with none, and the number of
+  // jobs handed out, so that the wasted round trips can be compared with
+  // the work done.
+  size_t num_wasted_job_requests, num_jobs_leased;
+
+  // which worker each job being rendered was handed out to, when in
+  // milliseconds it reached the front of that worker's buffer (if it
+  // has) and whether a backup copy has been handed out too.
+  struct dispatch_info {
+    boost::uint64_t time;
+    string worker;
+    bool started;
+    bool backup;
+  };
+  typedef boost::unordered_map<tile_protocol, dispatch_info, metatile_hash, metatile_equal> dispatched_t;
+  dispatched_t dispatched;
+
+  // the jobs handed out to each worker, in the order it works on them.
+  std::map<string, std::deque<tile_protocol> > worker_jobs;
+
+  // how long recent renders took, and the fraction of them which a job
+  // has to have taken longer than to be given to another worker too.
+  rendermq::render_times durations;
+  double straggler_percentile;
+
+  // backup copies of jobs handed out, and results thrown away because
+  // the job had already been answered (or was never asked for).
+  size_t num_backup_jobs, num_discarded_results;
+
+  // estimates of how long each style and zoom takes to render, and the
+  // file they're kept in across restarts, if there is one.
+  boost::shared_ptr<rendermq::render_cost_model> costs;
+  boost::optional<string> costs_file;
+  bool costs_changed;
+
   // name of the broker.
   string broker_name;
+
+  // when this is a shard: its index, the socket it reports its status 
+  // to the router on and the status it last reported.
+  unsigned int shard_index;
+  boost::scoped_ptr<zstream::socket::push> status_push;
+  boost::optional<std::pair<uint32_t, uint64_t> > reported_status;
+
+  // when this is the router: the shards, the socket they report their
+  // status on and the priority of the front of the queue across all 
+  // the shards, as of the last status report.
+  std::vector<boost::shared_ptr<shard> > shards;
+  boost::scoped_ptr<zstream::socket::pull> status_pull;
+  boost::optional<uint32_t> shards_front_priority;
+
+  // the heartbeat and other things which happen at given times.
+  rendermq::timer_wheel timers;
+};
+
+/* a shard of the broker's queue, as seen from the router: the thread
+ * running it, the sockets to talk to it and the status it last reported.
+ */
+struct broker_impl::pimpl::shard : public boost::noncopyable {
+  shard(const pt::ptree &config, const string &name, zmq::context_t &ctx,
+        unsigned int index, size_t num_shards)
+    : impl(new pimpl(config, name, ctx, num_shards)),
+      frontend(ctx), backend(ctx), monitor(ctx),
+      priority(0), unprocessed(0), drain_time(0) {
+    // inproc sockets have to be bound before they can be connected to.
+    impl->bind_shard(index);
+    const string subdirectory = (boost::format("shard-%1%") % index).str();
+    impl->open_journal(config, subdirectory);
+    impl->open_spill(config, subdirectory);
+    impl->open_render_costs(config, subdirectory);
+    frontend.connect(shard_endpoint(name, index, "frontend"));
+    backend.connect(shard_endpoint(name, index, "backend"));
+    monitor.connect(shard_endpoint(name, index, "monitor"));
+
+    thread.reset(new boost::thread(boost::bind(&pimpl::run, impl.get())));
+  }
+
+  ~shard() {
+    // the router normally shuts the shards down, but make sure the thread 
+    // isn't left running if the broker didn't get that far.
+    if (thread->joinable()) {
+      try {
+        string reply;
+        monitor << "SHUTDOWN";
+        monitor >> reply;
+        thread->join();
+      } catch (const std::exception &e) {
+        LOG_ERROR(boost::format("Error shutting down shard: %1%") % e.what());
+      }
+    }
+  }
+
+  boost::scoped_ptr<pimpl> impl;
+  zstream::socket::xpair frontend, backend;
+  zstream::socket::req monitor;
+  boost::scoped_ptr<boost::thread> thread;
+
+  uint32_t priority;
+  uint64_t unprocessed, drain_time;
 };
 
+void
+broker_impl::pimpl::start_shards(const pt::ptree &config, size_t num_shards) {
+  // the router must be listening for status before the shards start.
+  status_pull.reset(new zstream::socket::pull(context));
+  status_pull->bind(status_endpoint(broker_name));
+
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards.push_back(boost::shared_ptr<shard>(new shard(config, broker_name, context, i, num_shards)));
+  }
+}
+
+bool
+broker_impl::pimpl::shard_status(uint32_t &priority, uint64_t &unprocessed) const {
+  bool has_jobs = false;
+  priority = 0;
+  unprocessed = 0;
+
+  BOOST_FOREACH(const boost::shared_ptr<shard> &s, shards) {
+    if (s->unprocessed > 0) {
+      priority = has_jobs ? std::max(priority, s->priority) : s->priority;
+      unprocessed += s->unprocessed;
+      has_jobs = true;
+    }
+  }
+
+  return has_jobs;
+}
+
+broker_impl::pimpl::shard *
+broker_impl::pimpl::shard_with_jobs() const {
+  shard *best = 0;
+
+  BOOST_FOREACH(const boost::shared_ptr<shard> &s, shards) {
+    if ((s->unprocessed > 0) && 
+        ((best == 0) || (s->priority > best->priority) ||
+         ((s->priority == best->priority) && (s->unprocessed > best->unprocessed)))) {
+      best = s.get();
+    }
+  }
+
+  return best;
+}
+
+broker_impl::pimpl::shard &
+broker_impl::pimpl::shard_for(const tile_protocol &tile) const {
+  return *shards[hash_value(tile) % shards.size()];
+}
+
+std::vector<string>
+broker_impl::pimpl::broadcast(const string &command) {
+  std::vector<string> replies(shards.size());
+
+  // send to all the shards before waiting for any of them, so that they
+  // can all get on with it at the same time.
+  BOOST_FOREACH(const boost::shared_ptr<shard> &s, shards) {
+    s->monitor << command;
+  }
+  for (size_t i = 0; i < shards.size(); ++i) {
+    shards[i]->monitor >> replies[i];
+  }
+
+  return replies;
+}
+
+void
+broker_impl::pimpl::route_backend() {
+  list<string> worker_addresses;
+  string command;
+
+  manip::routing_headers headers(worker_addresses);
+  *backend_rep >> headers >> command;
+  LOG_FINER(boost::format("Routing message from `%1%': %2%") % worker_addresses.front() % command);
+
+  if ((command.compare("RESULT") == 0) && backend_rep->has_more()) {
+    // results go back to the shard which owns the metatile.
+    zmq::message_t msg;
+    tile_protocol meta;
+    *backend_rep >> msg;
+
+    if (peek_metatile(msg, meta)) {
+      zstream::socket::osocket &out = shard_for(meta).backend.to(worker_addresses);
+      out << manip::more << command;
+      forward(*backend_rep, out, msg);
+
+    } else {
+      LOG_ERROR(boost::format("Unable to parse result from `%1%'.") % worker_addresses.front());
+      drain(*backend_rep);
+    }
+
+  } else if ((command.compare("GET_JOB") == 0) || (command.compare("GET_JOBS") == 0) ||
+             (command.compare("WAIT_JOBS") == 0)) {
+    // requests for jobs go to the shard with the best jobs to hand out.
+    // if there aren't any the worker gets an answer straight away or,
+    // if it asked to wait, is sent jobs when a shard reports some.
+    uint32_t num_requested = 1;
+    const bool batched = (command.compare("GET_JOB") != 0);
+    if (batched && backend_rep->has_more()) {
+      *backend_rep >> num_requested;
+    }
+    const rendermq::style_set styles = read_styles();
+
+    const bool wait = (command.compare("WAIT_JOBS") == 0);
+    if (!wait) {
+      stop_waiting(worker_addresses.front());
+    }
+
+    // the shards don't report which styles their jobs are, so a worker
+    // which can only render some may be told the shard has none for it.
+    shard *s = shard_with_jobs();
+    if (s != 0) {
+      route_job_request(*s, worker_addresses, wait ? "GET_JOBS" : command, num_requested, styles);
+
+    } else if (wait) {
+      wait_for_jobs(worker_addresses, num_requested, styles);
+
+    } else {
+      backend_rep->to(worker_addresses) << "NO JOBS";
+      ++num_wasted_job_requests;
+    }
+
+  } else if (command.compare("CANCEL_WAIT") == 0) {
+    stop_waiting(worker_addresses.front());
+    drain(*backend_rep);
+
+  } else if ((command.compare("RENEW") == 0) || (command.compare("RELEASE") == 0) ||
+             (command.compare("STYLES") == 0)) {
+    if (command.compare("RELEASE") == 0) {
+      stop_waiting(worker_addresses.front());
+    }
+
+    // a worker's leases could be on any of the shards.
+    std::vector<string> frames;
+    while (backend_rep->has_more()) {
+      frames.push_back(string());
+      *backend_rep >> frames.back();
+    }
+    BOOST_FOREACH(const boost::shared_ptr<shard> &s, shards) {
+      zstream::socket::osocket &out = s->backend.to(worker_addresses);
+      if (!frames.empty()) { out << manip::more; }
+      out << command;
+      for (size_t i = 0; i < frames.size(); ++i) {
+        if (i + 1 < frames.size()) { out << manip::more; }
+        out << frames[i];
+      }
+    }
+
+  } else {
+    drain(*backend_rep);
+  }
+}
+
+void
+broker_impl::pimpl::route_job_request(shard &s, const list<string> &worker_addresses, 
+                                      const string &command, uint32_t num_requested,
+                                      const rendermq::style_set &styles) {
+  zstream::socket::osocket &out = s.backend.to(worker_addresses);
+  if (command.compare("GET_JOB") == 0) {
+    if (!styles.empty()) { out << manip::more; }
+    out << command;
+  } else {
+    out << manip::more << command;
+    if (!styles.empty()) { out << manip::more; }
+    out << num_requested;
+  }
+  for (rendermq::style_set::const_iterator itr = styles.begin(); itr != styles.end(); ) {
+    const string &style = *itr;
+    if (++itr != styles.end()) { out << manip::more; }
+    out << style;
+  }
+
+  // assume the jobs will be handed out, so that a burst of requests
+  // is spread over the shards. the shard's next status report will
+  // correct this if it's wrong.
+  const uint64_t leased = std::min(uint64_t(std::min(size_t(num_requested), max_lease_jobs)), 
+                                   s.unprocessed);
+  s.unprocessed -= leased;
+}
+
+void
+broker_impl::pimpl::route_to_waiting() {
+  // pass on the requests of the workers which are waiting for jobs, for
+  // as long as the shards have reported that there are jobs to give.
+  while (!idle.empty()) {
+    shard *s = shard_with_jobs();
+    if (s == 0) { break; }
+
+    rendermq::waiting_worker w = *idle.pop();
+    timers.cancel(w.timer);
+    route_job_request(*s, w.addresses, "GET_JOBS", w.num_jobs, w.styles);
+  }
+}
+
+void
+broker_impl::pimpl::route_frontend() {
+  list<string> client_addresses;
+  zmq::message_t msg;
+  tile_protocol tile;
+
+  manip::routing_headers headers(client_addresses);
+  *frontend_rep >> headers >> msg;
+
+  if (peek_metatile(msg, tile)) {
+    forward(*frontend_rep, shard_for(tile).frontend.to(client_addresses), msg);
+
+  } else {
+    LOG_ERROR(boost::format("Unable to parse request from `%1%'.") % client_addresses.front());
+    drain(*frontend_rep);
+  }
+}
+
+void
+broker_impl::pimpl::route_status() {
+  uint32_t index = 0, priority = 0;
+  uint64_t unprocessed = 0;
+
+  uint64_t drain_time = 0;
+  *status_pull >> index >> priority >> unprocessed;
+  if (status_pull->has_more()) {
+    *status_pull >> drain_time;
+  }
+  if (index < shards.size()) {
+    shards[index]->priority = priority;
+    shards[index]->unprocessed = unprocessed;
+    shards[index]->drain_time = drain_time;
+  }
+
+  // as with a single queue, tell the workers when the priority of the
+  // highest priority job goes up.
+  boost::optional<uint32_t> front_priority;
+  if (shard_status(priority, unprocessed)) {
+    front_priority = priority;
+    if (!shards_front_priority || (*shards_front_priority < priority)) {
+      publish_availability();
+    }
+  }
+  shards_front_priority = front_priority;
+}
+
+void
+broker_impl::pimpl::route_heartbeat() {
+  // get the shards to refresh their status. the replies will be read
+  // along with any other status reports, so this heartbeat goes out
+  // with what we know at the moment.
+  broadcast("HEARTBEAT");
+
+  uint32_t priority = 0;
+  uint64_t unprocessed = 0;
+  shard_status(priority, unprocessed);
+
+  // the shards share the workers, so each one's drain time is for its
+  // part of the jobs on all the workers, and they add up.
+  uint64_t drain_time = 0;
+  BOOST_FOREACH(const boost::shared_ptr<shard> &s, shards) {
+    drain_time += s->drain_time;
+  }
+
+  frontend_pub 
+    << manip::more << frontend_rep->identity()
+    << manip::more << unprocessed
+    << drain_time;
+
+  publish_availability();
+}
+
+bool
+broker_impl::pimpl::route_monitor() {
+  string str;
+  monitor >> str;
+
+  if ((str.compare("CLEAR TASK QUEUE") == 0) ||
+      (str.compare("RESUBMIT ZOMBIE TASKS") == 0)) {
+    broadcast(str);
+    monitor << str;
+
+  } else if (str.compare("STATS") == 0) {
+    monitor << aggregate_stats(broadcast(str), 
+      (boost::format("waiting_workers=%d wasted_job_requests=%d") 
+       % idle.size() % num_wasted_job_requests).str());
+
+  } else if (str.compare("HEARTBEAT") == 0) {
+    route_heartbeat();
+    monitor << str;
+
+  } else if (str.compare("SHUTDOWN") == 0) {
+    broadcast(str);
+    BOOST_FOREACH(const boost::shared_ptr<shard> &s, shards) {
+      s->thread->join();
+    }
+    monitor << str;
+    return false;
+
+  } else {
+    monitor << "UNKNOWN";
+  }
+
+  return true;
+}
+
+void
+broker_impl::pimpl::route() {
+  // the external sockets, the shards' status and then each of the
+  // shards' frontend and backend sockets.
+  std::vector<zmq::pollitem_t> items;
+  items.push_back(pollin(*backend_rep));
+  items.push_back(pollin(*frontend_rep));
+  items.push_back(pollin(monitor));
+  items.push_back(pollin(*status_pull));
+  BOOST_FOREACH(const boost::shared_ptr<shard> &s, shards) {
+    items.push_back(pollin(s->frontend));
+    items.push_back(pollin(s->backend));
+  }
+
+  start_timers();
+
+  while (true) {
+    zmq::poll(&items[0], items.size(), poll_timeout(timers.timeout(rendermq::timer_wheel::now())));
+
+    if (items[0].revents & ZMQ_POLLIN) {
+      route_backend();
+    }
+
+    if (items[1].revents & ZMQ_POLLIN) {
+      route_frontend();
+    }
+
+    // replies from the shards, which go back out with their routing
+    // headers as they are, and without copying the tiles.
+    for (size_t i = 0; i < shards.size(); ++i) {
+      if (items[4 + 2 * i].revents & ZMQ_POLLIN) {
+        list<string> addresses;
+        zmq::message_t msg;
+        manip::routing_headers headers(addresses);
+        shards[i]->frontend >> headers >> msg;
+        forward(shards[i]->frontend, frontend_rep->to(addresses), msg);
+      }
+
+      if (items[5 + 2 * i].revents & ZMQ_POLLIN) {
+        list<string> addresses;
+        zmq::message_t msg;
+        manip::routing_headers headers(addresses);
+        shards[i]->backend >> headers >> msg;
+        forward(shards[i]->backend, backend_rep->to(addresses), msg);
+      }
+    }
+
+    if (items[3].revents & ZMQ_POLLIN) {
+      route_status();
+      route_to_waiting();
+    }
+
+    if (items[2].revents & ZMQ_POLLIN) {
+      if (!route_monitor()) { break; }
+    }
+
+    timers.expire(rendermq::timer_wheel::now());
+  }
+}
+
 broker_impl::broker_impl(const pt::ptree &config, 
                          const string &broker_name, 
                          zmq::context_t &ctx) 
@@ -248,27 +1896,18 @@ broker_impl::broker_impl(const pt::ptree &config,
     throw std::runtime_error(ostr.str());
   }
   
-  string frontend_req_addr = self->second.in_req;
-  string frontend_pub_addr = self->second.in_sub;
-  string backend_req_addr = self->second.out_req;
-  string backend_pub_addr = self->second.out_sub;
-  string monitor_addr = self->second.monitor;
-  string frontend_identity = self->second.in_identity.get_value_or(dqueue::util::make_uuid());
-  string backend_identity = self->second.out_identity.get_value_or(dqueue::util::make_uuid());
-  
   // init ZMQ sockets
-  impl->frontend_rep.set_identity(frontend_identity);
-  impl->frontend_rep.bind(frontend_req_addr.c_str());
-  impl->frontend_pub.bind(frontend_pub_addr.c_str());
-  
-  impl->backend_rep.set_identity(backend_identity);
-  impl->backend_rep.bind(backend_req_addr.c_str());
-  impl->backend_pub.bind(backend_pub_addr.c_str());
-  
-  impl->monitor.bind(monitor_addr); // external monitor
-  // needs to have the broker name, as for testing we'll sometimes have
-  // multiple brokers running inside the same process.
-  impl->monitor.bind("inproc://monitor-" + broker_name); // internal monitor thread 
+  impl->bind(self->second);
+
+  // with more than one shard, this thread just routes messages to the
+  // shards, which each run their own queue for part of the tiles.
+  if (self->second.shards > 1) {
+    impl->start_shards(config, self->second.shards);
+  } else {
+    impl->open_journal(config, string());
+    impl->open_spill(config, string());
+    impl->open_render_costs(config, string());
+  }
 }
 
 broker_impl::~broker_impl() {
@@ -276,135 +1915,11 @@ broker_impl::~broker_impl() {
 
 void 
 broker_impl::operator()() {    
-  // start monitor/heartbeat thread
-  task_monitor mon(impl->context, 
-                   impl->heartbeat_interval, 
-                   impl->resubmit_interval,
-                   impl->shutdown_requested,
-                   impl->broker_name);
-  boost::thread t(mon);
-  
-  while (true) {
-    //  Initialize poll set
-    zmq::pollitem_t items [] = {
-      // Always poll for worker activity on backend
-      { impl->backend_rep.socket(),  0, ZMQ_POLLIN, 0 },
-      // Always poll front-end
-      { impl->frontend_rep.socket(), 0, ZMQ_POLLIN, 0 },
-      // Monitoring socket
-      { impl->monitor.socket(), 0, ZMQ_POLLIN, 0 },
-    };
-    
-    zmq::poll (&items [0], 3, -1);
-    
-    //  Handle worker activity on backend
-    if (items [0].revents & ZMQ_POLLIN) {
-      list<string> worker_addresses;
-      string command;
-      
-      // message parts are worker, client addresses then the returned metatile.
-      manip::routing_headers headers(worker_addresses);
-      impl->backend_rep >> headers >> command;
-      LOG_FINER(boost::format("Message from `%1%': %2%") % worker_addresses.front() % command);
-
-      if (command.compare("RESULT") == 0) { 
-        tile_protocol meta;
-        impl->backend_rep >> meta;
-        send_tile_to_listeners(impl->queue, impl->frontend_rep, meta, worker_addresses.front());
-      }
-      
-      if (command.compare("GET_JOB") == 0) {
-        boost::optional<const task &> t = impl->queue.front();
-        if (t) {
-          tile_protocol proto = static_cast<tile_protocol>(*t);
-          impl->backend_rep.to(worker_addresses) << manip::more << "JOB" << proto;
-          impl->queue.set_processed(proto);
-          
-        } else {
-          impl->backend_rep.to(worker_addresses) << "NO JOBS";
-        }
-        // TODO: do we need the "optimisation" of sending back whether there are
-        // any jobs when the worker gives us back a complete job?
-      }
-    }
-    
-    // frontend communications with the handlers
-    if (items [1].revents & ZMQ_POLLIN) {            
-      list<string> client_addresses;
-      tile_protocol tile;
-      
-      zstream::manip::routing_headers headers(client_addresses);
-      impl->frontend_rep >> headers >> tile;
-      
-      int priority = 100;
-      if (tile.status == cmdRenderBulk ) priority = 0;
-      else if (tile.status == cmdDirty) priority = 50;
-      else if (tile.status == cmdRenderPrio) priority = 150;
-
-      LOG_FINER(boost::format("Tile request: %1% priority=%2%") % tile % priority);
-
-      // take a look at the highest priority task in the queue before we add this one.
-      boost::optional<const task &> front_task = impl->queue.front();
-      
-      impl->queue.push(tile, client_addresses.front(), priority);
-      
-      // we send out a notification to all listening workers if the priority of the 
-      // highest priority item in the queue has changed.
-      if ((!front_task) || (front_task->priority() < priority)) {
-        impl->publish_availability();
-      }
-    }
-    
-    // monitor
-    if (items [2].revents & ZMQ_POLLIN) {
-      string str;
-      impl->monitor >> str;
-      
-      if (str.compare("CLEAR TASK QUEUE") == 0) {
-        impl->queue.clear();
-        impl->monitor << str;
-
-      } else if (str.compare("RESUBMIT ZOMBIE TASKS") == 0) {
-        impl->queue.resubmit_older_than(impl->zombie_time); // older then 30 sec
-        impl->monitor << str;
-
-      } else if (str.compare("STATS") == 0) {
-        size_t size = impl->queue.size();
-        size_t unprocessed = impl->queue.count_unprocessed();
-        int priority = impl->queue.front() ? impl->queue.front()->priority() : -1;
-
-        string stats = (boost::format("num_tasks=%d num_unprocessed=%d highest_priority=%d") 
-                        % size % unprocessed % priority).str();
-        impl->monitor << stats;
-        
-      } else if (str.compare("HEARTBEAT") == 0) {
-        // send frontends a queue count, so they know how busy the queues
-        // are. this should allow them to make decisions about whether to 
-        // send clients old tiles or not.
-        impl->frontend_pub 
-          << manip::more << impl->frontend_rep.identity()
-          << uint64_t(impl->queue.count_unprocessed());
-
-        // publish availability information to the workers, so that they 
-        // can claim jobs if they want to.
-        impl->publish_availability();
-        impl->monitor << str;
-        
-      } else if (str.compare("SHUTDOWN") == 0) {
-        impl->monitor << str;
-        break;
-        
-      } else {
-        impl->monitor << "UNKNOWN";
-      }
-    }
+  if (impl->shards.empty()) {
+    impl->run();
+  } else {
+    impl->route();
   }
-
-  // attempt to shut down somewhat cleanly
-  impl->shutdown_requested = true;
-  t.join();
-  LOG_DEBUG(boost::format("Shutting down with %1% jobs still in the queue.") % impl->queue.size());
 }
 
 } // namespace rendermq
-
@@ -0,0 +1,260 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef TILE_CACHE_HPP
+#define TILE_CACHE_HPP
+
+#include "tile_protocol.hpp"
+
+#include <string>
+#include <ctime> // for std::time_t
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/optional.hpp>
+#include <boost/functional/hash.hpp>
+
+namespace rendermq
+{
+
+/* a tile which was recently looked up in storage or rendered. the tile
+ * holds the position, style and format along with the data and last
+ * modified time. its status is cmdDone if the tile is fresh or 
+ * cmdIgnore if it has been marked as expired, as storage would say.
+ */
+struct cached_tile
+{
+   cached_tile(tile_protocol const& t, std::time_t e)
+      : tile(t), expiry(e) {}
+
+   tile_protocol tile;
+   std::time_t expiry;
+};
+
+/* a bounded cache of the tiles the handler has recently served, so 
+ * that the most popular tiles, which get most of the requests, can be
+ * served without a round trip to storage.
+ *
+ * the cache is limited by the memory its entries use, and the least 
+ * recently used entries are evicted to make space. entries expire 
+ * after a fixed time to live, so that changes made to storage by other
+ * handlers and the workers are picked up. the handler also erases the
+ * tiles of a metatile which is marked as dirty.
+ */
+class tile_cache
+{
+   // compares the parts of the tile which identify a single tile in
+   // one format.
+   struct tile_equal
+   {
+      bool operator()(tile_protocol const& a, tile_protocol const& b) const
+      {
+         return (a.x == b.x && a.y == b.y && a.z == b.z && 
+                 a.format == b.format && a.style == b.style);
+      }
+   };
+
+   struct tile_hash
+   {
+      std::size_t operator()(tile_protocol const& t) const
+      {
+         std::size_t seed = hash_value(t);
+         boost::hash_combine(seed, t.x);
+         boost::hash_combine(seed, t.y);
+         boost::hash_combine(seed, int(t.format));
+         return seed;
+      }
+   };
+
+   // compares only the parts of the tile which identify the metatile
+   // it is in, so that all its tiles can be found.
+   struct metatile_equal
+   {
+      bool operator()(tile_protocol const& a, tile_protocol const& b) const
+      {
+         return ((a.x & ~(METATILE-1)) == (b.x & ~(METATILE-1)) && 
+                 (a.y & ~(METATILE-1)) == (b.y & ~(METATILE-1)) && 
+                 a.z == b.z && a.style == b.style);
+      }
+   };
+
+   struct metatile_hash
+   {
+      std::size_t operator()(tile_protocol const& t) const
+      {
+         return hash_value(t);
+      }
+   };
+
+   typedef boost::multi_index::multi_index_container<cached_tile,
+      boost::multi_index::indexed_by<
+// most recently used at the front
+      boost::multi_index::sequenced<>,
+// hash index on x,y,z, style & format
+      boost::multi_index::hashed_unique<
+         boost::multi_index::member<cached_tile, tile_protocol, &cached_tile::tile>,
+         tile_hash, tile_equal>,
+// hash index on the metatile
+      boost::multi_index::hashed_non_unique<
+         boost::multi_index::member<cached_tile, tile_protocol, &cached_tile::tile>,
+         metatile_hash, metatile_equal>
+      > > cont_type;
+
+   typedef cont_type::nth_index<1>::type tile_index_type;
+   typedef cont_type::nth_index<2>::type meta_index_type;
+
+   // the memory used by an entry, roughly: its data, its style name and
+   // the entry itself. the index nodes aren't counted.
+   static size_t entry_bytes(tile_protocol const& tile)
+   {
+      return tile.data().size() + tile.style.size() + sizeof(cached_tile);
+   }
+
+   void erase_lru()
+   {
+      m_bytes -= entry_bytes(m_cache.back().tile);
+      m_cache.pop_back();
+   }
+
+public:
+   /* create a cache which uses up to max_bytes of memory, holding each
+    * tile for up to ttl seconds. a max_bytes of zero disables the 
+    * cache.
+    */
+   tile_cache(size_t max_bytes, int ttl)
+      : m_max_bytes(max_bytes), m_ttl(ttl), m_bytes(0),
+        m_hits(0), m_misses(0), m_evictions(0) {}
+
+   /* add a tile which has been found in storage or rendered, replacing
+    * any older copy of it. only tiles with data which are done (or
+    * ignored, meaning they're expired) are kept. the client id and the
+    * request's last modified time aren't part of the cached copy.
+    */
+   void insert(tile_protocol const& tile, std::time_t now)
+   {
+      if ((tile.status != cmdDone && tile.status != cmdIgnore) || tile.data().empty()) return;
+      if (entry_bytes(tile) > m_max_bytes) return;
+
+      erase(tile);
+
+      tile_protocol copy(tile);
+      copy.id = 0;
+      copy.request_last_modified = 0;
+      m_cache.push_front(cached_tile(copy, now + m_ttl));
+      m_bytes += entry_bytes(copy);
+
+      // throw away anything which has expired first, as it's of no
+      // use, then the least recently used until there's enough space.
+      while (!m_cache.empty() && m_cache.back().expiry <= now)
+      {
+         erase_lru();
+      }
+      while (m_bytes > m_max_bytes)
+      {
+         erase_lru();
+         ++m_evictions;
+      }
+   }
+
+   /* look up a tile in the same style and format. this only counts as
+    * a hit if the cached copy hasn't reached its time to live.
+    */
+   boost::optional<tile_protocol const&> find(tile_protocol const& tile, std::time_t now)
+   {
+      tile_index_type & index = m_cache.get<1>();
+      tile_index_type::iterator itr = index.find(tile);
+
+      if (itr != index.end() && itr->expiry <= now)
+      {
+         m_bytes -= entry_bytes(itr->tile);
+         index.erase(itr);
+         itr = index.end();
+      }
+
+      if (itr == index.end())
+      {
+         ++m_misses;
+         return boost::optional<tile_protocol const&>();
+      }
+
+      m_cache.relocate(m_cache.begin(), m_cache.project<0>(itr));
+      ++m_hits;
+      return boost::optional<tile_protocol const&>(itr->tile);
+   }
+
+   // remove a single tile in one format.
+   void erase(tile_protocol const& tile)
+   {
+      tile_index_type & index = m_cache.get<1>();
+      tile_index_type::iterator itr = index.find(tile);
+      if (itr != index.end())
+      {
+         m_bytes -= entry_bytes(itr->tile);
+         index.erase(itr);
+      }
+   }
+
+   /* remove all the tiles, in all formats, of the metatile containing
+    * the given tile, e.g: because it's been marked as dirty.
+    */
+   void erase_metatile(tile_protocol const& tile)
+   {
+      meta_index_type & index = m_cache.get<2>();
+      std::pair<meta_index_type::iterator, meta_index_type::iterator> range = index.equal_range(tile);
+      while (range.first != range.second)
+      {
+         m_bytes -= entry_bytes(range.first->tile);
+         range.first = index.erase(range.first);
+      }
+   }
+
+   // the number of tiles in the cache.
+   size_t size() const { return m_cache.size(); }
+
+   // the most memory the cache will use, or zero if it's disabled.
+   size_t max_bytes() const { return m_max_bytes; }
+
+   // the memory used by the cache's entries, in bytes.
+   size_t bytes() const { return m_bytes; }
+
+   // counters for the lookups which were and weren't answered by the
+   // cache, and entries which had to be thrown away to make space.
+   size_t hits() const { return m_hits; }
+   size_t misses() const { return m_misses; }
+   size_t evictions() const { return m_evictions; }
+
+private:
+   cont_type m_cache;
+   size_t m_max_bytes;
+   int m_ttl;
+   size_t m_bytes;
+   size_t m_hits, m_misses, m_evictions;
+};
+
+} // namespace rendermq
+
+#endif // TILE_CACHE_HPP
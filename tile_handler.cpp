@@ -32,6 +32,7 @@
 #include "zstream.hpp"
 #include "zstream_pbuf.hpp"
 #include "storage_worker.hpp"
+#include "zmq_utils.hpp"
 #include "tile_handler.hpp"
 #include "logging/logger.hpp"
 
@@ -56,6 +57,7 @@
 #include <stdexcept>
 #include <map>
 #include <list>
+#include <algorithm>
 
 using boost::shared_ptr;
 using boost::optional;
@@ -67,6 +69,22 @@ using std::list;
 using std::runtime_error;
 namespace pt = boost::property_tree;
 
+// how often, in seconds, to log the tile cache's hit ratio and memory
+// use.
+#define TILE_CACHE_REPORT_INTERVAL (60)
+
+// the deadlines for requests waiting on the queue are kept on a wheel
+// of this many slots, each this many milliseconds long.
+#define RENDER_TIMER_SLOTS (4096)
+#define RENDER_TIMER_TICK (10)
+
+// how often, in milliseconds, to adjust the queue thresholds.
+#define ADMISSION_CONTROL_INTERVAL (5000)
+
+// requests for paths ending in this are answered with the handler's
+// queue thresholds, rather than a tile.
+#define STATS_PATH "/stats"
+
 // unless otherwise specified, the maximum zoom for any tile
 // layer. this can be overridden on a per-style basis in the
 // config file.
@@ -74,6 +92,15 @@ namespace pt = boost::property_tree;
 
 namespace {
 
+// 0MQ versions before 3 take the poll timeout in microseconds.
+long poll_timeout(long ms) {
+#if ZMQ_VERSION_MAJOR < 3
+   return (ms < 0) ? ms : ms * 1000;
+#else
+   return ms;
+#endif
+}
+
 inline bool old_tile(rendermq::tile_protocol const& tile, std::time_t delta)
 {
    return (tile.z > 10 && delta > 31536000) ? true : false;
@@ -154,14 +181,19 @@ namespace po = boost::program_options;
 namespace rendermq {
 
 tile_handler::tile_handler(const string &handler_id, 
-                           const string &in_ep, 
-                           const string &out_ep,
+                           const vector<string> &in_eps, 
+                           const vector<string> &out_eps,
                            std::time_t max_age,
                            size_t queue_threshold_stale,
                            size_t queue_threshold_satisfy,
                            size_t queue_threshold_max,
+                           unsigned int target_latency,
                            bool stale_render_background,
                            size_t max_io_threads,
+                           size_t tile_cache_size,
+                           int tile_cache_ttl,
+                           size_t drain_budget,
+                           const render_timeouts &timeouts,
                            const string &dqueue_config,
                            const pt::ptree &storage_conf,
                            const style_rules &rules,
@@ -171,30 +203,42 @@ tile_handler::tile_handler(const string &handler_id,
      m_socket_rep(m_context, ZMQ_PUB),
      m_str_handler_id(handler_id),
      m_max_age(max_age), 
-     m_queue_threshold_stale(queue_threshold_stale),
-     m_queue_threshold_satisfy(queue_threshold_satisfy),
-     m_queue_threshold_max(queue_threshold_max),
+     m_admission(queue_threshold_stale, queue_threshold_satisfy, queue_threshold_max,
+                 target_latency, ADMISSION_CONTROL_INTERVAL, timer_wheel::now()),
      m_stale_render_background(stale_render_background),
      m_style_rules(rules),
+     m_dirty_list(dirty_list),
+     m_tile_cache(tile_cache_size, tile_cache_ttl),
+     m_next_cache_report(std::time(0) + TILE_CACHE_REPORT_INTERVAL),
+     m_render_timeouts(timeouts),
+     m_timers(RENDER_TIMER_SLOTS, RENDER_TIMER_TICK, timer_wheel::now()),
      m_queue_runner(dqueue_config, m_context), 
      m_socket_storage_request(m_context),
-     m_socket_storage_results(m_context)
+     m_socket_storage_results(m_context),
+     m_drain(drain_budget),
+     m_reply(max_age)
 {
    LOG_INFO(boost::format("Init tile handler with ID: %1%") % m_str_handler_id);
 
    // connect the out socket to mongrel, so we've somewhere
    // for requests to go if we happen to receive some the 
-   // instant we start up.
+   // instant we start up. replies are published to all the mongrel
+   // servers, and each only takes those which start with its uuid.
    m_socket_rep.setsockopt(ZMQ_IDENTITY, m_str_handler_id.data(), m_str_handler_id.length());        
-   m_socket_rep.connect(out_ep.c_str());
+   BOOST_FOREACH(const string &out_ep, out_eps) {
+      m_socket_rep.connect(out_ep.c_str());
+   }
 
    // setup the queue runner
    m_queue_runner.default_handler(
       dqueue::runner::handler_function_t(
-         boost::bind(&tile_handler::reply_with_tile, this, _1)));
+         boost::bind(&tile_handler::handle_rendered_tile, this, _1)));
 
-   // connect input socket to mongrel server
-   m_socket_req.connect(in_ep.c_str());
+   // connect input socket to the mongrel servers, which requests are
+   // taken from fairly.
+   BOOST_FOREACH(const string &in_ep, in_eps) {
+      m_socket_req.connect(in_ep.c_str());
+   }
       
    // push and pull sockets for storage handling.
    m_socket_storage_request.bind("inproc://storage_request_" + m_str_handler_id);
@@ -203,64 +247,203 @@ tile_handler::tile_handler(const string &handler_id,
    // start storage worker thread
    m_ptr_storage_instance.reset(new storage_worker(m_context, storage_conf, m_str_handler_id, max_io_threads, dirty_list));
    m_ptr_storage_thread.reset(new boost::thread(boost::ref(*m_ptr_storage_instance)));
+
+   // the mongrel and storage sockets stay the same, but the queue's
+   // poll items are filled in each time around the loop.
+   zmq::pollitem_t items [] = {
+      { m_socket_req,  0, ZMQ_POLLIN, 0 }, 
+      { m_socket_storage_results.socket(), 0, ZMQ_POLLIN, 0 },
+      { NULL, 0, ZMQ_POLLIN, 0 },
+      { NULL, 0, ZMQ_POLLIN, 0 },
+   };
+   std::copy(&items[0], &items[4], &m_poll_items[0]);
+
+   // requests from mongrel, results from storage and the queue are
+   // each drained in turn, so that a flood of one can't starve the
+   // others.
+   m_drain.add_source(boost::bind(&poll_ready, &m_poll_items[0], 1),
+                      boost::bind(&tile_handler::handle_request_from_mongrel, this));
+   m_drain.add_source(boost::bind(&poll_ready, &m_poll_items[1], 1),
+                      boost::bind(&tile_handler::handle_response_from_storage, this));
+   m_drain.add_source(boost::bind(&poll_ready, &m_poll_items[2], 2),
+                      boost::bind(&tile_handler::handle_response_from_queue, this));
+
+   m_timers.schedule(timer_wheel::now() + m_admission.interval(),
+                     boost::bind(&tile_handler::update_admission, this));
 }
 
 void 
 tile_handler::operator()() {
    // main pull/pub loop     
    while (true) {
-      zmq::pollitem_t items [] = {
-         //  Always poll for mongrel frontend activity
-         { m_socket_req,  0, ZMQ_POLLIN, 0 }, 
-         // always poll for storage component activity
-         { m_socket_storage_results.socket(), 0, ZMQ_POLLIN, 0 },
-         //  Poll tile
-         { NULL, 0, ZMQ_POLLIN, 0 },
-         { NULL, 0, ZMQ_POLLIN, 0 },
-      };
-    
       // for the moment assume there's only one pollitem for the distributed queue
       assert(m_queue_runner.num_pollitems() == 2);
-      m_queue_runner.fill_pollitems(&items[2]);
+      m_queue_runner.fill_pollitems(&m_poll_items[2]);
     
-      // poll
+      // poll, waking up in time for the next request deadline.
       try {
-         zmq::poll(&items[0], 4, -1);
+         zmq::poll(&m_poll_items[0], 4, poll_timeout(m_timers.timeout(timer_wheel::now())));
       } catch (const zmq::error_t &) {
          // ignore and loop...
          continue;
       }
     
-      // handle request from mongrel
-      if (items[0].revents & ZMQ_POLLIN) {
-         // this will either send a request to the storage component, or 
-         // return an error to the user. either way, it shouldn't take long.
-         handle_request_from_mongrel();
-      }
-                
-      // handle response from the storage component
-      else if (items[1].revents & ZMQ_POLLIN) {
-         // this either returns a response to the client, which might be an
-         // error, or forwards the request on to the broker.
-         handle_response_from_storage();
-      } 
-                
-      // handle response from broker
-      else {
-         m_queue_runner.handle_pollitems(&items[2]);
+      // handle everything which is waiting, up to the budget for each
+      // source. requests from mongrel will either be sent to the storage
+      // component or return an error to the user. responses from storage
+      // either return a response to the client, which might be an
+      // error, or forward the request on to the broker.
+      m_drain();
+
+      // give up on anything which has waited too long for the queue.
+      m_timers.expire(timer_wheel::now());
+
+      report_cache_stats();
+   }
+}
+
+void
+tile_handler::handle_response_from_queue() {
+   m_queue_runner.handle_pollitems(&m_poll_items[2]);
+}
+
+void
+tile_handler::handle_rendered_tile(const tile_protocol &tile) {
+   m_tile_cache.insert(tile, std::time(0));
+
+   // only reply if the client is still waiting. if it's already been
+   // sent something else then mongrel may have re-used the connection
+   // id for another request.
+   optional<pending_render> waiting = m_pending_renders.remove(tile);
+   if (waiting) {
+      m_timers.cancel(waiting->timer);
+      m_admission.render_latency(timer_wheel::now() - waiting->sent);
+      reply_with_tile(tile);
+
+   } else if (tile.id > 0) {
+      LOG_DEBUG(boost::format("Dropping rendered tile %1%, as the client is no longer waiting for it.") % tile);
+   }
+}
+
+void
+tile_handler::render_and_wait(tile_protocol &tile) {
+   // keep what came back from storage, which may include a stale copy
+   // of the tile to fall back on if the render doesn't come back.
+   const tile_protocol request(tile);
+
+   tile.status = cmdRender;
+   if (!send_to_queue(tile)) { return; }
+
+   const boost::uint64_t now = timer_wheel::now();
+   const timer_wheel::timer_id timer = 
+      m_timers.schedule(now + m_render_timeouts.timeout(tile),
+                        boost::bind(&tile_handler::handle_render_timeout, this,
+                                    tile_protocol(cmdRender, tile.x, tile.y, tile.z, tile.id, 
+                                                  tile.style, tile.format)));
+   optional<pending_render> previous = m_pending_renders.add(pending_render(request, timer, now));
+   if (previous) { m_timers.cancel(previous->timer); }
+}
+
+void
+tile_handler::handle_render_timeout(const tile_protocol &tile) {
+   optional<pending_render> waiting = m_pending_renders.remove(tile);
+   if (!waiting) { return; }
+
+   // the client has waited at least this long, which is a sign that
+   // too much is being sent to the queue.
+   m_admission.render_latency(timer_wheel::now() - waiting->sent);
+
+   tile_protocol &stale = waiting->tile;
+   if ((stale.status == cmdDone || stale.status == cmdIgnore) && (stale.data().size() > 0)) {
+      LOG_WARNING(boost::format("Timed out waiting for %1% to render, sending stale tile.") % tile);
+      stale.status = cmdIgnore;
+      reply_with_tile(stale);
+
+   } else if (m_servers.known(tile.id)) {
+      LOG_WARNING(boost::format("Timed out waiting for %1% to render, sending 504.") % tile);
+      string send_id = (boost::format("%d") % m_servers.connection(tile.id)).str();
+      send_504(m_socket_rep, m_servers.uuid(tile.id), send_id);
+      m_servers.release(tile.id);
+
+   } else {
+      LOG_ERROR(boost::format("Cannot time out tile where ID is set to invalid: %1%") % tile);
+   }
+}
+
+void
+tile_handler::update_admission() {
+   const size_t old_max = m_admission.threshold_max();
+   m_admission.update(m_queue_runner.queue_length(), timer_wheel::now());
+
+   if (m_admission.threshold_max() != old_max) {
+      LOG_INFO(boost::format("Render latency %1%ms against a target of %2%ms, queue grew by %3%: "
+                             "queue thresholds now stale=%4% satisfy=%5% max=%6%.")
+               % m_admission.latency() % m_admission.target() % m_admission.growth()
+               % m_admission.threshold_stale() % m_admission.threshold_satisfy()
+               % m_admission.threshold_max());
+   }
+
+   m_timers.schedule(timer_wheel::now() + m_admission.interval(),
+                     boost::bind(&tile_handler::update_admission, this));
+}
+
+void
+tile_handler::send_stats(const string &uuid, const string &id) {
+   const string stats = (boost::format(
+      "queue_length=%1% queue_threshold_stale=%2% queue_threshold_satisfy=%3% "
+      "queue_threshold_max=%4% threshold_scale=%5$.2f target_latency_ms=%6% "
+      "render_latency_ms=%7% queue_growth=%8% waiting_renders=%9% "
+      "tile_cache_hits=%10% tile_cache_misses=%11% mongrel_servers=%12% "
+      "mongrel_clients=%13%\n")
+      % m_queue_runner.queue_length() % m_admission.threshold_stale()
+      % m_admission.threshold_satisfy() % m_admission.threshold_max()
+      % m_admission.scale() % m_admission.target() % m_admission.latency()
+      % m_admission.growth() % m_pending_renders.size()
+      % m_tile_cache.hits() % m_tile_cache.misses() % m_servers.size()
+      % m_servers.waiting()).str();
+   send_reply(m_socket_rep, uuid, id, 200, stats);
+}
+
+void
+tile_handler::invalidate_cached(const tile_protocol &tile) {
+   m_tile_cache.erase_metatile(tile);
+
+   map<string, list<string> >::const_iterator itr = m_dirty_list.find(tile.style);
+   if (itr != m_dirty_list.end()) {
+      BOOST_FOREACH(const string &style, itr->second) {
+         tile_protocol dependent_tile(tile);
+         dependent_tile.style = style;
+         m_tile_cache.erase_metatile(dependent_tile);
       }
    }
 }
 
+void
+tile_handler::report_cache_stats() {
+   const std::time_t now = std::time(0);
+   if (now < m_next_cache_report) { return; }
+   m_next_cache_report = now + TILE_CACHE_REPORT_INTERVAL;
+
+   if (m_tile_cache.max_bytes() == 0) { return; }
+   const size_t lookups = m_tile_cache.hits() + m_tile_cache.misses();
+   LOG_INFO(boost::format("Tile cache: %1% hits from %2% lookups (%3$.1f%%), %4% tiles "
+                          "using %5% of %6% bytes, %7% evictions.")
+            % m_tile_cache.hits() % lookups 
+            % (lookups > 0 ? 100.0 * m_tile_cache.hits() / lookups : 0.0)
+            % m_tile_cache.size() % m_tile_cache.bytes() % m_tile_cache.max_bytes()
+            % m_tile_cache.evictions());
+}
+
 void 
 tile_handler::reply_with_tile(const tile_protocol &tile) {
-   string send_id = (boost::format("%d") % tile.id).str();         
    std::time_t current_time = std::time(0);
 
-   if (tile.id < 0) {
+   if (!m_servers.known(tile.id)) {
       LOG_ERROR(boost::format("Cannot reply with tile where ID is set to invalid: %1%") % tile);
       return;
    }
+   const string &uuid = m_servers.uuid(tile.id);
+   const int64_t connection = m_servers.connection(tile.id);
 
    /* tile is done, has data & is OK */
    if ((tile.status == cmdDone || tile.status == cmdIgnore) &&
@@ -274,22 +457,24 @@ tile_handler::reply_with_tile(const tile_protocol &tile) {
          or last modified header doesn't exist */
       if ((tile.request_last_modified == 0) || 
           (tile.last_modified < tile.request_last_modified)) {
-         send_tile(m_socket_rep, m_date_format, m_str_mongrel_id, send_id, 
-                   m_max_age, tile.last_modified, expire_time, tile.data(), 
-                   mime_type);
+         m_reply.send_tile(m_socket_rep, uuid, connection, 
+                           tile.last_modified, expire_time, tile.data(), 
+                           mime_type);
                         
       } else {
          // not modified
-         send_304(m_socket_rep, m_str_mongrel_id, send_id,
-                  current_time, m_date_format, mime_type);
+         m_reply.send_304(m_socket_rep, uuid, connection,
+                          current_time, mime_type);
       }
    } else {
       // something bad happened, return a server error status
-      send_500(m_socket_rep, m_str_mongrel_id, send_id);
+      string send_id = (boost::format("%d") % connection).str();         
+      send_500(m_socket_rep, uuid, send_id);
       // log this out too...
       LOG_ERROR(boost::format("tile received from broker is %1% and has status "
                               "!= done/ignore or zero size.") % tile);
    }
+   m_servers.release(tile.id);
 }
 
 void 
@@ -306,40 +491,60 @@ tile_handler::handle_request_from_mongrel() {
       if (!more) break;
    }               
         
-   // process last message
-   string txt((char*)msg.data(),msg.size());
-   mongrel_request request;                
+   // process last message, straight out of the message buffer.
+   const char *txt = static_cast<const char *>(msg.data());
+   mongrel_request_view &request = m_request;
         
-   if (m_request_parse(request, txt)) {
-      tile_protocol tile;
-      if (m_path_parse(tile, request.path()) && 
+   if (m_request_parse(request, txt, txt + msg.size())) {
+      tile_protocol &tile = request.tile;
+      if (request.is_tile && 
           m_style_rules.rewrite_and_check(tile)) {
-         // need to store the ID of the client in with the tile request so
-         // that when/if the data comes back we know where to tell mongrel
-         // to send it to.
-         tile.id = boost::lexical_cast<int>(request.id());
-
-         // need to store the id of the mongrel server too? we really 
-         // should, in case multiple mongrel servers are being used. but
-         // for the moment, just assume it's true.
-         if (m_str_mongrel_id.empty()) {
-            m_str_mongrel_id = request.uuid();
-#ifdef RENDERMQ_DEBUG
-         } else {
-            assert(m_str_mongrel_id == request.uuid());
-#endif
+         // need to store the ID of the client, and the mongrel server
+         // it's connected to, in with the tile request so that when/if
+         // the data comes back we know where to tell mongrel to send it.
+         optional<int64_t> client_id = m_servers.client_id(request.uuid, request.client_id);
+         if (!client_id) {
+            LOG_WARNING(boost::format("Connection id %1% from mongrel %2% can't be routed, as there are "
+                                      "too many clients waiting. Sending 503...") 
+                        % request.client_id % string(request.uuid.begin(), request.uuid.end()));
+            send_503(m_socket_rep, string(request.uuid.begin(), request.uuid.end()), 
+                     string(request.id.begin(), request.id.end()));
+            return;
+         }
+         tile.id = *client_id;
+
+         // a dirty tile mustn't be served from the cache any more.
+         // otherwise, the most popular tiles can be answered from the
+         // cache without a round trip to storage.
+         if (tile.status == cmdDirty) {
+            invalidate_cached(tile);
+
+         } else if (tile.status != cmdStatus) {
+            optional<const tile_protocol &> cached = m_tile_cache.find(tile, std::time(0));
+            if (cached) {
+               tile_protocol hit(*cached);
+               hit.id = tile.id;
+               hit.request_last_modified = tile.request_last_modified;
+               handle_lookup(hit);
+               return;
+            }
          }
 
          // send request to storage, see if the tile has already been
          // cached.
          m_socket_storage_request << tile;
                         
+      } else if (boost::ends_with(request.path, STATS_PATH)) {
+         send_stats(string(request.uuid.begin(), request.uuid.end()), 
+                    string(request.id.begin(), request.id.end()));
+
       } else {
-         std::string path = request.path();
+         std::string path(request.path.begin(), request.path.end());
          // sanitize URL before logging it
          std::replace_if(path.begin(), path.end(), !(boost::is_alnum() || boost::is_any_of("/.")), '_');
          LOG_WARNING(boost::format("Can not parse tile URL '%1%'. Sending 404...") % path);
-         send_404(m_socket_rep, request.uuid(), request.id());
+         send_404(m_socket_rep, string(request.uuid.begin(), request.uuid.end()), 
+                  string(request.id.begin(), request.id.end()));
       }
    }
 }
@@ -348,9 +553,28 @@ void
 tile_handler::handle_response_from_storage() {
    tile_protocol tile;
    m_socket_storage_results >> tile;
-  
+
+   // a lookup which was already in progress when the tile was dirtied
+   // may have put it back in the cache.
+   if (tile.status == cmdDirty) {
+      invalidate_cached(tile);
+   } else if (tile.status != cmdStatus) {
+      m_tile_cache.insert(tile, std::time(0));
+   }
+
+   handle_lookup(tile);
+}
+
+void 
+tile_handler::handle_lookup(tile_protocol &tile) {
+   // every answer goes back to the client, so there has to be one.
+   if (!m_servers.known(tile.id)) {
+      LOG_ERROR(boost::format("Cannot answer lookup for tile where ID is set to invalid: %1%") % tile);
+      return;
+   }
+
    if (tile.status == cmdStatus) {
-      string send_id = (boost::format("%d") % tile.id).str(); 
+      string send_id = (boost::format("%d") % m_servers.connection(tile.id)).str(); 
       // request was for status, so the tile metadata will tell us what
       // the response should be.
       if (tile.last_modified > 0) 
@@ -358,33 +582,37 @@ tile_handler::handle_response_from_storage() {
          // tile is present, and has a last-modified time
          std::stringstream txt;
          txt << "Tile last modified: " << std::asctime(std::gmtime(&tile.last_modified));
-         send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, txt.str());
+         send_reply(m_socket_rep, m_servers.uuid(tile.id), send_id, 200, txt.str());
          
       } 
       else if (tile.data().size() > 0) 
       {
          // tile is present, but has been expired.
-         send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, "Tile marked as dirty.");
+         send_reply(m_socket_rep, m_servers.uuid(tile.id), send_id, 200, "Tile marked as dirty.");
          
       } 
       else 
       {
          // tile isn't present.
-         send_404(m_socket_rep, m_str_mongrel_id, send_id);
+         send_404(m_socket_rep, m_servers.uuid(tile.id), send_id);
       }
+      m_servers.release(tile.id);
 
    } else if (tile.status == cmdDirty) {
-      string send_id = (boost::format("%d") % tile.id).str(); 
+      string send_id = (boost::format("%d") % m_servers.connection(tile.id)).str(); 
 
-      if (m_queue_runner.queue_length() >= m_queue_threshold_max)
+      if (m_queue_runner.queue_length() >= m_admission.threshold_max())
       {
          // send a 503 - queue is too long to send anything to.
-         send_503(m_socket_rep, m_str_mongrel_id, send_id);
+         m_admission.held_back();
+         send_503(m_socket_rep, m_servers.uuid(tile.id), send_id);
+         m_servers.release(tile.id);
       }
       else
       {
          string txt("Tile submitted for rendering...");
-         send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, txt);
+         send_reply(m_socket_rep, m_servers.uuid(tile.id), send_id, 200, txt);
+         m_servers.release(tile.id);
 
          tile.status = cmdRenderBulk;
          tile.set_data("");
@@ -394,19 +622,23 @@ tile_handler::handle_response_from_storage() {
    } else if (tile.status == cmdNotDone) {
       // tile isn't available - have to render it, if there are resources
       // available to do it.
-      if (m_queue_runner.queue_length() >= m_queue_threshold_max) 
+      if (m_queue_runner.queue_length() >= m_admission.threshold_max()) 
       {
          // send 503 (service unavailable) to indicate overload.
-         string send_id = (boost::format("%d") % tile.id).str(); 
-         send_503(m_socket_rep, m_str_mongrel_id, send_id);
+         m_admission.held_back();
+         string send_id = (boost::format("%d") % m_servers.connection(tile.id)).str(); 
+         send_503(m_socket_rep, m_servers.uuid(tile.id), send_id);
+         m_servers.release(tile.id);
 
       } 
-      else if (m_queue_runner.queue_length() >= m_queue_threshold_satisfy)
+      else if (m_queue_runner.queue_length() >= m_admission.threshold_satisfy())
       {
          // render the tile in the background and tell the client that
          // it's not ready yet.
-         string send_id = (boost::format("%d") % tile.id).str(); 
-         send_202(m_socket_rep, m_str_mongrel_id, send_id);
+         m_admission.held_back();
+         string send_id = (boost::format("%d") % m_servers.connection(tile.id)).str(); 
+         send_202(m_socket_rep, m_servers.uuid(tile.id), send_id);
+         m_servers.release(tile.id);
 
          tile.status = cmdRenderBulk;
          tile.set_data("");
@@ -417,15 +649,20 @@ tile_handler::handle_response_from_storage() {
       else 
       {
          // render the tile (and have the client wait for the response)
-         tile.status = cmdRender;
-         send_to_queue(tile);
+         render_and_wait(tile);
       } 
 
    } else {
       // check if tile is fresh
-      if ((tile.status == cmdDone) ||
-          (m_queue_runner.queue_length() >= m_queue_threshold_stale))
+      if (tile.status == cmdDone)
+      {
+         reply_with_tile(tile);
+      }
+      else if (m_queue_runner.queue_length() >= m_admission.threshold_stale())
       {
+         // the queue is too long to wait on, so make do with the stale
+         // tile.
+         m_admission.held_back();
          reply_with_tile(tile);
       }
       else
@@ -439,7 +676,7 @@ tile_handler::handle_response_from_storage() {
             // don't background render when the queue is very long. this
             // prevents queue overload when a very large area has been
             // expired.
-            if (m_queue_runner.queue_length() < m_queue_threshold_stale)
+            if (m_queue_runner.queue_length() < m_admission.threshold_stale())
             {
                tile.status = cmdRenderBulk;
                tile.set_data("");
@@ -449,9 +686,9 @@ tile_handler::handle_response_from_storage() {
          }
          else 
          {
-            // otherwise render the tile and wait for the result.
-            tile.status = cmdRender;
-            send_to_queue(tile);
+            // otherwise render the tile and wait for the result, falling
+            // back on the stale tile if it takes too long.
+            render_and_wait(tile);
          }            
       }
    }       
@@ -568,7 +805,7 @@ style_rules::rewrite_and_check(tile_protocol &tile) const
    }
 }
 
-void
+bool
 tile_handler::send_to_queue(const rendermq::tile_protocol &tile)
 {
    bool error = true;
@@ -593,11 +830,14 @@ tile_handler::send_to_queue(const rendermq::tile_protocol &tile)
 
    // if there was an error, and the tile has a client ID attached to
    // it, then send an error back to the client.
-   if (error && tile.id > 0)
+   if (error && m_servers.known(tile.id))
    {
-      string send_id = (boost::format("%d") % tile.id).str(); 
-      send_404(m_socket_rep, m_str_mongrel_id, send_id);
+      string send_id = (boost::format("%d") % m_servers.connection(tile.id)).str(); 
+      send_404(m_socket_rep, m_servers.uuid(tile.id), send_id);
+      m_servers.release(tile.id);
    }
+
+   return !error;
 }
 
 } // namespace rendermq
@@ -29,10 +29,15 @@
 #include "tile_protocol.hpp"
 #include "zstream.hpp"
 #include "storage_worker.hpp"
+#include "tile_cache.hpp"
+#include "fair_drain.hpp"
+#include "pending_renders.hpp"
+#include "admission_control.hpp"
+#include "timer_wheel.hpp"
 #include "dqueue/distributed_queue.hpp"
-#include "tile_path_parser.hpp"
 #include "mongrel_request_parser.hpp"
-#include "http/http_date_formatter.hpp"
+#include "mongrel_servers.hpp"
+#include "http/http_reply.hpp"
 
 // boost
 #include <boost/thread/thread.hpp>
@@ -41,6 +46,7 @@
 
 // stl
 #include <ctime>
+#include <vector>
 
 namespace rendermq {
 
@@ -109,19 +115,32 @@ public:
     * requests.
     *
     * @param handler_id zeromq identity of this handler.
-    * @param in_ep incoming endpoint from mongrel2.
-    * @param out_ep outgoing endpoing to mongrel2.
+    * @param in_eps incoming endpoints from mongrel2, one for each
+    *          mongrel2 server (or group of servers sharing a handler).
+    * @param out_eps outgoing endpoints to mongrel2, likewise.
     * @param max_age age, in seconds, to put in the HTTP expiry
     *          headers.
     * @param queue_threshold_stale queue length at which to return
     *          stale tiles rather than render them. 
     * @param queue_threshold_max queue length at which to return an
     *          error rather than try to render tiles. 
+    * @param target_latency time, in milliseconds, which clients should
+    *          wait for renders. the queue thresholds are adjusted to
+    *          keep to it. zero keeps the thresholds fixed.
     * @param stale_render_background if true, return stale tiles
     *          immediately, even if the queue length is low, and
     *          render the tile in the background.
     * @param max_io_threads maximum number of concurrent storage
     *          requests to run. others are queued.
+    * @param tile_cache_size maximum memory, in bytes, to use for
+    *          caching recently served tiles. zero disables the cache.
+    * @param tile_cache_ttl time, in seconds, to keep tiles in the
+    *          cache for.
+    * @param drain_budget maximum number of messages to handle from
+    *          each of mongrel, storage and the queue before moving on
+    *          to the next.
+    * @param timeouts how long clients can wait for tiles to be 
+    *          rendered before they're sent a stale tile or an error.
     * @param dqueue_config file name of distributed queue config.
     * @param storage_conf storage configuration - already parsed as a
     *          property tree.
@@ -131,14 +150,19 @@ public:
     *          dirty request.
     */
    tile_handler(const std::string &handler_id, 
-                const std::string &in_ep, 
-                const std::string &out_ep,
+                const std::vector<std::string> &in_eps, 
+                const std::vector<std::string> &out_eps,
                 std::time_t max_age,
                 size_t queue_threshold_stale, 
                 size_t queue_threshold_satisfy, 
                 size_t queue_threshold_max,
+                unsigned int target_latency,
                 bool stale_render_background,
                 size_t max_io_threads,
+                size_t tile_cache_size,
+                int tile_cache_ttl,
+                size_t drain_budget,
+                const render_timeouts &timeouts,
                 const std::string &dqueue_config,
                 const boost::property_tree::ptree &storage_conf,
                 const style_rules &rules,
@@ -164,17 +188,60 @@ private:
     */
    void handle_response_from_storage();
 
+   /* reply to the client or send the tile to the queue, depending on
+    * what the storage lookup, or the cache, found for it.
+    */
+   void handle_lookup(rendermq::tile_protocol &tile);
+
+   /* called when a rendered tile comes back from the queue.
+    */
+   void handle_rendered_tile(const rendermq::tile_protocol &tile);
+
+   /* send the tile to the queue to be rendered and have the client
+    * wait for it, up to the render timeout for the tile.
+    */
+   void render_and_wait(rendermq::tile_protocol &tile);
+
+   /* called when a client has waited for a tile for as long as it can.
+    * the client is sent the stale tile, if there is one, or an error.
+    */
+   void handle_render_timeout(const rendermq::tile_protocol &tile);
+
+   /* adjust the queue thresholds for the render latency and queue
+    * growth seen since the last time, and schedule the next time.
+    */
+   void update_admission();
+
+   /* send the client the thresholds currently in effect, along with
+    * what they're based on.
+    */
+   void send_stats(const std::string &uuid, const std::string &id);
+
+   /* remove the metatile containing the tile, and those of the styles
+    * which depend on its style, from the tile cache.
+    */
+   void invalidate_cached(const rendermq::tile_protocol &tile);
+
+   /* log the tile cache's hit ratio and memory use, if it's time to.
+    */
+   void report_cache_stats();
+
+   /* called when a message from the queue is detected.
+    */
+   void handle_response_from_queue();
+
    /* send a tile to the queue. if there's an error then print a 
     * message and, if there is a connection id associated with the
-    * tile, send an error response back to the client.
+    * tile, send an error response back to the client. returns whether
+    * the tile was sent.
     */
-   void send_to_queue(const rendermq::tile_protocol &tile);
+   bool send_to_queue(const rendermq::tile_protocol &tile);
    
    // zeromq socket context used in the handler
    zmq::context_t m_context;
 
-   // sockets connected to mongrel. req to receive requests, rep to
-   // send replies.
+   // sockets connected to each of the mongrel servers. req to receive
+   // requests, rep to send replies.
    zmq::socket_t m_socket_req, m_socket_rep;
 
    // handler identity, used to identify this handler to the broker.
@@ -186,9 +253,9 @@ private:
    // cache-related HTTP headers.
    std::time_t m_max_age;
 
-   // the queue length at which to return stale tiles and errors to the
-   // client, respectively.
-   size_t m_queue_threshold_stale, m_queue_threshold_satisfy, m_queue_threshold_max;
+   // decides the queue length at which to return stale tiles, render
+   // in the background and return errors to the client, respectively.
+   rendermq::admission_control m_admission;
 
    // if true, return tiles to the client even if they're stale (marked as
    // expired). this reduces the amount of time clients are waiting for
@@ -198,6 +265,21 @@ private:
    // the style re-write rules.
    const style_rules &m_style_rules;
 
+   // map of style names into the styles which depend on them, which are
+   // also dirtied whenever the keyed style is dirtied.
+   std::map<std::string, std::list<std::string> > m_dirty_list;
+
+   // tiles which have recently been looked up in storage or rendered,
+   // and when to next log how well the cache is doing.
+   rendermq::tile_cache m_tile_cache;
+   std::time_t m_next_cache_report;
+
+   // how long clients can wait for tiles to be rendered, the requests
+   // which are waiting and the timers for their deadlines.
+   rendermq::render_timeouts m_render_timeouts;
+   rendermq::pending_renders m_pending_renders;
+   rendermq::timer_wheel m_timers;
+
    // the queue of rendering jobs
    dqueue::runner m_queue_runner;
    
@@ -206,17 +288,22 @@ private:
    zstream::socket::push m_socket_storage_request;
    zstream::socket::pull m_socket_storage_results;
 
-   // mongrel2 format request parser
-   rendermq::request_parser m_request_parse;
+   // poll items for mongrel, storage and the queue, in that order, and
+   // the drain which takes messages from each of them in turn.
+   zmq::pollitem_t m_poll_items[4];
+   rendermq::fair_drain m_drain;
 
-   // function object to parse URLs into tile protocol objects
-   rendermq::tile_path_parser m_path_parse;
+   // mongrel2 format request parser, which also parses the tile path,
+   // and the request it parses into, which is re-used for each message.
+   rendermq::request_view_parser m_request_parse;
+   rendermq::mongrel_request_view m_request;
 
-   // http time formatting function object
-   rendermq::http_date_formatter m_date_format;
+   // prepared headers for tile replies
+   rendermq::http_reply_templates m_reply;
 
-   // mongrel2 server ID that we're connected to.
-   std::string m_str_mongrel_id;
+   // the mongrel2 servers that requests have come from, so that
+   // replies can be sent back to the right one.
+   rendermq::mongrel_servers m_servers;
 
    // pointers to the instance of the storage worker and the thread that
    // it is running on. this is separate from the main thread of the tile
@@ -32,6 +32,7 @@
 #include <stdexcept>
 #include <map>
 #include <list>
+#include <vector>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
@@ -46,13 +47,19 @@
 #define DEFAULT_QUEUE_THRESHOLD_STALE (100)
 #define DEFAULT_QUEUE_THRESHOLD_SATISFY (500)
 #define DEFAULT_QUEUE_THRESHOLD_MAX (1000)
+#define DEFAULT_TARGET_RENDER_LATENCY (0)
 #define DEFAULT_IO_MAX_CONCURRENCY (64)
+#define DEFAULT_TILE_CACHE_SIZE (64)
+#define DEFAULT_TILE_CACHE_TTL (60)
+#define DEFAULT_DRAIN_BUDGET (32)
+#define DEFAULT_RENDER_TIMEOUT (30)
 
 namespace po = boost::program_options;
 namespace pt = boost::property_tree;
 using std::map;
 using std::string;
 using std::list;
+using std::vector;
 
 // maximum length of a hostname from gethostname().
 #define HOSTNAME_MAX (1024)
@@ -80,6 +87,16 @@ map<string, list<string> > dirty_list_from_conf(const pt::ptree &conf)
    return deps;
 }
 
+// read a list of 0MQ endpoints, separated by commas or spaces.
+vector<string> endpoints_from_conf(const pt::ptree &conf, const string &key, const string &def)
+{
+   vector<string> endpoints;
+   string str = conf.get<string>(key, def);
+   boost::trim_if(str, boost::is_any_of(", "));
+   boost::split(endpoints, str, boost::is_any_of(", "), boost::token_compress_on);
+   return endpoints;
+}
+
 // turn an instance command line option into a set of strings
 // to be tried as the section headers.
 list<string> host_sections(const string &instance)
@@ -264,16 +281,37 @@ int main( int argc, char** argv)
    // expiry-chaining.
    map<string, list<string> > dirty_deps = dirty_list_from_conf(conf);
 
+   // how long clients can wait for a tile to be rendered, by default
+   // and for particular styles and zoom levels.
+   rendermq::render_timeouts render_timeouts(
+      conf, conf.get<double>("mongrel2.render_timeout", DEFAULT_RENDER_TIMEOUT));
+
+   // the handler can serve several mongrel servers, each with a pair of
+   // endpoints to connect to.
+   vector<string> in_endpoints = endpoints_from_conf(conf, "mongrel2.in_endpoint", "ipc:///tmp/mongrel_send");
+   vector<string> out_endpoints = endpoints_from_conf(conf, "mongrel2.out_endpoint", "ipc:///tmp/mongrel_recv");
+   if (in_endpoints.size() != out_endpoints.size())
+   {
+      std::cerr << "ERROR: in_endpoint and out_endpoint must list the same number of endpoints, "
+                << "one pair for each mongrel2 server.\n";
+      return EXIT_FAILURE;
+   }
+
    rendermq::tile_handler handler(
       uuid,
-      conf.get<string>("mongrel2.in_endpoint","ipc:///tmp/mongrel_send"),
-      conf.get<string>("mongrel2.out_endpoint","ipc:///tmp/mongrel_recv"),
+      in_endpoints,
+      out_endpoints,
       conf.get<std::time_t>("mongrel2.max_age",60*60*24),
       conf.get<size_t>("mongrel2.queue_threshold_stale", DEFAULT_QUEUE_THRESHOLD_STALE),
       conf.get<size_t>("mongrel2.queue_threshold_satisfy", DEFAULT_QUEUE_THRESHOLD_SATISFY),
       conf.get<size_t>("mongrel2.queue_threshold_max", DEFAULT_QUEUE_THRESHOLD_MAX),                    
+      (unsigned int)(conf.get<double>("mongrel2.target_render_latency", DEFAULT_TARGET_RENDER_LATENCY) * 1000),
       conf.get<bool>("mongrel2.stale_render_background", false),
       conf.get<size_t>("mongrel2.max_io_concurrency", DEFAULT_IO_MAX_CONCURRENCY),
+      size_t(conf.get<double>("mongrel2.tile_cache_size", DEFAULT_TILE_CACHE_SIZE) * 1024 * 1024),
+      conf.get<int>("mongrel2.tile_cache_ttl", DEFAULT_TILE_CACHE_TTL),
+      conf.get<size_t>("mongrel2.drain_budget", DEFAULT_DRAIN_BUDGET),
+      render_timeouts,
       dqueue_config, conf.get_child("tiles"), style_rules, dirty_deps);
 
    handler();
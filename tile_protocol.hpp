@@ -80,6 +80,12 @@ public:
       {
          data_ = data;
       }
+   // exchanges the data with the given string, which avoids copying
+   // large metatiles around.
+   void swap_data(std::string &data)
+      {
+         data_.swap(data);
+      }
 
    protoCmd status;
    int x;
@@ -170,16 +176,16 @@ inline bool serialise(const tile_protocol &tile, std::string &buf) {
    return t.SerializeToString(&buf);
 }
 
-inline bool unserialise(const std::string &buf, tile_protocol &tile) {
+inline bool unserialise(const char *buf, size_t size, tile_protocol &tile) {
    proto::tile t;
-   bool result = t.ParseFromString(buf);
+   bool result = t.ParseFromArray(buf, size);
    if (result) {
       tile.status = static_cast<rendermq::protoCmd>(t.command());
       tile.x = t.x();
       tile.y = t.y();
       tile.z = t.z();
       tile.id = t.id();
-      tile.set_data(t.image());
+      tile.swap_data(*t.mutable_image());
       tile.style = t.style();
       tile.format = static_cast<rendermq::protoFmt>(t.format());
       tile.last_modified = t.has_last_modified() ? t.last_modified() : 0;
@@ -188,6 +194,10 @@ inline bool unserialise(const std::string &buf, tile_protocol &tile) {
    return result;
 }
 
+inline bool unserialise(const std::string &buf, tile_protocol &tile) {
+   return unserialise(buf.data(), buf.size(), tile);
+}
+
 inline bool send(zmq::socket_t & socket, tile_protocol const& tile)
 {
    std::string buf;
@@ -225,8 +235,7 @@ inline bool recv (zmq::socket_t & socket, tile_protocol & tile)
 {
    zmq::message_t msg;
    socket.recv(&msg);
-   std::string buf(static_cast<char*>(msg.data()),msg.size());
-   return unserialise(buf, tile);
+   return unserialise(static_cast<const char *>(msg.data()), msg.size(), tile);
 }
 
 }
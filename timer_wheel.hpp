@@ -0,0 +1,241 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <list>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/optional.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace rendermq
+{
+
+/* timers for an event loop, so that it can do things at given times
+ * without a separate thread to wake it up.
+ *
+ * this is a hashed timer wheel: each timer goes into the slot for the
+ * tick it's due in, modulo the number of slots, so scheduling and 
+ * cancelling take constant time and only the slots for the ticks which
+ * have passed need to be looked at to find the timers which are due.
+ * timers further away than one turn of the wheel share slots with 
+ * nearer ones, and are skipped over until they're due.
+ *
+ * times are in milliseconds, from the monotonic clock given by now(), 
+ * so they aren't affected by changes to the system time.
+ */
+class timer_wheel : public boost::noncopyable
+{
+public:
+   typedef boost::function<void ()> callback_type;
+   typedef boost::uint64_t timer_id;
+
+private:
+   struct timer
+   {
+      timer(timer_id i, boost::uint64_t t, callback_type const& c) : id(i), tick(t), callback(c) {}
+
+      timer_id id;
+      boost::uint64_t tick;
+      callback_type callback;
+   };
+
+   typedef std::list<timer> slot_type;
+   typedef boost::unordered_map<timer_id, std::pair<size_t, slot_type::iterator> > index_type;
+
+   struct earlier
+   {
+      bool operator()(timer const& a, timer const& b) const
+      {
+         return (a.tick < b.tick) || ((a.tick == b.tick) && (a.id < b.id));
+      }
+   };
+
+   size_t slot_for(boost::uint64_t tick) const
+   {
+      return size_t(tick % m_slots.size());
+   }
+
+   // whether any of the timers in the slot are due by the given tick.
+   static bool has_due(slot_type const& slot, boost::uint64_t tick)
+   {
+      for (slot_type::const_iterator itr = slot.begin(); itr != slot.end(); ++itr)
+      {
+         if (itr->tick <= tick) return true;
+      }
+      return false;
+   }
+
+public:
+   /* a wheel with the given number of slots, each a tick of the given
+    * number of milliseconds, starting at the given time.
+    */
+   timer_wheel(size_t num_slots, unsigned int tick_length, boost::uint64_t start)
+      : m_slots(std::max(num_slots, size_t(1))), m_tick_length(std::max(tick_length, 1u)),
+        m_current(start / m_tick_length), m_next_id(0) {}
+
+   /* the time now, in milliseconds, from the monotonic clock.
+    */
+   static boost::uint64_t now()
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return boost::uint64_t(ts.tv_sec) * 1000 + boost::uint64_t(ts.tv_nsec) / 1000000;
+   }
+
+   /* call the callback at the given time, or as soon as possible after
+    * it. returns an id which can be used to cancel the timer.
+    */
+   timer_id schedule(boost::uint64_t when, callback_type const& callback)
+   {
+      // round up, so that timers don't go off early, and anything which 
+      // is already due goes off at the next tick.
+      const boost::uint64_t tick = std::max((when + m_tick_length - 1) / m_tick_length, m_current + 1);
+      const timer_id id = m_next_id++;
+      const size_t slot = slot_for(tick);
+
+      m_slots[slot].push_back(timer(id, tick, callback));
+      m_index.insert(std::make_pair(id, std::make_pair(slot, --m_slots[slot].end())));
+
+      if (m_next_tick && (tick < *m_next_tick))
+      {
+         m_next_tick = tick;
+      }
+      return id;
+   }
+
+   /* stop a timer from going off. returns false if it has already gone
+    * off or been cancelled.
+    */
+   bool cancel(timer_id id)
+   {
+      index_type::iterator itr = m_index.find(id);
+      if (itr == m_index.end()) return false;
+
+      // the timer might have been the next one due, but it's cheaper to
+      // wake up for nothing than to find the next one again.
+      m_slots[itr->second.first].erase(itr->second.second);
+      m_index.erase(itr);
+      return true;
+   }
+
+   /* the number of milliseconds from the given time until the next 
+    * timer is due, zero if one is due already, or -1 if there aren't
+    * any timers. this is suitable as a poll timeout.
+    */
+   long timeout(boost::uint64_t when) const
+   {
+      if (m_index.empty()) return -1;
+
+      if (!m_next_tick)
+      {
+         // look for the first slot with a timer due in this turn of the
+         // wheel. if there isn't one, wake up after a whole turn and look
+         // again then.
+         boost::uint64_t tick = m_current + 1;
+         while ((tick < m_current + m_slots.size()) && !has_due(m_slots[slot_for(tick)], tick))
+         {
+            ++tick;
+         }
+         m_next_tick = tick;
+      }
+
+      const boost::uint64_t next = *m_next_tick * m_tick_length;
+      return (next > when) ? long(next - when) : 0;
+   }
+
+   /* call the callbacks of all the timers which are due by the given
+    * time, in the order they were due, and return how many there were.
+    * callbacks can schedule or cancel other timers.
+    */
+   size_t expire(boost::uint64_t when)
+   {
+      const boost::uint64_t tick = when / m_tick_length;
+      if (tick <= m_current) return 0;
+
+      // only the slots for the ticks which have passed need looking at,
+      // and each only once, however long it's been.
+      std::vector<timer> due;
+      const boost::uint64_t first = std::max(m_current + 1, (tick >= m_slots.size()) ? tick - m_slots.size() + 1 : 0);
+      for (boost::uint64_t t = first; t <= tick; ++t)
+      {
+         slot_type &slot = m_slots[slot_for(t)];
+         slot_type::iterator itr = slot.begin();
+         while (itr != slot.end())
+         {
+            if (itr->tick <= tick)
+            {
+               due.push_back(*itr);
+               m_index.erase(itr->id);
+               itr = slot.erase(itr);
+            }
+            else
+            {
+               ++itr;
+            }
+         }
+      }
+      m_current = tick;
+      m_next_tick.reset();
+
+      std::sort(due.begin(), due.end(), earlier());
+      for (std::vector<timer>::iterator itr = due.begin(); itr != due.end(); ++itr)
+      {
+         itr->callback();
+      }
+      return due.size();
+   }
+
+   /* the number of timers which haven't gone off yet.
+    */
+   size_t size() const
+   {
+      return m_index.size();
+   }
+
+private:
+   std::vector<slot_type> m_slots;
+   unsigned int m_tick_length;
+
+   // the last tick which has been expired, and the next one which has a
+   // timer due in it, if that's known.
+   boost::uint64_t m_current;
+   mutable boost::optional<boost::uint64_t> m_next_tick;
+
+   // where to find each timer, for cancelling it.
+   index_type m_index;
+   timer_id m_next_id;
+};
+
+} // namespace rendermq
+
+#endif // TIMER_WHEEL_HPP
@@ -47,6 +47,37 @@ bool sendmore (zmq::socket_t & socket, std::string const& string)
     return (rc);
 }
 
+bool poll_ready (zmq::pollitem_t *items, int nitems)
+{
+    bool any_ready = false;
+    for (int i = 0; i < nitems; ++i)
+    {
+        zmq::pollitem_t &item = items[i];
+        if (item.socket != NULL)
+        {
+            uint32_t events = 0;
+            size_t events_size = sizeof (events);
+            zmq_getsockopt (item.socket, ZMQ_EVENTS, &events, &events_size);
+            item.revents = short(events) & item.events;
+        }
+        else
+        {
+            // plain file descriptors have to be polled. an interrupted
+            // poll just means the item isn't ready yet.
+            item.revents = 0;
+            try
+            {
+                zmq::poll (&item, 1, 0);
+            }
+            catch (const zmq::error_t &)
+            {
+            }
+        }
+        any_ready = any_ready || (item.revents != 0);
+    }
+    return any_ready;
+}
+
 void zmq_check_version_ok() 
 {
    int major, minor, patch;
@@ -35,6 +35,12 @@ namespace rendermq  {
 bool send (zmq::socket_t & socket, const std::string & string);
 bool sendmore (zmq::socket_t & socket, const std::string & string);
 
+// fill in the revents of the poll items without blocking, returning
+// whether any of them are ready. 0MQ sockets are checked through
+// ZMQ_EVENTS, which doesn't need a system call, so this is cheap enough
+// to call before reading each message.
+bool poll_ready (zmq::pollitem_t *items, int nitems);
+
 // check that the version of 0MQ that we compiled against is the 
 // same as the version we've just linked against. aborts the program
 // if there is a mismatch.
@@ -333,6 +333,12 @@ xrep::xrep(zmq::context_t &ctx)
     osocket(ctx, ZMQ_XREP) {
 }
 
+xrep::xrep(zmq::context_t &ctx, int type)
+  : basic_socket(ctx, type),
+    ixsocket(ctx, type),
+    osocket(ctx, type) {
+}
+
 // get an osocket to the addressee
 osocket &
 xrep::to(const std::string &addr) {
@@ -355,6 +361,11 @@ xrep::to(const list<string> &addrs) {
   return out;
 }
 
+xpair::xpair(zmq::context_t &ctx)
+  : basic_socket(ctx, ZMQ_PAIR),
+    xrep(ctx, ZMQ_PAIR) {
+}
+
 pair::pair(zmq::context_t &ctx) 
   : basic_socket(ctx, ZMQ_PAIR),
     osocket(ctx, ZMQ_PAIR),
@@ -232,6 +232,21 @@ public:
   // get an osocket to a list of addressees, used for multi-hop
   // routing.
   osocket &to(const std::list<std::string> &);
+
+protected:
+  // for derived sockets which use the same routed framing
+  xrep(zmq::context_t &, int);
+};
+
+/* a pair socket which reads and writes messages framed in the same
+ * way as an XREP socket, with routing headers before the message. this
+ * is for passing routed messages between threads over inproc://, so
+ * that a thread can handle messages from an XREP socket owned by 
+ * another thread as if it were reading from that socket directly.
+ */
+class xpair : public xrep {
+public:
+  xpair(zmq::context_t &);
 };
 
 /* a point-to-point matched pair socket. this type of socket is
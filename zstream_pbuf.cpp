@@ -46,9 +46,11 @@ operator<<(osocket &out, const tile_protocol &tile) {
 
 isocket &
 operator>>(isocket &in, tile_protocol &tile) {
-  string buf;
-  in >> buf;
-  if (!unserialise(buf, tile)) {
+  // parse straight out of the message, rather than copying it into a
+  // string first, as it may be a large metatile.
+  zmq::message_t msg;
+  in >> msg;
+  if (!unserialise(static_cast<const char *>(msg.data()), msg.size(), tile)) {
     throw runtime_error("Can't deserialise tile from buffer!");
   }
   return in;